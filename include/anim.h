@@ -17,15 +17,98 @@
 #ifndef ELF_TOOLS_ANIM_H
 #define ELF_TOOLS_ANIM_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 struct anim;
 struct cg;
+struct video_writer;
 
 struct anim *anim_parse_script(const char *path);
 uint8_t *anim_pack(struct anim *in, size_t *size_out);
+struct anim_rect {
+	int x, y, w, h;
+};
+
+// rendered frame, stored as the region that changed since the previous frame
+struct anim_frame {
+	struct anim_rect rect;
+	// RGBA pixels of `rect` (NULL if nothing changed)
+	uint8_t *pixels;
+	// number of 16ms ticks the frame is displayed for (0 if overdrawn immediately)
+	unsigned nr_frames;
+};
+
+struct anim_frames {
+	// size of the rendered surface
+	unsigned w, h;
+	// frames[0] covers the whole surface
+	unsigned nr_frames;
+	struct anim_frame *frames;
+};
+
+// receives frames from anim_render as they are rendered
+struct anim_frame_sink {
+	bool (*begin)(unsigned w, unsigned h, void *data);
+	bool (*frame)(struct anim_frame *frame, void *data);
+	void *data;
+};
+
+// duration of one tick of the animation interpreter
+#define ANIM_TICK_MS 16
+// maximum number of ticks anim_player_advance runs to catch up after a stall
+#define ANIM_MAX_CATCHUP_TICKS 60
+
+enum anim_step {
+	// all streams are halted
+	ANIM_STEP_HALTED,
+	// the tick didn't complete a frame
+	ANIM_STEP_TICK,
+	// the tick completed a frame
+	ANIM_STEP_FRAME,
+};
+
+// frame-stepping renderer, e.g. for live playback
+struct anim_player;
+
+struct anim_player *anim_player_begin(struct anim *anim, struct cg *src, struct cg *dst);
+void anim_player_end(struct anim_player *player);
+void anim_player_size(struct anim_player *player, unsigned *w, unsigned *h);
+enum anim_step anim_player_step(struct anim_player *player);
+bool anim_player_advance(struct anim_player *player, unsigned ms);
+unsigned anim_player_next_tick(struct anim_player *player);
+const uint8_t *anim_player_current_frame(struct anim_player *player,
+		struct anim_rect *changed);
+
+bool anim_render(struct anim *anim, struct cg *src, struct cg *dst, unsigned max_frames,
+		struct anim_frame_sink *sink);
+bool anim_render_frames(struct anim *anim, struct cg *src, struct cg *dst,
+		unsigned max_frames, struct anim_frames *out);
+void anim_frame_apply(struct anim_frame *frame, uint8_t *canvas, unsigned stride);
+void anim_frames_free(struct anim_frames *frames);
 uint8_t *anim_render_gif(struct anim *anim, struct cg *src, struct cg *dst,
 		unsigned max_frames, size_t *size_out);
+bool anim_render_gif_to_file(struct anim *anim, struct cg *src, struct cg *dst,
+		unsigned max_frames, unsigned nr_threads, FILE *f);
+bool anim_render_video(struct anim *anim, struct cg *src, struct cg *dst,
+		unsigned max_frames, struct video_writer *writer);
+
+// row kernels for masked copy/compose draw calls (selected at runtime)
+struct anim_blit_kernels {
+	const char *name;
+	void (*copy_masked8)(uint8_t *dst, const uint8_t *src, unsigned w);
+	void (*compose8)(uint8_t *dst, const uint8_t *fg, const uint8_t *bg, unsigned w);
+	void (*copy_masked32)(uint8_t *dst, const uint8_t *src, unsigned w);
+	void (*compose32)(uint8_t *dst, const uint8_t *fg, const uint8_t *bg, unsigned w);
+};
+
+#define ANIM_BLIT_MAX_KERNELS 3
+
+extern const struct anim_blit_kernels anim_blit_scalar;
+unsigned anim_blit_available(const struct anim_blit_kernels **out);
+const struct anim_blit_kernels *anim_blit_get(void);
+void anim_blit_set(const struct anim_blit_kernels *kernels);
 
 #endif // ELF_TOOLS_ANIM_H
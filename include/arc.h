@@ -69,11 +69,61 @@ struct arc_extract_options {
 	.mes_name_fun = -1, \
 }
 
+enum arc_file_type {
+	ARC_FILE_FS,
+	ARC_FILE_MEM,
+	ARC_FILE_ARCDATA,
+};
+
+// a file to be written to an archive
+struct arc_file {
+	enum arc_file_type type;
+	union {
+		struct { string name; string path; } fs;
+		struct { string name; uint8_t *data; size_t size; } mem;
+		struct archive_data *arcdata;
+	};
+	uint32_t packed_offset;
+	uint32_t packed_size;
+};
+
+typedef vector_t(struct arc_file) arc_file_list;
+
+#define ARC_METADATA_DEFAULT (struct arc_metadata) { \
+	.name_length = 20, \
+	.name_off = 0, \
+	.offset_off = 20, \
+	.size_off = 24, \
+	.entry_size = 28, \
+	.offset_key  = 0x55aa55aa, \
+	.size_key    = 0xaa55aa55, \
+	.name_key    = 0x55, \
+}
+
+string arc_file_name(struct arc_file *f);
+void arc_file_free(struct arc_file *f);
+void arc_file_list_free(arc_file_list list);
+struct arc_file arc_file_mem(string name, uint8_t *data, size_t size, bool compress);
+struct archive *arc_file_list_open(const char *path, arc_file_list *files);
+void arc_file_list_put(arc_file_list *files, struct archive *arc, string name,
+		struct arc_file f);
+bool arc_write(const char *path, arc_file_list files, struct arc_metadata *meta);
+void arc_decode_key(const char *key, struct arc_metadata *dst);
+void arc_set_key_by_game(const char *name, struct arc_metadata *meta);
+
 enum archive_data_type arc_data_type(const char *path);
 bool arc_is_compressed(const char *path, enum ai5_game_id game_id);
+bool arc_is_mes_file(const char *name);
+void arc_mes_crypt(const char *name, uint8_t *data, size_t size);
 bool arc_extract_one(struct archive *arc, const char *name, const char *output_file,
 		struct arc_extract_options *opt);
 bool arc_extract_all(struct archive *arc, const char *_output_dir,
 		struct arc_extract_options *opt);
 
+struct port;
+struct mes_text_bundle;
+bool arc_text_export(struct archive *arc, struct port *out, int name_function);
+bool arc_text_import(const char *arc_path, struct mes_text_bundle *bundle,
+		const char *output_path);
+
 #endif
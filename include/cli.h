@@ -27,6 +27,7 @@ extern struct command cmd_a6;
 extern struct command cmd_a6_compile;
 extern struct command cmd_a6_decompile;
 extern struct command cmd_anim;
+extern struct command cmd_anim_bench;
 extern struct command cmd_anim_compile;
 extern struct command cmd_anim_decompile;
 extern struct command cmd_anim_render;
@@ -34,6 +35,8 @@ extern struct command cmd_arc;
 extern struct command cmd_arc_extract;
 extern struct command cmd_arc_list;
 extern struct command cmd_arc_pack;
+extern struct command cmd_arc_text_export;
+extern struct command cmd_arc_text_import;
 extern struct command cmd_ccd;
 extern struct command cmd_ccd_unpack;
 extern struct command cmd_cg;
@@ -48,8 +51,13 @@ extern struct command cmd_lzss_decompress;
 extern struct command cmd_mdd;
 extern struct command cmd_mdd_render;
 extern struct command cmd_mes;
+extern struct command cmd_mes_ast;
+extern struct command cmd_mes_check;
 extern struct command cmd_mes_compile;
 extern struct command cmd_mes_decompile;
+extern struct command cmd_mes_index;
+extern struct command cmd_mes_search;
+extern struct command cmd_mes_xref;
 extern struct command cmd_mp3;
 extern struct command cmd_mp3_extract;
 extern struct command cmd_mp3_render;
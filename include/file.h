@@ -17,10 +17,14 @@
 #ifndef ELF_TOOLS_FILE_H
 #define ELF_TOOLS_FILE_H
 
+#include <stdbool.h>
+
 struct anim;
 struct cg;
+struct port;
 
 struct anim *file_anim_load(const char *path);
 struct cg *file_cg_load(const char *path);
+bool file_port_open(struct port *out, const char *path);
 
 #endif // ELF_TOOLS_FILE_H
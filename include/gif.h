@@ -0,0 +1,50 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef ELF_TOOLS_GIF_H
+#define ELF_TOOLS_GIF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct port;
+struct gif_pool;
+struct gif_scratch;
+
+/*
+ * Animated GIF encoder which only encodes the changed region of each frame.
+ * Pixels within that region which didn't change are left transparent, so that
+ * the previous frame shows through.
+ */
+struct gif_encoder {
+	struct port *out;
+	unsigned w, h;
+	// the image currently displayed by the GIF (RGBA)
+	uint8_t *shown;
+	unsigned nr_frames;
+	// worker threads (NULL when encoding on the calling thread)
+	struct gif_pool *pool;
+	// LZW state when encoding on the calling thread
+	struct gif_scratch *scratch;
+};
+
+bool gif_encoder_begin(struct gif_encoder *gif, struct port *out, unsigned w, unsigned h,
+		unsigned nr_threads);
+bool gif_encoder_frame(struct gif_encoder *gif, const uint8_t *pixels, unsigned stride,
+		int x, int y, int w, int h, unsigned centiseconds);
+bool gif_encoder_end(struct gif_encoder *gif);
+
+#endif // ELF_TOOLS_GIF_H
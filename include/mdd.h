@@ -17,9 +17,13 @@
 #ifndef ELF_TOOLS_MDD_H
 #define ELF_TOOLS_MDD_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+struct video_writer;
+
 uint8_t *mdd_render(uint8_t *data, size_t size, size_t *size_out);
+bool mdd_render_video(uint8_t *data, size_t size, struct video_writer *writer);
 
 #endif // ELF_TOOLS_MDD_H
@@ -122,6 +122,8 @@ struct mes_ast {
 	enum mes_ast_type type;
 	uint32_t address;
 	bool is_goto_target;
+	// index of the node's label in the flat parser (goto targets only)
+	uint32_t label_no;
 	union {
 		mes_statement_list statements;
 		struct mes_ast_if cond;
@@ -131,6 +133,28 @@ struct mes_ast {
 	};
 };
 
+// procedure or menu entry of a lazily decompiled .mes file
+struct mes_lazy_entry {
+	// MES_AST_PROCEDURE, MES_AST_SUB or MES_AST_MENU_ENTRY
+	enum mes_ast_type type;
+	uint32_t address;
+	uint32_t end_address;
+	// index of the enclosing entry (-1 for toplevel entries)
+	int parent;
+	// decompiled AST (NULL until requested with mes_lazy_decompile)
+	struct mes_ast *ast;
+	// undecompiled CFG (toplevel entries only)
+	struct mes_block *block;
+	// index of block in the toplevel CFG (toplevel entries only)
+	unsigned slot;
+};
+
+// .mes file split into procedures/menu entries, which are decompiled on demand
+struct mes_lazy {
+	vector_t(struct mes_lazy_entry) entries;
+	struct mes_block toplevel;
+};
+
 // ctor.c
 struct mes_statement *mes_stmt(enum mes_statement_op op);
 struct mes_statement *mes_stmt_end(void);
@@ -226,6 +250,10 @@ void mes_ast_block_free(mes_ast_block block);
 
 bool mes_decompile(uint8_t *data, size_t data_size, mes_ast_block *out);
 bool mes_decompile_debug(uint8_t *data, size_t data_size, mes_block_list *out);
+bool mes_lazy_init(uint8_t *data, size_t data_size, struct mes_lazy *out);
+struct mes_ast *mes_lazy_decompile(struct mes_lazy *lazy, unsigned entry);
+int mes_lazy_find(struct mes_lazy *lazy, uint32_t address);
+void mes_lazy_free(struct mes_lazy *lazy);
 
 void mes_ast_print(struct mes_ast *node, int name_function, struct port *out);
 void mes_ast_block_print(mes_ast_block block, int name_function, struct port *out);
@@ -236,15 +264,28 @@ void mes_block_tree_print(mes_block_list blocks, struct port *out);
 
 uint32_t mes_statement_size(struct mes_statement *stmt);
 uint32_t aiw_mes_statement_size(struct mes_statement *stmt);
+uint32_t mes_statement_place(struct mes_statement *stmt, uint32_t addr);
+uint32_t mes_statement_list_assign_addresses(mes_statement_list statements);
 
-mes_statement_list mes_flat_parse(const char *path);
+bool mes_flat_parse(const char *path, mes_statement_list *out);
+bool mes_smes_parse(const char *path, mes_statement_list *out);
+bool mes_ast_compile(mes_ast_block toplevel, mes_statement_list *out,
+		void (*label)(struct mes_ast*, struct mes_statement*, void*), void *data);
 uint8_t *mes_pack(mes_statement_list stmts, size_t *size_out);
 
+mes_ast_block mes_random_program(uint32_t seed, unsigned nr_statements);
+
 void mes_statement_list_foreach_text(mes_statement_list statements,
 		int name_function,
 		void(*handle_text)(string text, struct mes_statement*, unsigned, void*),
 		void(*handle_statement)(struct mes_statement*, void*),
 		void *data);
+void mes_statement_list_foreach_text_span(mes_statement_list statements,
+		int name_function,
+		void(*handle_span)(struct mes_statement **stmts, unsigned nr_stmts, void*),
+		void(*handle_statement)(struct mes_statement*, void*),
+		void *data);
+string mes_text_span_to_string(struct mes_statement **stmts, unsigned nr_stmts);
 
 struct mes_text_line {
 	char *text;
@@ -258,11 +299,162 @@ struct mes_text_substitution {
 	vector_t(struct mes_text_line) to;
 };
 
-typedef vector_t(struct mes_text_substitution) mes_text_sub_list;
+typedef struct mes_text_sub_list {
+	vector_t(struct mes_text_substitution) subs;
+	// backing buffer for the text of all substitution lines
+	char *text;
+} mes_text_sub_list;
+
+// text for multiple mes files in a single file, separated by '# file = "NAME"' headers
+struct mes_text_bundle_file {
+	string name;
+	mes_text_sub_list subs;
+};
+
+typedef struct mes_text_bundle {
+	vector_t(struct mes_text_bundle_file) files;
+	// backing buffer for the text of all files
+	char *text;
+} mes_text_bundle;
 
 bool mes_text_parse(FILE *f, mes_text_sub_list *out);
 void mes_text_sub_list_free(mes_text_sub_list list);
-mes_statement_list mes_substitute_text(mes_statement_list mes, mes_text_sub_list subs_in);
+bool mes_text_bundle_parse(FILE *f, mes_text_bundle *out);
+void mes_text_bundle_free(mes_text_bundle bundle);
+unsigned mes_text_bundle_fill_duplicates(mes_text_bundle *bundle);
+unsigned mes_text_bundle_print_duplicates(mes_text_bundle *bundle, struct port *out);
+struct mes_text_encode_cache *mes_text_encode_cache_new(void);
+void mes_text_encode_cache_free(struct mes_text_encode_cache *cache);
+mes_statement_list mes_substitute_text(mes_statement_list mes, mes_text_sub_list subs_in,
+		struct mes_text_encode_cache *cache);
+
+// full-text index over the text of a set of mes files
+struct mes_index_script {
+	string name;
+	uint32_t hash;
+	uint32_t first_text;
+	uint32_t nr_texts;
+};
+
+struct mes_index_text {
+	uint32_t script;
+	uint32_t no;
+	uint32_t address;
+	uint32_t off;
+	uint32_t len;
+};
+
+struct mes_index_gram {
+	uint32_t gram;
+	uint32_t off;
+	uint32_t count;
+};
+
+struct mes_index {
+	// settings the index was built with
+	int32_t game;
+	int32_t name_function;
+	vector_t(struct mes_index_script) scripts;
+	vector_t(struct mes_index_text) texts;
+	// sorted trigram table, indexing into postings
+	vector_t(struct mes_index_gram) grams;
+	vector_t(uint32_t) postings;
+	// NUL-separated text of all entries
+	char *pool;
+	size_t pool_size;
+	size_t pool_cap;
+};
+
+void mes_index_init(struct mes_index *idx, int game, int name_function);
+void mes_index_free(struct mes_index *idx);
+bool mes_index_compatible(struct mes_index *idx, struct mes_index *other);
+bool mes_index_add_script(struct mes_index *idx, const char *name, uint8_t *data,
+		size_t size, struct mes_index *prev);
+void mes_index_finalize(struct mes_index *idx);
+bool mes_index_read(struct mes_index *idx, const char *path);
+bool mes_index_write(struct mes_index *idx, const char *path);
+void mes_index_search(struct mes_index *idx, const char *query,
+		void(*handle_text)(struct mes_index*, struct mes_index_text*, void*),
+		void *data);
+
+// cross-reference table of procedures, scripts and variables
+enum mes_xref_kind {
+	MES_XREF_PROC,
+	MES_XREF_SUB,
+	MES_XREF_MES,
+	MES_XREF_FLAG,
+	MES_XREF_VAR16,
+	MES_XREF_VAR32,
+	// 16-bit system variables (the only kind on AIWIN)
+	MES_XREF_SYSVAR,
+	MES_XREF_SYSVAR32,
+	// procedure arguments
+	MES_XREF_ARG,
+	MES_XREF_NR_KINDS
+};
+
+enum mes_xref_access {
+	MES_XREF_DEFINE,
+	MES_XREF_CALL,
+	MES_XREF_READ,
+	MES_XREF_WRITE,
+	MES_XREF_NR_ACCESS
+};
+
+struct mes_xref {
+	uint8_t kind;
+	uint8_t access;
+	// script containing the reference (index into names)
+	uint32_t script;
+	// procedure/variable number, or index into names for MES_XREF_MES
+	uint32_t no;
+	uint32_t address;
+};
+
+struct mes_xref_table {
+	vector_t(string) names;
+	vector_t(struct mes_xref) refs;
+};
+
+extern const char * const mes_xref_kind_names[MES_XREF_NR_KINDS];
+extern const char * const mes_xref_access_names[MES_XREF_NR_ACCESS];
+
+void mes_xref_table_init(struct mes_xref_table *table);
+void mes_xref_table_free(struct mes_xref_table *table);
+void mes_xref_add_script(struct mes_xref_table *table, const char *name,
+		mes_statement_list statements);
+void mes_xref_table_finalize(struct mes_xref_table *table);
+bool mes_xref_table_read(struct mes_xref_table *table, const char *path);
+bool mes_xref_table_write(struct mes_xref_table *table, const char *path);
+int mes_xref_name_index(struct mes_xref_table *table, const char *name);
+unsigned mes_xref_lookup(struct mes_xref_table *table, enum mes_xref_kind kind, uint32_t no,
+		void(*handle_ref)(struct mes_xref_table*, struct mes_xref*, void*),
+		void *data);
+
+// binary AST file
+struct mes_ast_file_script {
+	string name;
+	// offset into data (when read from a file)
+	uint32_t offset;
+	uint32_t size;
+	// serialized script (when added with mes_ast_file_add_script)
+	uint8_t *blob;
+};
+
+struct mes_ast_file {
+	uint8_t *data;
+	size_t size;
+	vector_t(struct mes_ast_file_script) scripts;
+};
+
+void mes_ast_file_init(struct mes_ast_file *file);
+void mes_ast_file_free(struct mes_ast_file *file);
+void mes_ast_file_add_script(struct mes_ast_file *file, const char *name, mes_ast_block block);
+bool mes_ast_file_write(struct mes_ast_file *file, const char *path);
+bool mes_ast_file_is_ast(const char *path);
+bool mes_ast_file_read(struct mes_ast_file *file, const char *path);
+int mes_ast_file_find(struct mes_ast_file *file, const char *name);
+bool mes_ast_file_load(struct mes_ast_file *file, unsigned no, mes_ast_block *out);
 
 enum mes_virtual_op {
 	VOP_END,
@@ -0,0 +1,63 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef ELF_TOOLS_VIDEO_H
+#define ELF_TOOLS_VIDEO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct port;
+
+enum video_format {
+	// YUV4MPEG2 stream (4:4:4)
+	VIDEO_Y4M,
+	// headerless RGBA frames
+	VIDEO_RGBA,
+	// numbered PNG files in a directory
+	VIDEO_PNG,
+};
+
+/*
+ * Constant frame rate video writer. Frames are written as soon as they are
+ * passed to the writer; a frame lasting several frame periods is written
+ * several times.
+ */
+struct video_writer {
+	enum video_format format;
+	// output stream (Y4M/RGBA)
+	struct port *out;
+	// output directory (PNG)
+	const char *dir;
+	unsigned w, h;
+	unsigned nr_frames;
+	// Y'CbCr planes of the current frame (Y4M)
+	uint8_t *planes;
+	// encoded PNG of the current frame, re-used when it is repeated (PNG)
+	uint8_t *png;
+	size_t png_size;
+	// set when a write fails (reported by video_writer_end)
+	bool failed;
+};
+
+bool video_format_from_name(const char *name, enum video_format *out);
+bool video_writer_begin(struct video_writer *v, unsigned w, unsigned h,
+		unsigned fps_num, unsigned fps_den);
+bool video_writer_frame(struct video_writer *v, const uint8_t *pixels, unsigned stride,
+		unsigned repeat);
+bool video_writer_end(struct video_writer *v);
+
+#endif // ELF_TOOLS_VIDEO_H
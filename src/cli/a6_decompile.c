@@ -27,6 +27,7 @@
 
 #include "a6.h"
 #include "cli.h"
+#include "file.h"
 
 enum {
 	LOPT_OUTPUT = 256,
@@ -91,13 +92,9 @@ static int cli_a6_decompile(int argc, char *argv[])
 
 	// open output file
 	struct port out;
-	if (output_file) {
-		if (!port_file_open(&out, output_file)) {
-			sys_error("Failed to open output file \"%s\": %s\n",
-					output_file, strerror(errno));
-		}
-	} else {
-		port_file_init(&out, stdout);
+	if (!file_port_open(&out, output_file)) {
+		sys_error("Failed to open output file \"%s\": %s\n",
+				output_file, strerror(errno));
 	}
 
 	NOTICE("%d entries", (int)vector_length(a6));
@@ -0,0 +1,214 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nulib.h"
+
+#include "anim.h"
+#include "cli.h"
+
+/*
+ * Microbenchmark for the masked copy/compose row kernels used by the animation
+ * renderer. Each kernel set supported by the host CPU is run over a synthetic
+ * frame (about half mask color) for every op and bit depth, checked against the
+ * scalar kernels and timed.
+ */
+
+enum {
+	LOPT_WIDTH = 256,
+	LOPT_HEIGHT,
+	LOPT_REPEAT,
+};
+
+enum bench_op {
+	BENCH_COPY_MASKED,
+	BENCH_COMPOSE,
+	NR_BENCH_OPS
+};
+
+static const char * const op_names[NR_BENCH_OPS] = {
+	[BENCH_COPY_MASKED] = "copy-masked",
+	[BENCH_COMPOSE] = "compose",
+};
+
+struct bench_frame {
+	unsigned w, h, bpp;
+	uint8_t *fg, *bg, *dst;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void frame_init(struct bench_frame *f, unsigned w, unsigned h, unsigned bpp)
+{
+	size_t size = (size_t)w * h * (bpp / 8);
+	f->w = w;
+	f->h = h;
+	f->bpp = bpp;
+	f->fg = xmalloc(size);
+	f->bg = xmalloc(size);
+	f->dst = xmalloc(size);
+
+	srand(0);
+	for (size_t i = 0; i < size; i++) {
+		f->fg[i] = rand();
+		f->bg[i] = rand();
+	}
+	// mask out runs of pixels, so that both the all-mask and mixed cases are exercised
+	for (unsigned px = 0; px < w * h; px += 1 + rand() % 32) {
+		unsigned run = rand() % 32;
+		for (unsigned i = px; i < px + run && i < w * h; i++) {
+			if (bpp == 8) {
+				f->fg[i] = 8;
+			} else {
+				f->fg[i*4+0] = 0;
+				f->fg[i*4+1] = 0xf8;
+				f->fg[i*4+2] = 0;
+			}
+		}
+		px += run;
+	}
+}
+
+static void frame_free(struct bench_frame *f)
+{
+	free(f->fg);
+	free(f->bg);
+	free(f->dst);
+}
+
+static void frame_render(struct bench_frame *f, const struct anim_blit_kernels *k,
+		enum bench_op op)
+{
+	const size_t stride = (size_t)f->w * (f->bpp / 8);
+	for (unsigned row = 0; row < f->h; row++) {
+		uint8_t *fg = f->fg + row * stride;
+		uint8_t *bg = f->bg + row * stride;
+		uint8_t *dst = f->dst + row * stride;
+		if (op == BENCH_COPY_MASKED && f->bpp == 8)
+			k->copy_masked8(dst, fg, f->w);
+		else if (op == BENCH_COPY_MASKED)
+			k->copy_masked32(dst, fg, f->w);
+		else if (f->bpp == 8)
+			k->compose8(dst, fg, bg, f->w);
+		else
+			k->compose32(dst, fg, bg, f->w);
+	}
+}
+
+static bool frame_check(struct bench_frame *f, const struct anim_blit_kernels *k,
+		enum bench_op op)
+{
+	size_t size = (size_t)f->w * f->h * (f->bpp / 8);
+	uint8_t *expected = xmalloc(size);
+	memcpy(f->dst, f->bg, size);
+	frame_render(f, &anim_blit_scalar, op);
+	memcpy(expected, f->dst, size);
+	memcpy(f->dst, f->bg, size);
+	frame_render(f, k, op);
+	bool r = !memcmp(expected, f->dst, size);
+	free(expected);
+	return r;
+}
+
+static int cli_anim_bench(int argc, char *argv[])
+{
+	unsigned w = 640;
+	unsigned h = 480;
+	unsigned repeat = 200;
+
+	while (1) {
+		int c = command_getopt(argc, argv, &cmd_anim_bench);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case LOPT_WIDTH:
+			w = atoi(optarg);
+			break;
+		case LOPT_HEIGHT:
+			h = atoi(optarg);
+			break;
+		case LOPT_REPEAT:
+			repeat = atoi(optarg);
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		command_usage_error(&cmd_anim_bench, "Wrong number of arguments.\n");
+	if (w < 1 || h < 1 || repeat < 1)
+		command_usage_error(&cmd_anim_bench, "Invalid frame size or repeat count.\n");
+
+	const struct anim_blit_kernels *kernels[ANIM_BLIT_MAX_KERNELS];
+	unsigned nr_kernels = anim_blit_available(kernels);
+	NOTICE("%ux%u, %u frames; default kernels: %s", w, h, repeat, anim_blit_get()->name);
+
+	int status = 0;
+	printf("%-12s %4s %-8s %12s %8s\n", "op", "bpp", "kernels", "Mpx/s", "speedup");
+	for (unsigned bpp = 8; bpp <= 32; bpp += 24) {
+		struct bench_frame f;
+		frame_init(&f, w, h, bpp);
+		for (enum bench_op op = 0; op < NR_BENCH_OPS; op++) {
+			double scalar_rate = 0;
+			// scalar last, so that speedups can be printed in a single pass
+			for (int i = nr_kernels - 1; i >= 0; i--) {
+				const struct anim_blit_kernels *k = kernels[i];
+				if (!frame_check(&f, k, op)) {
+					sys_warning("%s %s/%u: output differs from scalar kernels\n",
+							k->name, op_names[op], bpp);
+					status = 1;
+				}
+				double start = now();
+				for (unsigned r = 0; r < repeat; r++) {
+					frame_render(&f, k, op);
+				}
+				double rate = ((double)w * h * repeat / 1e6) / (now() - start);
+				if (k == &anim_blit_scalar)
+					scalar_rate = rate;
+				printf("%-12s %4u %-8s %12.1f %7.2fx\n", op_names[op], bpp, k->name,
+						rate, scalar_rate > 0 ? rate / scalar_rate : 1.0);
+			}
+		}
+		frame_free(&f);
+	}
+	return status;
+}
+
+struct command cmd_anim_bench = {
+	.name = "bench",
+	.usage = "[options]",
+	.description = "Benchmark the renderer's masked copy/compose kernels",
+	.parent = &cmd_anim,
+	.fun = cli_anim_bench,
+	.options = {
+		{ "width", 0, "Set the frame width (default 640)", required_argument, LOPT_WIDTH },
+		{ "height", 0, "Set the frame height (default 480)", required_argument, LOPT_HEIGHT },
+		{ "repeat", 0, "Set the number of frames per kernel (default 200)",
+		  required_argument, LOPT_REPEAT },
+		{ 0 }
+	}
+};
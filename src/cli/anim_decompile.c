@@ -65,13 +65,9 @@ static int cli_anim_decompile(int argc, char *argv[])
 
 	// open output file
 	struct port out;
-	if (output_file) {
-		if (!port_file_open(&out, output_file)) {
-			sys_error("Failed to open output file \"%s\": %s\n",
-					output_file, strerror(errno));
-		}
-	} else {
-		port_file_init(&out, stdout);
+	if (!file_port_open(&out, output_file)) {
+		sys_error("Failed to open output file \"%s\": %s\n",
+				output_file, strerror(errno));
 	}
 
 	anim_print(&out, anim);
@@ -16,34 +16,384 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "nulib.h"
 #include "nulib/file.h"
+#include "nulib/hashtable.h"
 #include "nulib/port.h"
 #include "nulib/string.h"
+#include "nulib/vector.h"
 #include "ai5/anim.h"
+#include "ai5/arc.h"
 #include "ai5/cg.h"
 #include "ai5/game.h"
 
 #include "anim.h"
+#include "arc.h"
 #include "cli.h"
 #include "file.h"
+#include "util.h"
+#include "video.h"
 
 enum {
 	LOPT_OUTPUT = 256,
 	LOPT_GAME,
 	LOPT_BG,
 	LOPT_MAX_FRAMES,
+	LOPT_ARCHIVE,
+	LOPT_CG_ARCHIVE,
+	LOPT_THREADS,
+	LOPT_FORMAT,
 };
 
 #define DEFAULT_MAX_FRAMES 500
 
+static struct archive *open_archive(const char *path)
+{
+	unsigned flags = ARCHIVE_MMAP;
+	if (!arc_is_compressed(path, ai5_target_game))
+		flags |= ARCHIVE_RAW;
+	struct archive *arc = archive_open(path, flags);
+	if (!arc)
+		sys_error("Failed to open archive file \"%s\".\n", path);
+	return arc;
+}
+
+static bool is_anim_file(const char *name)
+{
+	const char *ext = file_extension(name);
+	return ext && (!strcasecmp(ext, "S4") || !strcasecmp(ext, "A"));
+}
+
+static bool is_cg_file(const char *name)
+{
+	return file_extension(name) && (int)cg_type_from_name(name) >= 0;
+}
+
+// file name without extension, in upper case
+static string base_name(const char *name)
+{
+	const char *ext = file_extension(name);
+	size_t len = ext ? (size_t)(ext - name - 1) : strlen(name);
+	string s = string_new_len(name, len);
+	for (size_t i = 0; i < len; i++) {
+		s[i] = toupper((unsigned char)s[i]);
+	}
+	return s;
+}
+
+// CG cache {{{
+
+/*
+ * Each CG in the archive is decoded at most once, by the first render that needs
+ * it, and freed when the last animation using it has been rendered. Renders draw
+ * into their own copy (draw calls can modify the source CG).
+ */
+struct cg_cache_entry {
+	struct archive_data *data;
+	string key;
+	struct cg *cg;
+	bool failed;
+	// number of animations still to be rendered using this CG
+	unsigned ref;
+	pthread_mutex_t lock;
+};
+
+declare_hashtable_string_type(cg_table, struct cg_cache_entry*);
+define_hashtable_string(cg_table, struct cg_cache_entry*);
+
+struct cg_cache {
+	struct archive *arc;
+	// archive access is not thread safe
+	pthread_mutex_t *arc_lock;
+	// CGs by base name
+	hashtable_t(cg_table) table;
+};
+
+static void cg_cache_init(struct cg_cache *cache, struct archive *arc, pthread_mutex_t *arc_lock)
+{
+	cache->arc = arc;
+	cache->arc_lock = arc_lock;
+	cache->table = (hashtable_t(cg_table)) hashtable_initializer(cg_table);
+
+	struct archive_data *data;
+	archive_foreach(data, arc) {
+		if (!is_cg_file(data->name))
+			continue;
+		string key = base_name(data->name);
+		int ret;
+		hashtable_iter_t k = hashtable_put(cg_table, &cache->table, key, &ret);
+		if (ret == HASHTABLE_KEY_PRESENT) {
+			// several CGs with the same base name: use the first one
+			string_free(key);
+			continue;
+		}
+		struct cg_cache_entry *e = xcalloc(1, sizeof(struct cg_cache_entry));
+		e->data = data;
+		e->key = key;
+		pthread_mutex_init(&e->lock, NULL);
+		hashtable_val(&cache->table, k) = e;
+	}
+}
+
+static void cg_cache_destroy(struct cg_cache *cache)
+{
+	struct cg_cache_entry *e;
+	hashtable_foreach_value(&cache->table, e) {
+		cg_free(e->cg);
+		string_free(e->key);
+		pthread_mutex_destroy(&e->lock);
+		free(e);
+	}
+	hashtable_destroy(cg_table, &cache->table);
+}
+
+/*
+ * Take a reference to the CG with the given base name (before rendering starts).
+ */
+static struct cg_cache_entry *cg_cache_ref(struct cg_cache *cache, const char *name)
+{
+	hashtable_iter_t k = hashtable_get(cg_table, &cache->table, name);
+	if (k == hashtable_end(&cache->table))
+		return NULL;
+	struct cg_cache_entry *e = hashtable_val(&cache->table, k);
+	e->ref++;
+	return e;
+}
+
+/*
+ * Get a private copy of a CG, decoding it if this is the first use.
+ */
+static struct cg *cg_cache_get(struct cg_cache *cache, struct cg_cache_entry *e)
+{
+	struct cg *cg = NULL;
+	pthread_mutex_lock(&e->lock);
+	if (!e->cg && !e->failed) {
+		pthread_mutex_lock(cache->arc_lock);
+		bool loaded = archive_data_load(e->data);
+		pthread_mutex_unlock(cache->arc_lock);
+		if (loaded) {
+			e->cg = cg_load_arcdata(e->data);
+			archive_data_release(e->data);
+		}
+		if (!e->cg) {
+			sys_warning("Failed to decode CG \"%s\"\n", e->data->name);
+			e->failed = true;
+		}
+	}
+	if (e->cg)
+		cg = cg_copy(e->cg);
+	pthread_mutex_unlock(&e->lock);
+	return cg;
+}
+
+/*
+ * Release a reference to a CG, freeing it once no remaining animation uses it.
+ */
+static void cg_cache_unref(struct cg_cache_entry *e)
+{
+	pthread_mutex_lock(&e->lock);
+	if (--e->ref == 0) {
+		cg_free(e->cg);
+		e->cg = NULL;
+	}
+	pthread_mutex_unlock(&e->lock);
+}
+
+// CG cache }}}
+// Archive rendering {{{
+
+struct render_job {
+	struct archive_data *data;
+	struct cg_cache_entry *cg;
+	struct cg_cache_entry *bg;
+	string output_file;
+};
+
+struct render_batch {
+	struct cg_cache cache;
+	pthread_mutex_t arc_lock;
+	vector_t(struct render_job) jobs;
+	unsigned max_frames;
+	// index of the next job to render
+	unsigned next;
+	pthread_mutex_t next_lock;
+	unsigned nr_failed;
+};
+
+static bool render_job(struct render_batch *batch, struct render_job *job)
+{
+	pthread_mutex_lock(&batch->arc_lock);
+	struct anim *anim = NULL;
+	if (archive_data_load(job->data)) {
+		anim = anim_parse(job->data->data, job->data->size);
+		archive_data_release(job->data);
+	}
+	pthread_mutex_unlock(&batch->arc_lock);
+	if (!anim) {
+		sys_warning("Failed to parse animation file \"%s\"\n", job->data->name);
+		return false;
+	}
+
+	bool ok = false;
+	struct cg *cg = cg_cache_get(&batch->cache, job->cg);
+	struct cg *bg = job->bg ? cg_cache_get(&batch->cache, job->bg) : NULL;
+	if (!cg || (job->bg && !bg))
+		goto end;
+
+	FILE *f = file_open_utf8(job->output_file, "wb");
+	if (!f) {
+		sys_warning("Failed to open output file \"%s\": %s\n", job->output_file,
+				strerror(errno));
+		goto end;
+	}
+	// parallelism is across animations: encode each GIF on the render thread
+	ok = anim_render_gif_to_file(anim, cg, bg, batch->max_frames, 1, f);
+	if (fclose(f))
+		ok = false;
+	if (!ok)
+		sys_warning("Failed to render animation to \"%s\"\n", job->output_file);
+end:
+	cg_free(cg);
+	cg_free(bg);
+	anim_free(anim);
+	return ok;
+}
+
+static void *render_worker(void *data)
+{
+	struct render_batch *batch = data;
+	while (1) {
+		pthread_mutex_lock(&batch->next_lock);
+		unsigned i = batch->next++;
+		pthread_mutex_unlock(&batch->next_lock);
+		if (i >= vector_length(batch->jobs))
+			break;
+
+		struct render_job *job = &vector_A(batch->jobs, i);
+		bool ok = render_job(batch, job);
+		cg_cache_unref(job->cg);
+		if (job->bg)
+			cg_cache_unref(job->bg);
+
+		pthread_mutex_lock(&batch->next_lock);
+		if (!ok)
+			batch->nr_failed++;
+		pthread_mutex_unlock(&batch->next_lock);
+	}
+	return NULL;
+}
+
+/*
+ * Render every animation in an archive to a GIF in `output_dir`. The source CG of
+ * an animation is the CG with the same base name (e.g. FOO.S4 -> FOO.GP8) in the
+ * CG archive; the background CG (if any) is shared by all animations. Returns
+ * false if any animation failed to render.
+ */
+static bool render_archive(const char *anim_path, const char *cg_path, const char *bg_name,
+		const char *output_dir, unsigned max_frames, unsigned nr_threads)
+{
+	struct render_batch batch = { .max_frames = max_frames };
+	pthread_mutex_init(&batch.arc_lock, NULL);
+	pthread_mutex_init(&batch.next_lock, NULL);
+
+	struct archive *anim_arc = open_archive(anim_path);
+	struct archive *cg_arc = cg_path ? open_archive(cg_path) : anim_arc;
+	cg_cache_init(&batch.cache, cg_arc, &batch.arc_lock);
+
+	string bg_key = NULL;
+	if (bg_name) {
+		bg_key = base_name(bg_name);
+		hashtable_iter_t k = hashtable_get(cg_table, &batch.cache.table, bg_key);
+		if (k == hashtable_end(&batch.cache.table))
+			sys_error("Background CG \"%s\" not found in archive\n", bg_name);
+	}
+
+	if (*output_dir && mkdir_p(output_dir) < 0)
+		sys_error("Failed to create output directory: %s.\n", strerror(errno));
+
+	// resolve CGs
+	struct archive_data *data;
+	archive_foreach(data, anim_arc) {
+		if (!is_anim_file(data->name))
+			continue;
+		string key = base_name(data->name);
+		struct cg_cache_entry *cg = cg_cache_ref(&batch.cache, key);
+		if (!cg) {
+			sys_warning("No CG found for animation \"%s\"\n", data->name);
+			string_free(key);
+			continue;
+		}
+		string_free(key);
+
+		string out_name = file_replace_extension(data->name, "GIF");
+		struct render_job job = {
+			.data = data,
+			.cg = cg,
+			.bg = bg_key ? cg_cache_ref(&batch.cache, bg_key) : NULL,
+			.output_file = string_new(output_dir),
+		};
+		if (*output_dir && output_dir[strlen(output_dir) - 1] != '/')
+			job.output_file = string_concat_cstring(job.output_file, "/");
+		job.output_file = string_concat(job.output_file, out_name);
+		string_free(out_name);
+		vector_push(struct render_job, batch.jobs, job);
+	}
+
+	// render
+	if (!nr_threads)
+		nr_threads = nr_cpus();
+	nr_threads = min(nr_threads, max(vector_length(batch.jobs), 1));
+	// select the blit kernels before the workers use them
+	anim_blit_get();
+	pthread_t *threads = xcalloc(nr_threads, sizeof(pthread_t));
+	unsigned nr_started = 0;
+	for (; nr_started < nr_threads; nr_started++) {
+		if (pthread_create(&threads[nr_started], NULL, render_worker, &batch))
+			break;
+	}
+	if (!nr_started)
+		render_worker(&batch);
+	for (unsigned i = 0; i < nr_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	unsigned nr_jobs = vector_length(batch.jobs);
+	NOTICE("Rendered %u of %u animations.", nr_jobs - batch.nr_failed, nr_jobs);
+	bool ok = batch.nr_failed == 0;
+
+	struct render_job *job;
+	vector_foreach_p(job, batch.jobs) {
+		string_free(job->output_file);
+	}
+	vector_destroy(batch.jobs);
+	string_free(bg_key);
+	cg_cache_destroy(&batch.cache);
+	if (cg_arc != anim_arc)
+		archive_close(cg_arc);
+	archive_close(anim_arc);
+	pthread_mutex_destroy(&batch.arc_lock);
+	pthread_mutex_destroy(&batch.next_lock);
+	return ok;
+}
+
+// Archive rendering }}}
+
 static int cli_anim_render(int argc, char *argv[])
 {
 	string output_file = NULL;
 	string bg_file = NULL;
+	string archive = NULL;
+	string cg_archive = NULL;
 	int max_frames = DEFAULT_MAX_FRAMES;
+	int nr_threads = 0;
+	bool video = false;
+	enum video_format format = VIDEO_Y4M;
 
 	while (1) {
 		int c = command_getopt(argc, argv, &cmd_anim_render);
@@ -69,15 +419,51 @@ static int cli_anim_render(int argc, char *argv[])
 				max_frames = DEFAULT_MAX_FRAMES;
 			}
 			break;
+		case LOPT_ARCHIVE:
+			archive = string_new(optarg);
+			break;
+		case LOPT_CG_ARCHIVE:
+			cg_archive = string_new(optarg);
+			break;
+		case LOPT_THREADS:
+			nr_threads = atoi(optarg);
+			if (nr_threads < 0) {
+				sys_warning("Invalid number of threads: %s", optarg);
+				nr_threads = 0;
+			}
+			break;
+		case LOPT_FORMAT:
+			video = strcasecmp(optarg, "gif");
+			if (video && !video_format_from_name(optarg, &format))
+				command_usage_error(&cmd_anim_render, "Unknown output format: %s\n",
+						optarg);
+			break;
 		}
 	}
 	argc -= optind;
 	argv += optind;
 
+	if (archive) {
+		if (argc != 0)
+			command_usage_error(&cmd_anim_render, "Wrong number of arguments.\n");
+		if (video)
+			command_usage_error(&cmd_anim_render,
+					"--archive only supports GIF output.\n");
+		bool ok = render_archive(archive, cg_archive, bg_file,
+				output_file ? output_file : "", max_frames, nr_threads);
+		string_free(output_file);
+		string_free(bg_file);
+		string_free(archive);
+		string_free(cg_archive);
+		return ok ? 0 : 1;
+	}
+
 	if (argc != 2)
 		command_usage_error(&cmd_anim_render, "Wrong number of arguments.\n");
 
-	if (!output_file) {
+	if (video && format == VIDEO_PNG && !output_file)
+		command_usage_error(&cmd_anim_render, "PNG output requires an output directory.\n");
+	if (!output_file && !video) {
 		output_file = file_replace_extension(path_basename(argv[0]), "GIF");
 	}
 
@@ -86,16 +472,37 @@ static int cli_anim_render(int argc, char *argv[])
 	struct cg *cg = file_cg_load(argv[1]);
 	struct cg *bg = bg_file ? file_cg_load(bg_file) : NULL;
 
-	// render gif
-	size_t gif_size;
-	uint8_t *gif = anim_render_gif(anim, cg, bg, max_frames, &gif_size);
-	if (gif && !file_write(output_file, gif, gif_size))
-		sys_error("Failed to write output file \"%s\": %s", output_file,
-				strerror(errno));
+	// render (frames are written as they are rendered)
+	if (video) {
+		// Y4M/RGBA streams are written to stdout by default (PNG output is a directory)
+		struct port out;
+		if (format != VIDEO_PNG && output_file && strcmp(output_file, "-")) {
+			if (!port_file_open(&out, output_file))
+				sys_error("Failed to open output file \"%s\": %s", output_file,
+						strerror(errno));
+		} else if (format != VIDEO_PNG) {
+			port_file_init(&out, stdout);
+		}
+		struct video_writer writer = { .format = format, .out = &out, .dir = output_file };
+		bool ok = anim_render_video(anim, cg, bg, max_frames, &writer);
+		if (format != VIDEO_PNG && !port_close(&out))
+			ok = false;
+		if (!ok)
+			sys_error("Failed to render animation");
+	} else {
+		FILE *f = file_open_utf8(output_file, "wb");
+		if (!f)
+			sys_error("Failed to open output file \"%s\": %s", output_file,
+					strerror(errno));
+		bool ok = anim_render_gif_to_file(anim, cg, bg, max_frames, 0, f);
+		if (fclose(f))
+			ok = false;
+		if (!ok)
+			sys_error("Failed to render animation to \"%s\"", output_file);
+	}
 
 	string_free(output_file);
 	string_free(bg_file);
-	free(gif);
 	anim_free(anim);
 	cg_free(cg);
 	cg_free(bg);
@@ -104,7 +511,7 @@ static int cli_anim_render(int argc, char *argv[])
 
 struct command cmd_anim_render = {
 	.name = "render",
-	.usage = "[options] <s4-file> <g8-file>",
+	.usage = "[options] <s4-file> <g8-file> | --archive <arc-file> [options]",
 	.description = "Render an animation file",
 	.parent = &cmd_anim,
 	.fun = cli_anim_render,
@@ -114,6 +521,14 @@ struct command cmd_anim_render = {
 		{ "game", 0, "Specify the target game", required_argument, LOPT_GAME },
 		{ "max-frames", 'f', "Set the maximum number of frames to render",
 		  required_argument, LOPT_MAX_FRAMES },
+		{ "archive", 0, "Render every animation in an archive (output is a directory)",
+		  required_argument, LOPT_ARCHIVE },
+		{ "cg-archive", 0, "Load CGs from a different archive (with --archive)",
+		  required_argument, LOPT_CG_ARCHIVE },
+		{ "threads", 0, "Set the number of animations rendered in parallel (with --archive)",
+		  required_argument, LOPT_THREADS },
+		{ "format", 0, "Set the output format (gif, y4m, rgba or png)",
+		  required_argument, LOPT_FORMAT },
 		{ 0 }
 	}
 };
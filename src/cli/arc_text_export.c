@@ -0,0 +1,97 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nulib.h"
+#include "nulib/port.h"
+#include "ai5/arc.h"
+#include "ai5/game.h"
+
+#include "arc.h"
+#include "cli.h"
+#include "file.h"
+
+enum {
+	LOPT_OUTPUT = 256,
+	LOPT_GAME,
+	LOPT_MES_NAME,
+};
+
+int arc_text_export_cmd(int argc, char *argv[])
+{
+	const char *output_file = NULL;
+	int name_function = -1;
+	while (1) {
+		int c = command_getopt(argc, argv, &cmd_arc_text_export);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'o':
+		case LOPT_OUTPUT:
+			output_file = optarg;
+			break;
+		case 'g':
+		case LOPT_GAME:
+			ai5_set_game(optarg);
+			break;
+		case LOPT_MES_NAME:
+			name_function = atoi(optarg);
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		command_usage_error(&cmd_arc_text_export, "Wrong number of arguments.\n");
+
+	unsigned flags = ARCHIVE_MMAP;
+	if (!arc_is_compressed(argv[0], ai5_target_game))
+		flags |= ARCHIVE_RAW;
+
+	struct archive *arc = archive_open(argv[0], flags);
+	if (!arc)
+		sys_error("Failed to open archive file \"%s\".\n", argv[0]);
+
+	struct port out;
+	if (!file_port_open(&out, output_file))
+		sys_error("Failed to open output file \"%s\": %s\n", output_file, strerror(errno));
+
+	bool r = arc_text_export(arc, &out, name_function);
+
+	port_close(&out);
+	archive_close(arc);
+	return r ? 0 : 1;
+}
+
+struct command cmd_arc_text_export = {
+	.name = "text-export",
+	.usage = "[options...] <input-file>",
+	.description = "Export the text of all mes files in an archive to a single file",
+	.parent = &cmd_arc,
+	.fun = arc_text_export_cmd,
+	.options = {
+		{ "output", 'o', "Set the output file path", required_argument, LOPT_OUTPUT },
+		{ "game", 'g', "Set the target game", required_argument, LOPT_GAME },
+		{ "mes-name-function", 0, "Specify the name function number for mes files",
+			required_argument, LOPT_MES_NAME },
+		{ 0 }
+	}
+};
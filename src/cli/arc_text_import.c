@@ -0,0 +1,117 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/port.h"
+#include "ai5/arc.h"
+#include "ai5/game.h"
+
+#include "arc.h"
+#include "cli.h"
+#include "file.h"
+#include "mes.h"
+
+enum {
+	LOPT_OUTPUT = 256,
+	LOPT_GAME,
+	LOPT_FILL_DUPLICATES,
+	LOPT_DUPLICATES,
+};
+
+int arc_text_import_cmd(int argc, char *argv[])
+{
+	const char *output_file = NULL;
+	const char *dup_file = NULL;
+	bool fill_duplicates = false;
+	while (1) {
+		int c = command_getopt(argc, argv, &cmd_arc_text_import);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'o':
+		case LOPT_OUTPUT:
+			output_file = optarg;
+			break;
+		case 'g':
+		case LOPT_GAME:
+			ai5_set_game(optarg);
+			break;
+		case LOPT_FILL_DUPLICATES:
+			fill_duplicates = true;
+			break;
+		case LOPT_DUPLICATES:
+			dup_file = optarg;
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		command_usage_error(&cmd_arc_text_import, "Wrong number of arguments.\n");
+	if (!output_file)
+		command_usage_error(&cmd_arc_text_import, "Output file not specified.\n");
+
+	FILE *f = file_open_utf8(argv[1], "rb");
+	if (!f)
+		sys_error("Opening input file \"%s\": %s\n", argv[1], strerror(errno));
+	mes_text_bundle bundle;
+	bool ok = mes_text_bundle_parse(f, &bundle);
+	fclose(f);
+	if (!ok)
+		sys_error("Parsing input file \"%s\"\n", argv[1]);
+
+	if (dup_file) {
+		struct port out;
+		if (!file_port_open(&out, dup_file))
+			sys_error("Failed to open output file \"%s\": %s\n", dup_file,
+					strerror(errno));
+		unsigned n = mes_text_bundle_print_duplicates(&bundle, &out);
+		port_close(&out);
+		NOTICE("%u duplicated source lines", n);
+	}
+	if (fill_duplicates) {
+		unsigned n = mes_text_bundle_fill_duplicates(&bundle);
+		NOTICE("Filled %u untranslated lines from duplicates", n);
+	}
+
+	bool r = arc_text_import(argv[0], &bundle, output_file);
+	mes_text_bundle_free(bundle);
+	return r ? 0 : 1;
+}
+
+struct command cmd_arc_text_import = {
+	.name = "text-import",
+	.usage = "[options...] <input-archive> <text-file>",
+	.description = "Substitute text from a single file into the mes files of an archive",
+	.parent = &cmd_arc,
+	.fun = arc_text_import_cmd,
+	.options = {
+		{ "output", 'o', "Set the output archive path", required_argument, LOPT_OUTPUT },
+		{ "game", 'g', "Set the target game", required_argument, LOPT_GAME },
+		{ "fill-duplicates", 0, "Reuse translations for identical untranslated lines",
+			no_argument, LOPT_FILL_DUPLICATES },
+		{ "duplicates", 0, "Write a report of duplicated source lines to a file",
+			required_argument, LOPT_DUPLICATES },
+		{ 0 }
+	}
+};
@@ -46,6 +46,7 @@ struct command cmd_anim = {
 	.description = "Tools for compiling and decompiling animation files",
 	.parent = &cmd_elf,
 	.commands = {
+		&cmd_anim_bench,
 		&cmd_anim_compile,
 		&cmd_anim_decompile,
 		&cmd_anim_render,
@@ -62,6 +63,8 @@ struct command cmd_arc = {
 		&cmd_arc_extract,
 		&cmd_arc_list,
 		&cmd_arc_pack,
+		&cmd_arc_text_export,
+		&cmd_arc_text_import,
 		NULL
 	}
 };
@@ -142,8 +145,13 @@ struct command cmd_mes = {
 	.description = "Tools for compiling and decompiling .mes files",
 	.parent = &cmd_elf,
 	.commands = {
+		&cmd_mes_ast,
+		&cmd_mes_check,
 		&cmd_mes_compile,
 		&cmd_mes_decompile,
+		&cmd_mes_index,
+		&cmd_mes_search,
+		&cmd_mes_xref,
 		NULL
 	}
 };
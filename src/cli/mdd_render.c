@@ -16,6 +16,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 
 #include "nulib.h"
@@ -29,14 +30,40 @@
 #include "cli.h"
 #include "file.h"
 #include "mdd.h"
+#include "video.h"
 
 enum {
 	LOPT_OUTPUT = 256,
+	LOPT_FORMAT,
 };
 
+/*
+ * Render to a video. Y4M/RGBA streams are written to stdout by default (PNG
+ * output is a directory).
+ */
+static bool render_video(uint8_t *data, size_t size, enum video_format format,
+		const char *output_file)
+{
+	struct port out;
+	if (format != VIDEO_PNG && output_file && strcmp(output_file, "-")) {
+		if (!port_file_open(&out, output_file))
+			sys_error("Failed to open output file \"%s\": %s", output_file,
+					strerror(errno));
+	} else if (format != VIDEO_PNG) {
+		port_file_init(&out, stdout);
+	}
+	struct video_writer writer = { .format = format, .out = &out, .dir = output_file };
+	bool ok = mdd_render_video(data, size, &writer);
+	if (format != VIDEO_PNG && !port_close(&out))
+		ok = false;
+	return ok;
+}
+
 static int cli_mdd_render(int argc, char *argv[])
 {
 	string output_file = NULL;
+	bool video = false;
+	enum video_format format = VIDEO_Y4M;
 	while (1) {
 		int c = command_getopt(argc, argv, &cmd_mdd_render);
 		if (c == -1)
@@ -46,6 +73,12 @@ static int cli_mdd_render(int argc, char *argv[])
 		case LOPT_OUTPUT:
 			output_file = string_new(optarg);
 			break;
+		case LOPT_FORMAT:
+			video = strcasecmp(optarg, "gif");
+			if (video && !video_format_from_name(optarg, &format))
+				command_usage_error(&cmd_mdd_render, "Unknown output format: %s\n",
+						optarg);
+			break;
 		}
 	}
 	argc -= optind;
@@ -54,13 +87,26 @@ static int cli_mdd_render(int argc, char *argv[])
 	if (argc != 1)
 		command_usage_error(&cmd_mdd_render, "Wrong number of arguments.\n");
 
-	if (!output_file)
+	if (video && format == VIDEO_PNG && !output_file)
+		command_usage_error(&cmd_mdd_render, "PNG output requires an output directory.\n");
+	if (!output_file && !video)
 		output_file = file_replace_extension(path_basename(argv[0]), "GIF");
 
 	size_t size;
 	uint8_t *data = file_read(argv[0], &size);
+
+	if (video) {
+		if (!render_video(data, size, format, output_file))
+			sys_error("Failed to render movie");
+		free(data);
+		string_free(output_file);
+		return 0;
+	}
+
 	uint8_t *gif = mdd_render(data, size, &size);
 	free(data);
+	if (!gif)
+		sys_error("Failed to render movie file \"%s\".\n", argv[0]);
 
 	if (!file_write(output_file, gif, size))
 		sys_error("Failed to write output file \"%s\": %s", output_file, strerror(errno));
@@ -78,6 +124,8 @@ struct command cmd_mdd_render = {
 	.fun = cli_mdd_render,
 	.options = {
 		{ "output", 'o', "Set the output file path", required_argument, LOPT_OUTPUT },
+		{ "format", 0, "Set the output format (gif, y4m, rgba or png)",
+		  required_argument, LOPT_FORMAT },
 		{ 0 }
 	}
 };
@@ -0,0 +1,159 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/port.h"
+#include "ai5/arc.h"
+#include "ai5/game.h"
+#include "ai5/mes.h"
+
+#include "arc.h"
+#include "cli.h"
+#include "mes.h"
+
+enum {
+	LOPT_OUTPUT = 256,
+	LOPT_GAME,
+	LOPT_NAME,
+};
+
+static void ast_build(struct mes_ast_file *file, const char *path)
+{
+	unsigned flags = ARCHIVE_MMAP;
+	if (!arc_is_compressed(path, ai5_target_game))
+		flags |= ARCHIVE_RAW;
+	struct archive *arc = archive_open(path, flags);
+	if (!arc)
+		sys_error("Failed to open archive file \"%s\".\n", path);
+
+	mes_ast_file_init(file);
+	struct archive_data *data;
+	archive_foreach(data, arc) {
+		if (!arc_is_mes_file(data->name))
+			continue;
+		if (!archive_data_load(data)) {
+			sys_warning("Failed to read file \"%s\" from archive\n", data->name);
+			continue;
+		}
+		arc_mes_crypt(data->name, data->data, data->size);
+		mes_clear_labels();
+		mes_ast_block toplevel = vector_initializer;
+		if (mes_decompile(data->data, data->size, &toplevel))
+			mes_ast_file_add_script(file, data->name, toplevel);
+		else
+			sys_warning("Failed to decompile .mes file \"%s\".\n", data->name);
+		mes_ast_block_free(toplevel);
+		archive_data_release(data);
+	}
+	archive_close(arc);
+}
+
+static int ast_print(struct mes_ast_file *file, const char *name, int name_function)
+{
+	int no = mes_ast_file_find(file, name);
+	if (no < 0) {
+		sys_warning("No script named \"%s\".\n", name);
+		return 1;
+	}
+
+	mes_ast_block toplevel;
+	if (!mes_ast_file_load(file, no, &toplevel))
+		return 1;
+
+	struct port out;
+	port_file_init(&out, stdout);
+	mes_ast_block_print(toplevel, name_function, &out);
+	port_close(&out);
+	mes_ast_block_free(toplevel);
+	return 0;
+}
+
+int cli_mes_ast(int argc, char *argv[])
+{
+	char *output_file = NULL;
+	int name_function = -1;
+
+	while (1) {
+		int c = command_getopt(argc, argv, &cmd_mes_ast);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'o':
+		case LOPT_OUTPUT:
+			output_file = optarg;
+			break;
+		case 'g':
+		case LOPT_GAME:
+			ai5_set_game(optarg);
+			break;
+		case LOPT_NAME:
+			name_function = atoi(optarg);
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 && argc != 2)
+		command_usage_error(&cmd_mes_ast, "Wrong number of arguments.\n");
+
+	// input is either a saved AST file or an archive
+	struct mes_ast_file file;
+	if (mes_ast_file_is_ast(argv[0])) {
+		// the reason (wrong game or version) has already been reported
+		if (!mes_ast_file_read(&file, argv[0]))
+			sys_error("Failed to load AST file \"%s\".\n", argv[0]);
+	} else {
+		ast_build(&file, argv[0]);
+	}
+
+	if (output_file && !mes_ast_file_write(&file, output_file))
+		sys_error("Failed to write output file \"%s\": %s\n", output_file, strerror(errno));
+
+	int r = 0;
+	if (argc == 2) {
+		r = ast_print(&file, argv[1], name_function);
+	} else if (!output_file) {
+		struct mes_ast_file_script *script;
+		vector_foreach_p(script, file.scripts) {
+			printf("%s\t%u\n", script->name, script->size);
+		}
+	}
+
+	mes_ast_file_free(&file);
+	return r;
+}
+
+struct command cmd_mes_ast = {
+	.name = "ast",
+	.usage = "[options...] <input-archive|ast-file> [<mes-name>]",
+	.description = "Save or load the decompiled ASTs of the .mes files in an archive",
+	.parent = &cmd_mes,
+	.fun = cli_mes_ast,
+	.options = {
+		{ "output", 'o', "Save the ASTs to a file", required_argument, LOPT_OUTPUT },
+		{ "game", 'g', "Set the target game", required_argument, LOPT_GAME },
+		{ "name-function", 0, "Specify the name function number", required_argument, LOPT_NAME },
+		{ 0 }
+	}
+};
@@ -0,0 +1,571 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/port.h"
+#include "ai5/arc.h"
+#include "ai5/game.h"
+#include "ai5/mes.h"
+
+#include "arc.h"
+#include "cli.h"
+#include "mes.h"
+
+/*
+ * Round-trip checks for the .mes toolchain, run over real scripts or over randomly
+ * generated programs:
+ *
+ *   pack:      parse -> mes_pack, compared with the original bytecode
+ *   size:      mes_statement_size of every statement, summed and compared with the
+ *              size of the original bytecode
+ *   layout:    mes_statement_list_assign_addresses on statements stripped of the
+ *              addresses recorded by the parser; every statement must land at its
+ *              original address
+ *   flat:      parse -> flat print -> flat parse -> mes_pack, compared with the original
+ *   decompile: mes_decompile -> AST file -> load, compared by printed output
+ *   text:      mes_statement_list_foreach_text and foreach_text_span, which must agree
+ *              on the number of text lines
+ *   subst:     mes_substitute_text replacing 1%, 10% and 100% of the text lines; the
+ *              result must pack to bytecode that parses again
+ *
+ * Random programs are compiled from an AST built with the statement constructors
+ * (see mes_random_program), so they exercise the toolchain without needing any game
+ * data. Program N of a run uses seed S+N, and is named "random-<seed>" in failure
+ * messages; `--random 1 --seed <seed>` regenerates it.
+ *
+ * Each stage also records its throughput, so that a performance regression shows up
+ * in the same run as a correctness regression.
+ */
+
+enum {
+	LOPT_GAME = 256,
+	LOPT_FLAT,
+	LOPT_REPEAT,
+	LOPT_RANDOM,
+	LOPT_SEED,
+	LOPT_SIZE,
+};
+
+enum check_stage {
+	STAGE_PARSE,
+	STAGE_PACK,
+	STAGE_SIZE,
+	STAGE_LAYOUT,
+	STAGE_TEXT,
+	STAGE_TEXT_SPAN,
+	STAGE_SUBST_1,
+	STAGE_SUBST_10,
+	STAGE_SUBST_100,
+	STAGE_FLAT_PRINT,
+	STAGE_FLAT_PARSE,
+	STAGE_DECOMPILE,
+	STAGE_AST_SAVE,
+	STAGE_AST_LOAD,
+	NR_STAGES
+};
+
+static const char * const stage_names[NR_STAGES] = {
+	[STAGE_PARSE] = "parse",
+	[STAGE_PACK] = "pack",
+	[STAGE_SIZE] = "size",
+	[STAGE_LAYOUT] = "layout",
+	[STAGE_TEXT] = "text",
+	[STAGE_TEXT_SPAN] = "text-span",
+	[STAGE_SUBST_1] = "subst-1%",
+	[STAGE_SUBST_10] = "subst-10%",
+	[STAGE_SUBST_100] = "subst-100%",
+	[STAGE_FLAT_PRINT] = "flat-print",
+	[STAGE_FLAT_PARSE] = "flat-parse",
+	[STAGE_DECOMPILE] = "decompile",
+	[STAGE_AST_SAVE] = "ast-save",
+	[STAGE_AST_LOAD] = "ast-load",
+};
+
+struct check {
+	// scratch file for the flat round-trip (NULL to skip it)
+	const char *flat_file;
+	unsigned repeat;
+	unsigned nr_files;
+	unsigned nr_failed;
+	struct {
+		uint64_t statements;
+		double seconds;
+	} stages[NR_STAGES];
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stage_time(struct check *check, enum check_stage stage, double start,
+		unsigned nr_stmts)
+{
+	check->stages[stage].seconds += now() - start;
+	check->stages[stage].statements += nr_stmts;
+}
+
+static bool check_bytes(const char *name, const char *stage, uint8_t *expected,
+		size_t expected_size, uint8_t *actual, size_t actual_size)
+{
+	size_t i;
+	for (i = 0; i < expected_size && i < actual_size; i++) {
+		if (expected[i] != actual[i])
+			break;
+	}
+	if (i == expected_size && i == actual_size)
+		return true;
+	sys_warning("%s: %s: output differs at offset 0x%zx (%zu bytes, expected %zu)\n",
+			name, stage, i, actual_size, expected_size);
+	return false;
+}
+
+static char *ast_to_string(mes_ast_block block)
+{
+	struct port out;
+	port_buffer_init(&out);
+	mes_ast_block_print(block, -1, &out);
+	port_putc(&out, '\0');
+	return (char*)port_buffer_get(&out, NULL);
+}
+
+static bool check_pack(struct check *check, const char *name, uint8_t *data, size_t size,
+		mes_statement_list statements)
+{
+	double start = now();
+	size_t packed_size;
+	uint8_t *packed = mes_pack(statements, &packed_size);
+	stage_time(check, STAGE_PACK, start, vector_length(statements));
+
+	bool r = check_bytes(name, "pack", data, size, packed, packed_size);
+	free(packed);
+	return r;
+}
+
+static bool check_layout(struct check *check, const char *name, size_t size,
+		mes_statement_list statements)
+{
+	double start = now();
+	uint64_t total = 0;
+	struct mes_statement *stmt;
+	vector_foreach(stmt, statements) {
+		total += mes_statement_size(stmt);
+	}
+	stage_time(check, STAGE_SIZE, start, vector_length(statements));
+	if (total != size) {
+		sys_warning("%s: size: statements measure %llu bytes (expected %zu)\n", name,
+				(unsigned long long)total, size);
+		return false;
+	}
+
+	// forget the parser's layout, so that every statement is measured again
+	unsigned nr_stmts = vector_length(statements);
+	uint32_t *addresses = xcalloc(nr_stmts ? nr_stmts : 1, sizeof(uint32_t));
+	for (unsigned i = 0; i < nr_stmts; i++) {
+		stmt = vector_A(statements, i);
+		addresses[i] = stmt->address;
+		stmt->address = 0;
+		stmt->next_address = 0;
+	}
+
+	start = now();
+	total = mes_statement_list_assign_addresses(statements);
+	stage_time(check, STAGE_LAYOUT, start, nr_stmts);
+
+	bool ok = true;
+	if (total != size) {
+		sys_warning("%s: layout: statements placed in %llu bytes (expected %zu)\n",
+				name, (unsigned long long)total, size);
+		ok = false;
+	}
+	for (unsigned i = 0; ok && i < nr_stmts; i++) {
+		if (vector_A(statements, i)->address != addresses[i]) {
+			sys_warning("%s: layout: statement %u placed at %08x (expected %08x)\n",
+					name, i, (unsigned)vector_A(statements, i)->address,
+					(unsigned)addresses[i]);
+			ok = false;
+		}
+	}
+	free(addresses);
+	return ok;
+}
+
+static void count_text(string text, struct mes_statement *stmt, unsigned nr_stmts,
+		void *data)
+{
+	(*(unsigned*)data)++;
+}
+
+static void count_span(struct mes_statement **stmts, unsigned nr_stmts, void *data)
+{
+	(*(unsigned*)data)++;
+}
+
+static bool check_text(struct check *check, const char *name, mes_statement_list statements)
+{
+	double start = now();
+	unsigned nr_texts = 0;
+	mes_statement_list_foreach_text(statements, -1, count_text, NULL, &nr_texts);
+	stage_time(check, STAGE_TEXT, start, vector_length(statements));
+
+	start = now();
+	unsigned nr_spans = 0;
+	mes_statement_list_foreach_text_span(statements, -1, count_span, NULL, &nr_spans);
+	stage_time(check, STAGE_TEXT_SPAN, start, vector_length(statements));
+
+	if (nr_texts != nr_spans) {
+		sys_warning("%s: text: %u text lines but %u spans\n", name, nr_texts, nr_spans);
+		return false;
+	}
+	return true;
+}
+
+typedef vector_t(string) text_list;
+
+static void collect_text(string text, struct mes_statement *stmt, unsigned nr_stmts,
+		void *data)
+{
+	text_list *texts = data;
+	vector_push(string, *texts, string_dup(text));
+}
+
+// replace every (100/density)th text line
+static mes_text_sub_list make_subs(text_list texts, unsigned density)
+{
+	mes_text_sub_list subs = { .subs = vector_initializer };
+	for (unsigned i = 0; i < vector_length(texts); i += 100 / density) {
+		struct mes_text_substitution sub = {
+			.no = i,
+			.from = string_dup(vector_A(texts, i)),
+			.to = vector_initializer,
+		};
+		struct mes_text_line line = { (char*)"置き換えたテキスト", 18 };
+		vector_push(struct mes_text_line, sub.to, line);
+		vector_push(struct mes_text_substitution, subs.subs, sub);
+	}
+	return subs;
+}
+
+static bool check_subst(struct check *check, const char *name, uint8_t *data, size_t size)
+{
+	static const unsigned density[] = { 1, 10, 100 };
+	static const enum check_stage stages[] = { STAGE_SUBST_1, STAGE_SUBST_10,
+		STAGE_SUBST_100 };
+	text_list texts = vector_initializer;
+	bool r = true;
+
+	for (unsigned i = 0; r && i < ARRAY_SIZE(density); i++) {
+		// mes_substitute_text consumes its input, so each run needs a fresh parse
+		mes_statement_list statements = vector_initializer;
+		mes_clear_labels();
+		if (!mes_parse_statements(data, size, &statements)) {
+			sys_warning("%s: subst: parse failed\n", name);
+			r = false;
+			break;
+		}
+		if (i == 0)
+			mes_statement_list_foreach_text(statements, -1, collect_text, NULL, &texts);
+		if (vector_empty(texts)) {
+			mes_statement_list_free(statements);
+			break;
+		}
+
+		unsigned nr_stmts = vector_length(statements);
+		mes_text_sub_list subs = make_subs(texts, density[i]);
+		double start = now();
+		statements = mes_substitute_text(statements, subs, NULL);
+		stage_time(check, stages[i], start, nr_stmts);
+		mes_text_sub_list_free(subs);
+
+		size_t packed_size;
+		uint8_t *packed = mes_pack(statements, &packed_size);
+		mes_statement_list_free(statements);
+		statements = (mes_statement_list)vector_initializer;
+		mes_clear_labels();
+		if (!mes_parse_statements(packed, packed_size, &statements)) {
+			sys_warning("%s: subst-%u%%: substituted output does not parse\n", name,
+					density[i]);
+			r = false;
+		}
+		mes_statement_list_free(statements);
+		free(packed);
+	}
+
+	string s;
+	vector_foreach(s, texts) {
+		string_free(s);
+	}
+	vector_destroy(texts);
+	return r;
+}
+
+static bool check_flat(struct check *check, const char *name, uint8_t *data, size_t size,
+		mes_statement_list statements)
+{
+	double start = now();
+	struct port out;
+	if (!port_file_open(&out, check->flat_file))
+		sys_error("Failed to open scratch file \"%s\".\n", check->flat_file);
+	mes_flat_statement_list_print(statements, &out);
+	port_close(&out);
+	stage_time(check, STAGE_FLAT_PRINT, start, vector_length(statements));
+
+	start = now();
+	mes_statement_list reparsed;
+	if (!mes_flat_parse(check->flat_file, &reparsed)) {
+		sys_warning("%s: flat: failed to parse printed output\n", name);
+		return false;
+	}
+	size_t packed_size;
+	uint8_t *packed = mes_pack(reparsed, &packed_size);
+	stage_time(check, STAGE_FLAT_PARSE, start, vector_length(reparsed));
+
+	bool r = check_bytes(name, "flat", data, size, packed, packed_size);
+	free(packed);
+	mes_statement_list_free(reparsed);
+	return r;
+}
+
+static bool check_decompile(struct check *check, const char *name, uint8_t *data, size_t size,
+		unsigned nr_stmts)
+{
+	double start = now();
+	mes_ast_block toplevel = vector_initializer;
+	mes_clear_labels();
+	if (!mes_decompile(data, size, &toplevel)) {
+		sys_warning("%s: decompile: failed\n", name);
+		return false;
+	}
+	stage_time(check, STAGE_DECOMPILE, start, nr_stmts);
+
+	start = now();
+	struct mes_ast_file file;
+	mes_ast_file_init(&file);
+	mes_ast_file_add_script(&file, name, toplevel);
+	stage_time(check, STAGE_AST_SAVE, start, nr_stmts);
+
+	start = now();
+	mes_ast_block loaded;
+	bool r = mes_ast_file_load(&file, 0, &loaded);
+	stage_time(check, STAGE_AST_LOAD, start, nr_stmts);
+	mes_ast_file_free(&file);
+
+	if (r) {
+		char *expected = ast_to_string(toplevel);
+		char *actual = ast_to_string(loaded);
+		if (strcmp(expected, actual)) {
+			sys_warning("%s: ast: loaded AST differs from decompiler output\n", name);
+			r = false;
+		}
+		free(expected);
+		free(actual);
+		mes_ast_block_free(loaded);
+	} else {
+		sys_warning("%s: ast: failed to load saved AST\n", name);
+	}
+	mes_ast_block_free(toplevel);
+	return r;
+}
+
+static void check_mes(struct check *check, const char *name, uint8_t *data, size_t size)
+{
+	for (unsigned i = 0; i < check->repeat; i++) {
+		double start = now();
+		mes_statement_list statements = vector_initializer;
+		mes_clear_labels();
+		if (!mes_parse_statements(data, size, &statements)) {
+			sys_warning("%s: parse: failed\n", name);
+			check->nr_failed++;
+			return;
+		}
+		unsigned nr_stmts = vector_length(statements);
+		stage_time(check, STAGE_PARSE, start, nr_stmts);
+
+		bool ok = check_pack(check, name, data, size, statements);
+		if (ok)
+			ok = check_layout(check, name, size, statements);
+		if (ok)
+			ok = check_text(check, name, statements);
+		if (ok && check->flat_file)
+			ok = check_flat(check, name, data, size, statements);
+		mes_statement_list_free(statements);
+		if (ok)
+			ok = check_decompile(check, name, data, size, nr_stmts);
+		if (ok)
+			ok = check_subst(check, name, data, size);
+		if (!ok) {
+			check->nr_failed++;
+			return;
+		}
+	}
+	check->nr_files++;
+}
+
+static void check_archive(struct check *check, const char *path)
+{
+	unsigned flags = ARCHIVE_MMAP;
+	if (!arc_is_compressed(path, ai5_target_game))
+		flags |= ARCHIVE_RAW;
+	struct archive *arc = archive_open(path, flags);
+	if (!arc)
+		sys_error("Failed to open archive file \"%s\".\n", path);
+
+	struct archive_data *data;
+	archive_foreach(data, arc) {
+		if (!arc_is_mes_file(data->name))
+			continue;
+		if (!archive_data_load(data)) {
+			sys_warning("Failed to read file \"%s\" from archive\n", data->name);
+			continue;
+		}
+		arc_mes_crypt(data->name, data->data, data->size);
+		check_mes(check, data->name, data->data, data->size);
+		archive_data_release(data);
+	}
+	archive_close(arc);
+}
+
+static void check_file(struct check *check, const char *path)
+{
+	size_t size;
+	uint8_t *data = file_read(path, &size);
+	if (!data)
+		sys_error("Failed to read file \"%s\".\n", path);
+	check_mes(check, path, data, size);
+	free(data);
+}
+
+static void check_random(struct check *check, unsigned nr_programs, uint32_t seed,
+		unsigned nr_statements)
+{
+	for (unsigned i = 0; i < nr_programs; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "random-%u", (unsigned)(seed + i));
+
+		mes_statement_list statements;
+		if (!mes_ast_compile(mes_random_program(seed + i, nr_statements), &statements,
+					NULL, NULL)) {
+			sys_warning("%s: failed to compile generated program\n", name);
+			check->nr_failed++;
+			continue;
+		}
+		size_t size;
+		uint8_t *data = mes_pack(statements, &size);
+		mes_statement_list_free(statements);
+		check_mes(check, name, data, size);
+		free(data);
+	}
+}
+
+static void print_stats(struct check *check)
+{
+	printf("%-12s %12s %10s %14s\n", "stage", "statements", "seconds", "stmts/sec");
+	for (int i = 0; i < NR_STAGES; i++) {
+		if (!check->stages[i].statements)
+			continue;
+		double s = check->stages[i].seconds;
+		printf("%-12s %12llu %10.3f %14.0f\n", stage_names[i],
+				(unsigned long long)check->stages[i].statements, s,
+				s > 0 ? check->stages[i].statements / s : 0);
+	}
+	printf("%u files OK, %u failed\n", check->nr_files, check->nr_failed);
+}
+
+int cli_mes_check(int argc, char *argv[])
+{
+	struct check check = { .repeat = 1 };
+	unsigned nr_random = 0;
+	uint32_t seed = time(NULL);
+	unsigned random_size = 500;
+
+	while (1) {
+		int c = command_getopt(argc, argv, &cmd_mes_check);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'g':
+		case LOPT_GAME:
+			ai5_set_game(optarg);
+			break;
+		case LOPT_FLAT:
+			check.flat_file = optarg;
+			break;
+		case LOPT_REPEAT:
+			check.repeat = max(1, atoi(optarg));
+			break;
+		case LOPT_RANDOM:
+			nr_random = max(0, atoi(optarg));
+			break;
+		case LOPT_SEED:
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case LOPT_SIZE:
+			random_size = max(1, atoi(optarg));
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1 && !nr_random)
+		command_usage_error(&cmd_mes_check, "Wrong number of arguments.\n");
+
+	for (int i = 0; i < argc; i++) {
+		if (arc_is_mes_file(argv[i]))
+			check_file(&check, argv[i]);
+		else
+			check_archive(&check, argv[i]);
+	}
+
+	if (nr_random) {
+		NOTICE("Checking %u random programs (seed %u)", nr_random, (unsigned)seed);
+		check_random(&check, nr_random, seed, random_size);
+	}
+
+	print_stats(&check);
+	return check.nr_failed ? 1 : 0;
+}
+
+struct command cmd_mes_check = {
+	.name = "check",
+	.usage = "[options...] [input-archive|mes-file]...",
+	.description = "Round-trip .mes files through the parser, packer and decompiler",
+	.parent = &cmd_mes,
+	.fun = cli_mes_check,
+	.options = {
+		{ "game", 'g', "Set the target game", required_argument, LOPT_GAME },
+		{ "flat", 0, "Also round-trip through the flat format, using the given scratch file",
+			required_argument, LOPT_FLAT },
+		{ "repeat", 0, "Run each file through the checks N times", required_argument,
+			LOPT_REPEAT },
+		{ "random", 0, "Also check N randomly generated programs", required_argument,
+			LOPT_RANDOM },
+		{ "seed", 0, "Set the seed of the first random program", required_argument,
+			LOPT_SEED },
+		{ "size", 0, "Set the number of statements per random program (default 500)",
+			required_argument, LOPT_SIZE },
+		{ 0 }
+	}
+};
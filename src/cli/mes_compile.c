@@ -16,17 +16,24 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "nulib.h"
 #include "nulib/file.h"
-#include "nulib/port.h"
 #include "nulib/string.h"
+#include "nulib/vector.h"
+#include "ai5/arc.h"
 #include "ai5/game.h"
 
+#include "arc.h"
 #include "cli.h"
 #include "mes.h"
+#include "util.h"
 
 enum {
 	LOPT_OUTPUT = 256,
@@ -34,6 +41,9 @@ enum {
 	LOPT_FLAT,
 	LOPT_TEXT,
 	LOPT_BASE,
+	LOPT_BATCH,
+	LOPT_KEY,
+	LOPT_THREADS,
 };
 
 enum compile_mode {
@@ -42,10 +52,431 @@ enum compile_mode {
 	MODE_TEXT,
 };
 
+static string error_string(const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	return string_new(buf);
+}
+
+/*
+ * Parse a .TXT file and substitute its text into the base .MES file. libai5's .MES
+ * parser is not thread safe, so `ai5_lock` (if given) is held while it runs.
+ */
+static bool parse_text(const char *path, const char *base,
+		struct mes_text_encode_cache *cache, pthread_mutex_t *ai5_lock,
+		mes_statement_list *out, string *error)
+{
+	// read and parse input .MES file
+	string mes_path = base ? string_new(base) : file_replace_extension(path, "MES.IN");
+	size_t data_size;
+	uint8_t *data = file_read(mes_path, &data_size);
+	if (!data) {
+		*error = error_string("Reading input .MES file \"%s\": %s", mes_path,
+				strerror(errno));
+		string_free(mes_path);
+		return false;
+	}
+	mes_statement_list mes = vector_initializer;
+	if (ai5_lock)
+		pthread_mutex_lock(ai5_lock);
+	bool parsed = mes_parse_statements(data, data_size, &mes);
+	if (ai5_lock)
+		pthread_mutex_unlock(ai5_lock);
+	if (!parsed) {
+		*error = error_string("Parsing input .MES file \"%s\"", mes_path);
+		string_free(mes_path);
+		free(data);
+		return false;
+	}
+	string_free(mes_path);
+	free(data);
+
+	// read and parse input .TXT file
+	FILE *text_file = file_open_utf8(path, "rb");
+	if (!text_file) {
+		*error = error_string("Opening input file \"%s\": %s", path, strerror(errno));
+		mes_statement_list_free(mes);
+		return false;
+	}
+	mes_text_sub_list subs;
+	bool ok = mes_text_parse(text_file, &subs);
+	fclose(text_file);
+	if (!ok) {
+		*error = error_string("Parsing input file \"%s\"", path);
+		mes_statement_list_free(mes);
+		return false;
+	}
+
+	// substitute text into input .MES file
+	*out = mes_substitute_text(mes, subs, cache);
+	mes_text_sub_list_free(subs);
+	return true;
+}
+
+/*
+ * Compile a single input file. On failure, NULL is returned and `error` is set
+ * to a description of the problem.
+ */
+static uint8_t *compile_file(const char *path, enum compile_mode mode, const char *base,
+		struct mes_text_encode_cache *cache, pthread_mutex_t *ai5_lock, size_t *size_out,
+		string *error)
+{
+	mes_statement_list mes = vector_initializer;
+	switch (mode) {
+	case MODE_NORMAL:
+		if (!mes_smes_parse(path, &mes)) {
+			*error = error_string("Parsing input file \"%s\"", path);
+			return NULL;
+		}
+		break;
+	case MODE_FLAT:
+		if (!mes_flat_parse(path, &mes)) {
+			*error = error_string("Parsing input file \"%s\"", path);
+			return NULL;
+		}
+		break;
+	case MODE_TEXT:
+		if (!parse_text(path, base, cache, ai5_lock, &mes, error))
+			return NULL;
+		break;
+	}
+
+	uint8_t *packed = mes_pack(mes, size_out);
+	mes_statement_list_free(mes);
+	return packed;
+}
+
+// batch mode {{{
+
+struct batch_error {
+	string path;
+	string message;
+};
+
+struct batch_job {
+	string path;
+	enum compile_mode mode;
+	// compiled output; NULL (with `error` set) on failure
+	uint8_t *data;
+	size_t size;
+	string error;
+};
+
+struct batch {
+	enum compile_mode smes_mode;
+	vector_t(struct batch_error) errors;
+	unsigned nr_files;
+	// text encodings shared by all files in the batch
+	struct mes_text_encode_cache *cache;
+	// number of files compiled in parallel (0 for one per CPU)
+	unsigned nr_threads;
+	vector_t(struct batch_job) jobs;
+	// index of the next job to compile
+	unsigned next;
+	pthread_mutex_t next_lock;
+	// libai5's .MES parser is not thread safe (the flat/smes parsers are)
+	pthread_mutex_t ai5_lock;
+};
+
+/*
+ * Determine how to compile a file in a batch based on its extension.
+ * Returns false if the file should be ignored.
+ */
+static bool batch_file_mode(struct batch *batch, const char *path, enum compile_mode *mode)
+{
+	const char *ext = file_extension(path);
+	if (!ext)
+		return false;
+	if (!strcasecmp(ext, "TXT")) {
+		*mode = MODE_TEXT;
+		return true;
+	}
+	if (!strcasecmp(ext, "SMES")) {
+		*mode = batch->smes_mode;
+		return true;
+	}
+	return false;
+}
+
+static void batch_add_file(struct batch *batch, const char *path)
+{
+	struct batch_job job = { .path = string_new(path) };
+	if (batch_file_mode(batch, path, &job.mode))
+		batch->nr_files++;
+	else
+		job.error = string_new("Unrecognized file type (expected .TXT or .SMES)");
+	vector_push(struct batch_job, batch->jobs, job);
+}
+
+static void *batch_worker(void *data)
+{
+	struct batch *batch = data;
+	while (1) {
+		pthread_mutex_lock(&batch->next_lock);
+		unsigned i = batch->next++;
+		pthread_mutex_unlock(&batch->next_lock);
+		if (i >= vector_length(batch->jobs))
+			break;
+
+		struct batch_job *job = &vector_A(batch->jobs, i);
+		if (job->error)
+			continue;
+		job->data = compile_file(job->path, job->mode, NULL, batch->cache,
+				&batch->ai5_lock, &job->size, &job->error);
+		sys_message("%s... %s\n", job->path, job->data ? "OK" : "FAILED");
+	}
+	return NULL;
+}
+
+/*
+ * Compile every file in the batch on a pool of worker threads.
+ */
+static void batch_compile(struct batch *batch)
+{
+	unsigned nr_threads = batch->nr_threads ? batch->nr_threads : nr_cpus();
+	nr_threads = min(nr_threads, max(vector_length(batch->jobs), 1));
+	pthread_t *threads = xcalloc(nr_threads, sizeof(pthread_t));
+	unsigned nr_started = 0;
+	for (; nr_started < nr_threads; nr_started++) {
+		if (pthread_create(&threads[nr_started], NULL, batch_worker, batch))
+			break;
+	}
+	if (!nr_started)
+		batch_worker(batch);
+	for (unsigned i = 0; i < nr_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+}
+
+/*
+ * Get the output of a compiled file, taking ownership of it. If the file failed to
+ * compile, its error is added to the batch's errors and NULL is returned.
+ */
+static uint8_t *batch_job_take(struct batch *batch, struct batch_job *job, size_t *size_out)
+{
+	if (!job->data) {
+		struct batch_error e = { .path = string_dup(job->path), .message = job->error };
+		vector_push(struct batch_error, batch->errors, e);
+		job->error = NULL;
+		return NULL;
+	}
+	uint8_t *data = job->data;
+	*size_out = job->size;
+	job->data = NULL;
+	return data;
+}
+
+static void batch_jobs_free(struct batch *batch)
+{
+	struct batch_job *job;
+	vector_foreach_p(job, batch->jobs) {
+		string_free(job->path);
+		if (job->error)
+			string_free(job->error);
+		free(job->data);
+	}
+	vector_destroy(batch->jobs);
+}
+
+/*
+ * Print a combined report of all errors in the batch.
+ * Returns the exit code for the command.
+ */
+static int batch_report(struct batch *batch)
+{
+	if (vector_empty(batch->errors)) {
+		sys_message("Compiled %u files.\n", batch->nr_files);
+		vector_destroy(batch->errors);
+		return 0;
+	}
+
+	sys_warning("%u of %u files failed to compile:\n",
+			(unsigned)vector_length(batch->errors), batch->nr_files);
+	struct batch_error *e;
+	vector_foreach_p(e, batch->errors) {
+		sys_warning("  %s: %s\n", e->path, e->message);
+		string_free(e->path);
+		string_free(e->message);
+	}
+	vector_destroy(batch->errors);
+	return 1;
+}
+
+static int compare_strings(const void *_a, const void *_b)
+{
+	const string *a = _a;
+	const string *b = _b;
+	return strcmp(*a, *b);
+}
+
+/*
+ * Compile every .TXT/.SMES file in a directory, writing the results as .MES files
+ * into `output_dir`.
+ */
+static int batch_compile_dir(struct batch *batch, const char *input_dir,
+		const char *output_dir)
+{
+	DIR *dir = opendir(input_dir);
+	if (!dir)
+		sys_error("Failed to open directory \"%s\": %s\n", input_dir, strerror(errno));
+
+	// collect input files (sorted, so that output is deterministic)
+	vector_t(string) inputs = vector_initializer;
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		enum compile_mode mode;
+		if (!batch_file_mode(batch, ent->d_name, &mode))
+			continue;
+		string path = string_new(input_dir);
+		if (path[string_length(path) - 1] != '/')
+			path = string_concat_cstring(path, "/");
+		path = string_concat_cstring(path, ent->d_name);
+		vector_push(string, inputs, path);
+	}
+	closedir(dir);
+	qsort(inputs.a, vector_length(inputs), sizeof(string), compare_strings);
+
+	if (mkdir_p(output_dir) < 0)
+		sys_error("Failed to create output directory: %s.\n", strerror(errno));
+
+	string path;
+	vector_foreach(path, inputs) {
+		batch_add_file(batch, path);
+		string_free(path);
+	}
+	vector_destroy(inputs);
+	batch_compile(batch);
+
+	struct batch_job *job;
+	vector_foreach_p(job, batch->jobs) {
+		size_t size;
+		uint8_t *data = batch_job_take(batch, job, &size);
+		if (!data)
+			continue;
+		string out_path = string_new(output_dir);
+		if (out_path[string_length(out_path) - 1] != '/')
+			out_path = string_concat_cstring(out_path, "/");
+		string name = file_replace_extension(path_basename(job->path), "MES");
+		out_path = string_concat(out_path, name);
+		if (!file_write(out_path, data, size)) {
+			struct batch_error e = {
+				.path = string_dup(job->path),
+				.message = error_string("Writing output file \"%s\": %s",
+						out_path, strerror(errno)),
+			};
+			vector_push(struct batch_error, batch->errors, e);
+		}
+		string_free(name);
+		string_free(out_path);
+		free(data);
+	}
+	batch_jobs_free(batch);
+	return batch_report(batch);
+}
+
+/*
+ * Get the name of the archive entry for a compiled file. If the base archive
+ * contains a .LIB file by the same name, that name is used instead of .MES.
+ */
+static string batch_arc_name(struct archive *arc, const char *path)
+{
+	string name = file_replace_extension(path_basename(path), "MES");
+	if (arc && archive_get_index(arc, name) < 0) {
+		string lib_name = file_replace_extension(name, "LIB");
+		if (archive_get_index(arc, lib_name) >= 0) {
+			string_free(name);
+			return lib_name;
+		}
+		string_free(lib_name);
+	}
+	return name;
+}
+
+/*
+ * Compile every file listed in an ARCPACK manifest, writing the results directly
+ * into the manifest's output archive. The archive is only written if all files
+ * compile successfully.
+ */
+static int batch_compile_manifest(struct batch *batch, const char *manifest_path,
+		struct arc_metadata *meta)
+{
+	struct arc_manifest *mf = arc_manifest_parse(manifest_path);
+	if (!mf)
+		sys_error("Failed to parse archive manifest \"%s\".\n", manifest_path);
+	if (mf->type != ARC_MF_ARCPACK)
+		sys_error("Unsupported manifest type.\n");
+
+	bool compress = arc_is_compressed(mf->output_path, ai5_target_game);
+
+	struct archive *arc = NULL;
+	arc_file_list files = vector_initializer;
+	if (mf->arcpack.input_arc) {
+		if (!(arc = arc_file_list_open(mf->arcpack.input_arc, &files)))
+			sys_error("Failed to open archive \"%s\"\n", mf->arcpack.input_arc);
+	}
+
+	string path;
+	vector_foreach(path, mf->arcpack.input_files) {
+		batch_add_file(batch, path);
+	}
+	batch_compile(batch);
+
+	struct batch_job *job;
+	vector_foreach_p(job, batch->jobs) {
+		size_t size;
+		uint8_t *data = batch_job_take(batch, job, &size);
+		if (!data)
+			continue;
+		string name = batch_arc_name(arc, job->path);
+		if (string_length(name) >= meta->name_length) {
+			struct batch_error e = {
+				.path = string_dup(job->path),
+				.message = error_string("File name too long: \"%s\"", name),
+			};
+			vector_push(struct batch_error, batch->errors, e);
+			string_free(name);
+			free(data);
+			continue;
+		}
+		arc_file_list_put(&files, arc, name, arc_file_mem(name, data, size, compress));
+	}
+
+	batch_jobs_free(batch);
+
+	if (vector_empty(batch->errors))
+		arc_write(mf->output_path, files, meta);
+
+	if (arc)
+		archive_close(arc);
+	arc_file_list_free(files);
+	arc_manifest_free(mf);
+	return batch_report(batch);
+}
+
+static bool path_is_dir(const char *path)
+{
+	DIR *dir = opendir(path);
+	if (!dir)
+		return false;
+	closedir(dir);
+	return true;
+}
+
+// batch mode }}}
+
 int cli_mes_compile(int argc, char *argv[])
 {
 	char *input_mes = NULL;
 	char *output_file = NULL;
+	bool batch = false;
+	bool key = false;
+	int nr_threads = 0;
+	struct arc_metadata meta = ARC_METADATA_DEFAULT;
 	enum compile_mode mode = MODE_NORMAL;
 
 	while (1) {
@@ -61,6 +492,7 @@ int cli_mes_compile(int argc, char *argv[])
 		case 'g':
 		case LOPT_GAME:
 			ai5_set_game(optarg);
+			arc_set_key_by_game(optarg, &meta);
 			break;
 		case LOPT_FLAT:
 			mode = MODE_FLAT;
@@ -68,9 +500,24 @@ int cli_mes_compile(int argc, char *argv[])
 		case 't':
 		case LOPT_TEXT:
 			mode = MODE_TEXT;
+			break;
 		case LOPT_BASE:
 			input_mes = optarg;
 			break;
+		case LOPT_BATCH:
+			batch = true;
+			break;
+		case LOPT_KEY:
+			arc_decode_key(optarg, &meta);
+			key = true;
+			break;
+		case LOPT_THREADS:
+			nr_threads = atoi(optarg);
+			if (nr_threads < 0) {
+				sys_warning("Invalid number of threads: %s", optarg);
+				nr_threads = 0;
+			}
+			break;
 		}
 	}
 	argc -= optind;
@@ -80,63 +527,47 @@ int cli_mes_compile(int argc, char *argv[])
 		command_usage_error(&cmd_mes_compile, "Wrong number of arguments.\n");
 	}
 
-	if (mode == MODE_NORMAL) {
-		sys_error("Structured mes compilation not yet implemented.\n");
-	}
-
-	// open output file
-	struct port out;
-	if (output_file) {
-		if (!port_file_open(&out, output_file)) {
-			sys_error("Failed to open output file \"%s\": %s\n",
-					output_file, strerror(errno));
-		}
-	} else {
-		port_file_init(&out, stdout);
-	}
-
-	mes_statement_list mes = vector_initializer;
-
-	if (mode == MODE_FLAT) {
-		mes = mes_flat_parse(argv[0]);
-	} else if (mode == MODE_TEXT) {
-		// read and parse input .MES file
-		string mes_path = input_mes
-			? string_new(input_mes)
-			: file_replace_extension(argv[0], "MES.IN");
-		size_t data_size;
-		uint8_t *data = file_read(mes_path, &data_size);
-		if (!data)
-			sys_error("Reading input .MES file \"%s\": %s", mes_path, strerror(errno));
-		if (!mes_parse_statements(data, data_size, &mes))
-			sys_error("Parsing input .MES file \"%s\"", mes_path);
-		string_free(mes_path);
-		free(data);
-
-		// read and parse input .TXT file
-		FILE *text_file = file_open_utf8(argv[0], "rb");
-		if (!text_file)
-			sys_error("Opening input file \"%s\": %s", argv[0], strerror(errno));
-		mes_text_sub_list subs;
-		if (!mes_text_parse(text_file, &subs)) {
-			sys_error("Parsing input file \"%s\"", argv[0]);
+	if (batch) {
+		if (input_mes)
+			command_usage_error(&cmd_mes_compile,
+					"--base cannot be used with --batch.\n");
+		struct batch b = {
+			.smes_mode = mode == MODE_FLAT ? MODE_FLAT : MODE_NORMAL,
+			.errors = vector_initializer,
+			.cache = mes_text_encode_cache_new(),
+			.nr_threads = nr_threads,
+			.jobs = vector_initializer,
+		};
+		pthread_mutex_init(&b.next_lock, NULL);
+		pthread_mutex_init(&b.ai5_lock, NULL);
+		int r;
+		if (path_is_dir(argv[0])) {
+			if (key)
+				command_usage_error(&cmd_mes_compile,
+						"--key requires an archive manifest.\n");
+			r = batch_compile_dir(&b, argv[0], output_file ? output_file : ".");
+		} else {
+			r = batch_compile_manifest(&b, argv[0], &meta);
 		}
-		// substitute text into input .MES file
-		mes = mes_substitute_text(mes, subs);
-		mes_text_sub_list_free(subs);
+		mes_text_encode_cache_free(b.cache);
+		pthread_mutex_destroy(&b.next_lock);
+		pthread_mutex_destroy(&b.ai5_lock);
+		return r;
 	}
+	if (key)
+		command_usage_error(&cmd_mes_compile, "--key requires --batch.\n");
 
+	string error = NULL;
 	size_t size;
-	uint8_t *packed = mes_pack(mes, &size);
+	uint8_t *packed = compile_file(argv[0], mode, input_mes, NULL, NULL, &size, &error);
+	if (!packed)
+		sys_error("%s\n", error);
 
 	if (!file_write(output_file ? output_file : "out.mes", packed, size)) {
 		WARNING("file_write failed");
 	}
 
 	free(packed);
-	mes_statement_list_free(mes);
-
-	port_close(&out);
 	return 0;
 }
 
@@ -152,6 +583,12 @@ struct command cmd_mes_compile = {
 		{ "text", 't', "Replace text in a mes file", no_argument, LOPT_TEXT },
 		{ "base", 0, "Base mes file (for text mode)", required_argument, LOPT_BASE },
 		{ "flat", 0, "Compile a flat list of statements", no_argument, LOPT_FLAT },
+		{ "batch", 0, "Compile a directory or archive manifest of .TXT/.SMES files",
+			no_argument, LOPT_BATCH },
+		{ "key", 0, "Specify the index encryption key (with --batch and a manifest)",
+			required_argument, LOPT_KEY },
+		{ "threads", 0, "Set the number of files compiled in parallel (with --batch)",
+			required_argument, LOPT_THREADS },
 		{ 0 }
 	}
 };
@@ -25,6 +25,7 @@
 #include "ai5/game.h"
 
 #include "cli.h"
+#include "file.h"
 #include "mes.h"
 
 enum {
@@ -35,6 +36,7 @@ enum {
 	LOPT_TREE,
 	LOPT_TEXT,
 	LOPT_NAME,
+	LOPT_ENTRY,
 };
 
 enum decompile_mode {
@@ -50,6 +52,7 @@ int cli_mes_decompile(int argc, char *argv[])
 	char *output_file = NULL;
 	enum decompile_mode mode = DECOMPILE_NORMAL;
 	int name_function = -1;
+	char *entry = NULL;
 
 	while (1) {
 		int c = command_getopt(argc, argv, &cmd_mes_decompile);
@@ -81,6 +84,9 @@ int cli_mes_decompile(int argc, char *argv[])
 		case LOPT_NAME:
 			name_function = atoi(optarg);
 			break;
+		case LOPT_ENTRY:
+			entry = optarg;
+			break;
 		}
 	}
 	argc -= optind;
@@ -92,13 +98,9 @@ int cli_mes_decompile(int argc, char *argv[])
 
 	// open output file
 	struct port out;
-	if (output_file) {
-		if (!port_file_open(&out, output_file)) {
-			sys_error("Failed to open output file \"%s\": %s\n",
-					output_file, strerror(errno));
-		}
-	} else {
-		port_file_init(&out, stdout);
+	if (!file_port_open(&out, output_file)) {
+		sys_error("Failed to open output file \"%s\": %s\n",
+				output_file, strerror(errno));
 	}
 
 	// read mes file
@@ -109,7 +111,20 @@ int cli_mes_decompile(int argc, char *argv[])
 	}
 
 	// parse/decompile mes file
-	if (mode == DECOMPILE_FLAT) {
+	if (entry) {
+		// decompile a single procedure/menu entry
+		struct mes_lazy lazy;
+		if (!mes_lazy_init(mes, mes_size, &lazy))
+			sys_error("Failed to parse .mes file \"%s\".\n", argv[0]);
+		int no = mes_lazy_find(&lazy, strtoul(entry, NULL, 0));
+		if (no < 0)
+			sys_error("No procedure or menu entry at address %s.\n", entry);
+		struct mes_ast *node = mes_lazy_decompile(&lazy, no);
+		if (!node)
+			sys_error("Procedure or menu entry at address %s is unreachable.\n", entry);
+		mes_ast_print(node, name_function, &out);
+		mes_lazy_free(&lazy);
+	} else if (mode == DECOMPILE_FLAT) {
 		mes_statement_list statements = vector_initializer;
 		if (!mes_parse_statements(mes, mes_size, &statements))
 			sys_error("Failed to parse .mes file \"%s\".\n", argv[0]);
@@ -160,6 +175,7 @@ struct command cmd_mes_decompile = {
 		{ "blocks", 0, "Display (labelled) blocks", no_argument, LOPT_BLOCKS },
 		{ "tree", 0, "Display block tree", no_argument, LOPT_TREE },
 		{ "name-function", 0, "Specify the name function number", required_argument, LOPT_NAME },
+		{ "entry", 0, "Decompile only the procedure/menu entry at the given address", required_argument, LOPT_ENTRY },
 		{ 0 }
 	}
 };
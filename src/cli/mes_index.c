@@ -0,0 +1,139 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/string.h"
+#include "ai5/arc.h"
+#include "ai5/game.h"
+#include "ai5/mes.h"
+
+#include "arc.h"
+#include "cli.h"
+#include "mes.h"
+
+enum {
+	LOPT_OUTPUT = 256,
+	LOPT_GAME,
+	LOPT_NAME,
+	LOPT_REBUILD,
+};
+
+int cli_mes_index(int argc, char *argv[])
+{
+	string output_file = NULL;
+	int name_function = -1;
+	bool rebuild = false;
+
+	while (1) {
+		int c = command_getopt(argc, argv, &cmd_mes_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'o':
+		case LOPT_OUTPUT:
+			output_file = string_new(optarg);
+			break;
+		case 'g':
+		case LOPT_GAME:
+			ai5_set_game(optarg);
+			break;
+		case LOPT_NAME:
+			name_function = atoi(optarg);
+			break;
+		case LOPT_REBUILD:
+			rebuild = true;
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		command_usage_error(&cmd_mes_index, "Wrong number of arguments.\n");
+	if (!output_file)
+		output_file = file_replace_extension(path_basename(argv[0]), "IDX");
+
+	struct mes_index idx;
+	mes_index_init(&idx, ai5_target_game, name_function);
+
+	// load previous index, so that unchanged files needn't be parsed again
+	struct mes_index prev;
+	bool have_prev = !rebuild && file_exists(output_file)
+		&& mes_index_read(&prev, output_file);
+	if (have_prev && !mes_index_compatible(&idx, &prev)) {
+		NOTICE("Game or name function changed; rebuilding index.");
+		mes_index_free(&prev);
+		have_prev = false;
+	}
+
+	unsigned flags = ARCHIVE_MMAP;
+	if (!arc_is_compressed(argv[0], ai5_target_game))
+		flags |= ARCHIVE_RAW;
+	struct archive *arc = archive_open(argv[0], flags);
+	if (!arc)
+		sys_error("Failed to open archive file \"%s\".\n", argv[0]);
+
+	struct archive_data *data;
+	archive_foreach(data, arc) {
+		if (!arc_is_mes_file(data->name))
+			continue;
+		if (!archive_data_load(data)) {
+			sys_warning("Failed to read file \"%s\" from archive\n", data->name);
+			continue;
+		}
+		arc_mes_crypt(data->name, data->data, data->size);
+		mes_clear_labels();
+		if (!mes_index_add_script(&idx, data->name, data->data, data->size,
+					have_prev ? &prev : NULL))
+			sys_warning("Failed to parse .mes file \"%s\".\n", data->name);
+		archive_data_release(data);
+	}
+	mes_index_finalize(&idx);
+
+	if (!mes_index_write(&idx, output_file))
+		sys_error("Failed to write index file \"%s\": %s\n", output_file, strerror(errno));
+	NOTICE("Indexed %u lines of text in %u files.",
+			(unsigned)vector_length(idx.texts), (unsigned)vector_length(idx.scripts));
+
+	if (have_prev)
+		mes_index_free(&prev);
+	mes_index_free(&idx);
+	archive_close(arc);
+	string_free(output_file);
+	return 0;
+}
+
+struct command cmd_mes_index = {
+	.name = "index",
+	.usage = "[options...] <input-archive>",
+	.description = "Build a search index of the text in an archive of .mes files",
+	.parent = &cmd_mes,
+	.fun = cli_mes_index,
+	.options = {
+		{ "output", 'o', "Set the output file path", required_argument, LOPT_OUTPUT },
+		{ "game", 'g', "Set the target game", required_argument, LOPT_GAME },
+		{ "name-function", 0, "Specify the name function number", required_argument, LOPT_NAME },
+		{ "rebuild", 0, "Ignore any existing index file", no_argument, LOPT_REBUILD },
+		{ 0 }
+	}
+};
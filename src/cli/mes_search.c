@@ -0,0 +1,70 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "nulib.h"
+
+#include "cli.h"
+#include "mes.h"
+
+struct search_data {
+	unsigned count;
+};
+
+static void print_result(struct mes_index *idx, struct mes_index_text *t, void *_data)
+{
+	struct search_data *data = _data;
+	printf("%s:%u:%08x: %s\n", vector_A(idx->scripts, t->script).name, t->no,
+			t->address, idx->pool + t->off);
+	data->count++;
+}
+
+int cli_mes_search(int argc, char *argv[])
+{
+	while (1) {
+		int c = command_getopt(argc, argv, &cmd_mes_search);
+		if (c == -1)
+			break;
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		command_usage_error(&cmd_mes_search, "Wrong number of arguments.\n");
+
+	struct mes_index idx;
+	if (!mes_index_read(&idx, argv[0]))
+		sys_error("Failed to read index file \"%s\".\n", argv[0]);
+
+	struct search_data data = {0};
+	mes_index_search(&idx, argv[1], print_result, &data);
+
+	mes_index_free(&idx);
+	return data.count ? 0 : 1;
+}
+
+struct command cmd_mes_search = {
+	.name = "search",
+	.usage = "[options...] <index-file> <text>",
+	.description = "Search for text using an index built with 'mes index'",
+	.parent = &cmd_mes,
+	.fun = cli_mes_search,
+	.options = {
+		{ 0 }
+	}
+};
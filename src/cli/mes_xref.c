@@ -0,0 +1,169 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "ai5/arc.h"
+#include "ai5/game.h"
+#include "ai5/mes.h"
+
+#include "arc.h"
+#include "cli.h"
+#include "mes.h"
+
+enum {
+	LOPT_OUTPUT = 256,
+	LOPT_GAME,
+};
+
+static void xref_build(struct mes_xref_table *table, const char *path)
+{
+	unsigned flags = ARCHIVE_MMAP;
+	if (!arc_is_compressed(path, ai5_target_game))
+		flags |= ARCHIVE_RAW;
+	struct archive *arc = archive_open(path, flags);
+	if (!arc)
+		sys_error("Failed to open archive file \"%s\".\n", path);
+
+	mes_xref_table_init(table);
+	struct archive_data *data;
+	archive_foreach(data, arc) {
+		if (!arc_is_mes_file(data->name))
+			continue;
+		if (!archive_data_load(data)) {
+			sys_warning("Failed to read file \"%s\" from archive\n", data->name);
+			continue;
+		}
+		arc_mes_crypt(data->name, data->data, data->size);
+		mes_clear_labels();
+		mes_statement_list statements = vector_initializer;
+		if (mes_parse_statements(data->data, data->size, &statements))
+			mes_xref_add_script(table, data->name, statements);
+		else
+			sys_warning("Failed to parse .mes file \"%s\".\n", data->name);
+		mes_statement_list_free(statements);
+		archive_data_release(data);
+	}
+	mes_xref_table_finalize(table);
+	archive_close(arc);
+}
+
+static void print_ref(struct mes_xref_table *table, struct mes_xref *ref, void *data)
+{
+	printf("%s:%08x: %s\n", vector_A(table->names, ref->script), ref->address,
+			mes_xref_access_names[ref->access]);
+}
+
+static void print_table(struct mes_xref_table *table)
+{
+	struct mes_xref *ref;
+	vector_foreach_p(ref, table->refs) {
+		printf("%s ", mes_xref_kind_names[ref->kind]);
+		if (ref->kind == MES_XREF_MES)
+			printf("%s ", vector_A(table->names, ref->no));
+		else
+			printf("%u ", ref->no);
+		print_ref(table, ref, NULL);
+	}
+}
+
+static int xref_query(struct mes_xref_table *table, const char *kind_name, const char *no_str)
+{
+	int kind = -1;
+	for (int i = 0; i < MES_XREF_NR_KINDS; i++) {
+		if (!strcasecmp(kind_name, mes_xref_kind_names[i]))
+			kind = i;
+	}
+	if (kind < 0)
+		command_usage_error(&cmd_mes_xref, "Unknown reference kind: %s\n", kind_name);
+
+	long no;
+	if (kind == MES_XREF_MES) {
+		if ((no = mes_xref_name_index(table, no_str)) < 0)
+			return 1;
+	} else {
+		char *endptr;
+		no = strtol(no_str, &endptr, 0);
+		if (*endptr || no < 0)
+			command_usage_error(&cmd_mes_xref, "Invalid number: %s\n", no_str);
+	}
+
+	return mes_xref_lookup(table, kind, no, print_ref, NULL) ? 0 : 1;
+}
+
+int cli_mes_xref(int argc, char *argv[])
+{
+	char *output_file = NULL;
+
+	while (1) {
+		int c = command_getopt(argc, argv, &cmd_mes_xref);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'o':
+		case LOPT_OUTPUT:
+			output_file = optarg;
+			break;
+		case 'g':
+		case LOPT_GAME:
+			ai5_set_game(optarg);
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 && argc != 3)
+		command_usage_error(&cmd_mes_xref, "Wrong number of arguments.\n");
+
+	// input is either a saved table or an archive
+	struct mes_xref_table table;
+	if (!mes_xref_table_read(&table, argv[0]))
+		xref_build(&table, argv[0]);
+
+	if (output_file && !mes_xref_table_write(&table, output_file))
+		sys_error("Failed to write output file \"%s\": %s\n", output_file, strerror(errno));
+
+	int r = 0;
+	if (argc == 3)
+		r = xref_query(&table, argv[1], argv[2]);
+	else if (!output_file)
+		print_table(&table);
+
+	mes_xref_table_free(&table);
+	return r;
+}
+
+struct command cmd_mes_xref = {
+	.name = "xref",
+	.usage = "[options...] <input-archive|xref-file> [<kind> <number>]",
+	.description = "Cross-reference procedures, mes files and variables "
+		"(kind: proc, sub, mes, flag, var16, var32, sysvar, sysvar32, arg)",
+	.parent = &cmd_mes,
+	.fun = cli_mes_xref,
+	.options = {
+		{ "output", 'o', "Save the cross-reference table", required_argument, LOPT_OUTPUT },
+		{ "game", 'g', "Set the target game", required_argument, LOPT_GAME },
+		{ 0 }
+	}
+};
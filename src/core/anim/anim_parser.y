@@ -1,4 +1,5 @@
 %define api.prefix {anim_script_}
+%define api.pure full
 %define parse.error detailed
 %define parse.lac full
 
@@ -12,14 +13,20 @@
 #include "nulib/vector.h"
 #include "anim_parser.tab.h"
 
-int anim_script_lex();
-extern FILE *anim_script_in;
-extern int anim_script_lineno;
+int anim_script_lex_init(void **scanner);
+void anim_script_set_in(FILE *in, void *scanner);
+int anim_script_get_lineno(void *scanner);
+int anim_script_lex_destroy(void *scanner);
+int anim_script_parse(void *scanner, struct anim_parse_state *state);
 
 #define PARSE_ERROR(fmt, ...) \
-	sys_error("ERROR: At line %d: " fmt "\n", anim_script_lineno, ##__VA_ARGS__)
+	sys_error("ERROR: At line %d: " fmt "\n", anim_script_get_lineno(state->scanner), \
+			##__VA_ARGS__)
 
-static struct anim program;
+struct anim_parse_state {
+	void *scanner;
+	struct anim program;
+};
 
 static FILE *open_file(const char *file)
 {
@@ -32,37 +39,39 @@ struct anim *anim_parse_script(const char *path)
 {
 	struct anim *anim = NULL;
 
-	anim_script_in = open_file(path);
-	if (!anim_script_in) {
+	FILE *in = open_file(path);
+	if (!in) {
 		WARNING("Failed to open input file \"%s\": %s", path, strerror(errno));
 		return NULL;
 	}
 
-	program = (struct anim){0};
-	if (anim_script_parse()) {
+	struct anim_parse_state state = {0};
+	anim_script_lex_init(&state.scanner);
+	anim_script_set_in(in, state.scanner);
+	if (anim_script_parse(state.scanner, &state)) {
 		WARNING("Failed to parse file: %s", path);
 		goto end;
 	}
 
 	anim = xmalloc(sizeof(struct anim));
-	*anim = program;
+	*anim = state.program;
 end:
-	if (anim_script_in != stdin)
-		fclose(anim_script_in);
-	anim_script_in = NULL;
+	anim_script_lex_destroy(state.scanner);
+	if (in != stdin)
+		fclose(in);
 	return anim;
 }
 
-void anim_script_error(const char *s)
+void anim_script_error(void *scanner, struct anim_parse_state *state, const char *s)
 {
 	PARSE_ERROR("%s", s);
 }
 
-static void push_stream(anim_stream stream)
+static void push_stream(struct anim_parse_state *state, anim_stream stream)
 {
 	for (int i = 0; i < ANIM_MAX_STREAMS; i++) {
-		if (vector_length(program.streams[i]) == 0) {
-			program.streams[i] = stream;
+		if (vector_length(state->program.streams[i]) == 0) {
+			state->program.streams[i] = stream;
 			return;
 		}
 	}
@@ -125,16 +134,16 @@ static bool draw_call_eq(struct anim_draw_call *a, struct anim_draw_call *b)
 	return false;
 }
 
-static unsigned push_draw_call(struct anim_draw_call *call)
+static unsigned push_draw_call(struct anim_parse_state *state, struct anim_draw_call *call)
 {
-	for (int i = 0; i < vector_length(program.draw_calls); i++) {
-		if (draw_call_eq(call, &vector_A(program.draw_calls, i)))
+	for (int i = 0; i < vector_length(state->program.draw_calls); i++) {
+		if (draw_call_eq(call, &vector_A(state->program.draw_calls, i)))
 			return i;
 	}
-	if (vector_length(program.draw_calls) + 20 >= 256)
+	if (vector_length(state->program.draw_calls) + 20 >= 256)
 		PARSE_ERROR("Too many draw calls");
-	unsigned no = vector_length(program.draw_calls);
-	vector_push(struct anim_draw_call, program.draw_calls, *call);
+	unsigned no = vector_length(state->program.draw_calls);
+	vector_push(struct anim_draw_call, state->program.draw_calls, *call);
 	return no;
 }
 
@@ -149,13 +158,15 @@ static struct anim_instruction make_instruction(enum anim_opcode op, uint8_t arg
 	return (struct anim_instruction) { .op = op, .arg = arg };
 }
 
-static struct anim_instruction make_draw_call(struct anim_draw_call *call)
+static struct anim_instruction make_draw_call(struct anim_parse_state *state,
+		struct anim_draw_call *call)
 {
-	uint8_t no = push_draw_call(call);
+	uint8_t no = push_draw_call(state, call);
 	return make_instruction(ANIM_OP_DRAW, no);
 }
 
-static struct anim_instruction make_fill(struct anim_target target, struct anim_size size)
+static struct anim_instruction make_fill(struct anim_parse_state *state,
+		struct anim_target target, struct anim_size size)
 {
 	struct anim_draw_call call = {
 		.op = ANIM_DRAW_OP_FILL,
@@ -164,10 +175,11 @@ static struct anim_instruction make_fill(struct anim_target target, struct anim_
 			.dim = size
 		}
 	};
-	return make_draw_call(&call);
+	return make_draw_call(state, &call);
 }
 
-static struct anim_instruction make_copy(enum anim_draw_opcode op, struct anim_target src,
+static struct anim_instruction make_copy(struct anim_parse_state *state,
+			enum anim_draw_opcode op, struct anim_target src,
 			struct anim_target dst, struct anim_size size)
 {
 	struct anim_draw_call call = {
@@ -178,10 +190,11 @@ static struct anim_instruction make_copy(enum anim_draw_opcode op, struct anim_t
 			.dim = size
 		}
 	};
-	return make_draw_call(&call);
+	return make_draw_call(state, &call);
 }
 
-static struct anim_instruction make_compose(enum anim_draw_opcode op, struct anim_target bg,
+static struct anim_instruction make_compose(struct anim_parse_state *state,
+			enum anim_draw_opcode op, struct anim_target bg,
 			struct anim_target fg, struct anim_target dst, struct anim_size size)
 {
 	struct anim_draw_call call = {
@@ -193,10 +206,11 @@ static struct anim_instruction make_compose(enum anim_draw_opcode op, struct ani
 			.dim = size
 		}
 	};
-	return make_draw_call(&call);
+	return make_draw_call(state, &call);
 }
 
-static struct anim_instruction make_set_color(uint8_t i, struct anim_color color)
+static struct anim_instruction make_set_color(struct anim_parse_state *state, uint8_t i,
+		struct anim_color color)
 {
 	if (i != (color.b & 0xf)) {
 		WARNING("blue value %u will be clobbered by index %u", color.b, i);
@@ -209,10 +223,11 @@ static struct anim_instruction make_set_color(uint8_t i, struct anim_color color
 			.color = color
 		}
 	};
-	return make_draw_call(&call);
+	return make_draw_call(state, &call);
 }
 
-static struct anim_instruction make_set_palette(struct anim_color c0, struct anim_color c1,
+static struct anim_instruction make_set_palette(struct anim_parse_state *state,
+			struct anim_color c0, struct anim_color c1,
 			struct anim_color c2, struct anim_color c3, struct anim_color c4,
 			struct anim_color c5, struct anim_color c6, struct anim_color c7,
 			struct anim_color c8, struct anim_color c9, struct anim_color c10,
@@ -229,10 +244,10 @@ static struct anim_instruction make_set_palette(struct anim_color c0, struct ani
 			}
 		}
 	};
-	return make_draw_call(&call);
+	return make_draw_call(state, &call);
 }
 
-static long parse_int(string str)
+static long parse_int(struct anim_parse_state *state, string str)
 {
 	char *endptr;
 	long i = strtol(str, &endptr, 0);
@@ -241,44 +256,44 @@ static long parse_int(string str)
 	return i;
 }
 
-static uint32_t _parse_uX(string str, unsigned limit)
+static uint32_t _parse_uX(struct anim_parse_state *state, string str, unsigned limit)
 {
-	long i = parse_int(str);
+	long i = parse_int(state, str);
 	if (i < 0 || i > limit)
 		PARSE_ERROR("value out of range: %s (valid range is [0, %u])", str, limit);
 	return i;
 }
 
-static uint32_t parse_uX(string str, unsigned limit)
+static uint32_t parse_uX(struct anim_parse_state *state, string str, unsigned limit)
 {
-	uint32_t i = _parse_uX(str, limit);
+	uint32_t i = _parse_uX(state, str, limit);
 	string_free(str);
 	return i;
 }
 
-static uint8_t parse_u1(string str)
+static uint8_t parse_u1(struct anim_parse_state *state, string str)
 {
-	return parse_uX(str, 1);
+	return parse_uX(state, str, 1);
 }
 
-static uint8_t parse_u4(string str)
+static uint8_t parse_u4(struct anim_parse_state *state, string str)
 {
-	return parse_uX(str, 15);
+	return parse_uX(state, str, 15);
 }
 
-static uint8_t parse_u8(string str)
+static uint8_t parse_u8(struct anim_parse_state *state, string str)
 {
-	return parse_uX(str, 255);
+	return parse_uX(state, str, 255);
 }
 
-static uint16_t parse_u16(string str)
+static uint16_t parse_u16(struct anim_parse_state *state, string str)
 {
-	return parse_uX(str, 65535);
+	return parse_uX(state, str, 65535);
 }
 
-static uint16_t parse_x_dim(string str)
+static uint16_t parse_x_dim(struct anim_parse_state *state, string str)
 {
-	uint16_t n = _parse_uX(str, 65535);
+	uint16_t n = _parse_uX(state, str, 65535);
 	if (anim_type == ANIM_S4 && n & 7) {
 		WARNING("X dimension will be truncated to multiple of 8: %s", str);
 	}
@@ -286,29 +301,31 @@ static uint16_t parse_x_dim(string str)
 	return n;
 }
 
-static struct anim_target make_target(string i, string x, string y)
+static struct anim_target make_target(struct anim_parse_state *state, string i, string x,
+		string y)
 {
 	return (struct anim_target) {
-		.i = parse_u1(i),
-		.x = parse_x_dim(x),
-		.y = parse_u16(y)
+		.i = parse_u1(state, i),
+		.x = parse_x_dim(state, x),
+		.y = parse_u16(state, y)
 	};
 }
 
-static struct anim_size make_size(string w, string h)
+static struct anim_size make_size(struct anim_parse_state *state, string w, string h)
 {
 	return (struct anim_size) {
-		.w = parse_x_dim(w),
-		.h = parse_u16(h)
+		.w = parse_x_dim(state, w),
+		.h = parse_u16(state, h)
 	};
 }
 
-static struct anim_color make_color(string r, string g, string b)
+static struct anim_color make_color(struct anim_parse_state *state, string r, string g,
+		string b)
 {
 	struct anim_color c = {
-		.r = parse_u4(r),
-		.g = parse_u4(g),
-		.b = parse_u4(b)
+		.r = parse_u4(state, r),
+		.g = parse_u4(state, g),
+		.b = parse_u4(state, b)
 	};
 	c.r |= c.r << 4;
 	c.g |= c.g << 4;
@@ -316,7 +333,7 @@ static struct anim_color make_color(string r, string g, string b)
 	return c;
 }
 
-static struct anim_color make_packed_color(string str)
+static struct anim_color make_packed_color(struct anim_parse_state *state, string str)
 {
 	// parse RRGGBB to integer
 	if (*str != '#')
@@ -343,15 +360,16 @@ static anim_color_list push_color(anim_color_list colors, struct anim_color colo
 	return colors;
 }
 
-static void push_palette(struct anim_palette palette)
+static void push_palette(struct anim_parse_state *state, struct anim_palette palette)
 {
-	vector_push(struct anim_palette, program.palettes, palette);
+	vector_push(struct anim_palette, state->program.palettes, palette);
 }
 
-static struct anim_palette make_palette(string no, anim_color_list colors)
+static struct anim_palette make_palette(struct anim_parse_state *state, string no,
+		anim_color_list colors)
 {
 	struct anim_palette pal;
-	pal.addr = parse_u16(no);
+	pal.addr = parse_u16(state, no);
 
 	int i = 0;
 	struct anim_color *c;
@@ -392,8 +410,17 @@ static struct anim_palette make_palette(string no, anim_color_list colors)
 	#include "nulib/string.h"
 	#include "ai5/anim.h"
 	typedef vector_t(struct anim_color) anim_color_list;
+	struct anim_parse_state;
 }
 
+%code provides {
+	int anim_script_lex(ANIM_SCRIPT_STYPE *lval, void *scanner);
+	void anim_script_error(void *scanner, struct anim_parse_state *state, const char *s);
+}
+
+%lex-param {void *scanner}
+%parse-param {void *scanner} {struct anim_parse_state *state}
+
 %token	<string>	I_CONSTANT C_CONSTANT
 %token	<token>		ARROW STREAM PALETTE NOOP CHECK_STOP STALL RESET HALT LOOP_START
 %token	<token>		LOOP_END LOOP2_START LOOP2_END LOAD_PALETTE COPY COPY_MASKED SWAP
@@ -418,17 +445,17 @@ head
 	;
 
 palettes
-	: palette { push_palette($1); }
-	| palettes palette { push_palette($2); }
+	: palette { push_palette(state, $1); }
+	| palettes palette { push_palette(state, $2); }
 	;
 
 palette
-	: PALETTE I_CONSTANT '{' colors '}' ';' { $$ = make_palette($2, $4); }
+	: PALETTE I_CONSTANT '{' colors '}' ';' { $$ = make_palette(state, $2, $4); }
 	;
 
 streams
-	: stream { push_stream($1); }
-	| streams stream { push_stream($2); }
+	: stream { push_stream(state, $1); }
+	| streams stream { push_stream(state, $2); }
 	;
 
 stream
@@ -446,31 +473,32 @@ instruction
 	| CHECK_STOP ';'
 	{ $$ = make_instruction(ANIM_OP_CHECK_STOP, 0); }
 	| STALL I_CONSTANT ';'
-	{ $$ = make_instruction(ANIM_OP_STALL, parse_u8($2)); }
+	{ $$ = make_instruction(ANIM_OP_STALL, parse_u8(state, $2)); }
 	| RESET ';'
 	{ $$ = make_instruction(ANIM_OP_RESET, 0); }
 	| HALT ';'
 	{ $$ = make_instruction(ANIM_OP_HALT, 0); }
 	| LOOP_START I_CONSTANT ';'
-	{ $$ = make_instruction(ANIM_OP_LOOP_START, parse_u8($2)); }
+	{ $$ = make_instruction(ANIM_OP_LOOP_START, parse_u8(state, $2)); }
 	| LOOP_END ';'
 	{ $$ = make_instruction(ANIM_OP_LOOP_END, 0); }
 	| LOOP2_START I_CONSTANT ';'
-	{ $$ = make_instruction(ANIM_OP_LOOP2_START, parse_u8($2)); }
+	{ $$ = make_instruction(ANIM_OP_LOOP2_START, parse_u8(state, $2)); }
 	| LOOP2_END ';'
 	{ $$ = make_instruction(ANIM_OP_LOOP2_END, 0); }
 	| LOAD_PALETTE I_CONSTANT ';'
-	{ $$ = make_instruction(ANIM_OP_LOAD_PALETTE, parse_u16($2)); }
+	{ $$ = make_instruction(ANIM_OP_LOAD_PALETTE, parse_u16(state, $2)); }
 	| FILL target '@' size ';'
-	{ $$ = make_fill($2, $4); }
+	{ $$ = make_fill(state, $2, $4); }
 	| copy_fun target ARROW target '@' size ';'
-	{ $$ = make_copy($1, $2, $4, $6); }
+	{ $$ = make_copy(state, $1, $2, $4, $6); }
 	| compose_fun target '+' target ARROW target '@' size ';'
-	{ $$ = make_compose($1, $2, $4, $6, $8); }
+	{ $$ = make_compose(state, $1, $2, $4, $6, $8); }
 	| SET_COLOR I_CONSTANT ARROW color ';'
-	{ $$ = make_set_color(parse_u4($2), $4); }
+	{ $$ = make_set_color(state, parse_u4(state, $2), $4); }
 	| SET_PALETTE color color color color color color color color color color color color color color color color ';'
-	{ $$ = make_set_palette($2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14, $15, $16, $17); }
+	{ $$ = make_set_palette(state, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14,
+			$15, $16, $17); }
 	;
 
 copy_fun
@@ -485,18 +513,19 @@ compose_fun
 	;
 
 target
-	: I_CONSTANT '(' I_CONSTANT ',' I_CONSTANT ')' { $$ = make_target($1, $3, $5); }
+	: I_CONSTANT '(' I_CONSTANT ',' I_CONSTANT ')' { $$ = make_target(state, $1, $3, $5); }
 	;
 
 size
-	: '(' I_CONSTANT ',' I_CONSTANT ')' { $$ = make_size($2, $4); }
+	: '(' I_CONSTANT ',' I_CONSTANT ')' { $$ = make_size(state, $2, $4); }
 	;
 
 colors
-	: C_CONSTANT { $$ = push_color((anim_color_list)vector_initializer, make_packed_color($1)); }
-	| colors C_CONSTANT { $$ = push_color($1, make_packed_color($2)); }
+	: C_CONSTANT
+	{ $$ = push_color((anim_color_list)vector_initializer, make_packed_color(state, $1)); }
+	| colors C_CONSTANT { $$ = push_color($1, make_packed_color(state, $2)); }
 	;
 
 color
-	: '(' I_CONSTANT ',' I_CONSTANT ',' I_CONSTANT ')' { $$ = make_color($2, $4, $6); }
+	: '(' I_CONSTANT ',' I_CONSTANT ',' I_CONSTANT ')' { $$ = make_color(state, $2, $4, $6); }
 	;
@@ -0,0 +1,267 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "nulib.h"
+
+#include "anim.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BLIT_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Row kernels for the masked copy and compose draw calls. The mask color is 8
+ * for indexed CGs and 00f800 for direct color CGs (the 4th byte is ignored).
+ */
+
+// XXX: we assume mask color is 8 / 00f800
+#define MASK8 8
+#define MASK32 0x0000f800u
+#define RGB32 0x00ffffffu
+
+// Scalar {{{
+
+static inline bool is_mask32(const uint8_t *p)
+{
+	return p[0] == 0 && p[1] == 0xf8 && p[2] == 0;
+}
+
+static void scalar_copy_masked8(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	for (unsigned i = 0; i < w; i++) {
+		if (src[i] != MASK8)
+			dst[i] = src[i];
+	}
+}
+
+static void scalar_compose8(uint8_t *dst, const uint8_t *fg, const uint8_t *bg, unsigned w)
+{
+	for (unsigned i = 0; i < w; i++) {
+		dst[i] = fg[i] == MASK8 ? bg[i] : fg[i];
+	}
+}
+
+static void scalar_copy_masked32(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	for (unsigned i = 0; i < w; i++, src += 4, dst += 4) {
+		if (!is_mask32(src))
+			memcpy(dst, src, 4);
+	}
+}
+
+static void scalar_compose32(uint8_t *dst, const uint8_t *fg, const uint8_t *bg, unsigned w)
+{
+	for (unsigned i = 0; i < w; i++, fg += 4, bg += 4, dst += 4) {
+		memcpy(dst, is_mask32(fg) ? bg : fg, 4);
+	}
+}
+
+const struct anim_blit_kernels anim_blit_scalar = {
+	.name = "scalar",
+	.copy_masked8 = scalar_copy_masked8,
+	.compose8 = scalar_compose8,
+	.copy_masked32 = scalar_copy_masked32,
+	.compose32 = scalar_compose32,
+};
+
+// Scalar }}}
+#ifdef BLIT_X86
+// SSE2 {{{
+
+/*
+ * SSE2 has no byte blend, so pixels are selected with and/andnot/or on the
+ * compare result (all ones where the source pixel is the mask color).
+ */
+#define SSE2_SELECT(m, a, b) _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b))
+
+__attribute__((target("sse2")))
+static void sse2_copy_masked8(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m128i key = _mm_set1_epi8(MASK8);
+	unsigned i = 0;
+	for (; i + 16 <= w; i += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+		__m128i m = _mm_cmpeq_epi8(s, key);
+		_mm_storeu_si128((__m128i*)(dst + i), SSE2_SELECT(m, d, s));
+	}
+	scalar_copy_masked8(dst + i, src + i, w - i);
+}
+
+__attribute__((target("sse2")))
+static void sse2_compose8(uint8_t *dst, const uint8_t *fg, const uint8_t *bg, unsigned w)
+{
+	const __m128i key = _mm_set1_epi8(MASK8);
+	unsigned i = 0;
+	for (; i + 16 <= w; i += 16) {
+		__m128i f = _mm_loadu_si128((const __m128i*)(fg + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(bg + i));
+		__m128i m = _mm_cmpeq_epi8(f, key);
+		_mm_storeu_si128((__m128i*)(dst + i), SSE2_SELECT(m, b, f));
+	}
+	scalar_compose8(dst + i, fg + i, bg + i, w - i);
+}
+
+__attribute__((target("sse2")))
+static void sse2_copy_masked32(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m128i key = _mm_set1_epi32(MASK32);
+	const __m128i rgb = _mm_set1_epi32(RGB32);
+	unsigned i = 0;
+	for (; i + 4 <= w; i += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + i*4));
+		__m128i d = _mm_loadu_si128((const __m128i*)(dst + i*4));
+		__m128i m = _mm_cmpeq_epi32(_mm_and_si128(s, rgb), key);
+		_mm_storeu_si128((__m128i*)(dst + i*4), SSE2_SELECT(m, d, s));
+	}
+	scalar_copy_masked32(dst + i*4, src + i*4, w - i);
+}
+
+__attribute__((target("sse2")))
+static void sse2_compose32(uint8_t *dst, const uint8_t *fg, const uint8_t *bg, unsigned w)
+{
+	const __m128i key = _mm_set1_epi32(MASK32);
+	const __m128i rgb = _mm_set1_epi32(RGB32);
+	unsigned i = 0;
+	for (; i + 4 <= w; i += 4) {
+		__m128i f = _mm_loadu_si128((const __m128i*)(fg + i*4));
+		__m128i b = _mm_loadu_si128((const __m128i*)(bg + i*4));
+		__m128i m = _mm_cmpeq_epi32(_mm_and_si128(f, rgb), key);
+		_mm_storeu_si128((__m128i*)(dst + i*4), SSE2_SELECT(m, b, f));
+	}
+	scalar_compose32(dst + i*4, fg + i*4, bg + i*4, w - i);
+}
+
+const struct anim_blit_kernels anim_blit_sse2 = {
+	.name = "sse2",
+	.copy_masked8 = sse2_copy_masked8,
+	.compose8 = sse2_compose8,
+	.copy_masked32 = sse2_copy_masked32,
+	.compose32 = sse2_compose32,
+};
+
+// SSE2 }}}
+// AVX2 {{{
+
+__attribute__((target("avx2")))
+static void avx2_copy_masked8(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m256i key = _mm256_set1_epi8(MASK8);
+	unsigned i = 0;
+	for (; i + 32 <= w; i += 32) {
+		__m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+		__m256i m = _mm256_cmpeq_epi8(s, key);
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_blendv_epi8(s, d, m));
+	}
+	sse2_copy_masked8(dst + i, src + i, w - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_compose8(uint8_t *dst, const uint8_t *fg, const uint8_t *bg, unsigned w)
+{
+	const __m256i key = _mm256_set1_epi8(MASK8);
+	unsigned i = 0;
+	for (; i + 32 <= w; i += 32) {
+		__m256i f = _mm256_loadu_si256((const __m256i*)(fg + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(bg + i));
+		__m256i m = _mm256_cmpeq_epi8(f, key);
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_blendv_epi8(f, b, m));
+	}
+	sse2_compose8(dst + i, fg + i, bg + i, w - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_copy_masked32(uint8_t *dst, const uint8_t *src, unsigned w)
+{
+	const __m256i key = _mm256_set1_epi32(MASK32);
+	const __m256i rgb = _mm256_set1_epi32(RGB32);
+	unsigned i = 0;
+	for (; i + 8 <= w; i += 8) {
+		__m256i s = _mm256_loadu_si256((const __m256i*)(src + i*4));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i*4));
+		__m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(s, rgb), key);
+		_mm256_storeu_si256((__m256i*)(dst + i*4), _mm256_blendv_epi8(s, d, m));
+	}
+	sse2_copy_masked32(dst + i*4, src + i*4, w - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_compose32(uint8_t *dst, const uint8_t *fg, const uint8_t *bg, unsigned w)
+{
+	const __m256i key = _mm256_set1_epi32(MASK32);
+	const __m256i rgb = _mm256_set1_epi32(RGB32);
+	unsigned i = 0;
+	for (; i + 8 <= w; i += 8) {
+		__m256i f = _mm256_loadu_si256((const __m256i*)(fg + i*4));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(bg + i*4));
+		__m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(f, rgb), key);
+		_mm256_storeu_si256((__m256i*)(dst + i*4), _mm256_blendv_epi8(f, b, m));
+	}
+	sse2_compose32(dst + i*4, fg + i*4, bg + i*4, w - i);
+}
+
+const struct anim_blit_kernels anim_blit_avx2 = {
+	.name = "avx2",
+	.copy_masked8 = avx2_copy_masked8,
+	.compose8 = avx2_compose8,
+	.copy_masked32 = avx2_copy_masked32,
+	.compose32 = avx2_compose32,
+};
+
+// AVX2 }}}
+#endif // BLIT_X86
+// Dispatch {{{
+
+static const struct anim_blit_kernels *selected = NULL;
+
+/*
+ * Get the list of kernels supported by the host CPU, best first.
+ */
+unsigned anim_blit_available(const struct anim_blit_kernels **out)
+{
+	unsigned n = 0;
+#ifdef BLIT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		out[n++] = &anim_blit_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		out[n++] = &anim_blit_sse2;
+#endif
+	out[n++] = &anim_blit_scalar;
+	return n;
+}
+
+const struct anim_blit_kernels *anim_blit_get(void)
+{
+	if (!selected) {
+		const struct anim_blit_kernels *list[ANIM_BLIT_MAX_KERNELS];
+		anim_blit_available(list);
+		selected = list[0];
+	}
+	return selected;
+}
+
+void anim_blit_set(const struct anim_blit_kernels *kernels)
+{
+	selected = kernels;
+}
+
+// Dispatch }}}
@@ -17,11 +17,14 @@
 #include <string.h>
 
 #include "nulib.h"
+#include "nulib/hashtable.h"
+#include "nulib/port.h"
 #include "ai5/anim.h"
 #include "ai5/cg.h"
 
-#define MSF_GIF_IMPL
-#include "msf_gif.h"
+#include "anim.h"
+#include "gif.h"
+#include "video.h"
 
 struct stream_state {
 	bool halted;
@@ -149,173 +152,228 @@ static uint8_t *px_offset32(struct cg *cg, unsigned x, unsigned y)
 	return cg->pixels + y * cg->metrics.w * 4 + x * 4;
 }
 
-static void stream_render_indexed_fill(struct anim_fill_args *call, struct cg *dst)
+// Dirty tracking {{{
+
+struct frame_state {
+	// region of dst changed since the last captured frame
+	struct anim_rect dirty;
+	// palette changed since the last captured frame
+	bool palette_changed;
+	// depalettized palette of dst (indexed only)
+	uint8_t lut[256*4];
+};
+
+static void rect_union(struct anim_rect *r, struct anim_rect a)
 {
-	if (call->dim.w < 1 || call->dim.h < 1)
+	if (a.w < 1 || a.h < 1)
+		return;
+	if (r->w < 1 || r->h < 1) {
+		*r = a;
 		return;
-	for (int row = 0; row < call->dim.h; row++) {
-		uint8_t *p = px_offset(dst, call->dst.x, call->dst.y + row);
-		memset(p, 8, call->dim.w);
 	}
+	int x1 = max(r->x + r->w, a.x + a.w);
+	int y1 = max(r->y + r->h, a.y + a.h);
+	r->x = min(r->x, a.x);
+	r->y = min(r->y, a.y);
+	r->w = x1 - r->x;
+	r->h = y1 - r->y;
 }
 
-static void stream_render_indexed_copy(struct anim_copy_args *call, struct cg *src,
-		struct cg *dst)
+static void rect_add(struct anim_rect *r, struct cg *dst, int x, int y, int w, int h)
 {
-	if (call->dim.w < 1 || call->dim.h < 1)
-		return;
-	for (int row = 0; row < call->dim.h; row++) {
-		uint8_t *src_p = px_offset(src, call->src.x, call->src.y + row);
-		uint8_t *dst_p = px_offset(dst, call->dst.x, call->dst.y + row);
-		memcpy(dst_p, src_p, call->dim.w);
+	if (x < 0) {
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		h += y;
+		y = 0;
 	}
+	if (x + w > (int)dst->metrics.w)
+		w = dst->metrics.w - x;
+	if (y + h > (int)dst->metrics.h)
+		h = dst->metrics.h - y;
+	rect_union(r, (struct anim_rect) { x, y, w, h });
 }
 
-static void stream_render_direct_copy(struct anim_copy_args *call, struct cg *src,
-		struct cg *dst)
+static void dirty_add(struct frame_state *frame, struct cg *dst, int x, int y, int w, int h)
 {
-	if (call->dim.w < 0 || call->dim.h < 1)
-		return;
-	for (int row = 0; row < call->dim.h; row++) {
-		uint8_t *src_p = px_offset32(src, call->src.x, call->src.y + row);
-		uint8_t *dst_p = px_offset32(dst, call->dst.x, call->dst.y + row);
-		memcpy(dst_p, src_p, call->dim.w * 4);
-	}
+	rect_add(&frame->dirty, dst, x, y, w, h);
 }
 
-static void _stream_render_indexed_copy_masked(int src_x, int src_y, int w, int h,
-		int dst_x, int dst_y, struct cg *src, struct cg *dst)
+/*
+ * Get the region of `dst` modified by a (clipped) draw call. Draw calls targeting
+ * `src` are not visible and don't dirty anything. Returns true if the draw call
+ * modifies the palette.
+ */
+static bool draw_call_dirty(struct anim_draw_call *call, struct cg *dst, struct anim_rect *r)
 {
-	if (w < 1 || h < 1)
-		return;
-	for (int row = 0; row < h; row++) {
-		uint8_t *src_p = px_offset(src, src_x, src_y + row);
-		uint8_t *dst_p = px_offset(dst, dst_x, dst_y + row);
-		for (int col = 0; col < w; col++, src_p++, dst_p++) {
-			// XXX: we assume mask color is 8
-			if (*src_p != 8)
-				*dst_p = *src_p;
-		}
-		//memcpy(dst_p, src_p, call->dim.w);
+	*r = (struct anim_rect) {0};
+	switch (call->op) {
+	case ANIM_DRAW_OP_FILL:
+		if (!call->fill.dst.i)
+			rect_add(r, dst, call->fill.dst.x, call->fill.dst.y,
+					call->fill.dim.w, call->fill.dim.h);
+		break;
+	case ANIM_DRAW_OP_SWAP:
+		if (!call->copy.src.i)
+			rect_add(r, dst, call->copy.src.x, call->copy.src.y,
+					call->copy.dim.w, call->copy.dim.h);
+		// fallthrough
+	case ANIM_DRAW_OP_COPY:
+	case ANIM_DRAW_OP_COPY_MASKED:
+		if (!call->copy.dst.i)
+			rect_add(r, dst, call->copy.dst.x, call->copy.dst.y,
+					call->copy.dim.w, call->copy.dim.h);
+		break;
+	case ANIM_DRAW_OP_COMPOSE:
+	case ANIM_DRAW_OP_COMPOSE_WITH_OFFSET:
+	case ANIM_DRAW_OP_COPY_MASKED2:
+		if (!call->compose.dst.i)
+			rect_add(r, dst, call->compose.dst.x, call->compose.dst.y,
+					call->compose.dim.w, call->compose.dim.h);
+		break;
+	case ANIM_DRAW_OP_SET_COLOR:
+	case ANIM_DRAW_OP_SET_PALETTE:
+		// palette change recolors the whole surface
+		rect_add(r, dst, 0, 0, dst->metrics.w, dst->metrics.h);
+		return true;
+	default:
+		break;
 	}
+	return false;
 }
 
-static void stream_render_indexed_copy_masked(struct anim_copy_args *call, struct cg *src,
-		struct cg *dst)
+// Dirty tracking }}}
+// Draw plan {{{
+
+/*
+ * Before rendering, draw calls are lowered into a flat array of operations with
+ * clipping, target surfaces, row pointers and row kernels resolved up front, so
+ * that executing a draw call is a single indirect call.
+ */
+struct draw_op {
+	void (*run)(struct draw_op *op);
+	// first row of each operand
+	uint8_t *dst;
+	uint8_t *src;
+	uint8_t *bg;
+	// row strides (in bytes)
+	unsigned dst_stride;
+	unsigned src_stride;
+	unsigned bg_stride;
+	// row width (in pixels and in bytes) and number of rows
+	unsigned w;
+	unsigned row_size;
+	unsigned rows;
+	union {
+		void (*copy_row)(uint8_t *dst, const uint8_t *src, unsigned w);
+		void (*compose_row)(uint8_t *dst, const uint8_t *fg, const uint8_t *bg,
+				unsigned w);
+	};
+	// palette operations
+	struct anim_draw_call *call;
+	struct cg *src_cg;
+	struct cg *dst_cg;
+	// region of dst modified by the operation
+	struct anim_rect dirty;
+	bool palette_changed;
+};
+
+typedef void (*draw_fn)(struct draw_op *op);
+
+static void draw_nop(struct draw_op *op)
 {
-	_stream_render_indexed_copy_masked(call->src.x, call->src.y, call->dim.w,
-			call->dim.h, call->dst.x, call->dst.y, src, dst);
 }
 
-static void stream_render_indexed_copy_masked2(struct anim_compose_args *call, struct cg *src,
-		struct cg *dst)
+static void draw_invalid(struct draw_op *op)
 {
-	_stream_render_indexed_copy_masked(call->fg.x, call->fg.y, call->dim.w,
-			call->dim.h, call->dst.x, call->dst.y, src, dst);
+	ERROR("Invalid draw call: %d", op->call->op);
 }
 
-static void stream_render_direct_copy_masked(struct anim_copy_args *call, struct cg *src,
-		struct cg *dst)
+static void draw_fill8(struct draw_op *op)
 {
-	if (call->dim.w < 1 || call->dim.h < 1)
-		return;
-	for (int row = 0; row < call->dim.h; row++) {
-		uint8_t *src_p = px_offset32(src, call->src.x, call->src.y + row);
-		uint8_t *dst_p = px_offset32(dst, call->dst.x, call->dst.y + row);
-		for (int col = 0; col < call->dim.w; col++, src_p += 4, dst_p += 4) {
-			// XXX: we assume mask color is 00f800
-			if (src_p[0] == 0 && src_p[1] == 0xf8 && src_p[2] == 0)
-				continue;
-			memcpy(dst_p, src_p, 4);
-		}
+	uint8_t *dst = op->dst;
+	for (unsigned row = 0; row < op->rows; row++, dst += op->dst_stride) {
+		memset(dst, 8, op->row_size);
 	}
 }
 
-static void stream_render_indexed_swap(struct anim_copy_args *call, struct cg *src,
-		struct cg *dst)
+static void draw_copy(struct draw_op *op)
 {
-	if (call->dim.w < 1 || call->dim.h < 1)
-		return;
-	for (int row = 0; row < call->dim.h; row++) {
-		uint8_t *src_p = px_offset(src, call->src.x, call->src.y + row);
-		uint8_t *dst_p = px_offset(dst, call->dst.x, call->dst.y + row);
-		for (int col = 0; col < call->dim.w; col++, src_p++, dst_p++) {
-			uint8_t tmp = *dst_p;
-			*dst_p = *src_p;
-			*src_p = tmp;
-		}
+	uint8_t *dst = op->dst;
+	uint8_t *src = op->src;
+	for (unsigned row = 0; row < op->rows; row++) {
+		memcpy(dst, src, op->row_size);
+		dst += op->dst_stride;
+		src += op->src_stride;
 	}
 }
 
-static void stream_render_direct_swap(struct anim_copy_args *call, struct cg *src,
-		struct cg *dst)
+static void draw_copy_masked(struct draw_op *op)
 {
-	if (call->dim.w < 1 || call->dim.h < 1)
-		return;
-	for (int row = 0; row < call->dim.h; row++) {
-		uint8_t *src_p = px_offset32(src, call->src.x, call->src.y + row);
-		uint8_t *dst_p = px_offset32(dst, call->dst.x, call->dst.y + row);
-		for (int col = 0; col < call->dim.w; col++, src_p += 4, dst_p += 4) {
-			uint8_t tmp[4];
-			memcpy(tmp, dst_p, 4);
-			memcpy(dst_p, src_p, 4);
-			memcpy(src_p, tmp, 4);
-		}
+	uint8_t *dst = op->dst;
+	uint8_t *src = op->src;
+	for (unsigned row = 0; row < op->rows; row++) {
+		op->copy_row(dst, src, op->w);
+		dst += op->dst_stride;
+		src += op->src_stride;
 	}
 }
 
-static void stream_render_indexed_compose(struct anim_compose_args *call, struct cg *fg,
-		struct cg *bg, struct cg *dst)
+// NOTE: pixels are swapped bytewise, which works for any bit depth
+static void draw_swap(struct draw_op *op)
 {
-	if (call->dim.w < 1 || call->dim.h < 1)
-		return;
-	for (int row = 0; row < call->dim.h; row++) {
-		uint8_t *fg_p = px_offset(fg, call->fg.x, call->fg.y + row);
-		uint8_t *bg_p = px_offset(bg, call->bg.x, call->bg.y + row);
-		uint8_t *dst_p = px_offset(dst, call->dst.x, call->dst.y + row);
-		for (int col = 0; col < call->dim.w; col++, fg_p++, bg_p++, dst_p++) {
-			// XXX: we assume mask color is 8
-			*dst_p = *fg_p == 8 ? *bg_p : *fg_p;
+	uint8_t *dst = op->dst;
+	uint8_t *src = op->src;
+	for (unsigned row = 0; row < op->rows; row++) {
+		for (unsigned i = 0; i < op->row_size; i++) {
+			uint8_t tmp = dst[i];
+			dst[i] = src[i];
+			src[i] = tmp;
 		}
+		dst += op->dst_stride;
+		src += op->src_stride;
 	}
 }
 
-static void stream_render_direct_compose(struct anim_compose_args *call, struct cg *fg,
-		struct cg *bg, struct cg *dst)
+static void draw_compose(struct draw_op *op)
 {
-	if (call->dim.w < 1 || call->dim.h < 1)
-		return;
-	for (int row = 0; row < call->dim.h; row++) {
-		uint8_t *fg_p = px_offset32(fg, call->fg.x, call->fg.y + row);
-		uint8_t *bg_p = px_offset32(bg, call->bg.x, call->bg.y + row);
-		uint8_t *dst_p = px_offset32(dst, call->dst.x, call->dst.y + row);
-		for (int col = 0; col < call->dim.w; col++, fg_p += 4, bg_p += 4, dst_p += 4) {
-			// XXX: we assume mask color is 00f800
-			if (fg_p[0] == 0 && fg_p[1] == 0xf8 && fg_p[2] == 0) {
-				memcpy(dst_p, bg_p, 4);
-			} else {
-				memcpy(dst_p, fg_p, 4);
-			}
-		}
+	uint8_t *dst = op->dst;
+	uint8_t *fg = op->src;
+	uint8_t *bg = op->bg;
+	for (unsigned row = 0; row < op->rows; row++) {
+		op->compose_row(dst, fg, bg, op->w);
+		dst += op->dst_stride;
+		fg += op->src_stride;
+		bg += op->bg_stride;
 	}
 }
 
-static void stream_render_indexed_set_color(struct anim_set_color_args *call, struct cg *src,
-		struct cg *dst)
+static void draw_compose_with_offset(struct draw_op *op)
 {
-	uint8_t *src_c = src->palette + call->i * 4;
-	uint8_t *dst_c = dst->palette + call->i * 4;
+	// XXX: the offset is controlled by the game, so the best we can do
+	//      is render with a static offset (0)
+	WARNING("COMPOSE_WITH_OFFSET will not render correctly");
+	draw_compose(op);
+}
+
+static void draw_set_color8(struct draw_op *op)
+{
+	struct anim_set_color_args *call = &op->call->set_color;
+	uint8_t *src_c = op->src_cg->palette + call->i * 4;
+	uint8_t *dst_c = op->dst_cg->palette + call->i * 4;
 	src_c[0] = dst_c[0] = call->color.b;
 	src_c[1] = dst_c[1] = call->color.g;
 	src_c[2] = dst_c[2] = call->color.r;
 	src_c[3] = dst_c[3] = 0;
 }
 
-static void stream_render_indexed_set_palette(struct anim_set_palette_args *call,
-		struct cg *src, struct cg *dst)
+static void draw_set_palette8(struct draw_op *op)
 {
-	uint8_t *src_c = src->palette;
-	uint8_t *dst_c = dst->palette;
+	struct anim_set_palette_args *call = &op->call->set_palette;
+	uint8_t *src_c = op->src_cg->palette;
+	uint8_t *dst_c = op->dst_cg->palette;
 	for (int i = 0; i < 16; i++, src_c += 4, dst_c += 4) {
 		src_c[0] = dst_c[0] = call->colors[i].b;
 		src_c[1] = dst_c[1] = call->colors[i].g;
@@ -324,100 +382,286 @@ static void stream_render_indexed_set_palette(struct anim_set_palette_args *call
 	}
 }
 
-static void stream_render_draw_direct(struct anim_draw_call *call, struct cg *src,
-		struct cg *dst)
+// implementation of each draw op for a given bit depth (NULL if invalid)
+struct draw_fns {
+	unsigned bpp;
+	draw_fn fill;
+	draw_fn copy;
+	draw_fn copy_masked;
+	draw_fn copy_masked2;
+	draw_fn swap;
+	draw_fn compose;
+	draw_fn compose_with_offset;
+	draw_fn set_color;
+	draw_fn set_palette;
+};
+
+static const struct draw_fns draw_fns_indexed = {
+	.bpp = 1,
+	.fill = draw_fill8,
+	.copy = draw_copy,
+	.copy_masked = draw_copy_masked,
+	.copy_masked2 = draw_copy_masked,
+	.swap = draw_swap,
+	.compose = draw_compose,
+	.set_color = draw_set_color8,
+	.set_palette = draw_set_palette8,
+};
+
+static const struct draw_fns draw_fns_direct = {
+	.bpp = 4,
+	.copy = draw_copy,
+	.copy_masked = draw_copy_masked,
+	.swap = draw_swap,
+	.compose = draw_compose,
+	.compose_with_offset = draw_compose_with_offset,
+};
+
+static uint8_t *draw_operand(struct cg *cg, struct anim_target *t, unsigned bpp,
+		unsigned *stride)
+{
+	*stride = cg->metrics.w * bpp;
+	return cg->pixels + t->y * *stride + t->x * bpp;
+}
+
+/*
+ * Lower a (clipped) draw call into a draw operation.
+ */
+static void draw_op_compile(struct draw_op *op, struct anim_draw_call *call,
+		struct cg *src, struct cg *dst)
 {
-#define TARGET(t) ((t).i ? src : dst)
+#define TARGET(t) ((t)->i ? src : dst)
+	const struct draw_fns *fns = src->palette ? &draw_fns_indexed : &draw_fns_direct;
+	const struct anim_blit_kernels *blit = anim_blit_get();
+	struct anim_target *op_dst = NULL, *op_src = NULL, *op_bg = NULL;
+	struct anim_size *dim = NULL;
+
+	*op = (struct draw_op) { .call = call, .src_cg = src, .dst_cg = dst };
+	op->palette_changed = draw_call_dirty(call, dst, &op->dirty);
+
 	switch (call->op) {
-	case ANIM_DRAW_OP_COPY:
-		stream_render_direct_copy(&call->copy, TARGET(call->copy.src),
-				TARGET(call->copy.dst));
+	case ANIM_DRAW_OP_FILL:
+		op->run = fns->fill;
+		op_dst = &call->fill.dst;
+		dim = &call->fill.dim;
 		break;
+	case ANIM_DRAW_OP_COPY:
 	case ANIM_DRAW_OP_COPY_MASKED:
-		stream_render_direct_copy_masked(&call->copy, TARGET(call->copy.src),
-				TARGET(call->copy.dst));
-		break;
 	case ANIM_DRAW_OP_SWAP:
-		stream_render_direct_swap(&call->copy, TARGET(call->copy.src),
-				TARGET(call->copy.dst));
+		if (call->op == ANIM_DRAW_OP_COPY)
+			op->run = fns->copy;
+		else if (call->op == ANIM_DRAW_OP_COPY_MASKED)
+			op->run = fns->copy_masked;
+		else
+			op->run = fns->swap;
+		op->copy_row = fns->bpp == 1 ? blit->copy_masked8 : blit->copy_masked32;
+		op_dst = &call->copy.dst;
+		op_src = &call->copy.src;
+		dim = &call->copy.dim;
+		break;
+	case ANIM_DRAW_OP_COPY_MASKED2:
+		op->run = fns->copy_masked2;
+		op->copy_row = fns->bpp == 1 ? blit->copy_masked8 : blit->copy_masked32;
+		op_dst = &call->compose.dst;
+		op_src = &call->compose.fg;
+		dim = &call->compose.dim;
 		break;
-	case ANIM_DRAW_OP_COMPOSE_WITH_OFFSET:
-		// XXX: the offset is controlled by the game, so the best we can do
-		//      is render with a static offset (0)
-		WARNING("COMPOSE_WITH_OFFSET will not render correctly");
-		// fallthrough
 	case ANIM_DRAW_OP_COMPOSE:
-		stream_render_direct_compose(&call->compose, TARGET(call->compose.fg),
-				TARGET(call->compose.bg), TARGET(call->compose.dst));
+	case ANIM_DRAW_OP_COMPOSE_WITH_OFFSET:
+		if (call->op == ANIM_DRAW_OP_COMPOSE)
+			op->run = fns->compose;
+		else
+			op->run = fns->compose_with_offset;
+		op->compose_row = fns->bpp == 1 ? blit->compose8 : blit->compose32;
+		op_dst = &call->compose.dst;
+		op_src = &call->compose.fg;
+		op_bg = &call->compose.bg;
+		dim = &call->compose.dim;
 		break;
-	case ANIM_DRAW_OP_0x60_COPY_MASKED:
-	case ANIM_DRAW_OP_0x61_COMPOSE:
-	case ANIM_DRAW_OP_0x62:
-	case ANIM_DRAW_OP_0x63_COPY_MASKED_WITH_XOFFSET:
-	case ANIM_DRAW_OP_0x64_COMPOSE_MASKED:
-	case ANIM_DRAW_OP_0x65_COMPOSE:
-	case ANIM_DRAW_OP_0x66:
-		ERROR("Unimplemented draw call: %d", call->op);
+	case ANIM_DRAW_OP_SET_COLOR:
+		op->run = fns->set_color;
+		break;
+	case ANIM_DRAW_OP_SET_PALETTE:
+		op->run = fns->set_palette;
 		break;
 	default:
-		ERROR("Invalid draw call");
+		break;
 	}
+
+	// invalid draw calls are an error only if they are actually executed
+	if (!op->run) {
+		op->run = draw_invalid;
+		return;
+	}
+	if (!dim)
+		return;
+	if (dim->w < 1 || dim->h < 1) {
+		op->run = draw_nop;
+		return;
+	}
+
+	op->w = dim->w;
+	op->row_size = dim->w * fns->bpp;
+	op->rows = dim->h;
+	op->dst = draw_operand(TARGET(op_dst), op_dst, fns->bpp, &op->dst_stride);
+	if (op_src)
+		op->src = draw_operand(TARGET(op_src), op_src, fns->bpp, &op->src_stride);
+	if (op_bg)
+		op->bg = draw_operand(TARGET(op_bg), op_bg, fns->bpp, &op->bg_stride);
 #undef TARGET
 }
 
-static void stream_render_draw(struct anim_draw_call *call, struct cg *src, struct cg *dst)
+/*
+ * Determine whether a draw call writes to the pixels or the palette of the source
+ * surface.
+ */
+static void draw_call_src_writes(struct anim_draw_call *call, bool *pixels, bool *palette)
 {
-	if (!src->palette) {
-		stream_render_draw_direct(call, src, dst);
-		return;
-	}
-#define TARGET(t) ((t).i ? src : dst)
 	switch (call->op) {
 	case ANIM_DRAW_OP_FILL:
-		stream_render_indexed_fill(&call->fill, TARGET(call->fill.dst));
+		if (call->fill.dst.i)
+			*pixels = true;
 		break;
 	case ANIM_DRAW_OP_COPY:
-		stream_render_indexed_copy(&call->copy, TARGET(call->copy.src),
-				TARGET(call->copy.dst));
-		break;
 	case ANIM_DRAW_OP_COPY_MASKED:
-		stream_render_indexed_copy_masked(&call->copy, TARGET(call->copy.src),
-				TARGET(call->copy.dst));
-		break;
-	case ANIM_DRAW_OP_COPY_MASKED2:
-		stream_render_indexed_copy_masked2(&call->compose, TARGET(call->compose.fg),
-				TARGET(call->compose.dst));
+		if (call->copy.dst.i)
+			*pixels = true;
 		break;
 	case ANIM_DRAW_OP_SWAP:
-		stream_render_indexed_swap(&call->copy, TARGET(call->copy.src),
-				TARGET(call->copy.dst));
+		if (call->copy.dst.i || call->copy.src.i)
+			*pixels = true;
 		break;
+	case ANIM_DRAW_OP_COPY_MASKED2:
 	case ANIM_DRAW_OP_COMPOSE:
-		stream_render_indexed_compose(&call->compose, TARGET(call->compose.fg),
-				TARGET(call->compose.bg), TARGET(call->compose.dst));
+	case ANIM_DRAW_OP_COMPOSE_WITH_OFFSET:
+		if (call->compose.dst.i)
+			*pixels = true;
 		break;
 	case ANIM_DRAW_OP_SET_COLOR:
-		stream_render_indexed_set_color(&call->set_color, src, dst);
-		break;
 	case ANIM_DRAW_OP_SET_PALETTE:
-		stream_render_indexed_set_palette(&call->set_palette, src, dst);
+		*palette = true;
 		break;
-	case ANIM_DRAW_OP_COMPOSE_WITH_OFFSET:
-	case ANIM_DRAW_OP_0x60_COPY_MASKED:
-	case ANIM_DRAW_OP_0x61_COMPOSE:
-	case ANIM_DRAW_OP_0x62:
-	case ANIM_DRAW_OP_0x63_COPY_MASKED_WITH_XOFFSET:
-	case ANIM_DRAW_OP_0x64_COMPOSE_MASKED:
-	case ANIM_DRAW_OP_0x65_COMPOSE:
-	case ANIM_DRAW_OP_0x66:
-		ERROR("Invalid draw call: %d", call->op);
+	default:
 		break;
 	}
-#undef TARGET
 }
 
+/*
+ * Clip the draw calls of an animation to the src/dst size and lower them into a
+ * draw plan, indexed by draw call number.
+ */
+static struct draw_op *draw_plan_compile(struct anim *anim, struct cg *src, struct cg *dst)
+{
+	unsigned nr_calls = vector_length(anim->draw_calls);
+	if (!nr_calls)
+		return NULL;
+
+	struct draw_op *plan = xcalloc(nr_calls, sizeof(struct draw_op));
+	for (unsigned i = 0; i < nr_calls; i++) {
+		struct anim_draw_call *call = &vector_A(anim->draw_calls, i);
+		draw_call_clip(call, src, dst);
+		draw_op_compile(&plan[i], call, src, dst);
+	}
+	return plan;
+}
+
+// Draw plan }}}
+// Frame capture {{{
+
+/*
+ * Get the depalettized color of each palette index, by depalettizing a CG
+ * containing every index once (so that the color format always matches
+ * cg_depalettize).
+ */
+static void frame_update_lut(struct frame_state *frame, struct cg *dst)
+{
+	struct cg *cg = cg_alloc_indexed(256, 1);
+	for (int i = 0; i < 256; i++) {
+		cg->pixels[i] = i;
+	}
+	memcpy(cg->palette, dst->palette, 256 * 4);
+	cg_depalettize(cg);
+	memcpy(frame->lut, cg->pixels, 256 * 4);
+	cg_free(cg);
+}
+
+/*
+ * Get the dirty rectangle and reset it.
+ */
+static struct anim_rect frame_take_dirty(struct frame_state *frame, struct cg *dst)
+{
+	if (dst->palette && frame->palette_changed)
+		frame_update_lut(frame, dst);
+	frame->palette_changed = false;
+
+	struct anim_rect r = frame->dirty;
+	frame->dirty = (struct anim_rect) {0};
+	return r;
+}
+
+/*
+ * Copy a region of `dst` as RGBA pixels to `out` (the position of the region's
+ * top left pixel in a buffer with the given stride).
+ */
+static void frame_copy(struct frame_state *frame, struct cg *dst, struct anim_rect r,
+		uint8_t *out, unsigned stride)
+{
+	for (int row = 0; row < r.h; row++, out += stride) {
+		if (!dst->palette) {
+			memcpy(out, px_offset32(dst, r.x, r.y + row), r.w * 4);
+			continue;
+		}
+		uint8_t *src_p = px_offset(dst, r.x, r.y + row);
+		for (int col = 0; col < r.w; col++) {
+			memcpy(out + col * 4, frame->lut + src_p[col] * 4, 4);
+		}
+	}
+}
+
+/*
+ * Capture the dirty region of `dst` as RGBA pixels and reset the dirty rectangle.
+ */
+static void frame_capture(struct frame_state *frame, struct cg *dst, struct anim_frame *out)
+{
+	struct anim_rect r = frame_take_dirty(frame, dst);
+	out->rect = r;
+	if (r.w < 1 || r.h < 1) {
+		out->pixels = NULL;
+		return;
+	}
+
+	out->pixels = xmalloc(r.w * r.h * 4);
+	frame_copy(frame, dst, r, out->pixels, r.w * 4);
+}
+
+/*
+ * Apply a frame to an RGBA canvas the size of the rendered surface.
+ */
+void anim_frame_apply(struct anim_frame *frame, uint8_t *canvas, unsigned stride)
+{
+	if (!frame->pixels)
+		return;
+	struct anim_rect *r = &frame->rect;
+	for (int row = 0; row < r->h; row++) {
+		memcpy(canvas + (r->y + row) * stride + r->x * 4,
+				frame->pixels + row * r->w * 4, r->w * 4);
+	}
+}
+
+void anim_frames_free(struct anim_frames *frames)
+{
+	for (unsigned i = 0; i < frames->nr_frames; i++) {
+		free(frames->frames[i].pixels);
+	}
+	free(frames->frames);
+	frames->frames = NULL;
+	frames->nr_frames = 0;
+}
+
+// Frame capture }}}
+
 static bool stream_render(struct anim *anim, unsigned stream, struct stream_state *state,
-		struct cg *src, struct cg *dst)
+		struct draw_op *plan, struct frame_state *frame)
 {
 	if (state->stalling) {
 		state->stalling--;
@@ -431,7 +675,9 @@ static bool stream_render(struct anim *anim, unsigned stream, struct stream_stat
 	struct anim_instruction instr = vector_A(anim->streams[stream], state->ip);
 	switch (instr.op) {
 	case ANIM_OP_DRAW:
-		stream_render_draw(&vector_A(anim->draw_calls, instr.arg), src, dst);
+		plan[instr.arg].run(&plan[instr.arg]);
+		rect_union(&frame->dirty, plan[instr.arg].dirty);
+		frame->palette_changed |= plan[instr.arg].palette_changed;
 		state->ip++;
 		state->dirty = true;
 		return false;
@@ -444,9 +690,8 @@ static bool stream_render(struct anim *anim, unsigned stream, struct stream_stat
 		state->ip++;
 		break;
 	case ANIM_OP_RESET:
-		// XXX: no point looping for offline render
-		state->halted = true;
-		//state->ip = 0;
+		// NOTE: the render stops once the animation returns to a previous state
+		state->ip = 0;
 		break;
 	case ANIM_OP_HALT:
 		state->halted = true;
@@ -491,16 +736,33 @@ static struct cg *make_blank_cg(struct cg *src)
 	return dst;
 }
 
-struct anim_frame {
-	struct cg *cg;
-	unsigned nr_frames;
+// Player {{{
+
+struct anim_player {
+	struct anim *anim;
+	struct cg *src;
+	struct cg *dst;
+	bool dst_needs_free;
+	struct draw_op *plan;
+	// the plan has draw calls writing to the pixels/palette of `src`
+	bool src_pixels_written;
+	bool src_palette_written;
+	struct stream_state state[ANIM_MAX_STREAMS];
+	struct frame_state frame;
+	// RGBA image of the last completed frame (allocated on first use)
+	uint8_t *canvas;
+	// region of the canvas changed since it was last retrieved
+	struct anim_rect changed;
+	// time since the last tick (ms)
+	unsigned elapsed;
 };
 
-struct anim_frame *anim_render_frames(struct anim *anim, struct cg *src, struct cg *dst,
-		unsigned max_frames)
+/*
+ * Start playing an animation. Draw calls are rendered to `dst`, or to a blank
+ * surface if `dst` is NULL.
+ */
+struct anim_player *anim_player_begin(struct anim *anim, struct cg *src, struct cg *dst)
 {
-	bool dst_needs_free = false;
-
 	if (src->palette && (dst && !dst->palette)) {
 		WARNING("source and destination CGs have different bit depth");
 		return NULL;
@@ -510,82 +772,648 @@ struct anim_frame *anim_render_frames(struct anim *anim, struct cg *src, struct
 		return NULL;
 	}
 
+	struct anim_player *p = xcalloc(1, sizeof(struct anim_player));
+	p->anim = anim;
+	p->src = src;
+	p->dst = dst;
+
 	// create empty CG if `dst` not provided
 	if (!dst) {
-		dst = make_blank_cg(src);
-		dst_needs_free = true;
+		p->dst = make_blank_cg(src);
+		p->dst_needs_free = true;
 	}
 
-	// ensure all draw operations are clipped to src/dst size
+	p->plan = draw_plan_compile(anim, src, p->dst);
 	struct anim_draw_call *call;
 	vector_foreach_p(call, anim->draw_calls) {
-		draw_call_clip(call, src, dst);
+		draw_call_src_writes(call, &p->src_pixels_written, &p->src_palette_written);
 	}
 
 	// halt all empty streams
-	struct stream_state state[ANIM_MAX_STREAMS] = {0};
 	for (int i = 0; i < ANIM_MAX_STREAMS; i++) {
 		if (vector_length(anim->streams[i]) == 0)
-			state[i].halted = true;
-	}
-
-	struct anim_frame *frames = xcalloc(max_frames, sizeof(struct anim_frame));
-	frames[0].cg = dst->palette ? cg_depalettize_copy(dst) : cg_copy(dst);
-
-	for (unsigned frame = 0; frame < max_frames;) {
-		bool halted = true;
-		bool flush = false;
-		for (int stream = 0; stream < ANIM_MAX_STREAMS; stream++) {
-			if (!state[stream].halted) {
-				halted = false;
-				if (stream_render(anim, stream, &state[stream], src, dst)
-						&& state[stream].dirty) {
-					flush = true;
-					state[stream].dirty = false;
-				}
-			}
+			p->state[i].halted = true;
+	}
+
+	// first frame is the whole surface
+	p->frame.palette_changed = true;
+	dirty_add(&p->frame, p->dst, 0, 0, p->dst->metrics.w, p->dst->metrics.h);
+	return p;
+}
+
+void anim_player_end(struct anim_player *p)
+{
+	free(p->plan);
+	free(p->canvas);
+	if (p->dst_needs_free)
+		cg_free(p->dst);
+	free(p);
+}
+
+void anim_player_size(struct anim_player *p, unsigned *w, unsigned *h)
+{
+	*w = p->dst->metrics.w;
+	*h = p->dst->metrics.h;
+}
+
+// update the canvas with the frame just completed
+static void player_present(struct anim_player *p)
+{
+	struct anim_rect r = frame_take_dirty(&p->frame, p->dst);
+	if (r.w < 1 || r.h < 1)
+		return;
+	unsigned stride = p->dst->metrics.w * 4;
+	frame_copy(&p->frame, p->dst, r, p->canvas + r.y * stride + r.x * 4, stride);
+	rect_union(&p->changed, r);
+}
+
+/*
+ * Run one tick (one instruction of each stream).
+ */
+enum anim_step anim_player_step(struct anim_player *p)
+{
+	bool halted = true;
+	bool flush = false;
+	for (int stream = 0; stream < ANIM_MAX_STREAMS; stream++) {
+		struct stream_state *state = &p->state[stream];
+		if (state->halted)
+			continue;
+		halted = false;
+		if (stream_render(p->anim, stream, state, p->plan, &p->frame) && state->dirty) {
+			flush = true;
+			state->dirty = false;
+		}
+	}
+	if (halted)
+		return ANIM_STEP_HALTED;
+	if (!flush)
+		return ANIM_STEP_TICK;
+	if (p->canvas)
+		player_present(p);
+	return ANIM_STEP_FRAME;
+}
+
+/*
+ * Advance playback by `ms` milliseconds of wall clock time, running a tick every
+ * ANIM_TICK_MS. Time left over carries into the next call, so that playback
+ * doesn't drift. After a long stall (more than ANIM_MAX_CATCHUP_TICKS ticks),
+ * the missed time is dropped rather than fast-forwarded. Returns true if a frame
+ * was completed.
+ */
+bool anim_player_advance(struct anim_player *p, unsigned ms)
+{
+	bool frame = false;
+	p->elapsed += ms;
+	for (unsigned i = 0; p->elapsed >= ANIM_TICK_MS; i++) {
+		if (i == ANIM_MAX_CATCHUP_TICKS) {
+			p->elapsed %= ANIM_TICK_MS;
+			break;
 		}
-		if (halted)
+		p->elapsed -= ANIM_TICK_MS;
+		enum anim_step step = anim_player_step(p);
+		if (step == ANIM_STEP_HALTED) {
+			p->elapsed = 0;
 			break;
-		if (flush) {
+		}
+		if (step == ANIM_STEP_FRAME)
+			frame = true;
+	}
+	return frame;
+}
+
+/*
+ * Milliseconds until the next tick is due (e.g. to schedule a timer).
+ */
+unsigned anim_player_next_tick(struct anim_player *p)
+{
+	return ANIM_TICK_MS - min(p->elapsed, ANIM_TICK_MS);
+}
+
+/*
+ * Get the RGBA pixels (with a stride of 4 * width) of the last completed frame.
+ * If `changed` is not NULL, it receives the region which changed since the
+ * previous call (the whole surface on the first call).
+ */
+const uint8_t *anim_player_current_frame(struct anim_player *p, struct anim_rect *changed)
+{
+	if (!p->canvas) {
+		// the first frame is the whole surface
+		p->canvas = xcalloc(p->dst->metrics.h, p->dst->metrics.w * 4);
+		p->frame.palette_changed = true;
+		dirty_add(&p->frame, p->dst, 0, 0, p->dst->metrics.w, p->dst->metrics.h);
+		player_present(p);
+	}
+	if (changed)
+		*changed = p->changed;
+	p->changed = (struct anim_rect) {0};
+	return p->canvas;
+}
+
+// Player }}}
+// Loop detection {{{
+
+static uint64_t hash_u64(uint64_t h, uint64_t v)
+{
+	h ^= v;
+	h *= 0x9e3779b97f4a7c15ull;
+	return h ^ (h >> 32);
+}
+
+static uint64_t hash_bytes(uint64_t h, const uint8_t *p, size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t v;
+		memcpy(&v, p + i, 8);
+		h = hash_u64(h, v);
+	}
+	for (; i < n; i++) {
+		h = hash_u64(h, p[i]);
+	}
+	return h;
+}
+
+static uint64_t hash_streams(struct stream_state *state)
+{
+	uint64_t h = 0;
+	for (int i = 0; i < ANIM_MAX_STREAMS; i++) {
+		struct stream_state *s = &state[i];
+		h = hash_u64(h, s->halted | (s->dirty << 1) | ((uint64_t)s->ip << 32));
+		h = hash_u64(h, s->stalling);
+		h = hash_u64(h, s->loop_start | ((uint64_t)s->loop_count << 32));
+		h = hash_u64(h, s->loop2_start | ((uint64_t)s->loop2_count << 32));
+	}
+	return h;
+}
+
+static bool streams_equal(struct stream_state *a, struct stream_state *b)
+{
+	for (int i = 0; i < ANIM_MAX_STREAMS; i++) {
+		if (a[i].halted != b[i].halted || a[i].dirty != b[i].dirty
+				|| a[i].ip != b[i].ip || a[i].stalling != b[i].stalling
+				|| a[i].loop_start != b[i].loop_start
+				|| a[i].loop_count != b[i].loop_count
+				|| a[i].loop2_start != b[i].loop2_start
+				|| a[i].loop2_count != b[i].loop2_count)
+			return false;
+	}
+	return true;
+}
+
+static size_t surface_size(struct cg *cg)
+{
+	return cg->metrics.w * cg->metrics.h * (cg->palette ? 1 : 4);
+}
+
+/*
+ * Hash the complete state of the renderer: stream states and both surfaces. Only
+ * the parts of `src` that draw calls can modify are included; the rest never
+ * changes.
+ */
+static uint64_t hash_render_state(struct anim_player *p)
+{
+	uint64_t h = hash_streams(p->state);
+	h = hash_bytes(h, p->dst->pixels, surface_size(p->dst));
+	if (p->dst->palette)
+		h = hash_bytes(h, p->dst->palette, 256 * 4);
+	if (p->src == p->dst)
+		return h;
+	if (p->src_pixels_written)
+		h = hash_bytes(h, p->src->pixels, surface_size(p->src));
+	if (p->src_palette_written && p->src->palette)
+		h = hash_bytes(h, p->src->palette, 256 * 4);
+	return h;
+}
+
+// copy of the (modifiable) renderer state
+struct render_snapshot {
+	struct stream_state state[ANIM_MAX_STREAMS];
+	struct frame_state frame;
+	uint8_t *dst_pixels;
+	uint8_t *dst_palette;
+	uint8_t *src_pixels;
+	uint8_t *src_palette;
+};
+
+static uint8_t *snapshot_bytes(const uint8_t *p, size_t size)
+{
+	uint8_t *copy = xmalloc(size);
+	memcpy(copy, p, size);
+	return copy;
+}
+
+static void snapshot_save(struct anim_player *p, struct render_snapshot *s)
+{
+	*s = (struct render_snapshot) { .frame = p->frame };
+	memcpy(s->state, p->state, sizeof(s->state));
+	s->dst_pixels = snapshot_bytes(p->dst->pixels, surface_size(p->dst));
+	if (p->dst->palette)
+		s->dst_palette = snapshot_bytes(p->dst->palette, 256 * 4);
+	if (p->src == p->dst)
+		return;
+	if (p->src_pixels_written)
+		s->src_pixels = snapshot_bytes(p->src->pixels, surface_size(p->src));
+	if (p->src_palette_written && p->src->palette)
+		s->src_palette = snapshot_bytes(p->src->palette, 256 * 4);
+}
+
+static void snapshot_restore(struct anim_player *p, struct render_snapshot *s)
+{
+	p->frame = s->frame;
+	memcpy(p->state, s->state, sizeof(p->state));
+	memcpy(p->dst->pixels, s->dst_pixels, surface_size(p->dst));
+	if (s->dst_palette)
+		memcpy(p->dst->palette, s->dst_palette, 256 * 4);
+	if (s->src_pixels)
+		memcpy(p->src->pixels, s->src_pixels, surface_size(p->src));
+	if (s->src_palette)
+		memcpy(p->src->palette, s->src_palette, 256 * 4);
+}
+
+static bool snapshot_equal(struct anim_player *p, struct render_snapshot *s)
+{
+	return streams_equal(p->state, s->state)
+		&& !memcmp(p->dst->pixels, s->dst_pixels, surface_size(p->dst))
+		&& (!s->dst_palette || !memcmp(p->dst->palette, s->dst_palette, 256 * 4))
+		&& (!s->src_pixels || !memcmp(p->src->pixels, s->src_pixels,
+					surface_size(p->src)))
+		&& (!s->src_palette || !memcmp(p->src->palette, s->src_palette, 256 * 4));
+}
+
+static void snapshot_free(struct render_snapshot *s)
+{
+	free(s->dst_pixels);
+	free(s->dst_palette);
+	free(s->src_pixels);
+	free(s->src_palette);
+}
+
+/*
+ * Check that the current state of the renderer is exactly its state at the start
+ * of frame `frame_no`, by replaying the animation from its initial state. The
+ * current state is restored afterwards.
+ */
+static bool state_equals_frame(struct anim_player *p, struct render_snapshot *initial,
+		unsigned frame_no)
+{
+	struct render_snapshot current;
+	snapshot_save(p, &current);
+	snapshot_restore(p, initial);
+	for (unsigned frame = 0; frame < frame_no;) {
+		enum anim_step step = anim_player_step(p);
+		if (step == ANIM_STEP_HALTED)
+			break;
+		if (step == ANIM_STEP_FRAME)
+			frame++;
+	}
+	bool r = snapshot_equal(p, &current);
+	snapshot_restore(p, &current);
+	snapshot_free(&current);
+	return r;
+}
+
+// index of the first entry (in a state_set's vector) for each hash
+declare_hashtable_int_type(state_table, int);
+define_hashtable_int(state_table, int);
+
+/*
+ * Find the chain of entries with the given hash. Entries whose hashes share the
+ * table key are linked through their `next` fields; a new chain is empty (-1).
+ */
+static hashtable_iter_t state_chain(hashtable_t(state_table) *table, uint64_t h)
+{
+	int ret;
+	hashtable_iter_t k = hashtable_put(state_table, table, (int32_t)(h ^ (h >> 32)), &ret);
+	if (ret != HASHTABLE_KEY_PRESENT)
+		hashtable_val(table, k) = -1;
+	return k;
+}
+
+struct seen_state {
+	uint64_t hash;
+	unsigned frame;
+	int next;
+};
+
+// renderer states at the start of each frame
+struct seen_set {
+	vector_t(struct seen_state) states;
+	hashtable_t(state_table) table;
+};
+
+/*
+ * Add the renderer state at the start of a frame to the set of previously seen
+ * states. Returns false if the renderer was in exactly this state before. States
+ * are compared by hash first; a matching hash is confirmed by replaying the
+ * animation, so that a hash collision can't end the render early.
+ */
+static bool state_add(struct seen_set *seen, struct anim_player *p,
+		struct render_snapshot *initial, unsigned frame)
+{
+	uint64_t h = hash_render_state(p);
+	hashtable_iter_t k = state_chain(&seen->table, h);
+	int head = hashtable_val(&seen->table, k);
+	for (int i = head; i >= 0; i = vector_A(seen->states, i).next) {
+		struct seen_state *s = &vector_A(seen->states, i);
+		if (s->hash == h && state_equals_frame(p, initial, s->frame))
+			return false;
+	}
+	struct seen_state s = { .hash = h, .frame = frame, .next = head };
+	hashtable_val(&seen->table, k) = vector_length(seen->states);
+	vector_push(struct seen_state, seen->states, s);
+	return true;
+}
+
+struct idle_state {
+	struct stream_state state[ANIM_MAX_STREAMS];
+	uint64_t hash;
+	int next;
+};
+
+// stream states seen while the surfaces are unchanged
+struct idle_set {
+	vector_t(struct idle_state) states;
+	hashtable_t(state_table) table;
+};
+
+/*
+ * Add the stream states to the set of previously seen stream states. Returns false
+ * if they were already in the set.
+ */
+static bool streams_add(struct idle_set *seen, struct stream_state *state)
+{
+	uint64_t h = hash_streams(state);
+	hashtable_iter_t k = state_chain(&seen->table, h);
+	int head = hashtable_val(&seen->table, k);
+	for (int i = head; i >= 0; i = vector_A(seen->states, i).next) {
+		struct idle_state *s = &vector_A(seen->states, i);
+		if (s->hash == h && streams_equal(s->state, state))
+			return false;
+	}
+	struct idle_state s = { .hash = h, .next = head };
+	memcpy(s.state, state, sizeof(s.state));
+	hashtable_val(&seen->table, k) = vector_length(seen->states);
+	vector_push(struct idle_state, seen->states, s);
+	return true;
+}
+
+static void idle_set_init(struct idle_set *seen)
+{
+	hashtable_t(state_table) table = hashtable_initializer(state_table);
+	seen->table = table;
+	vector_init(seen->states);
+}
+
+static void idle_set_destroy(struct idle_set *seen)
+{
+	hashtable_destroy(state_table, &seen->table);
+	vector_destroy(seen->states);
+}
+
+// Loop detection }}}
+
+/*
+ * Render an animation, passing each frame to `sink` as soon as its duration is
+ * known (i.e. when the next frame is flushed). Frames are freed after they are
+ * passed to the sink, unless the sink takes ownership of the pixels by setting
+ * `frame->pixels` to NULL.
+ *
+ * Rendering stops after at most `max_frames` frames, or as soon as the renderer
+ * returns to a state it was in at the start of an earlier frame (from then on,
+ * the output would repeat). A looping animation thus renders exactly once, and
+ * loops seamlessly if it returns to its initial state.
+ */
+bool anim_render(struct anim *anim, struct cg *src, struct cg *dst, unsigned max_frames,
+		struct anim_frame_sink *sink)
+{
+	struct anim_player *p = anim_player_begin(anim, src, dst);
+	if (!p)
+		return false;
+
+	bool ok = sink->begin(p->dst->metrics.w, p->dst->metrics.h, sink->data);
+
+	struct anim_frame pending = {0};
+	frame_capture(&p->frame, p->dst, &pending);
+
+	// renderer state at the start of each frame
+	struct render_snapshot initial;
+	snapshot_save(p, &initial);
+	struct seen_set seen = {
+		.states = vector_initializer,
+		.table = hashtable_initializer(state_table),
+	};
+	state_add(&seen, p, &initial, 0);
+	// stream states since the last flush, while the surfaces are unchanged
+	struct idle_set idle;
+	idle_set_init(&idle);
+
+	for (unsigned frame = 0; ok && frame < max_frames;) {
+		enum anim_step step = anim_player_step(p);
+		if (step == ANIM_STEP_HALTED)
+			break;
+		if (step == ANIM_STEP_FRAME) {
 			frame++;
 			if (frame >= max_frames)
 				break;
-			frames[frame].cg = dst->palette ? cg_depalettize_copy(dst) : cg_copy(dst);
-			frames[frame].nr_frames = 1;
+			if (!state_add(&seen, p, &initial, frame))
+				break;
+			if (!vector_empty(idle.states)) {
+				idle_set_destroy(&idle);
+				idle_set_init(&idle);
+			}
+			ok = sink->frame(&pending, sink->data);
+			free(pending.pixels);
+			frame_capture(&p->frame, p->dst, &pending);
+			pending.nr_frames = 1;
 		} else {
-			frames[frame].nr_frames++;
+			pending.nr_frames++;
+			// streams cycling without drawing anything: the frame lasts forever
+			bool drawing = false;
+			for (int stream = 0; stream < ANIM_MAX_STREAMS; stream++) {
+				drawing |= p->state[stream].dirty;
+			}
+			if (!drawing && !streams_add(&idle, p->state))
+				break;
 		}
 	}
+	hashtable_destroy(state_table, &seen.table);
+	vector_destroy(seen.states);
+	idle_set_destroy(&idle);
+	snapshot_free(&initial);
 
-	if (dst_needs_free)
-		cg_free(dst);
+	if (ok)
+		ok = sink->frame(&pending, sink->data);
+	free(pending.pixels);
 
-	return frames;
+	anim_player_end(p);
+	return ok;
 }
 
-uint8_t *anim_render_gif(struct anim *anim, struct cg *src, struct cg *dst,
-		unsigned max_frames, size_t *size_out)
+// Frame list {{{
+
+static bool frames_begin(unsigned w, unsigned h, void *data)
 {
-	struct anim_frame *frames = anim_render_frames(anim, src, dst, max_frames);
-	if (!frames)
-		return NULL;
+	struct anim_frames *frames = data;
+	frames->w = w;
+	frames->h = h;
+	return true;
+}
+
+static bool frames_frame(struct anim_frame *frame, void *data)
+{
+	struct anim_frames *frames = data;
+	frames->frames = xrealloc(frames->frames,
+			(frames->nr_frames + 1) * sizeof(struct anim_frame));
+	frames->frames[frames->nr_frames++] = *frame;
+	frame->pixels = NULL;
+	return true;
+}
+
+bool anim_render_frames(struct anim *anim, struct cg *src, struct cg *dst,
+		unsigned max_frames, struct anim_frames *out)
+{
+	*out = (struct anim_frames) {0};
+	struct anim_frame_sink sink = {
+		.begin = frames_begin,
+		.frame = frames_frame,
+		.data = out,
+	};
+	if (!anim_render(anim, src, dst, max_frames, &sink)) {
+		anim_frames_free(out);
+		return false;
+	}
+	return true;
+}
+
+// Frame list }}}
+// GIF {{{
+
+struct gif_sink {
+	struct port out;
+	struct gif_encoder encoder;
+	unsigned nr_threads;
+	unsigned stride;
+	uint8_t *canvas;
+	// region changed since the last encoded frame
+	struct anim_rect changed;
+	// total duration of the frames rendered/encoded so far
+	unsigned ms;
+	unsigned cs;
+};
 
-	MsfGifState gif_state = {};
-	msf_gif_begin(&gif_state, dst->metrics.w, dst->metrics.h);
+static bool gif_begin(unsigned w, unsigned h, void *data)
+{
+	struct gif_sink *gif = data;
+	gif->stride = w * 4;
+	gif->canvas = xcalloc(h, gif->stride);
+	return gif_encoder_begin(&gif->encoder, &gif->out, w, h, gif->nr_threads);
+}
+
+static bool gif_frame(struct anim_frame *frame, void *data)
+{
+	struct gif_sink *gif = data;
+	anim_frame_apply(frame, gif->canvas, gif->stride);
+	rect_union(&gif->changed, frame->rect);
 	// XXX: frames[0].nr_frames can be 0 if the first instruction is a draw call
-	for (int i = frames[0].nr_frames ? 0 : 1; i < max_frames && frames[i].cg; i++) {
-		// XXX: we want 16ms frame time, but gif only supports centiseconds
-		unsigned t = (frames[i].nr_frames * 16) / 10;
-		if (!msf_gif_frame(&gif_state, frames[i].cg->pixels, t, 16, dst->metrics.w * 4))
-			ERROR("msf_gif_frame");
+	if (!frame->nr_frames)
+		return true;
+	// gif only supports centiseconds: carry the rounding error over to the next
+	// frame, so that the animation doesn't drift
+	gif->ms += frame->nr_frames * ANIM_TICK_MS;
+	unsigned t = gif->ms / 10 - gif->cs;
+	gif->cs += t;
+	struct anim_rect r = gif->changed;
+	gif->changed = (struct anim_rect) {0};
+	return gif_encoder_frame(&gif->encoder, gif->canvas, gif->stride, r.x, r.y, r.w, r.h, t);
+}
+
+static bool render_gif(struct anim *anim, struct cg *src, struct cg *dst,
+		unsigned max_frames, struct gif_sink *gif)
+{
+	struct anim_frame_sink sink = {
+		.begin = gif_begin,
+		.frame = gif_frame,
+		.data = gif,
+	};
+	bool ok = anim_render(anim, src, dst, max_frames, &sink);
+	if (gif->canvas) {
+		ok = gif_encoder_end(&gif->encoder) && ok;
+		free(gif->canvas);
 	}
-	for (int i = 0; i < max_frames && frames[i].cg; i++) {
-		cg_free(frames[i].cg);
+	return ok;
+}
+
+uint8_t *anim_render_gif(struct anim *anim, struct cg *src, struct cg *dst,
+		unsigned max_frames, size_t *size_out)
+{
+	struct gif_sink gif = {0};
+	port_buffer_init(&gif.out);
+	bool ok = render_gif(anim, src, dst, max_frames, &gif);
+	uint8_t *data = port_buffer_get(&gif.out, size_out);
+	if (!ok) {
+		free(data);
+		return NULL;
 	}
-	free(frames);
+	return data;
+}
 
-	MsfGifResult gif = msf_gif_end(&gif_state);
-	*size_out = gif.dataSize;
-	return gif.data;
+/*
+ * Render an animation to a GIF file, encoding each frame as soon as it is
+ * rendered. Frames are encoded on `nr_threads` threads (see gif_encoder_begin).
+ */
+bool anim_render_gif_to_file(struct anim *anim, struct cg *src, struct cg *dst,
+		unsigned max_frames, unsigned nr_threads, FILE *f)
+{
+	struct gif_sink gif = { .nr_threads = nr_threads };
+	port_file_init(&gif.out, f);
+	return render_gif(anim, src, dst, max_frames, &gif);
 }
+
+// GIF }}}
+// Video {{{
+
+struct video_sink {
+	struct video_writer *writer;
+	unsigned stride;
+	uint8_t *canvas;
+};
+
+static bool video_begin(unsigned w, unsigned h, void *data)
+{
+	struct video_sink *video = data;
+	video->stride = w * 4;
+	video->canvas = xcalloc(h, video->stride);
+	// one frame period per tick (16ms)
+	return video_writer_begin(video->writer, w, h, 125, 2);
+}
+
+static bool video_frame(struct anim_frame *frame, void *data)
+{
+	struct video_sink *video = data;
+	anim_frame_apply(frame, video->canvas, video->stride);
+	return video_writer_frame(video->writer, video->canvas, video->stride,
+			frame->nr_frames);
+}
+
+/*
+ * Render an animation to a constant frame rate video, writing each frame as soon
+ * as it is rendered.
+ */
+bool anim_render_video(struct anim *anim, struct cg *src, struct cg *dst,
+		unsigned max_frames, struct video_writer *writer)
+{
+	struct video_sink video = { .writer = writer };
+	struct anim_frame_sink sink = {
+		.begin = video_begin,
+		.frame = video_frame,
+		.data = &video,
+	};
+	bool ok = anim_render(anim, src, dst, max_frames, &sink);
+	if (video.canvas) {
+		ok = video_writer_end(writer) && ok;
+		free(video.canvas);
+	}
+	return ok;
+}
+
+// Video }}}
@@ -30,6 +30,7 @@
 #include "ai5/mes.h"
 
 #include "arc.h"
+#include "file.h"
 #include "mdd.h"
 #include "mes.h"
 
@@ -74,13 +75,32 @@ bool arc_is_compressed(const char *path, enum ai5_game_id game_id)
 	return t == ARC_MES || t == ARC_DATA;
 }
 
-static bool open_output_file(const char *path, struct port *out)
+/*
+ * Returns true if `name` is the name of a mes file (.MES or .LIB).
+ */
+bool arc_is_mes_file(const char *name)
 {
-	if (!path) {
-		port_file_init(out, stdout);
-		return true;
+	const char *ext = file_extension(name);
+	return ext && (!strcasecmp(ext, "MES") || !strcasecmp(ext, "LIB"));
+}
+
+/*
+ * Encrypt or decrypt a mes file, if the target game uses encrypted mes files.
+ */
+void arc_mes_crypt(const char *name, uint8_t *data, size_t size)
+{
+	// XXX: hack for encrypted mes files in Kisaku
+	const char *ext = file_extension(name);
+	if (ai5_target_game == GAME_KISAKU && ext && !strcasecmp(ext, "MES")) {
+		for (size_t i = 0; i < size; i++) {
+			data[i] ^= 0x55;
+		}
 	}
-	if (!port_file_open(out, path)) {
+}
+
+static bool open_output_file(const char *path, struct port *out)
+{
+	if (!file_port_open(out, path)) {
 		WARNING("port_file_open: %s", strerror(errno));
 		return false;
 	}
@@ -225,13 +245,8 @@ static bool ext_is_cg(const char *ext)
 static bool extract_file(struct archive_data *data, const char *output_file,
 		struct arc_extract_options *opt)
 {
-	// XXX: hack for encrypted mes files in Kisaku
 	const char *ext = file_extension(data->name);
-	if (ai5_target_game == GAME_KISAKU && !strcasecmp(ext, "MES")) {
-		for (size_t i = 0; i < data->size; i++) {
-			data->data[i] ^= 0x55;
-		}
-	}
+	arc_mes_crypt(data->name, data->data, data->size);
 
 	if (opt->raw)
 		return extract_raw(data, output_file);
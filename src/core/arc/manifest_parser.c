@@ -26,42 +26,41 @@
 
 #pragma GCC diagnostic ignored "-Wunused-function"
 
-extern int arc_mf_lex();
-extern int arc_mf_lineno;
-extern FILE *arc_mf_in;
+int arc_mf_lex_init_extra(struct arc_mf_state *extra, void **scanner);
+void arc_mf_set_in(FILE *in, void *scanner);
+int arc_mf_get_lineno(void *scanner);
+int arc_mf_lex_destroy(void *scanner);
+int arc_mf_parse(void *scanner, struct arc_mf_state *state);
 
-int arc_mf_parse(void);
-
-static struct arc_manifest *arc_mf_output;
-
-void arc_mf_error(const char *s)
+void arc_mf_error(void *scanner, struct arc_mf_state *state, const char *s)
 {
-	sys_error("ERROR: At line %d: %s\n", arc_mf_lineno, s);
+	sys_error("ERROR: At line %d: %s\n", arc_mf_get_lineno(scanner), s);
 }
 
 struct arc_manifest *arc_manifest_parse(const char *path)
 {
 	// open input file
+	FILE *in;
 	if (!strcmp(path, "-"))
-		arc_mf_in = stdin;
+		in = stdin;
 	else
-		arc_mf_in = file_open_utf8(path, "rb");
-	if (!arc_mf_in)
+		in = file_open_utf8(path, "rb");
+	if (!in)
 		sys_error("Error opening input file: \"%s\": %s", path, strerror(errno));
 
 	// parse
-	arc_mf_parse();
+	struct arc_mf_state state = {0};
+	arc_mf_lex_init_extra(&state, &state.scanner);
+	arc_mf_set_in(in, state.scanner);
+	arc_mf_parse(state.scanner, &state);
+	arc_mf_lex_destroy(state.scanner);
 
 	// close input file
-	if (arc_mf_in != stdin) {
-		fclose(arc_mf_in);
-		arc_mf_in = stdin;
-	}
+	if (in != stdin)
+		fclose(in);
 
 	// return parsed manifest
-	struct arc_manifest *r = arc_mf_output;
-	arc_mf_output = NULL;
-	return r;
+	return state.output;
 }
 
 static inline arc_string_list push_string(arc_string_list list, string str)
@@ -1,4 +1,5 @@
 %define api.prefix {arc_mf_}
+%define api.pure full
 %define parse.error detailed
 %define parse.lac full
 
@@ -15,8 +16,24 @@
 
     typedef vector_t(string) arc_string_list;
     typedef vector_t(arc_string_list) arc_row_list;
+
+    struct arc_manifest;
+    struct arc_mf_state {
+        void *scanner;
+        char string_buf[256];
+        char *string_buf_ptr;
+        struct arc_manifest *output;
+    };
+}
+
+%code provides {
+    int arc_mf_lex(ARC_MF_STYPE *lval, void *scanner);
+    void arc_mf_error(void *scanner, struct arc_mf_state *state, const char *s);
 }
 
+%lex-param {void *scanner}
+%parse-param {void *scanner} {struct arc_mf_state *state}
+
 %{
 
 #include "src/core/arc/manifest_parser.c"
@@ -33,7 +50,7 @@
 
 %%
 
-file    :	STRING options NEWLINE STRING rows end { arc_mf_output = arc_make_manifest($1, $2, $4, $5); }
+file    :	STRING options NEWLINE STRING rows end { state->output = arc_make_manifest($1, $2, $4, $5); }
 	;
 
 options :			{ $$ = (arc_string_list)vector_initializer; }
@@ -0,0 +1,416 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/little_endian.h"
+#include "nulib/port.h"
+#include "nulib/string.h"
+#include "ai5/arc.h"
+#include "ai5/game.h"
+#include "ai5/lzss.h"
+
+#include "arc.h"
+
+string arc_file_name(struct arc_file *f)
+{
+	switch (f->type) {
+	case ARC_FILE_FS: return f->fs.path;
+	case ARC_FILE_MEM: return f->mem.name;
+	case ARC_FILE_ARCDATA: return f->arcdata->name;
+	}
+	ERROR("invalid arc_file type");
+}
+
+void arc_file_free(struct arc_file *f)
+{
+	switch (f->type) {
+	case ARC_FILE_FS:
+		string_free(f->fs.path);
+		break;
+	case ARC_FILE_MEM:
+		string_free(f->mem.name);
+		free(f->mem.data);
+		break;
+	case ARC_FILE_ARCDATA:
+		break;
+	}
+}
+
+void arc_file_list_free(arc_file_list list)
+{
+	struct arc_file *f;
+	vector_foreach_p(f, list) {
+		arc_file_free(f);
+	}
+	vector_destroy(list);
+}
+
+static void write_u32(struct port *out, uint32_t v)
+{
+	if (!port_write_u32(out, v))
+		sys_error("Write failure: %s\n", strerror(errno));
+}
+
+static void write_bytes(struct port *out, uint8_t *data, size_t size)
+{
+	if (!port_write_bytes(out, data, size))
+		sys_error("Write failure: %s\n", strerror(errno));
+}
+
+static void arc_seek(struct port *out, unsigned off)
+{
+	if (!port_seek(out, off))
+		sys_error("Seek failure: %s\n", strerror(errno));
+}
+
+static void arc_file_fs_write(struct port *out, struct arc_file *f)
+{
+	size_t size;
+	uint8_t *data = file_read(f->fs.path, &size);
+	write_bytes(out, data, size);
+	free(data);
+}
+
+static void arc_file_mem_write(struct port *out, struct arc_file *f)
+{
+	write_bytes(out, f->mem.data, f->mem.size);
+}
+
+static void arc_file_arcdata_write(struct port *out, struct arc_file *f)
+{
+	if (!archive_data_load(f->arcdata))
+		sys_error("Failed to load file from archive\n");
+	write_bytes(out, f->arcdata->data, f->arcdata->size);
+	archive_data_release(f->arcdata);
+}
+
+static void arc_file_write(struct port *out, struct arc_file *f)
+{
+	f->packed_offset = port_tell(out);
+
+	switch (f->type) {
+	case ARC_FILE_FS: arc_file_fs_write(out, f); break;
+	case ARC_FILE_MEM: arc_file_mem_write(out, f); break;
+	case ARC_FILE_ARCDATA: arc_file_arcdata_write(out, f); break;
+	}
+
+	f->packed_size = port_tell(out) - f->packed_offset;
+}
+
+static void kakyuusei_write_index(struct port *out, arc_file_list files)
+{
+	static uint8_t shuffle_table[20] = {
+		17, 2, 8, 19, 0, 5, 10, 13, 1, 15, 6, 4, 11, 16, 3, 9, 18, 12, 7, 14
+	};
+
+	uint8_t enc[20];
+	uint8_t raw[20];
+	uint8_t key = vector_length(files);
+	struct arc_file *f;
+	vector_foreach_p(f, files) {
+		string name = arc_file_name(f);
+		for (int i = 0; i < 12; i++) {
+			raw[i] = i < string_length(name) ? name[i] : 0;
+		}
+		le_put32(raw, 12, f->packed_size);
+		le_put32(raw, 16, f->packed_offset);
+
+		for (int i = 0; i < 20; i++) {
+			enc[i] = raw[shuffle_table[i]] ^ key;
+			key = ((int)key * 3 + 1) & 0xff;
+		}
+		write_bytes(out, enc, 20);
+	}
+}
+
+static bool arc_write_kakyuusei(const char *path, arc_file_list files)
+{
+	struct port out;
+	if (!port_file_open(&out, path))
+		sys_error("Failed to open \"%s\": %s\n", path, strerror(errno));
+
+	write_u32(&out, vector_length(files));
+	arc_seek(&out, 4 + vector_length(files) * 20);
+
+	struct arc_file *f;
+	vector_foreach_p(f, files) {
+		arc_file_write(&out, f);
+	}
+
+	arc_seek(&out, 4);
+	kakyuusei_write_index(&out, files);
+	return true;
+}
+
+static void write_entry_name(struct port *out, struct arc_file *f, struct arc_metadata *meta)
+{
+	uint8_t e_name[256];
+	string name = arc_file_name(f);
+
+	int i;
+	for (i = 0; name[i]; i++) {
+		e_name[i] = name[i] ^ meta->name_key;
+	}
+	for (; i < meta->name_length; i++) {
+		e_name[i] = meta->name_key;
+	}
+	write_bytes(out, e_name, meta->name_length);
+}
+
+static void write_entry_NSO(struct port *out, struct arc_file *f, struct arc_metadata *meta)
+{
+	write_entry_name(out, f, meta);
+	write_u32(out, f->packed_size ^ meta->size_key);
+	write_u32(out, f->packed_offset ^ meta->offset_key);
+}
+
+static void write_entry_NOS(struct port *out, struct arc_file *f, struct arc_metadata *meta)
+{
+	write_entry_name(out, f, meta);
+	write_u32(out, f->packed_offset ^ meta->offset_key);
+	write_u32(out, f->packed_size ^ meta->size_key);
+}
+
+bool arc_write(const char *path, arc_file_list files, struct arc_metadata *meta)
+{
+	if (ai5_target_game == GAME_KAKYUUSEI)
+		return arc_write_kakyuusei(path, files);
+
+	// determine entry format
+	void (*write_entry)(struct port*,struct arc_file*,struct arc_metadata*);
+	if (meta->name_off == 0 && meta->size_off == meta->name_length
+			&& meta->offset_off == meta->size_off + 4) {
+		write_entry = write_entry_NSO;
+	} else if (meta->name_off == 0 && meta->offset_off == meta->name_length
+			&& meta->size_off == meta->offset_off + 4) {
+		write_entry = write_entry_NOS;
+	} else {
+		sys_error("Unsupported archive entry format");
+	}
+
+	struct port out;
+	if (!port_file_open(&out, path))
+		sys_error("Failed to open \"%s\": %s\n", path, strerror(errno));
+
+	write_u32(&out, vector_length(files));
+
+	// write file data
+	if (!port_seek(&out, 4 + meta->entry_size * vector_length(files)))
+		sys_error("Seek failed: %s", strerror(errno));
+
+	struct arc_file *f;
+	vector_foreach_p(f, files) {
+		arc_file_write(&out, f);
+	}
+
+	// write index
+	if (!port_seek(&out, 4))
+		sys_error("Seek failed: %s", strerror(errno));
+
+	vector_foreach_p(f, files) {
+		write_entry(&out, f, meta);
+	}
+
+	port_close(&out);
+	return true;
+}
+
+/*
+ * Prepare an arc_file struct for in-memory data, compressing it if requested.
+ * Takes ownership of `name` and `data`.
+ */
+struct arc_file arc_file_mem(string name, uint8_t *data, size_t size, bool compress)
+{
+	if (compress) {
+		size_t compressed_size;
+		uint8_t *compressed;
+		if (game_is_aiwin())
+			compressed = lzss_bw_compress(data, size, &compressed_size);
+		else
+			compressed = lzss_compress(data, size, &compressed_size);
+		if (!compressed)
+			sys_error("Compression failure\n");
+		free(data);
+		data = compressed;
+		size = compressed_size;
+	}
+	return (struct arc_file) {
+		.type = ARC_FILE_MEM,
+		.mem = {
+			.name = name,
+			.data = data,
+			.size = size,
+		}
+	};
+}
+
+/*
+ * Add all files from an existing archive to a file list.
+ */
+struct archive *arc_file_list_open(const char *path, arc_file_list *files)
+{
+	struct archive *arc = archive_open(path, ARCHIVE_MMAP | ARCHIVE_RAW);
+	if (!arc)
+		return NULL;
+
+	struct archive_data *data;
+	archive_foreach(data, arc) {
+		const struct arc_file f = {
+			.type = ARC_FILE_ARCDATA,
+			.arcdata = data
+		};
+		vector_push(struct arc_file, *files, f);
+	}
+	return arc;
+}
+
+/*
+ * Add a file to a file list. If `arc` is given and the name appears in the
+ * archive, the existing entry is replaced.
+ */
+void arc_file_list_put(arc_file_list *files, struct archive *arc, string name,
+		struct arc_file f)
+{
+	int i;
+	if (arc && (i = archive_get_index(arc, name)) >= 0) {
+		struct arc_file *old = &vector_A(*files, i);
+		arc_file_free(old);
+		*old = f;
+	} else {
+		vector_push(struct arc_file, *files, f);
+	}
+}
+
+void arc_decode_key(const char *key, struct arc_metadata *dst)
+{
+	unsigned name_key;
+	if (sscanf(key, "%08x%08x%02x%02x", &dst->offset_key, &dst->size_key,
+				&name_key, &dst->name_length) != 4) {
+		sys_error("Invalid key: %s", key);
+	}
+	dst->name_key = name_key;
+}
+
+#define NAME_SIZE_OFFSET(len) \
+	.name_length = len, \
+	.name_off = 0, \
+	.size_off = len, \
+	.offset_off = len + 4, \
+	.entry_size = len + 8
+
+#define NAME_OFFSET_SIZE(len) \
+	.name_length = len, \
+	.name_off = 0, \
+	.offset_off = len, \
+	.size_off = len + 4, \
+	.entry_size = len + 8
+
+static struct arc_metadata game_keys[] = {
+	[GAME_YUKINOJOU] = {
+		NAME_SIZE_OFFSET(20),
+		.offset_key  = 0x87af1f1c,
+		.size_key    = 0xf3107572,
+		.name_key    = 0xfa,
+	},
+	[GAME_YUNO] = {
+		NAME_SIZE_OFFSET(20),
+		.offset_key  = 0x68820811,
+		.size_key    = 0x33656755,
+		.name_key    = 0x03,
+	},
+	[GAME_SHANGRLIA] = {
+		NAME_SIZE_OFFSET(20),
+		.offset_key  = 0x68820811,
+		.size_key    = 0x33656755,
+		.name_key    = 0x03,
+	},
+	[GAME_SHANGRLIA2] = {
+		NAME_SIZE_OFFSET(20),
+		.offset_key  = 0x68820811,
+		.size_key    = 0x33656755,
+		.name_key    = 0x03,
+	},
+	[GAME_BEYOND] = {
+		NAME_SIZE_OFFSET(20),
+		.offset_key  = 0x55aa55aa,
+		.size_key    = 0xaa55aa55,
+		.name_key    = 0x55,
+	},
+	[GAME_AI_SHIMAI] = {
+		NAME_SIZE_OFFSET(20),
+		.offset_key  = 0xd4c29ff9,
+		.size_key    = 0x13f09573,
+		.name_key    = 0x26,
+	},
+	[GAME_KOIHIME] = {
+		NAME_SIZE_OFFSET(20),
+		.offset_key  = 0x55aa55aa,
+		.size_key    = 0xaa55aa55,
+		.name_key    = 0x55,
+	},
+	[GAME_DOUKYUUSEI] = {
+		NAME_SIZE_OFFSET(20),
+		.offset_key  = 0x55aa55aa,
+		.size_key    = 0xaa55aa55,
+		.name_key    = 0x55,
+	},
+	[GAME_DOUKYUUSEI2] = {
+		NAME_SIZE_OFFSET(12),
+		.offset_key  = 0x55aa55aa,
+		.size_key    = 0xaa55aa55,
+		.name_key    = 0x55,
+	},
+	[GAME_ISAKU] = {
+		NAME_SIZE_OFFSET(20),
+		.offset_key  = 0x55aa55aa,
+		.size_key    = 0xaa55aa55,
+		.name_key    = 0x55,
+	},
+	[GAME_ALLSTARS] = {
+		NAME_SIZE_OFFSET(20),
+		.offset_key  = 0x44bd44bd,
+		.size_key    = 0xcf88cf88,
+		.name_key    = 0x66,
+	},
+	[GAME_SHUUSAKU] = {
+		NAME_OFFSET_SIZE(16),
+		.offset_key  = 0,
+		.size_key    = 0,
+		.name_key    = 0,
+	},
+	[GAME_KAWARAZAKIKE] = {
+		NAME_OFFSET_SIZE(32),
+		.offset_key  = 0,
+		.size_key    = 0,
+		.name_key    = 0,
+	},
+};
+
+void arc_set_key_by_game(const char *name, struct arc_metadata *meta)
+{
+	enum ai5_game_id id = ai5_parse_game_id(name);
+	if (id == GAME_KAKYUUSEI)
+		return;
+	if (id >= ARRAY_SIZE(game_keys))
+		sys_error("Key for game \"%s\" is unknown.\n", name);
+	*meta = game_keys[id];
+}
@@ -0,0 +1,152 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/port.h"
+#include "nulib/string.h"
+#include "ai5/arc.h"
+#include "ai5/game.h"
+#include "ai5/mes.h"
+
+#include "arc.h"
+#include "mes.h"
+
+/*
+ * Write the text of every mes file in an archive to a single translation bundle.
+ */
+bool arc_text_export(struct archive *arc, struct port *out, int name_function)
+{
+	bool r = true;
+	struct archive_data *data;
+	archive_foreach(data, arc) {
+		if (!arc_is_mes_file(data->name))
+			continue;
+		if (!archive_data_load(data)) {
+			sys_warning("Failed to read file \"%s\" from archive\n", data->name);
+			r = false;
+			continue;
+		}
+		arc_mes_crypt(data->name, data->data, data->size);
+
+		mes_clear_labels();
+		mes_statement_list statements = vector_initializer;
+		if (!mes_parse_statements(data->data, data->size, &statements)) {
+			sys_warning("Failed to parse .mes file \"%s\".\n", data->name);
+			archive_data_release(data);
+			r = false;
+			continue;
+		}
+		port_printf(out, "# file = \"%s\"\n\n", data->name);
+		mes_text_print(statements, out, name_function);
+		mes_statement_list_free(statements);
+		archive_data_release(data);
+	}
+	return r;
+}
+
+static uint8_t *import_file(struct archive *arc, struct mes_text_bundle_file *file,
+		struct mes_text_encode_cache *cache, string *name_out, size_t *size_out)
+{
+	struct archive_data *data = archive_get(arc, file->name);
+	if (!data) {
+		sys_warning("File \"%s\" not found in archive.\n", file->name);
+		return NULL;
+	}
+	arc_mes_crypt(data->name, data->data, data->size);
+
+	mes_clear_labels();
+	mes_statement_list mes = vector_initializer;
+	bool ok = mes_parse_statements(data->data, data->size, &mes);
+	// keep the name as it appears in the archive
+	string name = string_dup(data->name);
+	archive_data_release(data);
+	if (!ok) {
+		sys_warning("Failed to parse .mes file \"%s\".\n", file->name);
+		string_free(name);
+		return NULL;
+	}
+
+	mes = mes_substitute_text(mes, file->subs, cache);
+	uint8_t *packed = mes_pack(mes, size_out);
+	mes_statement_list_free(mes);
+
+	arc_mes_crypt(name, packed, *size_out);
+	*name_out = name;
+	return packed;
+}
+
+/*
+ * Substitute the text from a translation bundle into the mes files of an archive,
+ * writing the result to a new archive. All other files are copied unchanged.
+ * The output archive is only written if every file is imported successfully.
+ */
+bool arc_text_import(const char *arc_path, struct mes_text_bundle *bundle,
+		const char *output_path)
+{
+	bool compress = arc_is_compressed(arc_path, ai5_target_game);
+
+	// the archive is opened twice: once decompressed for reading mes files,
+	// and once raw so that untouched files are copied without recompression
+	struct archive *src = archive_open(arc_path, ARCHIVE_MMAP | (compress ? 0 : ARCHIVE_RAW));
+	if (!src) {
+		sys_warning("Failed to open archive file \"%s\".\n", arc_path);
+		return false;
+	}
+	arc_file_list files = vector_initializer;
+	struct archive *raw = arc_file_list_open(arc_path, &files);
+	if (!raw) {
+		sys_warning("Failed to open archive file \"%s\".\n", arc_path);
+		archive_close(src);
+		return false;
+	}
+
+	// lines which recur across files are only encoded once
+	struct mes_text_encode_cache *cache = mes_text_encode_cache_new();
+	unsigned nr_failed = 0;
+	struct mes_text_bundle_file *file;
+	vector_foreach_p(file, bundle->files) {
+		sys_message("%s... ", file->name);
+		string name;
+		size_t size;
+		uint8_t *packed = import_file(src, file, cache, &name, &size);
+		if (!packed) {
+			sys_message("FAILED\n");
+			nr_failed++;
+			continue;
+		}
+		arc_file_list_put(&files, raw, name, arc_file_mem(name, packed, size, compress));
+		sys_message("OK\n");
+	}
+
+	bool r = false;
+	if (nr_failed) {
+		sys_warning("%u of %u files failed to import; archive not written.\n",
+				nr_failed, (unsigned)vector_length(bundle->files));
+	} else {
+		struct arc_metadata meta = src->meta;
+		r = arc_write(output_path, files, &meta);
+	}
+
+	mes_text_encode_cache_free(cache);
+	arc_file_list_free(files);
+	archive_close(raw);
+	archive_close(src);
+	return r;
+}
@@ -19,8 +19,10 @@
 
 #include "nulib.h"
 #include "nulib/file.h"
+#include "nulib/port.h"
 #include "ai5/anim.h"
 #include "ai5/cg.h"
+#include "file.h"
 
 struct anim *file_anim_load(const char *path)
 {
@@ -61,4 +63,27 @@ struct cg *file_cg_load(const char *path)
 	return cg;
 }
 
+#define OUTPUT_BUFFER_SIZE (1 << 20)
 
+/*
+ * Open a port for writing formatted output. If `path` is NULL, stdout is used.
+ * The underlying stream is given a large buffer so that the many small writes
+ * issued by the printers are coalesced into few large ones.
+ */
+bool file_port_open(struct port *out, const char *path)
+{
+	if (!path) {
+		// stdout may only be re-buffered before anything is written to it
+		static bool stdout_buffered = false;
+		if (!stdout_buffered) {
+			setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+			stdout_buffered = true;
+		}
+		port_file_init(out, stdout);
+		return true;
+	}
+	if (!port_file_open(out, path))
+		return false;
+	setvbuf(out->file, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+	return true;
+}
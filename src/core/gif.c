@@ -0,0 +1,740 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "nulib.h"
+#include "nulib/little_endian.h"
+#include "nulib/port.h"
+
+#include "gif.h"
+#include "util.h"
+
+/*
+ * Each frame is encoded as a sub-image covering only the bounding box of the
+ * pixels that changed since the previous frame, with "do not dispose" disposal.
+ * Unchanged pixels inside the box are encoded with a transparent index. Colors
+ * go into a local color table; when a frame has more than 255 colors, it is
+ * reduced to fewer bits per channel with ordered dithering (the same 4x4 kernel
+ * as msf_gif). The bit depth is chosen from the set of distinct colors in the
+ * frame, so the pixels are only scanned once more to dither them.
+ *
+ * Finding the changed region depends on the previous frame, so it runs on the
+ * calling thread. Building the color table and LZW compression only depend on
+ * the (copied) region, so they are done by a pool of worker threads; encoded
+ * frames are written out in order as they complete.
+ */
+
+#define LZW_MAX_CODE 4095
+#define LZW_HASH_BITS 13
+#define LZW_HASH_SIZE (1 << LZW_HASH_BITS)
+
+#define COLOR_HASH_SIZE 1024
+#define MAX_COLORS 255
+// one bit per 24-bit color
+#define COLOR_SET_SIZE ((1 << 24) / 8)
+
+struct gif_rect {
+	int x, y, w, h;
+};
+
+// per-thread LZW dictionary (hash table) and color reduction state
+struct gif_scratch {
+	int32_t *lzw_keys;
+	int16_t *lzw_codes;
+	// bit set of colors (allocated on first use)
+	uint8_t *color_set;
+	// distinct colors of a frame with more than MAX_COLORS colors
+	uint32_t *colors;
+	unsigned nr_colors;
+	unsigned colors_cap;
+};
+
+// a frame, ready to be encoded
+struct gif_job {
+	struct gif_rect rect;
+	// RGBA pixels of rect; alpha is 0 for transparent pixels
+	uint8_t *pixels;
+	unsigned centiseconds;
+	// encoded image (worker threads only)
+	struct port out;
+	bool ok;
+	bool done;
+};
+
+struct gif_pool {
+	pthread_t *threads;
+	unsigned nr_threads;
+	pthread_mutex_t lock;
+	// signalled when a job is queued (or on shutdown)
+	pthread_cond_t work;
+	// signalled when a job is done
+	pthread_cond_t done;
+	// ring buffer of jobs: [head,next) running or done, [next,tail) queued
+	struct gif_job *jobs;
+	unsigned cap;
+	unsigned head, next, tail;
+	bool quit;
+};
+
+// Bit writer {{{
+
+struct bit_writer {
+	struct port *out;
+	// data sub-block: length byte followed by up to 255 bytes
+	uint8_t block[256];
+	unsigned len;
+	uint32_t acc;
+	unsigned nr_bits;
+	bool ok;
+};
+
+static void bw_flush_block(struct bit_writer *bw)
+{
+	if (!bw->len)
+		return;
+	bw->block[0] = bw->len;
+	if (!port_write_bytes(bw->out, bw->block, bw->len + 1))
+		bw->ok = false;
+	bw->len = 0;
+}
+
+static void bw_put_byte(struct bit_writer *bw, uint8_t b)
+{
+	bw->block[1 + bw->len++] = b;
+	if (bw->len == 255)
+		bw_flush_block(bw);
+}
+
+static void bw_put_code(struct bit_writer *bw, unsigned code, unsigned size)
+{
+	bw->acc |= code << bw->nr_bits;
+	bw->nr_bits += size;
+	while (bw->nr_bits >= 8) {
+		bw_put_byte(bw, bw->acc & 0xff);
+		bw->acc >>= 8;
+		bw->nr_bits -= 8;
+	}
+}
+
+static void bw_finish(struct bit_writer *bw)
+{
+	if (bw->nr_bits)
+		bw_put_byte(bw, bw->acc & 0xff);
+	bw_flush_block(bw);
+	if (!port_putc(bw->out, 0))
+		bw->ok = false;
+}
+
+// Bit writer }}}
+// LZW {{{
+
+static void scratch_init(struct gif_scratch *scratch)
+{
+	*scratch = (struct gif_scratch) {
+		.lzw_keys = xmalloc(LZW_HASH_SIZE * sizeof(int32_t)),
+		.lzw_codes = xmalloc(LZW_HASH_SIZE * sizeof(int16_t)),
+	};
+}
+
+static void scratch_free(struct gif_scratch *scratch)
+{
+	free(scratch->lzw_keys);
+	free(scratch->lzw_codes);
+	free(scratch->color_set);
+	free(scratch->colors);
+}
+
+static void lzw_reset(struct gif_scratch *gif)
+{
+	memset(gif->lzw_keys, 0, LZW_HASH_SIZE * sizeof(int32_t));
+}
+
+static int lzw_slot(struct gif_scratch *gif, int32_t key)
+{
+	unsigned i = ((uint32_t)key * 2654435761u) >> (32 - LZW_HASH_BITS);
+	while (gif->lzw_keys[i] && gif->lzw_keys[i] != key)
+		i = (i + 1) & (LZW_HASH_SIZE - 1);
+	return i;
+}
+
+static bool lzw_encode(struct gif_scratch *gif, struct port *out, const uint8_t *indices,
+		unsigned n, unsigned min_code_size)
+{
+	struct bit_writer bw = { .out = out, .ok = true };
+	const unsigned clear_code = 1 << min_code_size;
+	unsigned code_size = min_code_size + 1;
+	unsigned max_code = clear_code + 1;
+
+	if (!port_putc(out, min_code_size))
+		return false;
+
+	lzw_reset(gif);
+	bw_put_code(&bw, clear_code, code_size);
+
+	int cur = indices[0];
+	for (unsigned i = 1; i < n; i++) {
+		// keys are offset by 1 so that 0 marks an empty slot
+		int32_t key = ((cur << 8) | indices[i]) + 1;
+		int slot = lzw_slot(gif, key);
+		if (gif->lzw_keys[slot]) {
+			cur = gif->lzw_codes[slot];
+			continue;
+		}
+
+		bw_put_code(&bw, cur, code_size);
+		gif->lzw_keys[slot] = key;
+		gif->lzw_codes[slot] = ++max_code;
+		if (max_code >= (1u << code_size))
+			code_size++;
+		if (max_code == LZW_MAX_CODE) {
+			bw_put_code(&bw, clear_code, code_size);
+			lzw_reset(gif);
+			code_size = min_code_size + 1;
+			max_code = clear_code + 1;
+		}
+		cur = indices[i];
+	}
+
+	bw_put_code(&bw, cur, code_size);
+	// the decoder adds an entry for the last code, and widens its codes if the
+	// next one wouldn't fit
+	if (max_code + 1 == (1u << code_size) && code_size < 12)
+		code_size++;
+	bw_put_code(&bw, clear_code + 1, code_size);
+	bw_finish(&bw);
+	return bw.ok;
+}
+
+// LZW }}}
+// Color table {{{
+
+struct color_table {
+	uint32_t keys[COLOR_HASH_SIZE];
+	uint8_t index[COLOR_HASH_SIZE];
+	uint8_t rgb[256 * 3];
+	unsigned nr_colors;
+};
+
+static inline uint32_t px_color(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static void color_table_init(struct color_table *t)
+{
+	memset(t->keys, 0, sizeof(t->keys));
+	t->nr_colors = 0;
+}
+
+/*
+ * Look up (or add) the index of a color. Returns -1 if the table is full.
+ */
+static int color_table_index(struct color_table *t, uint32_t color)
+{
+	unsigned i = ((color * 2654435761u) >> 22) & (COLOR_HASH_SIZE - 1);
+	while (t->keys[i]) {
+		if (t->keys[i] == color + 1)
+			return t->index[i];
+		i = (i + 1) & (COLOR_HASH_SIZE - 1);
+	}
+	if (t->nr_colors >= MAX_COLORS)
+		return -1;
+	unsigned no = t->nr_colors++;
+	t->keys[i] = color + 1;
+	t->index[i] = no;
+	t->rgb[no*3+0] = color & 0xff;
+	t->rgb[no*3+1] = (color >> 8) & 0xff;
+	t->rgb[no*3+2] = (color >> 16) & 0xff;
+	return no;
+}
+
+static bool bit_set_add(uint8_t *set, uint32_t i)
+{
+	uint8_t bit = 1 << (i & 7);
+	if (set[i >> 3] & bit)
+		return false;
+	set[i >> 3] |= bit;
+	return true;
+}
+
+// Color table }}}
+// Dithering {{{
+
+// 4x4 ordered dithering kernel (as in msf_gif)
+static const uint8_t dither_kernel[16] = {
+	 0,  8,  2, 10,
+	12,  4, 14,  6,
+	 3, 11,  1,  9,
+	15,  7, 13,  5,
+};
+
+// largest threshold returned by dither_threshold
+#define DITHER_MAX (15 * 16 + 8)
+
+// threshold in [0,255) for the pixel at (x,y)
+static inline unsigned dither_threshold(int x, int y)
+{
+	return dither_kernel[(y & 3) * 4 + (x & 3)] * 16 + 8;
+}
+
+// reduce a channel to `levels`+1 levels, and expand it back to 8 bits
+static inline uint32_t dither_channel(uint8_t v, unsigned levels, unsigned threshold)
+{
+	return (v * levels + threshold) / 255 * 255 / levels;
+}
+
+static uint32_t dither_color(const uint8_t *p, unsigned levels, unsigned threshold)
+{
+	return dither_channel(p[0], levels, threshold)
+		| dither_channel(p[1], levels, threshold) << 8
+		| dither_channel(p[2], levels, threshold) << 16;
+}
+
+static void push_color(struct gif_scratch *s, uint32_t color)
+{
+	if (!bit_set_add(s->color_set, color))
+		return;
+	if (s->nr_colors == s->colors_cap) {
+		s->colors_cap = max(s->colors_cap * 2, 1024);
+		s->colors = xrealloc(s->colors, s->colors_cap * sizeof(uint32_t));
+	}
+	s->colors[s->nr_colors++] = color;
+}
+
+/*
+ * Collect the distinct colors of a job: the colors already in the table, plus
+ * those of the pixels from `start` on.
+ */
+static void collect_colors(struct gif_scratch *s, struct gif_job *job, struct color_table *t,
+		unsigned start)
+{
+	if (!s->color_set)
+		s->color_set = xcalloc(1, COLOR_SET_SIZE);
+	s->nr_colors = 0;
+	for (unsigned i = 0; i < t->nr_colors; i++) {
+		push_color(s, t->rgb[i*3] | (t->rgb[i*3+1] << 8) | (t->rgb[i*3+2] << 16));
+	}
+	const unsigned n = job->rect.w * job->rect.h;
+	const uint8_t *p = job->pixels + start * 4;
+	for (unsigned i = start; i < n; i++, p += 4) {
+		if (p[3])
+			push_color(s, px_color(p));
+	}
+	// leave the set empty for the next frame
+	for (unsigned i = 0; i < s->nr_colors; i++) {
+		s->color_set[s->colors[i] >> 3] = 0;
+	}
+}
+
+/*
+ * Count the colors that dithering the collected colors to `bits` bits per channel
+ * can produce, stopping once there are more than `limit`. Dithering rounds each
+ * channel either down or up, depending on the pixel's position.
+ */
+static unsigned count_dithered_colors(struct gif_scratch *s, unsigned bits, unsigned limit)
+{
+	const unsigned levels = (1 << bits) - 1;
+	unsigned count = 0;
+	memset(s->color_set, 0, ((1 << (bits * 3)) + 7) / 8);
+	for (unsigned i = 0; i < s->nr_colors && count <= limit; i++) {
+		unsigned lo[3], hi[3];
+		for (int ch = 0; ch < 3; ch++) {
+			unsigned v = ((s->colors[i] >> (ch * 8)) & 0xff) * levels;
+			lo[ch] = v / 255;
+			hi[ch] = (v + DITHER_MAX) / 255;
+		}
+		for (unsigned r = lo[0]; r <= hi[0]; r++) {
+			for (unsigned g = lo[1]; g <= hi[1]; g++) {
+				for (unsigned b = lo[2]; b <= hi[2]; b++) {
+					count += bit_set_add(s->color_set,
+							r | (g << bits) | (b << (bits * 2)));
+				}
+			}
+		}
+	}
+	memset(s->color_set, 0, ((1 << (bits * 3)) + 7) / 8);
+	return count;
+}
+
+/*
+ * Index a job's pixels with ordered dithering, using the largest number of bits
+ * per channel for which every color that dithering can produce fits into the
+ * table. Indices are offset by 1, with 0 for transparent pixels. Returns true if
+ * there are any transparent pixels.
+ */
+static bool dither_pixels(struct gif_scratch *s, struct gif_job *job, struct color_table *t,
+		uint8_t *out)
+{
+	unsigned bits = 7;
+	while (bits > 1 && count_dithered_colors(s, bits, MAX_COLORS) > MAX_COLORS)
+		bits--;
+	const unsigned levels = (1 << bits) - 1;
+
+	color_table_init(t);
+	bool transparent = false;
+	const uint8_t *p = job->pixels;
+	for (int y = job->rect.y; y < job->rect.y + job->rect.h; y++) {
+		for (int x = job->rect.x; x < job->rect.x + job->rect.w; x++, p += 4, out++) {
+			if (!p[3]) {
+				*out = 0;
+				transparent = true;
+				continue;
+			}
+			int c = color_table_index(t, dither_color(p, levels,
+						dither_threshold(x, y)));
+			assert(c >= 0);
+			*out = c + 1;
+		}
+	}
+	return transparent;
+}
+
+// Dithering }}}
+
+static bool px_changed(struct gif_encoder *gif, const uint8_t *p, int x, int y)
+{
+	return memcmp(p, gif->shown + (y * gif->w + x) * 4, 3);
+}
+
+/*
+ * Shrink the given rectangle to the bounding box of the pixels that differ from
+ * the displayed image.
+ */
+static struct gif_rect changed_rect(struct gif_encoder *gif, const uint8_t *pixels,
+		unsigned stride, struct gif_rect r)
+{
+	int x0 = r.x + r.w, y0 = r.y + r.h, x1 = r.x - 1, y1 = r.y - 1;
+	for (int y = r.y; y < r.y + r.h; y++) {
+		const uint8_t *row = pixels + y * stride;
+		for (int x = r.x; x < r.x + r.w; x++) {
+			if (!px_changed(gif, row + x * 4, x, y))
+				continue;
+			x0 = min(x0, x);
+			x1 = max(x1, x);
+			y0 = min(y0, y);
+			y1 = max(y1, y);
+		}
+	}
+	if (x1 < x0)
+		return (struct gif_rect) {0};
+	return (struct gif_rect) { x0, y0, x1 - x0 + 1, y1 - y0 + 1 };
+}
+
+/*
+ * Convert a job's pixels to color indices. Frames with at most MAX_COLORS colors
+ * are indexed exactly, in a single pass; others are dithered. Returns the
+ * transparent index (or -1 if unused).
+ */
+static int index_pixels(struct gif_scratch *s, struct gif_job *job, struct color_table *t,
+		uint8_t *out)
+{
+	const unsigned n = job->rect.w * job->rect.h;
+	color_table_init(t);
+	bool transparent = false;
+	unsigned i;
+	const uint8_t *p = job->pixels;
+	for (i = 0; i < n; i++, p += 4) {
+		if (!p[3]) {
+			// patched below, once the number of colors is known
+			out[i] = 0;
+			transparent = true;
+			continue;
+		}
+		int c = color_table_index(t, px_color(p));
+		if (c < 0)
+			break;
+		out[i] = c + 1;
+	}
+	if (i < n) {
+		collect_colors(s, job, t, i);
+		transparent = dither_pixels(s, job, t, out);
+	}
+
+	// transparent index goes after the colors
+	for (i = 0; i < n; i++) {
+		out[i] = out[i] ? out[i] - 1 : t->nr_colors;
+	}
+	return transparent ? (int)t->nr_colors : -1;
+}
+
+/*
+ * Write the GIF image for a job (graphic control extension, image descriptor,
+ * local color table and LZW data).
+ */
+static bool encode_job(struct gif_scratch *scratch, struct gif_job *job, struct port *out)
+{
+	struct gif_rect r = job->rect;
+	struct color_table table;
+	uint8_t *indices = xmalloc(r.w * r.h);
+	int transparent = index_pixels(scratch, job, &table, indices);
+	unsigned nr_entries = table.nr_colors + (transparent >= 0);
+	unsigned table_bits = 1;
+	while ((1u << table_bits) < nr_entries)
+		table_bits++;
+
+	// graphic control extension: do not dispose
+	uint8_t gce[8] = { 0x21, 0xf9, 4, 1 << 2 };
+	if (transparent >= 0) {
+		gce[3] |= 1;
+		gce[6] = transparent;
+	}
+	le_put16(gce, 4, min(job->centiseconds, 0xffff));
+
+	// image descriptor with local color table
+	uint8_t desc[10] = { 0x2c };
+	le_put16(desc, 1, r.x);
+	le_put16(desc, 3, r.y);
+	le_put16(desc, 5, r.w);
+	le_put16(desc, 7, r.h);
+	desc[9] = 0x80 | (table_bits - 1);
+
+	uint8_t colors[256 * 3] = {0};
+	memcpy(colors, table.rgb, table.nr_colors * 3);
+
+	bool ok = port_write_bytes(out, gce, sizeof(gce))
+		&& port_write_bytes(out, desc, sizeof(desc))
+		&& port_write_bytes(out, colors, (1 << table_bits) * 3)
+		&& lzw_encode(scratch, out, indices, r.w * r.h, max(2, table_bits));
+	free(indices);
+	return ok;
+}
+
+// Worker pool {{{
+
+static void *pool_worker(void *data)
+{
+	struct gif_pool *pool = data;
+	struct gif_scratch scratch;
+	scratch_init(&scratch);
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (pool->next == pool->tail && !pool->quit)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->next == pool->tail)
+			break;
+		struct gif_job *job = &pool->jobs[pool->next++ % pool->cap];
+		pthread_mutex_unlock(&pool->lock);
+
+		port_buffer_init(&job->out);
+		job->ok = encode_job(&scratch, job, &job->out);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = true;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	scratch_free(&scratch);
+	return NULL;
+}
+
+static struct gif_pool *pool_create(unsigned nr_threads)
+{
+	struct gif_pool *pool = xcalloc(1, sizeof(struct gif_pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	// enough queued frames to keep every thread busy, but no more
+	pool->cap = nr_threads * 2;
+	pool->jobs = xcalloc(pool->cap, sizeof(struct gif_job));
+	pool->threads = xcalloc(nr_threads, sizeof(pthread_t));
+	for (unsigned i = 0; i < nr_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, pool_worker, pool))
+			break;
+		pool->nr_threads++;
+	}
+	if (!pool->nr_threads) {
+		WARNING("failed to create GIF encoder threads");
+		free(pool->threads);
+		free(pool->jobs);
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+/*
+ * Write out finished jobs in order, waiting until at most `keep` jobs are left.
+ */
+static bool pool_write(struct gif_encoder *gif, unsigned keep)
+{
+	struct gif_pool *pool = gif->pool;
+	bool ok = true;
+	pthread_mutex_lock(&pool->lock);
+	while (pool->head != pool->tail) {
+		struct gif_job *job = &pool->jobs[pool->head % pool->cap];
+		if (!job->done) {
+			if (pool->tail - pool->head <= keep)
+				break;
+			pthread_cond_wait(&pool->done, &pool->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		size_t size;
+		uint8_t *data = port_buffer_get(&job->out, &size);
+		ok = job->ok && port_write_bytes(gif->out, data, size) && ok;
+		free(data);
+		free(job->pixels);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->head++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return ok;
+}
+
+static bool pool_submit(struct gif_encoder *gif, struct gif_job *job)
+{
+	struct gif_pool *pool = gif->pool;
+	bool ok = pool_write(gif, pool->cap - 1);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->jobs[pool->tail++ % pool->cap] = *job;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	return ok;
+}
+
+static bool pool_destroy(struct gif_encoder *gif)
+{
+	struct gif_pool *pool = gif->pool;
+	bool ok = pool_write(gif, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (unsigned i = 0; i < pool->nr_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool->jobs);
+	free(pool);
+	gif->pool = NULL;
+	return ok;
+}
+
+// Worker pool }}}
+
+/*
+ * Start encoding a GIF. Frames are encoded on `nr_threads` worker threads (0 for
+ * one per CPU); with 1, they are encoded on the calling thread.
+ */
+bool gif_encoder_begin(struct gif_encoder *gif, struct port *out, unsigned w, unsigned h,
+		unsigned nr_threads)
+{
+	*gif = (struct gif_encoder) {
+		.out = out,
+		.w = w,
+		.h = h,
+		.shown = xcalloc(w * h, 4),
+	};
+
+	if (!nr_threads)
+		nr_threads = nr_cpus();
+	if (nr_threads > 1)
+		gif->pool = pool_create(nr_threads);
+	if (!gif->pool) {
+		gif->scratch = xmalloc(sizeof(struct gif_scratch));
+		scratch_init(gif->scratch);
+	}
+
+	uint8_t header[13] = { 'G', 'I', 'F', '8', '9', 'a' };
+	le_put16(header, 6, w);
+	le_put16(header, 8, h);
+	// no global color table
+	static const uint8_t loop[19] = {
+		0x21, 0xff, 11, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0',
+		3, 1, 0, 0, 0
+	};
+	return port_write_bytes(out, header, sizeof(header))
+		&& port_write_bytes(out, loop, sizeof(loop));
+}
+
+/*
+ * Encode a frame. `pixels` is the full image (RGBA); pixels outside of the
+ * rectangle (x,y,w,h) must be unchanged since the previous frame.
+ */
+bool gif_encoder_frame(struct gif_encoder *gif, const uint8_t *pixels, unsigned stride,
+		int x, int y, int w, int h, unsigned centiseconds)
+{
+	bool keyframe = gif->nr_frames == 0;
+	struct gif_rect r = { 0, 0, gif->w, gif->h };
+	if (!keyframe) {
+		struct gif_rect hint = { max(x, 0), max(y, 0) };
+		hint.w = min(x + w, (int)gif->w) - hint.x;
+		hint.h = min(y + h, (int)gif->h) - hint.y;
+		r = hint.w > 0 && hint.h > 0 ? changed_rect(gif, pixels, stride, hint)
+			: (struct gif_rect) {0};
+		// nothing changed: a single transparent pixel carries the delay
+		if (r.w < 1)
+			r = (struct gif_rect) { 0, 0, 1, 1 };
+	}
+
+	// copy the region, marking unchanged pixels as transparent
+	struct gif_job job = {
+		.rect = r,
+		.pixels = xmalloc(r.w * r.h * 4),
+		.centiseconds = centiseconds,
+	};
+	uint8_t *o = job.pixels;
+	for (int row = r.y; row < r.y + r.h; row++) {
+		const uint8_t *p = pixels + row * stride + r.x * 4;
+		for (int col = r.x; col < r.x + r.w; col++, p += 4, o += 4) {
+			memcpy(o, p, 3);
+			o[3] = keyframe || px_changed(gif, p, col, row);
+		}
+	}
+
+	// update the displayed image
+	for (int row = r.y; row < r.y + r.h; row++) {
+		memcpy(gif->shown + (row * gif->w + r.x) * 4, pixels + row * stride + r.x * 4,
+				r.w * 4);
+	}
+	gif->nr_frames++;
+
+	if (gif->pool)
+		return pool_submit(gif, &job);
+
+	bool ok = encode_job(gif->scratch, &job, gif->out);
+	free(job.pixels);
+	return ok;
+}
+
+bool gif_encoder_end(struct gif_encoder *gif)
+{
+	bool ok = true;
+	if (gif->pool) {
+		ok = pool_destroy(gif);
+	} else {
+		scratch_free(gif->scratch);
+		free(gif->scratch);
+		gif->scratch = NULL;
+	}
+	ok = port_putc(gif->out, 0x3b) && ok;
+	free(gif->shown);
+	gif->shown = NULL;
+	return ok;
+}
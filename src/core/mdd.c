@@ -26,7 +26,9 @@
 #include "ai5/cg.h"
 #include "ai5/game.h"
 
-#include "msf_gif.h"
+#include "gif.h"
+#include "mdd.h"
+#include "video.h"
 
 static uint8_t *decode_offset(uint8_t *dst, int stride, uint8_t b)
 {
@@ -92,29 +94,68 @@ static struct cg *render_frame(struct movie *mov, unsigned frame)
 	return cg;
 }
 
-uint8_t *mdd_render(uint8_t *data, size_t size, size_t *size_out)
+static void movie_init(struct movie *mov, uint8_t *data)
 {
-	struct movie mov;
-	mov.nr_frames = le_get32(data, 0);
-	mov.w = le_get16(data, 4);
-	mov.h = le_get16(data, 6);
+	mov->nr_frames = le_get32(data, 0);
+	mov->w = le_get16(data, 4);
+	mov->h = le_get16(data, 6);
 
-	uint8_t *frame_data = data + 8 + mov.nr_frames * 4 + 708;
-	for (unsigned i = 0; i < mov.nr_frames; i++) {
-		mov.frame[i] = frame_data + le_get32(data, 8 + i * 4);
+	uint8_t *frame_data = data + 8 + mov->nr_frames * 4 + 708;
+	for (unsigned i = 0; i < mov->nr_frames; i++) {
+		mov->frame[i] = frame_data + le_get32(data, 8 + i * 4);
 	}
 
-	mov.palette = data + 8 + mov.nr_frames * 4;
+	mov->palette = data + 8 + mov->nr_frames * 4;
+}
+
+uint8_t *mdd_render(uint8_t *data, size_t size, size_t *size_out)
+{
+	struct movie mov;
+	movie_init(&mov, data);
 
-	MsfGifState gif_state = {};
-	msf_gif_begin(&gif_state, mov.w, mov.h);
+	// frames are stored whole; the encoder only writes the pixels that changed
+	struct port out;
+	port_buffer_init(&out);
+	struct gif_encoder gif;
+	if (!gif_encoder_begin(&gif, &out, mov.w, mov.h, 0)) {
+		gif_encoder_end(&gif);
+		free(port_buffer_get(&out, NULL));
+		return NULL;
+	}
 	for (unsigned frame = 0; frame < mov.nr_frames; frame++) {
 		struct cg *cg = render_frame(&mov, frame);
-		if (!msf_gif_frame(&gif_state, cg->pixels, 8, 16, mov.w * 4))
+		if (!gif_encoder_frame(&gif, cg->pixels, mov.w * 4, 0, 0, mov.w, mov.h, 8))
 			sys_warning("failed to add frame %u to gif", frame);
 		cg_free(cg);
 	}
-	MsfGifResult gif = msf_gif_end(&gif_state);
-	*size_out = gif.dataSize;
-	return gif.data;
+	bool ok = gif_encoder_end(&gif);
+	uint8_t *gif_data = port_buffer_get(&out, size_out);
+	if (!ok) {
+		free(gif_data);
+		return NULL;
+	}
+	return gif_data;
+}
+
+/*
+ * Render a movie to a constant frame rate video, writing each frame as soon as
+ * it is decoded.
+ */
+bool mdd_render_video(uint8_t *data, size_t size, struct video_writer *writer)
+{
+	struct movie mov;
+	movie_init(&mov, data);
+
+	// 80ms per frame, as in the GIF output
+	if (!video_writer_begin(writer, mov.w, mov.h, 25, 2)) {
+		video_writer_end(writer);
+		return false;
+	}
+	bool ok = true;
+	for (unsigned frame = 0; ok && frame < mov.nr_frames; frame++) {
+		struct cg *cg = render_frame(&mov, frame);
+		ok = video_writer_frame(writer, cg->pixels, mov.w * 4, 1);
+		cg_free(cg);
+	}
+	return video_writer_end(writer) && ok;
 }
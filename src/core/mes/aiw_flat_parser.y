@@ -1,4 +1,5 @@
 %define api.prefix {aiw_mf_}
+%define api.pure full
 %define parse.error detailed
 %define parse.lac full
 
@@ -21,18 +22,30 @@
     struct mes_parameter parameter;
     struct mes_statement *statement;
     mes_statement_list program;
+    struct mes_ast *node;
+    mes_ast_block block;
 }
 
 %code requires {
     #include "mes.h"
+    struct mf_state;
 }
 
+%code provides {
+    int aiw_mf_lex(AIW_MF_STYPE *lval, void *scanner);
+    void aiw_mf_error(void *scanner, struct mf_state *mf, const char *s);
+}
+
+%lex-param {void *scanner}
+%parse-param {void *scanner} {struct mf_state *mf}
+
 %token  <string>	IDENTIFIER I_CONSTANT STRING_LITERAL
 %token  <token>		LPAREN RPAREN PLUS MINUS MUL DIV MOD INVALID_TOKEN
 %token  <token>		AND_OP OR_OP LE_OP GE_OP EQ_OP NE_OP
 %token  <token>		VAR4 VAR16 VAR32 ARROW BYTE WORD DWORD RANDOM JZ GOTO
 %token  <token>		JUMP CALL MENUEXEC FUNCTION RETURN DEFPROC DEFMENU
 %token  <token>		SYSTEM CASE OP_0x35 OP_0x37 OP_0xFE
+%token  <token>		SMES_START IF ELSE WHILE CONTINUE BREAK PROCEDURE
 
 %type   <program>	stmts str
 %type   <statement>	stmt
@@ -44,15 +57,80 @@
 %type   <path>		path
 %type   <menu_case>	case
 %type   <cases>		cases
+%type   <string>	path_ident
+%type   <node>		node cond
+%type   <block>		block body item
+
+%destructor { string_free($$); } <string>
+%destructor { mes_expression_free($$); } <expression>
+%destructor { mf_qname_free($$); } <path>
+%destructor { mf_expression_list_free($$); } <arguments>
+%destructor { mes_parameter_list_free($$); } <parameters>
+%destructor { mf_param_free($$); } <parameter>
+%destructor { mes_statement_free($$); } <statement>
+%destructor { mes_statement_list_free($$); } <program>
+%destructor { mes_ast_free($$); } <node>
+%destructor { mes_ast_block_free($$); } <block>
+%destructor { mf_case_free($$); } <menu_case>
+%destructor { mf_case_table_free($$); } <cases>
 
 %start program
 
 %%
 
 program
-	: stmts { mf_program($1); }
+	: stmts { mf_program(mf, $1); }
+	| SMES_START { mf_ast_program(mf, (mes_ast_block)vector_initializer); }
+	| SMES_START block { mf_ast_program(mf, $2); }
 	;
 
+	/* structured input */
+
+block
+	: item { $$ = $1; }
+	| block item { $$ = mf_ast_append($1, $2); }
+	;
+
+body
+	: '{' '}' { $$ = (mes_ast_block)vector_initializer; }
+	| '{' block '}' { $$ = $2; }
+	;
+
+item
+	: stmt
+	  { $$ = mf_ast_statements(mf_push_statement((mes_statement_list)vector_initializer, $1)); }
+	| str
+	  { $$ = mf_ast_statements($1); }
+	| node
+	  { $$ = mf_ast_push((mes_ast_block)vector_initializer, $1); }
+	| IDENTIFIER ':' node
+	  { $$ = mf_ast_push((mes_ast_block)vector_initializer, mf_ast_label(mf, $1, $3)); }
+	;
+
+node
+	: cond
+	  { $$ = $1; }
+	| WHILE '(' expr ')' body
+	  { $$ = mf_ast_loop($3, $5); }
+	| PROCEDURE '[' expr ']' '=' body ';'
+	  { $$ = mf_ast_proc(MES_AST_PROCEDURE, $3, $6); }
+	| CONTINUE ';'
+	  { $$ = mf_ast_node(MES_AST_CONTINUE); }
+	| BREAK ';'
+	  { $$ = mf_ast_node(MES_AST_BREAK); }
+	;
+
+cond
+	: IF '(' expr ')' body
+	  { $$ = mf_ast_cond($3, $5, (mes_ast_block)vector_initializer); }
+	| IF '(' expr ')' body ELSE body
+	  { $$ = mf_ast_cond($3, $5, $7); }
+	| IF '(' expr ')' body ELSE cond
+	  { $$ = mf_ast_cond($3, $5, mf_ast_push((mes_ast_block)vector_initializer, $7)); }
+	;
+
+	/* flat input */
+
 stmts
 	: stmt { $$ = mf_push_statement((mes_statement_list)vector_initializer, $1); }
 	| stmts stmt { $$ = mf_push_statement($1, $2); }
@@ -63,14 +141,14 @@ stmts
 
 str
 	: STRING_LITERAL ';'
-	  { $$ = aiw_mf_parse_string_literal($1); }
+	  { $$ = aiw_mf_parse_string_literal(mf, $1); }
 	| IDENTIFIER ':' STRING_LITERAL ';'
-	  { $$ = aiw_mf_parse_string_literal($3); mf_push_label($1, vector_A($$, 0)); }
+	  { $$ = aiw_mf_parse_string_literal(mf, $3); mf_push_label(mf, $1, vector_A($$, 0)); }
 	;
 
 stmt
 	: IDENTIFIER ':' stmt
-	  { mf_push_label($1, $3); $$ = $3; }
+	  { mf_push_label(mf, $1, $3); $$ = $3; }
 	| RETURN ';'
 	  { $$ = aiw_mes_stmt_end(); }
 	| VAR4 '[' expr ']' '=' exprs ';'
@@ -80,46 +158,57 @@ stmt
 	| SYSTEM '.' VAR16 '[' expr ']' '=' exprs ';'
 	  { $$ = aiw_mes_stmt_set_sysvar($5, $8); }
 	| SYSTEM '.' IDENTIFIER '=' exprs ';'
-	  { $$ = aiw_mf_stmt_sys_named_var_set($3, $5); }
+	  { $$ = aiw_mf_stmt_sys_named_var_set(mf, $3, $5); }
 	| VAR32 '[' I_CONSTANT ']' '=' expr ';'
-	  { $$ = aiw_mes_stmt_set_var32(mf_parse_u8($3), $6); }
+	  { $$ = aiw_mes_stmt_set_var32(mf_parse_u8(mf, $3), $6); }
 	| VAR32 '[' I_CONSTANT ']' ARROW BYTE '[' expr ']' '=' exprs ';'
-	  { $$ = aiw_mes_stmt_ptr_set8(mf_parse_u8($3), $8, $11); }
+	  { $$ = aiw_mes_stmt_ptr_set8(mf_parse_u8(mf, $3), $8, $11); }
 	| VAR32 '[' I_CONSTANT ']' ARROW WORD '[' expr ']' '=' exprs ';'
-	  { $$ = aiw_mes_stmt_ptr_set16(mf_parse_u8($3), $8, $11); }
+	  { $$ = aiw_mes_stmt_ptr_set16(mf_parse_u8(mf, $3), $8, $11); }
 	| JZ expr IDENTIFIER ';'
-	  { $$ = aiw_mes_stmt_jz($2); mf_push_label_ref($$, $3); }
+	  { $$ = aiw_mes_stmt_jz($2); mf_push_label_ref(mf, $$, $3); }
 	| GOTO IDENTIFIER ';'
-	  { $$ = aiw_mes_stmt_jmp(); mf_push_label_ref($$, $2); }
+	  { $$ = aiw_mes_stmt_jmp(); mf_push_label_ref(mf, $$, $2); }
 	| JUMP params ';'
 	  { $$ = _aiw_mes_stmt_call(AIW_MES_STMT_JMP_MES, $2); }
 	| CALL params ';'
-	  { $$ = aiw_mf_stmt_call($2); }
+	  { $$ = aiw_mf_stmt_call(mf, $2); }
 	| DEFPROC expr IDENTIFIER ';'
-	  { $$ = aiw_mes_stmt_defproc($2); mf_push_label_ref($$, $3); }
+	  { $$ = aiw_mes_stmt_defproc($2); mf_push_label_ref(mf, $$, $3); }
 	| MENUEXEC exprs ';'
 	  { $$ = aiw_mes_stmt_menuexec($2); }
 	| DEFMENU expr '{' cases '}'
 	  { $$ = aiw_mes_stmt_defmenu($2, $4); }
         | OP_0x35 I_CONSTANT I_CONSTANT ';'
-          { $$ = aiw_mes_stmt_0x35(mf_parse_u16($2), mf_parse_u16($3)); }
+          { $$ = aiw_mes_stmt_0x35(mf_parse_u16(mf, $2), mf_parse_u16(mf, $3)); }
         | OP_0x37 I_CONSTANT ';'
-          { $$ = aiw_mes_stmt_0x37(mf_parse_u32($2)); }
+          { $$ = aiw_mes_stmt_0x37(mf_parse_u32(mf, $2)); }
         | OP_0xFE ';'
           { $$ = aiw_mes_stmt_0xfe(); }
 	| path params ';'
-	  { $$ = aiw_mf_parse_builtin($1, $2); }
+	  { $$ = aiw_mf_parse_builtin(mf, $1, $2); }
 	;
 
 path
 	: IDENTIFIER
 	  { $$ = mf_push_qname_ident((mes_qname)vector_initializer, $1); }
 	| FUNCTION '[' I_CONSTANT ']'
-	  { $$ = mf_push_qname_number((mes_qname)vector_initializer, mf_parse_u8($3)); }
-	| path '.' IDENTIFIER
+	  { $$ = mf_push_qname_number((mes_qname)vector_initializer, mf_parse_u8(mf, $3)); }
+	| path '.' path_ident
 	  { $$ = mf_push_qname_ident($1, $3); }
 	| path '.' FUNCTION '[' I_CONSTANT ']'
-	  { $$ = mf_push_qname_number($1, mf_parse_u8($5)); }
+	  { $$ = mf_push_qname_number($1, mf_parse_u8(mf, $5)); }
+	;
+
+// keywords of structured input may still be used in qualified names
+path_ident
+	: IDENTIFIER { $$ = $1; }
+	| IF { $$ = string_new("if"); }
+	| ELSE { $$ = string_new("else"); }
+	| WHILE { $$ = string_new("while"); }
+	| CONTINUE { $$ = string_new("continue"); }
+	| BREAK { $$ = string_new("break"); }
+	| PROCEDURE { $$ = string_new("procedure"); }
 	;
 
 cases
@@ -138,15 +227,15 @@ exprs
 	;
 
 primary_expr
-	: I_CONSTANT { $$ = mf_parse_constant($1); }
+	: I_CONSTANT { $$ = mf_parse_constant(mf, $1); }
 	| VAR4 '[' expr ']' { $$ = aiw_mes_expr_var4($3); }
 	| VAR16 '[' expr ']' { $$ = aiw_mes_expr_var16($3); }
 	| SYSTEM '.' VAR16 '[' expr ']' { $$ = aiw_mes_expr_sysvar($5); }
-	| SYSTEM '.' IDENTIFIER { $$ = aiw_mf_expr_named_sysvar($3); }
-	| VAR32 '[' I_CONSTANT ']' { $$ = aiw_mes_expr_var32(mf_parse_u8($3)); }
+	| SYSTEM '.' IDENTIFIER { $$ = aiw_mf_expr_named_sysvar(mf, $3); }
+	| VAR32 '[' I_CONSTANT ']' { $$ = aiw_mes_expr_var32(mf_parse_u8(mf, $3)); }
 	| VAR32 '[' I_CONSTANT ']' ARROW BYTE '[' expr ']'
-	  { $$ = aiw_mes_expr_ptr_get8(mf_parse_u8($3), $8); }
-	| RANDOM '(' I_CONSTANT ')' { $$ = aiw_mes_expr_random(mf_parse_u16($3)); }
+	  { $$ = aiw_mes_expr_ptr_get8(mf_parse_u8(mf, $3), $8); }
+	| RANDOM '(' I_CONSTANT ')' { $$ = aiw_mes_expr_random(mf_parse_u16(mf, $3)); }
 	| '(' expr ')' { $$ = $2; }
 	;
 
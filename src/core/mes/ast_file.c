@@ -0,0 +1,634 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "nulib.h"
+#include "nulib/buffer.h"
+#include "nulib/file.h"
+#include "nulib/little_endian.h"
+#include "nulib/string.h"
+#include "nulib/vector.h"
+#include "ai5/game.h"
+
+#include "mes.h"
+
+/*
+ * Binary serialization of decompiled scripts.
+ *
+ * A file holds the ASTs of any number of scripts. Every integer is little endian, and
+ * every offset is relative to the start of the structure containing it, so that a
+ * script can be located (or the whole file mapped) without any fixups.
+ *
+ *   "MAST" version game nr_scripts
+ *   directory: name_off name_len script_off script_size   (per script)
+ *   names
+ *   scripts (4-byte aligned)
+ *
+ * A script consists of a node table, a statement table and the statements themselves,
+ * packed as mes bytecode:
+ *
+ *   nr_roots nr_nodes nr_stmts code_size
+ *   nodes: type flags pad16 address stmt nr_stmts first[0] count[0] first[1] count[1]
+ *   stmts: address flags
+ *   code
+ *
+ * The nodes of each AST block are stored contiguously, so that a block is just a range
+ * of the node table; the toplevel block is nodes [0, nr_roots). Child blocks always
+ * come after their parent node. Statement lists are likewise ranges of the statement
+ * table. The heads of conditionals, loops, procedures and menu entries (condition
+ * expression, procedure number or menu parameters) are stored as the JZ/DEF_PROC/
+ * DEF_SUB/DEF_MENU statement they were decompiled from.
+ *
+ * Statements are packed at new addresses, so their original addresses and jump target
+ * flags are recorded in the statement table. Jump operands keep their original values.
+ */
+
+#define MES_AST_FILE_MAGIC "MAST"
+#define MES_AST_FILE_VERSION 1
+
+#define HEADER_SIZE 16
+#define DIR_ENTRY_SIZE 16
+#define SCRIPT_HEADER_SIZE 16
+#define NODE_SIZE 32
+#define STMT_SIZE 8
+
+#define NODE_GOTO_TARGET 1
+#define STMT_JUMP_TARGET 1
+
+#define NO_STMT 0xffffffff
+
+struct ast_node_record {
+	uint8_t type;
+	uint8_t flags;
+	uint32_t address;
+	uint32_t stmt;
+	uint32_t nr_stmts;
+	uint32_t first[2];
+	uint32_t count[2];
+};
+
+struct ast_writer {
+	vector_t(struct ast_node_record) nodes;
+	mes_statement_list stmts;
+	// statements created to hold the heads of compound nodes
+	mes_statement_list heads;
+};
+
+void mes_ast_file_init(struct mes_ast_file *file)
+{
+	file->data = NULL;
+	file->size = 0;
+	vector_init(file->scripts);
+}
+
+void mes_ast_file_free(struct mes_ast_file *file)
+{
+	struct mes_ast_file_script *script;
+	vector_foreach_p(script, file->scripts) {
+		string_free(script->name);
+		free(script->blob);
+	}
+	vector_destroy(file->scripts);
+	free(file->data);
+	mes_ast_file_init(file);
+}
+
+// writer {{{
+
+static struct mes_statement *make_head(enum mes_virtual_op vop)
+{
+	struct mes_statement *stmt = xcalloc(1, sizeof(struct mes_statement));
+	if (game_is_aiwin())
+		stmt->aiw_op = mes_aiw_vop_to_op(vop);
+	else
+		stmt->op = mes_ai5_vop_to_op(vop);
+	return stmt;
+}
+
+static uint32_t push_stmt(struct ast_writer *w, struct mes_statement *stmt)
+{
+	vector_push(struct mes_statement*, w->stmts, stmt);
+	return vector_length(w->stmts) - 1;
+}
+
+static uint32_t push_head(struct ast_writer *w, struct mes_statement *head)
+{
+	vector_push(struct mes_statement*, w->heads, head);
+	return push_stmt(w, head);
+}
+
+static uint32_t write_block(struct ast_writer *w, mes_ast_block block);
+
+static void write_node(struct ast_writer *w, uint32_t index, struct mes_ast *node)
+{
+	struct ast_node_record rec = {
+		.type = node->type,
+		.flags = node->is_goto_target ? NODE_GOTO_TARGET : 0,
+		.address = node->address,
+		.stmt = NO_STMT,
+	};
+	struct mes_statement *head;
+	struct mes_statement *stmt;
+	switch (node->type) {
+	case MES_AST_STATEMENTS:
+		rec.stmt = vector_length(w->stmts);
+		rec.nr_stmts = vector_length(node->statements);
+		vector_foreach(stmt, node->statements) {
+			push_stmt(w, stmt);
+		}
+		break;
+	case MES_AST_COND:
+		head = make_head(VOP_JZ);
+		head->JZ.expr = node->cond.condition;
+		rec.stmt = push_head(w, head);
+		rec.count[0] = vector_length(node->cond.consequent);
+		rec.first[0] = write_block(w, node->cond.consequent);
+		rec.count[1] = vector_length(node->cond.alternative);
+		rec.first[1] = write_block(w, node->cond.alternative);
+		break;
+	case MES_AST_LOOP:
+		head = make_head(VOP_JZ);
+		head->JZ.expr = node->loop.condition;
+		rec.stmt = push_head(w, head);
+		rec.count[0] = vector_length(node->loop.body);
+		rec.first[0] = write_block(w, node->loop.body);
+		break;
+	case MES_AST_PROCEDURE:
+	case MES_AST_SUB:
+		head = make_head(node->type == MES_AST_SUB ? VOP_DEF_SUB : VOP_DEF_PROC);
+		head->DEF_PROC.no_expr = node->proc.num_expr;
+		rec.stmt = push_head(w, head);
+		rec.count[0] = vector_length(node->proc.body);
+		rec.first[0] = write_block(w, node->proc.body);
+		break;
+	case MES_AST_MENU_ENTRY:
+		head = make_head(VOP_DEF_MENU);
+		head->DEF_MENU.params = node->menu.params;
+		rec.stmt = push_head(w, head);
+		rec.count[0] = vector_length(node->menu.body);
+		rec.first[0] = write_block(w, node->menu.body);
+		break;
+	case MES_AST_CONTINUE:
+	case MES_AST_BREAK:
+		break;
+	}
+	// child blocks may have reallocated the node table
+	vector_A(w->nodes, index) = rec;
+}
+
+// reserve a contiguous range of the node table for a block
+static uint32_t write_block(struct ast_writer *w, mes_ast_block block)
+{
+	uint32_t first = vector_length(w->nodes);
+	for (unsigned i = 0; i < vector_length(block); i++) {
+		struct ast_node_record rec = {0};
+		vector_push(struct ast_node_record, w->nodes, rec);
+	}
+	for (unsigned i = 0; i < vector_length(block); i++) {
+		write_node(w, first + i, vector_A(block, i));
+	}
+	return first;
+}
+
+static void pack_statements(mes_statement_list stmts, struct buffer *out)
+{
+	// the statement table records the original layout
+	unsigned nr_stmts = vector_length(stmts);
+	uint32_t (*layout)[2] = xcalloc(nr_stmts ? nr_stmts : 1, sizeof(*layout));
+	for (unsigned i = 0; i < nr_stmts; i++) {
+		struct mes_statement *stmt = vector_A(stmts, i);
+		layout[i][0] = stmt->address;
+		layout[i][1] = stmt->next_address;
+		buffer_write_u32(out, stmt->address);
+		buffer_write_u32(out, stmt->is_jump_target ? STMT_JUMP_TARGET : 0);
+	}
+
+	size_t code_size;
+	mes_statement_list_assign_addresses(stmts);
+	uint8_t *code = mes_pack(stmts, &code_size);
+
+	for (unsigned i = 0; i < nr_stmts; i++) {
+		vector_A(stmts, i)->address = layout[i][0];
+		vector_A(stmts, i)->next_address = layout[i][1];
+	}
+	free(layout);
+
+	buffer_write_u32_at(out, 12, code_size);
+	buffer_write_bytes(out, code, code_size);
+	free(code);
+}
+
+/*
+ * Serialize the AST of a script and add it to the file. The AST is left unchanged.
+ */
+void mes_ast_file_add_script(struct mes_ast_file *file, const char *name, mes_ast_block block)
+{
+	struct ast_writer w = {
+		.nodes = vector_initializer,
+		.stmts = vector_initializer,
+		.heads = vector_initializer,
+	};
+	write_block(&w, block);
+
+	struct buffer out;
+	buffer_init(&out, NULL, 0);
+	buffer_write_u32(&out, vector_length(block));
+	buffer_write_u32(&out, vector_length(w.nodes));
+	buffer_write_u32(&out, vector_length(w.stmts));
+	buffer_write_u32(&out, 0);
+
+	struct ast_node_record *rec;
+	vector_foreach_p(rec, w.nodes) {
+		buffer_write_u8(&out, rec->type);
+		buffer_write_u8(&out, rec->flags);
+		buffer_write_u16(&out, 0);
+		buffer_write_u32(&out, rec->address);
+		buffer_write_u32(&out, rec->stmt);
+		buffer_write_u32(&out, rec->nr_stmts);
+		buffer_write_u32(&out, rec->first[0]);
+		buffer_write_u32(&out, rec->count[0]);
+		buffer_write_u32(&out, rec->first[1]);
+		buffer_write_u32(&out, rec->count[1]);
+	}
+	pack_statements(w.stmts, &out);
+
+	// the head statements only borrowed their operands
+	struct mes_statement *head;
+	vector_foreach(head, w.heads) {
+		free(head);
+	}
+	vector_destroy(w.heads);
+	vector_destroy(w.stmts);
+	vector_destroy(w.nodes);
+
+	struct mes_ast_file_script script = {
+		.name = string_new(name),
+		.blob = out.buf,
+		.size = out.index,
+	};
+	vector_push(struct mes_ast_file_script, file->scripts, script);
+}
+
+static void pad4(struct buffer *out)
+{
+	while (out->index & 3)
+		buffer_write_u8(out, 0);
+}
+
+static const uint8_t *script_data(struct mes_ast_file *file, struct mes_ast_file_script *script)
+{
+	return script->blob ? script->blob : file->data + script->offset;
+}
+
+bool mes_ast_file_write(struct mes_ast_file *file, const char *path)
+{
+	struct buffer out;
+	buffer_init(&out, NULL, 0);
+	buffer_write_bytes(&out, (uint8_t*)MES_AST_FILE_MAGIC, 4);
+	buffer_write_u32(&out, MES_AST_FILE_VERSION);
+	buffer_write_u32(&out, ai5_target_game);
+	buffer_write_u32(&out, vector_length(file->scripts));
+
+	// directory
+	uint32_t name_off = HEADER_SIZE + vector_length(file->scripts) * DIR_ENTRY_SIZE;
+	uint32_t script_off = name_off;
+	struct mes_ast_file_script *script;
+	vector_foreach_p(script, file->scripts) {
+		script_off += string_length(script->name);
+	}
+	script_off = (script_off + 3) & ~3u;
+	vector_foreach_p(script, file->scripts) {
+		buffer_write_u32(&out, name_off);
+		buffer_write_u32(&out, string_length(script->name));
+		buffer_write_u32(&out, script_off);
+		buffer_write_u32(&out, script->size);
+		name_off += string_length(script->name);
+		script_off += (script->size + 3) & ~3u;
+	}
+
+	vector_foreach_p(script, file->scripts) {
+		buffer_write_bytes(&out, (uint8_t*)script->name, string_length(script->name));
+	}
+	pad4(&out);
+	vector_foreach_p(script, file->scripts) {
+		buffer_write_bytes(&out, script_data(file, script), script->size);
+		pad4(&out);
+	}
+
+	bool r = file_write(path, out.buf, out.index);
+	free(out.buf);
+	return r;
+}
+
+// writer }}}
+// reader {{{
+
+// returns true if `path` is an AST file (of any version, for any game)
+bool mes_ast_file_is_ast(const char *path)
+{
+	FILE *f = file_open_utf8(path, "rb");
+	if (!f)
+		return false;
+	char magic[4];
+	bool r = fread(magic, 4, 1, f) == 1 && !memcmp(magic, MES_AST_FILE_MAGIC, 4);
+	fclose(f);
+	return r;
+}
+
+/*
+ * Read an AST file. Only the directory is decoded; scripts are loaded on demand with
+ * `mes_ast_file_load`.
+ */
+bool mes_ast_file_read(struct mes_ast_file *file, const char *path)
+{
+	mes_ast_file_init(file);
+
+	size_t size;
+	uint8_t *data = file_read(path, &size);
+	if (!data)
+		return false;
+	if (size < HEADER_SIZE || memcmp(data, MES_AST_FILE_MAGIC, 4)) {
+		free(data);
+		return false;
+	}
+	if (le_get32(data, 4) != MES_AST_FILE_VERSION) {
+		WARNING("AST file \"%s\" has an unsupported version", path);
+		free(data);
+		return false;
+	}
+	if (le_get32(data, 8) != ai5_target_game) {
+		WARNING("AST file \"%s\" was created for a different game", path);
+		free(data);
+		return false;
+	}
+
+	file->data = data;
+	file->size = size;
+	uint32_t nr_scripts = le_get32(data, 12);
+	if ((size - HEADER_SIZE) / DIR_ENTRY_SIZE < nr_scripts)
+		goto error;
+	for (uint32_t i = 0; i < nr_scripts; i++) {
+		size_t pos = HEADER_SIZE + i * DIR_ENTRY_SIZE;
+		uint32_t name_off = le_get32(data, pos);
+		uint32_t name_len = le_get32(data, pos + 4);
+		struct mes_ast_file_script script = {
+			.offset = le_get32(data, pos + 8),
+			.size = le_get32(data, pos + 12),
+		};
+		if (name_off > size || size - name_off < name_len
+				|| script.offset > size || size - script.offset < script.size
+				|| (script.offset & 3))
+			goto error;
+		script.name = string_new_len((char*)data + name_off, name_len);
+		vector_push(struct mes_ast_file_script, file->scripts, script);
+	}
+	return true;
+error:
+	WARNING("Corrupt AST file: %s", path);
+	mes_ast_file_free(file);
+	return false;
+}
+
+int mes_ast_file_find(struct mes_ast_file *file, const char *name)
+{
+	for (unsigned i = 0; i < vector_length(file->scripts); i++) {
+		if (!strcasecmp(vector_A(file->scripts, i).name, name))
+			return i;
+	}
+	return -1;
+}
+
+struct ast_reader {
+	const uint8_t *nodes;
+	uint32_t nr_nodes;
+	mes_statement_list stmts;
+	// statements already claimed by a node
+	bool *used;
+};
+
+static bool stmt_available(struct ast_reader *r, uint32_t i)
+{
+	return i < vector_length(r->stmts) && !r->used[i];
+}
+
+static struct mes_statement *take_stmt(struct ast_reader *r, uint32_t i)
+{
+	r->used[i] = true;
+	return vector_A(r->stmts, i);
+}
+
+static enum mes_virtual_op node_head_vop(enum mes_ast_type type)
+{
+	switch (type) {
+	case MES_AST_COND:
+	case MES_AST_LOOP:
+		return VOP_JZ;
+	case MES_AST_PROCEDURE:
+		return VOP_DEF_PROC;
+	case MES_AST_SUB:
+		return VOP_DEF_SUB;
+	case MES_AST_MENU_ENTRY:
+		return VOP_DEF_MENU;
+	default:
+		return VOP_OTHER;
+	}
+}
+
+static bool read_block(struct ast_reader *r, uint32_t parent, uint32_t first, uint32_t count,
+		mes_ast_block *out);
+
+/*
+ * Read a node from the node table. The node is validated before it claims any
+ * statements, so that on failure everything read so far is owned either by the
+ * (partial) AST or by the statement list.
+ */
+static struct mes_ast *read_node(struct ast_reader *r, uint32_t index)
+{
+	const uint8_t *rec = r->nodes + index * NODE_SIZE;
+	enum mes_ast_type type = rec[0];
+	uint32_t stmt_no = le_get32(rec, 8);
+	uint32_t nr_stmts = le_get32(rec, 12);
+	uint32_t first[2] = { le_get32(rec, 16), le_get32(rec, 24) };
+	uint32_t count[2] = { le_get32(rec, 20), le_get32(rec, 28) };
+
+	if (type > MES_AST_BREAK)
+		return NULL;
+
+	struct mes_statement *head = NULL;
+	if (type == MES_AST_STATEMENTS) {
+		if (nr_stmts > vector_length(r->stmts))
+			return NULL;
+		for (uint32_t i = 0; i < nr_stmts; i++) {
+			if (!stmt_available(r, stmt_no + i))
+				return NULL;
+		}
+	} else if (node_head_vop(type) != VOP_OTHER) {
+		if (!stmt_available(r, stmt_no))
+			return NULL;
+		head = vector_A(r->stmts, stmt_no);
+		enum mes_virtual_op vop = game_is_aiwin() ? mes_aiw_vop(head) : mes_ai5_vop(head);
+		if (vop != node_head_vop(type))
+			return NULL;
+		take_stmt(r, stmt_no);
+	}
+
+	struct mes_ast *node = xcalloc(1, sizeof(struct mes_ast));
+	node->type = type;
+	node->is_goto_target = rec[1] & NODE_GOTO_TARGET;
+	node->address = le_get32(rec, 4);
+
+	bool ok = true;
+	switch (type) {
+	case MES_AST_STATEMENTS:
+		vector_init(node->statements);
+		for (uint32_t i = 0; i < nr_stmts; i++) {
+			vector_push(struct mes_statement*, node->statements,
+					take_stmt(r, stmt_no + i));
+		}
+		break;
+	case MES_AST_COND:
+		node->cond.condition = head->JZ.expr;
+		ok = read_block(r, index, first[0], count[0], &node->cond.consequent)
+			&& read_block(r, index, first[1], count[1], &node->cond.alternative);
+		break;
+	case MES_AST_LOOP:
+		node->loop.condition = head->JZ.expr;
+		ok = read_block(r, index, first[0], count[0], &node->loop.body);
+		break;
+	case MES_AST_PROCEDURE:
+	case MES_AST_SUB:
+		node->proc.num_expr = head->DEF_PROC.no_expr;
+		ok = read_block(r, index, first[0], count[0], &node->proc.body);
+		break;
+	case MES_AST_MENU_ENTRY:
+		node->menu.params = head->DEF_MENU.params;
+		ok = read_block(r, index, first[0], count[0], &node->menu.body);
+		break;
+	case MES_AST_CONTINUE:
+	case MES_AST_BREAK:
+		break;
+	}
+	// operands now belong to the node
+	free(head);
+
+	if (!ok) {
+		mes_ast_free(node);
+		return NULL;
+	}
+	return node;
+}
+
+static bool read_block(struct ast_reader *r, uint32_t parent, uint32_t first, uint32_t count,
+		mes_ast_block *out)
+{
+	vector_init(*out);
+	if (count == 0)
+		return true;
+	// child blocks come after their parent, which rules out cycles
+	if (first <= parent || first > r->nr_nodes || r->nr_nodes - first < count)
+		return false;
+	for (uint32_t i = 0; i < count; i++) {
+		struct mes_ast *node = read_node(r, first + i);
+		if (!node)
+			return false;
+		vector_push(struct mes_ast*, *out, node);
+	}
+	return true;
+}
+
+/*
+ * Load the AST of a script from an AST file.
+ */
+bool mes_ast_file_load(struct mes_ast_file *file, unsigned no, mes_ast_block *out)
+{
+	if (no >= vector_length(file->scripts))
+		return false;
+	struct mes_ast_file_script *script = &vector_A(file->scripts, no);
+	const uint8_t *data = script_data(file, script);
+	if (script->size < SCRIPT_HEADER_SIZE)
+		goto error;
+
+	uint32_t nr_roots = le_get32(data, 0);
+	uint32_t nr_nodes = le_get32(data, 4);
+	uint32_t nr_stmts = le_get32(data, 8);
+	uint32_t code_size = le_get32(data, 12);
+	size_t avail = script->size - SCRIPT_HEADER_SIZE;
+	if (nr_roots > nr_nodes || avail / NODE_SIZE < nr_nodes)
+		goto error;
+	avail -= nr_nodes * NODE_SIZE;
+	if (avail / STMT_SIZE < nr_stmts)
+		goto error;
+	avail -= nr_stmts * STMT_SIZE;
+	if (avail < code_size)
+		goto error;
+
+	const uint8_t *stmt_table = data + SCRIPT_HEADER_SIZE + nr_nodes * NODE_SIZE;
+	uint8_t *code = (uint8_t*)stmt_table + nr_stmts * STMT_SIZE;
+	struct ast_reader r = {
+		.nodes = data + SCRIPT_HEADER_SIZE,
+		.nr_nodes = nr_nodes,
+		.stmts = vector_initializer,
+	};
+	mes_clear_labels();
+	if (!mes_parse_statements(code, code_size, &r.stmts))
+		goto error;
+	if (vector_length(r.stmts) != nr_stmts) {
+		mes_statement_list_free(r.stmts);
+		goto error;
+	}
+
+	// restore the original layout
+	for (uint32_t i = 0; i < nr_stmts; i++) {
+		struct mes_statement *stmt = vector_A(r.stmts, i);
+		uint32_t size = stmt->next_address - stmt->address;
+		stmt->address = le_get32(stmt_table, i * STMT_SIZE);
+		stmt->next_address = stmt->address + size;
+		stmt->is_jump_target = le_get32(stmt_table, i * STMT_SIZE + 4) & STMT_JUMP_TARGET;
+	}
+
+	// the toplevel block has no parent node, so any range is valid for its children
+	r.used = xcalloc(nr_stmts ? nr_stmts : 1, sizeof(bool));
+	mes_ast_block block = vector_initializer;
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < nr_roots; i++) {
+		struct mes_ast *node = read_node(&r, i);
+		if (node)
+			vector_push(struct mes_ast*, block, node);
+		else
+			ok = false;
+	}
+	for (uint32_t i = 0; i < nr_stmts; i++) {
+		if (!r.used[i])
+			mes_statement_free(vector_A(r.stmts, i));
+	}
+	free(r.used);
+	vector_destroy(r.stmts);
+	if (!ok) {
+		mes_ast_block_free(block);
+		goto error;
+	}
+	*out = block;
+	return true;
+error:
+	WARNING("Corrupt script in AST file: %s", script->name);
+	return false;
+}
+
+// reader }}}
@@ -0,0 +1,334 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "nulib.h"
+#include "nulib/vector.h"
+#include "ai5/game.h"
+
+#include "mes.h"
+
+/*
+ * Lowering of structured mes (mes_ast) to a flat statement list.
+ *
+ * Code is generated in a single pass over the AST. Statements are placed as they are
+ * emitted, so the address of every backward jump target is already known. Forward
+ * jumps (to the end of an if/else, out of a loop, or past a procedure body) are
+ * collected in backpatch lists and patched once their target is placed.
+ *
+ *   if (c) { A } else { B }     JZ c, L1; A; JMP L2; L1: B; L2:
+ *   while (c) { A }             L1: JZ c, L2; A; JMP L1; L2:
+ *   procedure[n] = { A };       DEF_PROC n, L1; A; END; L1:
+ */
+
+typedef vector_t(struct mes_statement*) patch_list;
+
+struct loop_context {
+	uint32_t head;
+	patch_list breaks;
+	struct loop_context *outer;
+};
+
+struct codegen {
+	mes_statement_list out;
+	uint32_t addr;
+	// address most recently targeted by a jump
+	uint32_t target;
+	struct loop_context *loop;
+	void (*label)(struct mes_ast*, struct mes_statement*, void*);
+	void *data;
+	// set when the AST contains a construct that cannot be compiled
+	bool error;
+};
+
+static enum mes_virtual_op vop(struct mes_statement *stmt)
+{
+	return game_is_aiwin() ? mes_aiw_vop(stmt) : mes_ai5_vop(stmt);
+}
+
+static void emit(struct codegen *cg, struct mes_statement *stmt)
+{
+	cg->addr = mes_statement_place(stmt, cg->addr);
+	vector_push(struct mes_statement*, cg->out, stmt);
+}
+
+static struct mes_statement *last_stmt(struct codegen *cg)
+{
+	if (vector_empty(cg->out))
+		return NULL;
+	return vector_A(cg->out, vector_length(cg->out) - 1);
+}
+
+static void set_target(struct mes_statement *stmt, uint32_t addr)
+{
+	switch (vop(stmt)) {
+	case VOP_JZ:
+		stmt->JZ.addr = addr;
+		break;
+	case VOP_JMP:
+		stmt->JMP.addr = addr;
+		break;
+	case VOP_DEF_PROC:
+	case VOP_DEF_SUB:
+		stmt->DEF_PROC.skip_addr = addr;
+		break;
+	case VOP_DEF_MENU:
+		stmt->DEF_MENU.skip_addr = addr;
+		break;
+	default:
+		ERROR("invalid opcode for jump target: %d", stmt->op);
+	}
+}
+
+// resolve a backpatch list to the current address
+static void patch(struct codegen *cg, patch_list *list)
+{
+	struct mes_statement *stmt;
+	vector_foreach(stmt, *list) {
+		set_target(stmt, cg->addr);
+		cg->target = cg->addr;
+	}
+	vector_destroy(*list);
+	vector_init(*list);
+}
+
+static struct mes_statement *stmt_jz(struct mes_expression *cond)
+{
+	return game_is_aiwin() ? aiw_mes_stmt_jz(cond) : mes_stmt_jz(cond);
+}
+
+static struct mes_statement *stmt_jmp(void)
+{
+	return game_is_aiwin() ? aiw_mes_stmt_jmp() : mes_stmt_jmp();
+}
+
+static struct mes_statement *stmt_end(void)
+{
+	return game_is_aiwin() ? aiw_mes_stmt_end() : mes_stmt_end();
+}
+
+static void emit_jmp(struct codegen *cg, uint32_t addr)
+{
+	struct mes_statement *jmp = stmt_jmp();
+	jmp->JMP.addr = addr;
+	cg->target = addr;
+	emit(cg, jmp);
+}
+
+// true if control cannot fall through the last statement emitted since `start`
+static bool ends_in_jump(struct codegen *cg, unsigned start)
+{
+	if (vector_length(cg->out) <= start)
+		return false;
+	enum mes_virtual_op op = vop(last_stmt(cg));
+	return op == VOP_JMP || op == VOP_END;
+}
+
+// END, unless control cannot reach the current address
+static void emit_end(struct codegen *cg, unsigned start)
+{
+	struct mes_statement *last = last_stmt(cg);
+	if (vector_length(cg->out) > start && vop(last) == VOP_END && cg->target != cg->addr)
+		return;
+	emit(cg, stmt_end());
+}
+
+static void emit_block(struct codegen *cg, mes_ast_block block);
+
+// report an invalid node; compilation continues, but fails at the end
+static void invalid_node(struct codegen *cg, const char *msg)
+{
+	WARNING("%s", msg);
+	cg->error = true;
+}
+
+static void emit_compound(struct codegen *cg, struct mes_statement *head, mes_ast_block body)
+{
+	patch_list skip = vector_initializer;
+	vector_push(struct mes_statement*, skip, head);
+	emit(cg, head);
+
+	// loops do not extend into procedures
+	struct loop_context *loop = cg->loop;
+	cg->loop = NULL;
+	unsigned start = vector_length(cg->out);
+	emit_block(cg, body);
+	emit_end(cg, start);
+	cg->loop = loop;
+
+	patch(cg, &skip);
+}
+
+static void emit_cond(struct codegen *cg, struct mes_ast_if *cond)
+{
+	patch_list next = vector_initializer;
+	patch_list end = vector_initializer;
+
+	struct mes_statement *jz = stmt_jz(cond->condition);
+	vector_push(struct mes_statement*, next, jz);
+	emit(cg, jz);
+
+	unsigned start = vector_length(cg->out);
+	emit_block(cg, cond->consequent);
+	if (!vector_empty(cond->alternative) && !ends_in_jump(cg, start)) {
+		struct mes_statement *jmp = stmt_jmp();
+		vector_push(struct mes_statement*, end, jmp);
+		emit(cg, jmp);
+	}
+	patch(cg, &next);
+	emit_block(cg, cond->alternative);
+	patch(cg, &end);
+}
+
+static void emit_loop(struct codegen *cg, struct mes_ast_while *loop)
+{
+	struct loop_context ctx = {
+		.head = cg->addr,
+		.breaks = vector_initializer,
+		.outer = cg->loop,
+	};
+	cg->target = cg->addr;
+
+	struct mes_statement *jz = stmt_jz(loop->condition);
+	vector_push(struct mes_statement*, ctx.breaks, jz);
+	emit(cg, jz);
+
+	cg->loop = &ctx;
+	unsigned start = vector_length(cg->out);
+	emit_block(cg, loop->body);
+	cg->loop = ctx.outer;
+
+	if (!ends_in_jump(cg, start))
+		emit_jmp(cg, ctx.head);
+	patch(cg, &ctx.breaks);
+}
+
+static void emit_node(struct codegen *cg, struct mes_ast *node)
+{
+	unsigned start = vector_length(cg->out);
+	struct mes_statement *stmt;
+	switch (node->type) {
+	case MES_AST_STATEMENTS:
+		vector_foreach(stmt, node->statements) {
+			emit(cg, stmt);
+		}
+		vector_destroy(node->statements);
+		break;
+	case MES_AST_COND:
+		emit_cond(cg, &node->cond);
+		break;
+	case MES_AST_LOOP:
+		emit_loop(cg, &node->loop);
+		break;
+	case MES_AST_PROCEDURE:
+		stmt = game_is_aiwin() ? aiw_mes_stmt_defproc(node->proc.num_expr)
+			: mes_stmt_procd(node->proc.num_expr);
+		emit_compound(cg, stmt, node->proc.body);
+		break;
+	case MES_AST_SUB:
+		if (game_is_aiwin()) {
+			invalid_node(cg, "sub is not supported for this game");
+			break;
+		}
+		emit_compound(cg, mes_stmt_defsub(node->proc.num_expr), node->proc.body);
+		break;
+	case MES_AST_MENU_ENTRY:
+		if (game_is_aiwin()) {
+			invalid_node(cg, "menu entries are not supported for this game");
+			break;
+		}
+		emit_compound(cg, mes_stmt_menui(node->menu.params), node->menu.body);
+		break;
+	case MES_AST_CONTINUE:
+		if (!cg->loop) {
+			invalid_node(cg, "continue outside of loop");
+			break;
+		}
+		emit_jmp(cg, cg->loop->head);
+		break;
+	case MES_AST_BREAK:
+		if (!cg->loop) {
+			invalid_node(cg, "break outside of loop");
+			break;
+		}
+		stmt = stmt_jmp();
+		vector_push(struct mes_statement*, cg->loop->breaks, stmt);
+		emit(cg, stmt);
+		break;
+	}
+	if (node->is_goto_target && cg->label && vector_length(cg->out) > start)
+		cg->label(node, vector_A(cg->out, start), cg->data);
+}
+
+static void emit_block(struct codegen *cg, mes_ast_block block)
+{
+	struct mes_ast *node;
+	vector_foreach(node, block) {
+		emit_node(cg, node);
+		// block vectors are destroyed below; statements and operands now belong
+		// to the output list
+		switch (node->type) {
+		case MES_AST_COND:
+			vector_destroy(node->cond.consequent);
+			vector_destroy(node->cond.alternative);
+			break;
+		case MES_AST_LOOP:
+			vector_destroy(node->loop.body);
+			break;
+		case MES_AST_PROCEDURE:
+		case MES_AST_SUB:
+			vector_destroy(node->proc.body);
+			break;
+		case MES_AST_MENU_ENTRY:
+			vector_destroy(node->menu.body);
+			break;
+		default:
+			break;
+		}
+		free(node);
+	}
+}
+
+/*
+ * Compile an AST to a list of statements, with addresses assigned and all jumps
+ * generated for control flow resolved. The AST is consumed.
+ *
+ * If `label` is given, it is called for each goto target node with the first statement
+ * generated for that node (after the node's body has been compiled).
+ *
+ * Returns false if the AST contains invalid nodes (e.g. a break outside of a loop).
+ */
+bool mes_ast_compile(mes_ast_block toplevel, mes_statement_list *out,
+		void (*label)(struct mes_ast*, struct mes_statement*, void*), void *data)
+{
+	struct codegen cg = {
+		.out = vector_initializer,
+		.target = 0xffffffff,
+		.label = label,
+		.data = data,
+	};
+	emit_block(&cg, toplevel);
+	vector_destroy(toplevel);
+	// the decompiler drops the final END
+	emit_end(&cg, 0);
+	if (cg.error) {
+		mes_statement_list_free(cg.out);
+		return false;
+	}
+	*out = cg.out;
+	return true;
+}
@@ -1062,6 +1062,180 @@ bool mes_decompile_debug(uint8_t *data, size_t data_size, mes_block_list *out)
 	return true;
 }
 
+static enum mes_ast_type compound_ast_type(struct mes_block *block)
+{
+	switch (vop(block->compound.head)) {
+	case VOP_DEF_PROC: return MES_AST_PROCEDURE;
+	case VOP_DEF_SUB: return MES_AST_SUB;
+	default: return MES_AST_MENU_ENTRY;
+	}
+}
+
+static void lazy_add_entries(struct mes_lazy *lazy, struct mes_block *block, int parent)
+{
+	for (unsigned i = 0; i < vector_length(block->compound.blocks); i++) {
+		struct mes_block *child = vector_A(block->compound.blocks, i);
+		if (child->type != MES_BLOCK_COMPOUND)
+			continue;
+		int no = vector_length(lazy->entries);
+		struct mes_lazy_entry entry = {
+			.type = compound_ast_type(child),
+			.address = child->address,
+			.end_address = child->compound.end_address,
+			.parent = parent,
+			.block = parent < 0 ? child : NULL,
+			.slot = i,
+		};
+		vector_push(struct mes_lazy_entry, lazy->entries, entry);
+		lazy_add_entries(lazy, child, no);
+	}
+}
+
+/*
+ * Split a .mes file into procedures/menu entries without analyzing their
+ * control flow. This is only pass 1 of the CFG construction process; the
+ * remaining passes are run per entry by mes_lazy_decompile.
+ */
+bool mes_lazy_init(uint8_t *data, size_t data_size, struct mes_lazy *out)
+{
+	vop_init();
+	*out = (struct mes_lazy) { .toplevel = { .type = MES_BLOCK_COMPOUND } };
+
+	mes_statement_list statements = vector_initializer;
+	if (!(mes_parse_statements(data, data_size, &statements)))
+		return false;
+
+	cfg_create_compound_blocks(&out->toplevel, statements);
+	lazy_add_entries(out, &out->toplevel, -1);
+	return true;
+}
+
+/*
+ * Run passes 2-5 of the CFG construction process and the AST phase on a single
+ * (detached) compound block.
+ */
+static struct mes_ast *decompile_compound(struct mes_block *block)
+{
+	block->parent = NULL;
+	cfg_create_basic_blocks(block);
+	cfg_create_graph(&block->compound);
+	cfg_dom(&block->compound);
+	check_compound_block(block);
+
+	mes_ast_block ast = vector_initializer;
+	mes_block_list frontier = vector_initializer;
+	ast_create_node(&ast, NULL, block, frontier);
+	leak_check(&block->compound, 0);
+	ast_simplify(ast);
+
+	// XXX: the detached block has no post-order number; it's not dead code
+	block->post = 0;
+	_mes_block_free(block, false);
+	free(block);
+
+	assert(vector_length(ast) == 1);
+	struct mes_ast *node = vector_A(ast, 0);
+	vector_destroy(ast);
+	return node;
+}
+
+// find the AST nodes of nested entries within their toplevel entry's AST
+static void lazy_link_entries(struct mes_lazy *lazy, unsigned root, mes_ast_block block)
+{
+	struct mes_ast *node;
+	vector_foreach(node, block) {
+		switch (node->type) {
+		case MES_AST_COND:
+			lazy_link_entries(lazy, root, node->cond.consequent);
+			lazy_link_entries(lazy, root, node->cond.alternative);
+			break;
+		case MES_AST_LOOP:
+			lazy_link_entries(lazy, root, node->loop.body);
+			break;
+		case MES_AST_PROCEDURE:
+		case MES_AST_SUB:
+		case MES_AST_MENU_ENTRY:
+			for (unsigned i = root + 1; i < vector_length(lazy->entries); i++) {
+				struct mes_lazy_entry *e = &vector_A(lazy->entries, i);
+				if (e->parent < 0)
+					break;
+				if (e->address == node->address) {
+					e->ast = node;
+					break;
+				}
+			}
+			if (node->type == MES_AST_MENU_ENTRY)
+				lazy_link_entries(lazy, root, node->menu.body);
+			else
+				lazy_link_entries(lazy, root, node->proc.body);
+			break;
+		case MES_AST_STATEMENTS:
+		case MES_AST_CONTINUE:
+		case MES_AST_BREAK:
+			break;
+		}
+	}
+}
+
+/*
+ * Decompile a single procedure/menu entry. Nested entries are decompiled along
+ * with the toplevel entry containing them. The returned AST is owned by `lazy`
+ * and remains valid until mes_lazy_free is called.
+ */
+struct mes_ast *mes_lazy_decompile(struct mes_lazy *lazy, unsigned entry)
+{
+	assert(entry < vector_length(lazy->entries));
+	struct mes_lazy_entry *e = &vector_A(lazy->entries, entry);
+	if (e->ast)
+		return e->ast;
+
+	unsigned root = entry;
+	while (vector_A(lazy->entries, root).parent >= 0)
+		root = vector_A(lazy->entries, root).parent;
+
+	struct mes_lazy_entry *r = &vector_A(lazy->entries, root);
+	if (!r->ast) {
+		vop_init();
+		vector_A(lazy->toplevel.compound.blocks, r->slot) = NULL;
+		r->ast = decompile_compound(r->block);
+		r->block = NULL;
+		lazy_link_entries(lazy, root, r->ast->type == MES_AST_MENU_ENTRY
+				? r->ast->menu.body : r->ast->proc.body);
+	}
+
+	// NOTE: may be NULL if the entry is unreachable from its parent
+	return e->ast;
+}
+
+/*
+ * Find the entry starting at the given address. Returns -1 if there is none.
+ */
+int mes_lazy_find(struct mes_lazy *lazy, uint32_t address)
+{
+	for (unsigned i = 0; i < vector_length(lazy->entries); i++) {
+		if (vector_A(lazy->entries, i).address == address)
+			return i;
+	}
+	return -1;
+}
+
+void mes_lazy_free(struct mes_lazy *lazy)
+{
+	for (unsigned i = 0; i < vector_length(lazy->entries); i++) {
+		struct mes_lazy_entry *e = &vector_A(lazy->entries, i);
+		if (e->parent < 0 && e->ast)
+			mes_ast_free(e->ast);
+	}
+	vector_destroy(lazy->entries);
+
+	struct mes_block *block;
+	vector_foreach(block, lazy->toplevel.compound.blocks) {
+		if (block)
+			mes_block_free(block);
+	}
+	vector_destroy(lazy->toplevel.compound.blocks);
+}
+
 void mes_ast_free(struct mes_ast *node)
 {
 	switch (node->type) {
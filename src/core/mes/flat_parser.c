@@ -14,6 +14,7 @@
  * along with this program; if not, see <http://gnu.org/licenses/>.
  */
 
+#include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
@@ -30,21 +31,44 @@
 
 #include "flat_parser.h"
 
-extern int mf_lineno;
-extern int aiw_mf_lineno;
-
-#define MF_LINENO (game_is_aiwin() ? aiw_mf_lineno : mf_lineno)
-
 #define PARSE_ERROR(fmt, ...) \
-	sys_error("ERROR: At line %d: " fmt "\n", MF_LINENO, ##__VA_ARGS__)
+	mf_parse_error(mf, "At line %d: " fmt, mf->get_lineno(mf->scanner), ##__VA_ARGS__)
 
-mes_statement_list mf_parsed_code = vector_initializer;
+// reentrant scanner/parser interfaces
+int mf_lex_init_extra(struct mf_state *mf, void **scanner);
+void mf_set_in(FILE *in, void *scanner);
+int mf_get_lineno(void *scanner);
+int mf_lex_destroy(void *scanner);
+int mf_parse(void *scanner, struct mf_state *mf);
 
-extern FILE *mf_in;
-int mf_parse(void);
+int aiw_mf_lex_init_extra(struct mf_state *mf, void **scanner);
+void aiw_mf_set_in(FILE *in, void *scanner);
+int aiw_mf_get_lineno(void *scanner);
+int aiw_mf_lex_destroy(void *scanner);
+int aiw_mf_parse(void *scanner, struct mf_state *mf);
 
-extern FILE *aiw_mf_in;
-int aiw_mf_parse(void);
+define_hashtable_string(label_table, struct mes_statement*);
+
+/*
+ * Report an error and fail the parse. The caller continues with a placeholder
+ * result; the scanner then reports end of input, so that the parser unwinds its
+ * stack (freeing partial results via %destructor) and _mes_flat_parse fails without
+ * affecting the rest of the process (e.g. a batch compile continues with the next
+ * file). Only the first error is reported.
+ */
+static void mf_parse_error(struct mf_state *mf, const char *fmt, ...)
+{
+	if (mf->failed)
+		return;
+	mf->failed = true;
+
+	char buf[1024];
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	sys_warning("ERROR: %s\n", buf);
+}
 
 static FILE *open_file(const char *file)
 {
@@ -52,92 +76,133 @@ static FILE *open_file(const char *file)
 		return stdin;
 	FILE *f = file_open_utf8(file, "rb");
 	if (!f)
-		ERROR("Opening input file '%s': %s", file, strerror(errno));
+		WARNING("Opening input file '%s': %s", file, strerror(errno));
 	return f;
 }
 
+static void mf_state_destroy(struct mf_state *mf)
+{
+	struct label_ref *ref;
+	vector_foreach_p(ref, mf->label_refs) {
+		string_free(ref->name);
+	}
+	vector_destroy(mf->label_refs);
+	hashtable_destroy(label_table, &mf->labels);
+	string name;
+	vector_foreach(name, mf->label_names) {
+		string_free(name);
+	}
+	vector_destroy(mf->label_names);
+	vector_foreach(name, mf->node_labels) {
+		if (name)
+			string_free(name);
+	}
+	vector_destroy(mf->node_labels);
+}
+
 extern int aiw_mf_debug;
 
-static mes_statement_list aiw_mes_flat_parse(const char *path)
+static bool _mes_flat_parse(const char *path, bool structured, mes_statement_list *out)
 {
 	//aiw_mf_debug = 1;
-	mf_parsed_code = (mes_statement_list) vector_initializer;
-
-	aiw_mf_in = open_file(path);
-	if (aiw_mf_parse())
-		ERROR("Failed to parse file: %s", path);
-
-	if (aiw_mf_in != stdin)
-		fclose(aiw_mf_in);
-	aiw_mf_in = NULL;
+	bool aiwin = game_is_aiwin();
+	struct mf_state mf = {
+		.get_lineno = aiwin ? aiw_mf_get_lineno : mf_get_lineno,
+		.labels = hashtable_initializer(label_table),
+		.label_names = vector_initializer,
+		.label_refs = vector_initializer,
+		.program = vector_initializer,
+		.structured = structured,
+		.node_labels = vector_initializer,
+	};
+
+	FILE *in = open_file(path);
+	if (!in)
+		return false;
+
+	if (aiwin) {
+		aiw_mf_lex_init_extra(&mf, &mf.scanner);
+		aiw_mf_set_in(in, mf.scanner);
+	} else {
+		mf_lex_init_extra(&mf, &mf.scanner);
+		mf_set_in(in, mf.scanner);
+	}
 
-	mes_statement_list r = mf_parsed_code;
-	mf_parsed_code = (mes_statement_list) vector_initializer;
-	return r;
+	// on failure, the program has already been freed
+	bool ok = !(aiwin ? aiw_mf_parse(mf.scanner, &mf) : mf_parse(mf.scanner, &mf))
+		&& !mf.failed;
+	if (!ok)
+		WARNING("Failed to parse file: %s", path);
+
+	if (aiwin)
+		aiw_mf_lex_destroy(mf.scanner);
+	else
+		mf_lex_destroy(mf.scanner);
+	if (in != stdin)
+		fclose(in);
+
+	mf_state_destroy(&mf);
+	if (ok)
+		*out = mf.program;
+	return ok;
 }
 
-mes_statement_list mes_flat_parse(const char *path)
+/*
+ * Parse and compile a flat .mes file. Returns false (after printing the error) if
+ * the file cannot be parsed.
+ */
+bool mes_flat_parse(const char *path, mes_statement_list *out)
 {
-	if (game_is_aiwin())
-		return aiw_mes_flat_parse(path);
-
-	mf_parsed_code = (mes_statement_list) vector_initializer;
-
-	mf_in = open_file(path);
-	if (mf_parse())
-		ERROR("Failed to parse file: %s", path);
-
-	if (mf_in != stdin)
-		fclose(mf_in);
-	mf_in = NULL;
+	return _mes_flat_parse(path, false, out);
+}
 
-	mes_statement_list r = mf_parsed_code;
-	mf_parsed_code = (mes_statement_list) vector_initializer;
-	return r;
+/*
+ * Parse and compile a structured (.smes) file, as output by the decompiler.
+ */
+bool mes_smes_parse(const char *path, mes_statement_list *out)
+{
+	return _mes_flat_parse(path, true, out);
 }
 
-void mf_error(const char *s)
+void mf_error(void *scanner, struct mf_state *mf, const char *s)
 {
 	PARSE_ERROR("%s", s);
 }
 
-void aiw_mf_error(const char *s)
+void aiw_mf_error(void *scanner, struct mf_state *mf, const char *s)
 {
 	PARSE_ERROR("%s", s);
 }
 
-// hash table associating labels with addresses
-declare_hashtable_string_type(label_table, struct mes_statement*);
-define_hashtable_string(label_table, struct mes_statement*);
-hashtable_t(label_table) labels;
-
-// list of statements with unresolved label references
-struct label_ref { struct mes_statement *stmt; string name; };
-vector_t(struct label_ref) label_refs;
-
-void mf_push_label(string label, struct mes_statement *stmt)
+void mf_push_label(struct mf_state *mf, string label, struct mes_statement *stmt)
 {
 	int ret;
-	hashtable_iter_t k = hashtable_put(label_table, &labels, label, &ret);
-	if (unlikely(ret == HASHTABLE_KEY_PRESENT))
-		PARSE_ERROR("Multiple definitions of label: \"%s\"\n", label);
-	hashtable_val(&labels, k) = stmt;
+	hashtable_iter_t k = hashtable_put(label_table, &mf->labels, label, &ret);
+	if (unlikely(ret == HASHTABLE_KEY_PRESENT)) {
+		PARSE_ERROR("Multiple definitions of label: \"%s\"", label);
+		string_free(label);
+		return;
+	}
+	hashtable_val(&mf->labels, k) = stmt;
+	vector_push(string, mf->label_names, label);
 }
 
-void mf_push_label_ref(struct mes_statement *stmt, string name)
+void mf_push_label_ref(struct mf_state *mf, struct mes_statement *stmt, string name)
 {
 	struct label_ref ref = { stmt, name };
-	vector_push(struct label_ref, label_refs, ref);
+	vector_push(struct label_ref, mf->label_refs, ref);
 }
 
-static void aiw_mf_resolve_labels(mes_statement_list statements)
+static void aiw_mf_resolve_labels(struct mf_state *mf, mes_statement_list statements)
 {
 	struct label_ref ref;
-	vector_foreach(ref, label_refs) {
-		hashtable_iter_t k = hashtable_get(label_table, &labels, ref.name);
-		if (unlikely(k == hashtable_end(&labels)))
+	vector_foreach(ref, mf->label_refs) {
+		hashtable_iter_t k = hashtable_get(label_table, &mf->labels, ref.name);
+		if (unlikely(k == hashtable_end(&mf->labels))) {
 			PARSE_ERROR("Undefined label: %s", ref.name);
-		struct mes_statement *stmt = hashtable_val(&labels, k);
+			continue;
+		}
+		struct mes_statement *stmt = hashtable_val(&mf->labels, k);
 		switch (ref.stmt->aiw_op) {
 		case AIW_MES_STMT_JZ:
 			ref.stmt->JZ.addr = stmt->address;
@@ -154,14 +219,16 @@ static void aiw_mf_resolve_labels(mes_statement_list statements)
 	}
 }
 
-static void mf_resolve_labels(mes_statement_list statements)
+static void mf_resolve_labels(struct mf_state *mf, mes_statement_list statements)
 {
 	struct label_ref ref;
-	vector_foreach(ref, label_refs) {
-		hashtable_iter_t k = hashtable_get(label_table, &labels, ref.name);
-		if (unlikely(k == hashtable_end(&labels)))
+	vector_foreach(ref, mf->label_refs) {
+		hashtable_iter_t k = hashtable_get(label_table, &mf->labels, ref.name);
+		if (unlikely(k == hashtable_end(&mf->labels))) {
 			PARSE_ERROR("Undefined label: %s", ref.name);
-		struct mes_statement *stmt = hashtable_val(&labels, k);
+			continue;
+		}
+		struct mes_statement *stmt = hashtable_val(&mf->labels, k);
 		switch (ref.stmt->op) {
 		case MES_STMT_JZ:
 			ref.stmt->JZ.addr = stmt->address;
@@ -181,38 +248,132 @@ static void mf_resolve_labels(mes_statement_list statements)
 	}
 }
 
-static void aiw_mf_assign_addresses(mes_statement_list statements)
+void mf_program(struct mf_state *mf, mes_statement_list statements)
 {
-	uint32_t ip = 0;
-	struct mes_statement *stmt;
-	vector_foreach(stmt, statements) {
-		stmt->address = ip;
-		ip += aiw_mes_statement_size(stmt);
+	if (!mf->failed) {
+		mes_statement_list_assign_addresses(statements);
+		if (game_is_aiwin())
+			aiw_mf_resolve_labels(mf, statements);
+		else
+			mf_resolve_labels(mf, statements);
 	}
+	if (mf->failed) {
+		mes_statement_list_free(statements);
+		return;
+	}
+	mf->program = statements;
+}
+
+// structured input {{{
+
+struct mes_ast *mf_ast_node(enum mes_ast_type type)
+{
+	struct mes_ast *node = xcalloc(1, sizeof(struct mes_ast));
+	node->type = type;
+	return node;
+}
+
+struct mes_ast *mf_ast_cond(struct mes_expression *cond, mes_ast_block consequent,
+		mes_ast_block alternative)
+{
+	struct mes_ast *node = mf_ast_node(MES_AST_COND);
+	node->cond.condition = cond;
+	node->cond.consequent = consequent;
+	node->cond.alternative = alternative;
+	return node;
+}
+
+struct mes_ast *mf_ast_loop(struct mes_expression *cond, mes_ast_block body)
+{
+	struct mes_ast *node = mf_ast_node(MES_AST_LOOP);
+	node->loop.condition = cond;
+	node->loop.body = body;
+	return node;
+}
+
+struct mes_ast *mf_ast_proc(enum mes_ast_type type, struct mes_expression *num_expr,
+		mes_ast_block body)
+{
+	struct mes_ast *node = mf_ast_node(type);
+	node->proc.num_expr = num_expr;
+	node->proc.body = body;
+	return node;
+}
+
+struct mes_ast *mf_ast_menu(mes_parameter_list params, mes_ast_block body)
+{
+	struct mes_ast *node = mf_ast_node(MES_AST_MENU_ENTRY);
+	node->menu.params = params;
+	node->menu.body = body;
+	return node;
 }
 
-static void mf_assign_addresses(mes_statement_list statements)
+/*
+ * Append the nodes of `src` to `dst`. Adjacent statement lists are merged, so that
+ * a run of statements becomes a single node.
+ */
+mes_ast_block mf_ast_append(mes_ast_block dst, mes_ast_block src)
 {
-	uint32_t ip = 0;
-	struct mes_statement *stmt;
-	vector_foreach(stmt, statements) {
-		stmt->address = ip;
-		ip += mes_statement_size(stmt);
+	struct mes_ast *node;
+	vector_foreach(node, src) {
+		struct mes_ast *last = vector_empty(dst) ? NULL
+			: vector_A(dst, vector_length(dst) - 1);
+		if (last && last->type == MES_AST_STATEMENTS && node->type == MES_AST_STATEMENTS
+				&& !node->is_goto_target) {
+			last->statements = mf_append_statements(last->statements,
+					node->statements);
+			free(node);
+			continue;
+		}
+		vector_push(struct mes_ast*, dst, node);
 	}
+	vector_destroy(src);
+	return dst;
 }
 
-void mf_program(mes_statement_list statements)
+/*
+ * Label a structured node. The label is bound to the node's first statement when the
+ * node is compiled.
+ */
+struct mes_ast *mf_ast_label(struct mf_state *mf, string name, struct mes_ast *node)
 {
-	if (game_is_aiwin()) {
-		aiw_mf_assign_addresses(statements);
-		aiw_mf_resolve_labels(statements);
-	} else {
-		mf_assign_addresses(statements);
-		mf_resolve_labels(statements);
+	node->is_goto_target = true;
+	node->label_no = vector_length(mf->node_labels);
+	vector_push(string, mf->node_labels, name);
+	return node;
+}
+
+static void mf_ast_bind_label(struct mes_ast *node, struct mes_statement *stmt, void *data)
+{
+	struct mf_state *mf = data;
+	mf_push_label(mf, vector_A(mf->node_labels, node->label_no), stmt);
+	vector_A(mf->node_labels, node->label_no) = NULL;
+}
+
+void mf_ast_program(struct mf_state *mf, mes_ast_block block)
+{
+	if (mf->failed) {
+		mes_ast_block_free(block);
+		return;
+	}
+	mes_statement_list statements;
+	if (!mes_ast_compile(block, &statements, mf_ast_bind_label, mf)) {
+		mf->failed = true;
+		return;
 	}
-	mf_parsed_code = statements;
+	if (game_is_aiwin())
+		aiw_mf_resolve_labels(mf, statements);
+	else
+		mf_resolve_labels(mf, statements);
+	if (mf->failed) {
+		mes_statement_list_free(statements);
+		return;
+	}
+	mf->program = statements;
 }
 
+// structured input }}}
+
 static mes_parameter_list append_params(mes_parameter_list a, mes_parameter_list b)
 {
 	struct mes_parameter *p;
@@ -222,15 +383,18 @@ static mes_parameter_list append_params(mes_parameter_list a, mes_parameter_list
 	return a;
 }
 
-struct mes_statement *aiw_mf_parse_builtin(mes_qname name, mes_parameter_list _params)
+struct mes_statement *aiw_mf_parse_builtin(struct mf_state *mf, mes_qname name,
+		mes_parameter_list _params)
 {
 	int op;
 	mes_parameter_list call = mes_resolve_syscall(name, &op);
-	if (op < 0)
-		PARSE_ERROR("Invalid builtin");
-
 	mes_parameter_list params = append_params(call, _params);
 	vector_destroy(_params);
+	if (op < 0) {
+		PARSE_ERROR("Invalid builtin");
+		mes_parameter_list_free(params);
+		return aiw_mes_stmt_end();
+	}
 
 	switch (op) {
 	case AIW_MES_STMT_COMMIT_MESSAGE:
@@ -240,7 +404,7 @@ struct mes_statement *aiw_mf_parse_builtin(mes_qname name, mes_parameter_list _p
 	case AIW_MES_STMT_21:
 		if (!vector_empty(params))
 			PARSE_ERROR("builtin takes no parameters");
-		vector_destroy(params);
+		mes_parameter_list_free(params);
 		return aiw_mes_stmt(op);
 	default:
 		break;
@@ -248,41 +412,48 @@ struct mes_statement *aiw_mf_parse_builtin(mes_qname name, mes_parameter_list _p
 	return _aiw_mes_stmt_call(op, params);
 }
 
-static long parse_int(string str)
+static long parse_int(struct mf_state *mf, string str)
 {
 	char *endptr;
 	long i = strtol(str, &endptr, 0);
-	if (*endptr != '\0')
+	if (*endptr != '\0') {
 		PARSE_ERROR("invalid integer constant: %s", str);
+		return 0;
+	}
 	return i;
 }
 
-uint8_t mf_parse_u8(string str)
+uint8_t mf_parse_u8(struct mf_state *mf, string str)
 {
-	long i = parse_int(str);
-	if (i < 0 || i >= 256)
+	long i = parse_int(mf, str);
+	if (i < 0 || i >= 256) {
 		PARSE_ERROR("value out of range: %s", str);
+		i = 0;
+	}
 	string_free(str);
 	return i;
 }
 
-uint16_t mf_parse_u16(string str)
+uint16_t mf_parse_u16(struct mf_state *mf, string str)
 {
-	long i = parse_int(str);
-	if (i < 0 || i >= 65535)
+	long i = parse_int(mf, str);
+	if (i < 0 || i >= 65535) {
 		PARSE_ERROR("value out of range: %s", str);
+		i = 0;
+	}
 	string_free(str);
 	return i;
 }
 
-uint32_t mf_parse_u32(string str)
+uint32_t mf_parse_u32(struct mf_state *mf, string str)
 {
-	long i = parse_int(str);
+	long i = parse_int(mf, str);
 	string_free(str);
 	return i;
 }
 
-static struct mes_statement *read_string_literal(const char *in, const char **out)
+static struct mes_statement *read_string_literal(struct mf_state *mf, const char *in,
+		const char **out)
 {
 	const char *p = in;
 	if (mes_char_is_zenkaku(*p) || (p[0] == '\\' && p[1] == 'X')) {
@@ -323,9 +494,14 @@ static struct mes_statement *read_string_literal(const char *in, const char **ou
 		return stmt;
 	}
 	PARSE_ERROR("Invalid character in string literal: %02x", (unsigned)*in);
+	// placeholder for the rest of the literal
+	struct mes_statement *stmt = mes_stmt(MES_STMT_HANKAKU);
+	stmt->TXT.text = string_new("");
+	*out = in + strlen(in);
+	return stmt;
 }
 
-mes_statement_list mf_parse_string_literal(string str)
+mes_statement_list mf_parse_string_literal(struct mf_state *mf, string str)
 {
 	mes_statement_list stmts = vector_initializer;
 
@@ -334,14 +510,14 @@ mes_statement_list mf_parse_string_literal(string str)
 
 	const char *p = sjis;
 	while (*p) {
-		vector_push(struct mes_statement*, stmts, read_string_literal(p, &p));
+		vector_push(struct mes_statement*, stmts, read_string_literal(mf, p, &p));
 	}
 	string_free(sjis);
 
 	return stmts;
 }
 
-mes_statement_list aiw_mf_parse_string_literal(string str)
+mes_statement_list aiw_mf_parse_string_literal(struct mf_state *mf, string str)
 {
 	mes_statement_list stmts = vector_initializer;
 
@@ -350,7 +526,7 @@ mes_statement_list aiw_mf_parse_string_literal(string str)
 
 	const char *p = sjis;
 	while (*p) {
-		struct mes_statement *stmt = read_string_literal(p, &p);
+		struct mes_statement *stmt = read_string_literal(mf, p, &p);
 		stmt->aiw_op = AIW_MES_STMT_TXT;
 		vector_push(struct mes_statement*, stmts, stmt);
 	}
@@ -359,15 +535,22 @@ mes_statement_list aiw_mf_parse_string_literal(string str)
 	return stmts;
 }
 
-struct mes_statement *mf_stmt_sys_named_var_set(string name, mes_expression_list vals)
+struct mes_statement *mf_stmt_sys_named_var_set(struct mf_state *mf, string name,
+		mes_expression_list vals)
 {
 	bool dword;
 	int no = mes_resolve_sysvar(name, &dword);
-	if (no < 0)
+	uint8_t i = 0;
+	if (no < 0) {
 		PARSE_ERROR("Invalid system variable: %s", name);
-	uint8_t i = dword ? mes_sysvar32_index(no) : mes_sysvar16_index(no);
-	if (i == MES_CODE_INVALID)
-		PARSE_ERROR("System variable is not valid for game: %s", name);
+		dword = false;
+	} else {
+		i = dword ? mes_sysvar32_index(no) : mes_sysvar16_index(no);
+		if (i == MES_CODE_INVALID) {
+			PARSE_ERROR("System variable is not valid for game: %s", name);
+			i = 0;
+		}
+	}
 
 	string_free(name);
 
@@ -376,16 +559,22 @@ struct mes_statement *mf_stmt_sys_named_var_set(string name, mes_expression_list
 	return dword ? mes_stmt_sys_var32_set(e, vals) : mes_stmt_sys_var16_set(e, vals);
 }
 
-struct mes_statement *aiw_mf_stmt_sys_named_var_set(string name, mes_expression_list vals)
+struct mes_statement *aiw_mf_stmt_sys_named_var_set(struct mf_state *mf, string name,
+		mes_expression_list vals)
 {
 	bool dword;
 	int no = mes_resolve_sysvar(name, &dword);
-	if (no < 0)
+	uint8_t i = 0;
+	if (no < 0) {
 		PARSE_ERROR("Invalid system variable: %s", name);
-	assert(!dword);
-	uint8_t i = mes_sysvar16_index(no);
-	if (i == MES_CODE_INVALID)
-		PARSE_ERROR("System variable is not valid for game: %s", name);
+	} else {
+		assert(!dword);
+		i = mes_sysvar16_index(no);
+		if (i == MES_CODE_INVALID) {
+			PARSE_ERROR("System variable is not valid for game: %s", name);
+			i = 0;
+		}
+	}
 
 	string_free(name);
 
@@ -395,12 +584,15 @@ struct mes_statement *aiw_mf_stmt_sys_named_var_set(string name, mes_expression_
 	return stmt;
 }
 
-struct mes_statement *mf_stmt_named_sys(mes_qname name, mes_parameter_list _params)
+struct mes_statement *mf_stmt_named_sys(struct mf_state *mf, mes_qname name,
+		mes_parameter_list _params)
 {
 	int no;
 	mes_parameter_list call = mes_resolve_syscall(name, &no);
-	if (no < 0)
+	if (no < 0) {
 		PARSE_ERROR("Invalid System call");
+		no = 0;
+	}
 
 	mes_parameter_list params = append_params(call, _params);
 	struct mes_statement *stmt = mes_stmt(MES_STMT_SYS);
@@ -410,7 +602,8 @@ struct mes_statement *mf_stmt_named_sys(mes_qname name, mes_parameter_list _para
 	return stmt;
 }
 
-struct mes_statement *mf_stmt_util(mes_qname name, mes_parameter_list params)
+struct mes_statement *mf_stmt_util(struct mf_state *mf, mes_qname name,
+		mes_parameter_list params)
 {
 	mes_parameter_list call = mes_resolve_util(name);
 	struct mes_statement *stmt = mes_stmt(MES_STMT_UTIL);
@@ -419,43 +612,55 @@ struct mes_statement *mf_stmt_util(mes_qname name, mes_parameter_list params)
 	return stmt;
 }
 
-struct mes_statement *mf_stmt_call(mes_parameter_list params)
+struct mes_statement *mf_stmt_call(struct mf_state *mf, mes_parameter_list params)
 {
-	if (vector_length(params) < 1)
+	if (vector_length(params) < 1) {
 		PARSE_ERROR("Call with zero parameters");
+		return mes_stmt_proc(params);
+	}
 	if (vector_A(params, 0).type == MES_PARAM_STRING)
 		return mes_stmt_call(params);
 	return mes_stmt_proc(params);
 }
 
-struct mes_statement *aiw_mf_stmt_call(mes_parameter_list params)
+struct mes_statement *aiw_mf_stmt_call(struct mf_state *mf, mes_parameter_list params)
 {
-	if (vector_length(params) < 1)
+	if (vector_length(params) < 1) {
 		PARSE_ERROR("Call with zero parameters");
+		return _aiw_mes_stmt_call(AIW_MES_STMT_CALL_PROC, params);
+	}
 	if (vector_A(params, 0).type == MES_PARAM_STRING)
 		return _aiw_mes_stmt_call(AIW_MES_STMT_CALL_MES, params);
 	return _aiw_mes_stmt_call(AIW_MES_STMT_CALL_PROC, params);
 }
 
-struct mes_expression *mf_parse_constant(string text)
+struct mes_expression *mf_parse_constant(struct mf_state *mf, string text)
 {
-	long i = parse_int(text);
-	if (i < 0)
+	long i = parse_int(mf, text);
+	if (i < 0) {
 		PARSE_ERROR("value out of range: %ld", i);
-	struct mes_expression *expr = mes_expr_constant(parse_int(text));
+		i = 0;
+	}
+	struct mes_expression *expr = mes_expr_constant(i);
 	string_free(text);
 	return expr;
 }
 
-struct mes_expression *mf_expr_named_sysvar(string name)
+struct mes_expression *mf_expr_named_sysvar(struct mf_state *mf, string name)
 {
 	bool dword;
 	int no = mes_resolve_sysvar(name, &dword);
-	if (no < 0)
+	uint8_t i = 0;
+	if (no < 0) {
 		PARSE_ERROR("Invalid system variable: %s", name);
-	uint8_t i = dword ? mes_sysvar32_index(no) : mes_sysvar16_index(no);
-	if (i == MES_CODE_INVALID)
-		PARSE_ERROR("System variable is not valid for game: %s", name);
+		dword = false;
+	} else {
+		i = dword ? mes_sysvar32_index(no) : mes_sysvar16_index(no);
+		if (i == MES_CODE_INVALID) {
+			PARSE_ERROR("System variable is not valid for game: %s", name);
+			i = 0;
+		}
+	}
 	string_free(name);
 
 	struct mes_expression *index = mes_expr(MES_EXPR_IMM);
@@ -463,16 +668,21 @@ struct mes_expression *mf_expr_named_sysvar(string name)
 	return dword ? mes_expr_system_var32(index) : mes_expr_system_var16(index);
 }
 
-struct mes_expression *aiw_mf_expr_named_sysvar(string name)
+struct mes_expression *aiw_mf_expr_named_sysvar(struct mf_state *mf, string name)
 {
 	bool dword;
 	int no = mes_resolve_sysvar(name, &dword);
-	if (no < 0)
+	uint8_t i = 0;
+	if (no < 0) {
 		PARSE_ERROR("Invalid system variable: %s", name);
-	assert(!dword);
-	uint8_t i = mes_sysvar16_index(no);
-	if (i == MES_CODE_INVALID)
-		PARSE_ERROR("System variable is not valid for game: %s", name);
+	} else {
+		assert(!dword);
+		i = mes_sysvar16_index(no);
+		if (i == MES_CODE_INVALID) {
+			PARSE_ERROR("System variable is not valid for game: %s", name);
+			i = 0;
+		}
+	}
 	string_free(name);
 
 	struct mes_expression *expr = aiw_mes_expr(AIW_MES_EXPR_GET_SYSVAR_CONST);
@@ -17,25 +17,48 @@
 #ifndef ELF_TOOLS_MES_FLAT_PARSER_H_
 #define ELF_TOOLS_MES_FLAT_PARSER_H_
 
+#include "nulib/hashtable.h"
 #include "mes.h"
 
-int mf_lex();
-void mf_error(const char *s);
+declare_hashtable_string_type(label_table, struct mes_statement*);
 
-int aiw_mf_lex();
-void aiw_mf_error(const char *s);
+// statement with an unresolved label reference
+struct label_ref { struct mes_statement *stmt; string name; };
 
-extern mes_statement_list mf_parsed_code;
-void mf_push_label(string label, struct mes_statement *stmt);
-void mf_program(mes_statement_list statements);
-uint8_t mf_parse_u8(string str);
-uint16_t mf_parse_u16(string str);
-uint32_t mf_parse_u32(string str);
-mes_statement_list mf_parse_string_literal(string str);
-
-struct mes_statement *aiw_mf_parse_builtin(mes_qname name, mes_parameter_list params);
-struct mes_statement *aiw_mf_stmt_call(mes_parameter_list params);
-mes_statement_list aiw_mf_parse_string_literal(string str);
+/*
+ * Per-parse state. Everything the parser needs lives here (or in the
+ * reentrant scanner), so that independent files may be parsed concurrently.
+ */
+struct mf_state {
+	void *scanner;
+	int (*get_lineno)(void *scanner);
+	// hash table associating labels with statements
+	hashtable_t(label_table) labels;
+	// the keys of `labels`
+	vector_t(string) label_names;
+	// list of statements with unresolved label references
+	vector_t(struct label_ref) label_refs;
+	mes_statement_list program;
+	// structured (.smes) input: the scanner emits SMES_START before the first token
+	bool structured;
+	bool started;
+	// names of labelled AST nodes (indexed by the node's label_no)
+	vector_t(string) node_labels;
+	// set by the first error; the scanner then stops and the parse fails
+	bool failed;
+};
+
+void mf_push_label(struct mf_state *mf, string label, struct mes_statement *stmt);
+void mf_program(struct mf_state *mf, mes_statement_list statements);
+uint8_t mf_parse_u8(struct mf_state *mf, string str);
+uint16_t mf_parse_u16(struct mf_state *mf, string str);
+uint32_t mf_parse_u32(struct mf_state *mf, string str);
+mes_statement_list mf_parse_string_literal(struct mf_state *mf, string str);
+
+struct mes_statement *aiw_mf_parse_builtin(struct mf_state *mf, mes_qname name,
+		mes_parameter_list params);
+struct mes_statement *aiw_mf_stmt_call(struct mf_state *mf, mes_parameter_list params);
+mes_statement_list aiw_mf_parse_string_literal(struct mf_state *mf, string str);
 
 static inline mes_statement_list mf_push_statement(mes_statement_list list,
 		struct mes_statement *stmt)
@@ -89,17 +112,89 @@ static inline aiw_menu_table mf_push_case(aiw_menu_table table, struct aiw_mes_m
 	return table;
 }
 
-void mf_push_label_ref(struct mes_statement *stmt, string name);
+// destructors for partial results discarded by the parser {{{
+
+static inline void mf_expression_list_free(mes_expression_list list)
+{
+	struct mes_expression *expr;
+	vector_foreach(expr, list) {
+		mes_expression_free(expr);
+	}
+	vector_destroy(list);
+}
+
+static inline void mf_param_free(struct mes_parameter param)
+{
+	mes_parameter_list_free(mf_push_param((mes_parameter_list)vector_initializer, param));
+}
+
+static inline void mf_qname_free(mes_qname name)
+{
+	struct mes_qname_part *part;
+	vector_foreach_p(part, name) {
+		if (part->type == MES_QNAME_IDENT)
+			string_free(part->ident);
+	}
+	vector_destroy(name);
+}
+
+static inline void mf_case_free(struct aiw_mes_menu_case c)
+{
+	if (c.cond)
+		mes_expression_free(c.cond);
+	mes_statement_list_free(c.body);
+}
+
+static inline void mf_case_table_free(aiw_menu_table table)
+{
+	struct aiw_mes_menu_case c;
+	vector_foreach(c, table) {
+		mf_case_free(c);
+	}
+	vector_destroy(table);
+}
+
+// }}}
+
+void mf_push_label_ref(struct mf_state *mf, struct mes_statement *stmt, string name);
+
+void mf_ast_program(struct mf_state *mf, mes_ast_block block);
+struct mes_ast *mf_ast_label(struct mf_state *mf, string name, struct mes_ast *node);
+struct mes_ast *mf_ast_node(enum mes_ast_type type);
+struct mes_ast *mf_ast_cond(struct mes_expression *cond, mes_ast_block consequent,
+		mes_ast_block alternative);
+struct mes_ast *mf_ast_loop(struct mes_expression *cond, mes_ast_block body);
+struct mes_ast *mf_ast_proc(enum mes_ast_type type, struct mes_expression *num_expr,
+		mes_ast_block body);
+struct mes_ast *mf_ast_menu(mes_parameter_list params, mes_ast_block body);
+mes_ast_block mf_ast_append(mes_ast_block dst, mes_ast_block src);
+
+static inline mes_ast_block mf_ast_push(mes_ast_block block, struct mes_ast *node)
+{
+	vector_push(struct mes_ast*, block, node);
+	return block;
+}
+
+static inline mes_ast_block mf_ast_statements(mes_statement_list statements)
+{
+	struct mes_ast *node = mf_ast_node(MES_AST_STATEMENTS);
+	node->statements = statements;
+	return mf_ast_push((mes_ast_block)vector_initializer, node);
+}
 
-struct mes_statement *mf_stmt_sys_named_var_set(string name, mes_expression_list vals);
-struct mes_statement *mf_stmt_named_sys(mes_qname name, mes_parameter_list params);
-struct mes_statement *mf_stmt_util(mes_qname name, mes_parameter_list params);
-struct mes_statement *mf_stmt_call(mes_parameter_list params);
+struct mes_statement *mf_stmt_sys_named_var_set(struct mf_state *mf, string name,
+		mes_expression_list vals);
+struct mes_statement *mf_stmt_named_sys(struct mf_state *mf, mes_qname name,
+		mes_parameter_list params);
+struct mes_statement *mf_stmt_util(struct mf_state *mf, mes_qname name,
+		mes_parameter_list params);
+struct mes_statement *mf_stmt_call(struct mf_state *mf, mes_parameter_list params);
 
-struct mes_expression *mf_parse_constant(string text);
-struct mes_expression *mf_expr_named_sysvar(string name);
+struct mes_expression *mf_parse_constant(struct mf_state *mf, string text);
+struct mes_expression *mf_expr_named_sysvar(struct mf_state *mf, string name);
 
-struct mes_statement *aiw_mf_stmt_sys_named_var_set(string name, mes_expression_list vals);
-struct mes_expression *aiw_mf_expr_named_sysvar(string name);
+struct mes_statement *aiw_mf_stmt_sys_named_var_set(struct mf_state *mf, string name,
+		mes_expression_list vals);
+struct mes_expression *aiw_mf_expr_named_sysvar(struct mf_state *mf, string name);
 
 #endif // ELF_TOOLS_MES_FLAT_PARSER_H_
@@ -1,4 +1,5 @@
 %define api.prefix {mf_}
+%define api.pure full
 %define parse.error detailed
 %define parse.lac full
 
@@ -19,12 +20,23 @@
     struct mes_parameter parameter;
     struct mes_statement *statement;
     mes_statement_list program;
+    struct mes_ast *node;
+    mes_ast_block block;
 }
 
 %code requires {
     #include "mes.h"
+    struct mf_state;
 }
 
+%code provides {
+    int mf_lex(MF_STYPE *lval, void *scanner);
+    void mf_error(void *scanner, struct mf_state *mf, const char *s);
+}
+
+%lex-param {void *scanner}
+%parse-param {void *scanner} {struct mf_state *mf}
+
 %token  <string>	IDENTIFIER I_CONSTANT STRING_LITERAL
 %token  <token>		LPAREN RPAREN PLUS MINUS MUL DIV MOD INVALID_TOKEN
 %token  <token>		AND_OP OR_OP LE_OP GE_OP EQ_OP NE_OP
@@ -32,6 +44,7 @@
 %token  <token>		JZ GOTO JUMP CALL CALL_SUB UTIL LINE MENUEXEC
 %token  <token>		FUNCTION RETURN DEFPROC DEFMENU DEFSUB
 %token  <token>		OP_0x17 OP_0x18 OP_0x19 OP_0x1A OP_0x1B OP_0x1F
+%token  <token>		SMES_START IF ELSE WHILE CONTINUE BREAK PROCEDURE MENU SUB
 
 %type   <program>	stmts str
 %type   <statement>	stmt
@@ -41,15 +54,82 @@
 %type   <expression>	expr primary_expr mul_expr add_expr rel_expr eq_expr bitand_expr
 %type   <expression>	xor_expr bitior_expr and_expr or_expr
 %type   <path>		path
+%type   <string>	path_ident
+%type   <node>		node cond
+%type   <block>		block body item
+
+%destructor { string_free($$); } <string>
+%destructor { mes_expression_free($$); } <expression>
+%destructor { mf_qname_free($$); } <path>
+%destructor { mf_expression_list_free($$); } <arguments>
+%destructor { mes_parameter_list_free($$); } <parameters>
+%destructor { mf_param_free($$); } <parameter>
+%destructor { mes_statement_free($$); } <statement>
+%destructor { mes_statement_list_free($$); } <program>
+%destructor { mes_ast_free($$); } <node>
+%destructor { mes_ast_block_free($$); } <block>
 
 %start program
 
 %%
 
 program
-	: stmts { mf_program($1); }
+	: stmts { mf_program(mf, $1); }
+	| SMES_START { mf_ast_program(mf, (mes_ast_block)vector_initializer); }
+	| SMES_START block { mf_ast_program(mf, $2); }
+	;
+
+	/* structured input */
+
+block
+	: item { $$ = $1; }
+	| block item { $$ = mf_ast_append($1, $2); }
+	;
+
+body
+	: '{' '}' { $$ = (mes_ast_block)vector_initializer; }
+	| '{' block '}' { $$ = $2; }
 	;
 
+item
+	: stmt
+	  { $$ = mf_ast_statements(mf_push_statement((mes_statement_list)vector_initializer, $1)); }
+	| str
+	  { $$ = mf_ast_statements($1); }
+	| node
+	  { $$ = mf_ast_push((mes_ast_block)vector_initializer, $1); }
+	| IDENTIFIER ':' node
+	  { $$ = mf_ast_push((mes_ast_block)vector_initializer, mf_ast_label(mf, $1, $3)); }
+	;
+
+node
+	: cond
+	  { $$ = $1; }
+	| WHILE '(' expr ')' body
+	  { $$ = mf_ast_loop($3, $5); }
+	| PROCEDURE '[' expr ']' '=' body ';'
+	  { $$ = mf_ast_proc(MES_AST_PROCEDURE, $3, $6); }
+	| SUB '[' expr ']' '=' body ';'
+	  { $$ = mf_ast_proc(MES_AST_SUB, $3, $6); }
+	| MENU '[' params ']' '=' body ';'
+	  { $$ = mf_ast_menu($3, $6); }
+	| CONTINUE ';'
+	  { $$ = mf_ast_node(MES_AST_CONTINUE); }
+	| BREAK ';'
+	  { $$ = mf_ast_node(MES_AST_BREAK); }
+	;
+
+cond
+	: IF '(' expr ')' body
+	  { $$ = mf_ast_cond($3, $5, (mes_ast_block)vector_initializer); }
+	| IF '(' expr ')' body ELSE body
+	  { $$ = mf_ast_cond($3, $5, $7); }
+	| IF '(' expr ')' body ELSE cond
+	  { $$ = mf_ast_cond($3, $5, mf_ast_push((mes_ast_block)vector_initializer, $7)); }
+	;
+
+	/* flat input */
+
 stmts
 	: stmt { $$ = mf_push_statement((mes_statement_list)vector_initializer, $1); }
 	| stmts stmt { $$ = mf_push_statement($1, $2); }
@@ -60,14 +140,14 @@ stmts
 
 str
 	: STRING_LITERAL ';'
-	  { $$ = mf_parse_string_literal($1); }
+	  { $$ = mf_parse_string_literal(mf, $1); }
 	| IDENTIFIER ':' STRING_LITERAL ';'
-	  { $$ = mf_parse_string_literal($3); mf_push_label($1, vector_A($$, 0)); }
+	  { $$ = mf_parse_string_literal(mf, $3); mf_push_label(mf, $1, vector_A($$, 0)); }
 	;
 
 stmt
 	: IDENTIFIER ':' stmt
-	  { mf_push_label($1, $3); $$ = $3; }
+	  { mf_push_label(mf, $1, $3); $$ = $3; }
 	| RETURN ';'
 	  { $$ = mes_stmt_end(); }
 	| VAR4 '[' expr ']' '=' exprs ';'
@@ -75,55 +155,55 @@ stmt
 	| ARG '[' expr ']' '=' exprs ';'
 	  { $$ = mes_stmt_set_arg($3, $6); }
 	| VAR16 '[' I_CONSTANT ']' '=' exprs ';'
-	  { $$ = mes_stmt_setv(mf_parse_u8($3), $6); }
+	  { $$ = mes_stmt_setv(mf_parse_u8(mf, $3), $6); }
 	| VAR32 '[' I_CONSTANT ']' '=' exprs ';'
-	  { $$ = mes_stmt_setrd(mf_parse_u8($3), $6); }
+	  { $$ = mes_stmt_setrd(mf_parse_u8(mf, $3), $6); }
 	| VAR16 '[' I_CONSTANT ']' ARROW BYTE '[' expr ']' '=' exprs ';'
-	  { $$ = mes_stmt_setac(mf_parse_u8($3), $8, $11); }
+	  { $$ = mes_stmt_setac(mf_parse_u8(mf, $3), $8, $11); }
 	| VAR16 '[' I_CONSTANT ']' ARROW WORD '[' expr ']' '=' exprs ';'
-	  { $$ = mes_stmt_seta_at(mf_parse_u8($3) + 1, $8, $11); }
+	  { $$ = mes_stmt_seta_at(mf_parse_u8(mf, $3) + 1, $8, $11); }
 	| VAR32 '[' I_CONSTANT ']' ARROW BYTE '[' expr ']' '=' exprs ';'
-	  { $$ = mes_stmt_setab(mf_parse_u8($3) + 1, $8, $11); }
+	  { $$ = mes_stmt_setab(mf_parse_u8(mf, $3) + 1, $8, $11); }
 	| VAR32 '[' I_CONSTANT ']' ARROW WORD '[' expr ']' '=' exprs ';'
-	  { $$ = mes_stmt_setaw(mf_parse_u8($3) + 1, $8, $11); }
+	  { $$ = mes_stmt_setaw(mf_parse_u8(mf, $3) + 1, $8, $11); }
 	| VAR32 '[' I_CONSTANT ']' ARROW DWORD '[' expr ']' '=' exprs ';'
-	  { $$ = mes_stmt_setad(mf_parse_u8($3) + 1, $8, $11); }
+	  { $$ = mes_stmt_setad(mf_parse_u8(mf, $3) + 1, $8, $11); }
 	| JZ expr IDENTIFIER ';'
-	  { $$ = mes_stmt_jz($2); mf_push_label_ref($$, $3); }
+	  { $$ = mes_stmt_jz($2); mf_push_label_ref(mf, $$, $3); }
 	| GOTO IDENTIFIER ';'
-	  { $$ = mes_stmt_jmp(); mf_push_label_ref($$, $2); }
+	  { $$ = mes_stmt_jmp(); mf_push_label_ref(mf, $$, $2); }
 	| JUMP params ';'
 	  { $$ = mes_stmt_goto($2); }
 	| CALL params ';'
-	  { $$ = mf_stmt_call($2); }
+	  { $$ = mf_stmt_call(mf, $2); }
 	| CALL_SUB params ';'
 	  { $$ = mes_stmt_call_sub($2); }
 	| UTIL '.' path params ';'
-	  { $$ = mf_stmt_util($3, $4); }
+	  { $$ = mf_stmt_util(mf, $3, $4); }
 	| UTIL params ';'
 	  { $$ = mes_stmt_util($2); }
 	| LINE I_CONSTANT ';'
-	  { $$ = mes_stmt_line(mf_parse_u8($2)); }
+	  { $$ = mes_stmt_line(mf_parse_u8(mf, $2)); }
 	| MENUEXEC ';'
 	  { $$ = mes_stmt_menus(); }
 	| MENUEXEC params ';'
 	  { $$ = mes_stmt_menus_params($2); }
 	| SYSTEM '.' path params ';'
-	  { $$ = mf_stmt_named_sys($3, $4); }
+	  { $$ = mf_stmt_named_sys(mf, $3, $4); }
 	| SYSTEM '.' IDENTIFIER '=' exprs ';'
-	  { $$ = mf_stmt_sys_named_var_set($3, $5); }
+	  { $$ = mf_stmt_sys_named_var_set(mf, $3, $5); }
 	| SYSTEM '.' VAR16 '[' expr ']' '=' exprs ';'
 	  { $$ = mes_stmt_sys_var16_set($5, $8); }
 	| SYSTEM '.' VAR32 '[' expr ']' '=' exprs ';'
 	  { $$ = mes_stmt_sys_var32_set($5, $8); }
 	| DEFPROC expr IDENTIFIER ';'
-	  { $$ = mes_stmt_procd($2); mf_push_label_ref($$, $3); }
+	  { $$ = mes_stmt_procd($2); mf_push_label_ref(mf, $$, $3); }
 	| DEFMENU params IDENTIFIER ';'
-	  { $$ = mes_stmt_menui($2); mf_push_label_ref($$, $3); }
+	  { $$ = mes_stmt_menui($2); mf_push_label_ref(mf, $$, $3); }
 	| DEFSUB expr IDENTIFIER ';'
-	  { $$ = mes_stmt_defsub($2); mf_push_label_ref($$, $3); }
+	  { $$ = mes_stmt_defsub($2); mf_push_label_ref(mf, $$, $3); }
 	| OP_0x17 I_CONSTANT ';'
-	  { $$ = mes_stmt_17(mf_parse_u32($2)); }
+	  { $$ = mes_stmt_17(mf_parse_u32(mf, $2)); }
 	| OP_0x18 expr ';'
 	  { $$ = mes_stmt_18($2); }
 	| OP_0x19 ';'
@@ -133,18 +213,31 @@ stmt
 	| OP_0x1B params ';'
 	  { $$ = mes_stmt_1B($2); }
 	| OP_0x1F I_CONSTANT ';'
-	  { $$ = mes_stmt_1F(mf_parse_u32($2)); }
+	  { $$ = mes_stmt_1F(mf_parse_u32(mf, $2)); }
 	;
 
 path
-	: IDENTIFIER
+	: path_ident
 	  { $$ = mf_push_qname_ident((mes_qname)vector_initializer, $1); }
 	| FUNCTION '[' I_CONSTANT ']'
-	  { $$ = mf_push_qname_number((mes_qname)vector_initializer, mf_parse_u8($3)); }
-	| path '.' IDENTIFIER
+	  { $$ = mf_push_qname_number((mes_qname)vector_initializer, mf_parse_u8(mf, $3)); }
+	| path '.' path_ident
 	  { $$ = mf_push_qname_ident($1, $3); }
 	| path '.' FUNCTION '[' I_CONSTANT ']'
-	  { $$ = mf_push_qname_number($1, mf_parse_u8($5)); }
+	  { $$ = mf_push_qname_number($1, mf_parse_u8(mf, $5)); }
+	;
+
+// keywords of structured input may still be used in qualified names
+path_ident
+	: IDENTIFIER { $$ = $1; }
+	| IF { $$ = string_new("if"); }
+	| ELSE { $$ = string_new("else"); }
+	| WHILE { $$ = string_new("while"); }
+	| CONTINUE { $$ = string_new("continue"); }
+	| BREAK { $$ = string_new("break"); }
+	| PROCEDURE { $$ = string_new("procedure"); }
+	| MENU { $$ = string_new("menu"); }
+	| SUB { $$ = string_new("sub"); }
 	;
 
 exprs
@@ -153,24 +246,24 @@ exprs
 	;
 
 primary_expr
-	: I_CONSTANT { $$ = mf_parse_constant($1); }
+	: I_CONSTANT { $$ = mf_parse_constant(mf, $1); }
 	| VAR4 '[' expr ']' { $$ = mes_expr_var4($3); }
 	| ARG '[' expr ']' { $$ = mes_expr_arg($3); }
-	| VAR16 '[' I_CONSTANT ']' { $$ = mes_expr_var16(mf_parse_u8($3)); }
-	| VAR32 '[' I_CONSTANT ']' { $$ = mes_expr_var32(mf_parse_u8($3)); }
+	| VAR16 '[' I_CONSTANT ']' { $$ = mes_expr_var16(mf_parse_u8(mf, $3)); }
+	| VAR32 '[' I_CONSTANT ']' { $$ = mes_expr_var32(mf_parse_u8(mf, $3)); }
 	| VAR16 '[' I_CONSTANT ']' ARROW BYTE '[' expr ']'
-	  { $$ = mes_expr_array_index(MES_EXPR_PTR16_GET8, mf_parse_u8($3), $8); }
+	  { $$ = mes_expr_array_index(MES_EXPR_PTR16_GET8, mf_parse_u8(mf, $3), $8); }
 	| VAR16 '[' I_CONSTANT ']' ARROW WORD '[' expr ']'
-	  { $$ = mes_expr_array_index(MES_EXPR_PTR16_GET16, mf_parse_u8($3), $8); }
+	  { $$ = mes_expr_array_index(MES_EXPR_PTR16_GET16, mf_parse_u8(mf, $3), $8); }
 	| VAR32 '[' I_CONSTANT ']' ARROW BYTE '[' expr ']'
-	  { $$ = mes_expr_array_index(MES_EXPR_PTR32_GET8, mf_parse_u8($3), $8); }
+	  { $$ = mes_expr_array_index(MES_EXPR_PTR32_GET8, mf_parse_u8(mf, $3), $8); }
 	| VAR32 '[' I_CONSTANT ']' ARROW WORD '[' expr ']'
-	  { $$ = mes_expr_array_index(MES_EXPR_PTR32_GET16, mf_parse_u8($3), $8); }
+	  { $$ = mes_expr_array_index(MES_EXPR_PTR32_GET16, mf_parse_u8(mf, $3), $8); }
 	| VAR32 '[' I_CONSTANT ']' ARROW DWORD '[' expr ']'
-	  { $$ = mes_expr_array_index(MES_EXPR_PTR32_GET32, mf_parse_u8($3), $8); }
+	  { $$ = mes_expr_array_index(MES_EXPR_PTR32_GET32, mf_parse_u8(mf, $3), $8); }
 	| SYSTEM '.' VAR16 '[' expr ']' { $$ = mes_expr_system_var16($5); }
 	| SYSTEM '.' VAR32 '[' expr ']' { $$ = mes_expr_system_var32($5); }
-	| SYSTEM '.' IDENTIFIER { $$ = mf_expr_named_sysvar($3); }
+	| SYSTEM '.' IDENTIFIER { $$ = mf_expr_named_sysvar(mf, $3); }
 	| RANDOM '(' expr ')' { $$ = mes_expr_random($3); }
 	| '(' expr ')' { $$ = $2; }
 	;
@@ -0,0 +1,471 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nulib.h"
+#include "nulib/buffer.h"
+#include "nulib/file.h"
+#include "nulib/little_endian.h"
+#include "nulib/string.h"
+#include "nulib/vector.h"
+
+#include "mes.h"
+
+/*
+ * The index maps every 3-byte sequence (of UTF-8 text) to the sorted list of text
+ * entries containing it. A query is answered by taking the rarest trigram of the
+ * query string and verifying each of its candidates with a substring search.
+ *
+ * On disk (all integers are little endian u32):
+ *
+ *   "MIDX" version game name_function nr_scripts nr_texts nr_grams nr_postings pool_size
+ *   scripts:  hash first_text nr_texts name_len name[name_len]
+ *   texts:    script no address off len
+ *   grams:    gram off count
+ *   postings: text
+ *   pool:     char[pool_size]
+ *
+ * The game and name function are recorded because they determine how the text
+ * is decoded: an index built with different settings must not be reused.
+ */
+
+#define MES_INDEX_MAGIC "MIDX"
+#define MES_INDEX_VERSION 2
+
+void mes_index_init(struct mes_index *idx, int game, int name_function)
+{
+	memset(idx, 0, sizeof(struct mes_index));
+	idx->game = game;
+	idx->name_function = name_function;
+}
+
+/*
+ * Returns true if `idx` was built with the same settings as `other`.
+ */
+bool mes_index_compatible(struct mes_index *idx, struct mes_index *other)
+{
+	return idx->game == other->game && idx->name_function == other->name_function;
+}
+
+void mes_index_free(struct mes_index *idx)
+{
+	struct mes_index_script *s;
+	vector_foreach_p(s, idx->scripts) {
+		string_free(s->name);
+	}
+	vector_destroy(idx->scripts);
+	vector_destroy(idx->texts);
+	vector_destroy(idx->grams);
+	vector_destroy(idx->postings);
+	free(idx->pool);
+	mes_index_init(idx, idx->game, idx->name_function);
+}
+
+static uint32_t pool_add(struct mes_index *idx, const char *text, size_t len)
+{
+	if (idx->pool_size + len + 1 > idx->pool_cap) {
+		idx->pool_cap = max(idx->pool_cap * 2, idx->pool_size + len + 1);
+		idx->pool = xrealloc(idx->pool, idx->pool_cap);
+	}
+	uint32_t off = idx->pool_size;
+	memcpy(idx->pool + off, text, len);
+	idx->pool[off + len] = '\0';
+	idx->pool_size += len + 1;
+	return off;
+}
+
+static void push_text(struct mes_index *idx, uint32_t script, uint32_t no, uint32_t address,
+		const char *text, size_t len)
+{
+	struct mes_index_text t = {
+		.script = script,
+		.no = no,
+		.address = address,
+		.off = pool_add(idx, text, len),
+		.len = len,
+	};
+	vector_push(struct mes_index_text, idx->texts, t);
+}
+
+// FNV-1a
+static uint32_t data_hash(const uint8_t *data, size_t size)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < size; i++) {
+		h ^= data[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct mes_index_script *find_script(struct mes_index *idx, const char *name)
+{
+	struct mes_index_script *s;
+	vector_foreach_p(s, idx->scripts) {
+		if (!strcmp(s->name, name))
+			return s;
+	}
+	return NULL;
+}
+
+struct add_text_data {
+	struct mes_index *idx;
+	uint32_t script;
+	uint32_t no;
+};
+
+static void add_text(string text, struct mes_statement *stmt, unsigned nr_stmts, void *_data)
+{
+	struct add_text_data *data = _data;
+	push_text(data->idx, data->script, data->no++, stmt->address, text,
+			string_length(text));
+}
+
+/*
+ * Add the text of a mes file to the index. If `prev` contains an identical copy
+ * of the file (and was built with the same settings), its entries are copied
+ * over instead of parsing the file again.
+ */
+bool mes_index_add_script(struct mes_index *idx, const char *name, uint8_t *data,
+		size_t size, struct mes_index *prev)
+{
+	if (prev && !mes_index_compatible(idx, prev))
+		prev = NULL;
+
+	struct mes_index_script script = {
+		.name = string_new(name),
+		.hash = data_hash(data, size),
+		.first_text = vector_length(idx->texts),
+	};
+	uint32_t script_no = vector_length(idx->scripts);
+
+	struct mes_index_script *old = prev ? find_script(prev, name) : NULL;
+	if (old && old->hash == script.hash) {
+		for (uint32_t i = 0; i < old->nr_texts; i++) {
+			struct mes_index_text *t = &vector_A(prev->texts, old->first_text + i);
+			push_text(idx, script_no, t->no, t->address, prev->pool + t->off, t->len);
+		}
+	} else {
+		mes_statement_list statements = vector_initializer;
+		if (!mes_parse_statements(data, size, &statements)) {
+			string_free(script.name);
+			return false;
+		}
+		struct add_text_data d = { idx, script_no, 0 };
+		mes_statement_list_foreach_text(statements, idx->name_function, add_text, NULL, &d);
+		mes_statement_list_free(statements);
+	}
+
+	script.nr_texts = vector_length(idx->texts) - script.first_text;
+	vector_push(struct mes_index_script, idx->scripts, script);
+	return true;
+}
+
+struct gram_posting {
+	uint32_t gram;
+	uint32_t text;
+};
+
+static int gram_posting_cmp(const void *_a, const void *_b)
+{
+	const struct gram_posting *a = _a;
+	const struct gram_posting *b = _b;
+	if (a->gram != b->gram)
+		return a->gram < b->gram ? -1 : 1;
+	if (a->text != b->text)
+		return a->text < b->text ? -1 : 1;
+	return 0;
+}
+
+static inline uint32_t make_gram(const char *p)
+{
+	return ((uint32_t)(uint8_t)p[0] << 16) | ((uint32_t)(uint8_t)p[1] << 8) | (uint8_t)p[2];
+}
+
+/*
+ * Build the trigram table. Must be called once, after all scripts are added.
+ */
+void mes_index_finalize(struct mes_index *idx)
+{
+	size_t nr_pairs = 0;
+	struct mes_index_text *t;
+	vector_foreach_p(t, idx->texts) {
+		if (t->len >= 3)
+			nr_pairs += t->len - 2;
+	}
+
+	struct gram_posting *pairs = xcalloc(max(nr_pairs, 1), sizeof(struct gram_posting));
+	size_t n = 0;
+	for (uint32_t i = 0; i < vector_length(idx->texts); i++) {
+		t = &vector_A(idx->texts, i);
+		const char *text = idx->pool + t->off;
+		for (uint32_t j = 0; j + 2 < t->len; j++) {
+			pairs[n++] = (struct gram_posting) { make_gram(text + j), i };
+		}
+	}
+	qsort(pairs, n, sizeof(struct gram_posting), gram_posting_cmp);
+
+	for (size_t i = 0; i < n; i++) {
+		// skip repeated trigrams within a text
+		if (i > 0 && pairs[i].gram == pairs[i-1].gram && pairs[i].text == pairs[i-1].text)
+			continue;
+		if (i == 0 || pairs[i].gram != pairs[i-1].gram) {
+			struct mes_index_gram g = {
+				.gram = pairs[i].gram,
+				.off = vector_length(idx->postings),
+			};
+			vector_push(struct mes_index_gram, idx->grams, g);
+		}
+		vector_A(idx->grams, vector_length(idx->grams) - 1).count++;
+		vector_push(uint32_t, idx->postings, pairs[i].text);
+	}
+	free(pairs);
+}
+
+// serialization {{{
+
+static void write_u32_array(struct buffer *out, const uint32_t *a, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		buffer_write_u32(out, a[i]);
+	}
+}
+
+bool mes_index_write(struct mes_index *idx, const char *path)
+{
+	struct buffer out;
+	buffer_init(&out, NULL, 0);
+	buffer_write_bytes(&out, (uint8_t*)MES_INDEX_MAGIC, 4);
+	buffer_write_u32(&out, MES_INDEX_VERSION);
+	buffer_write_u32(&out, idx->game);
+	buffer_write_u32(&out, idx->name_function);
+	buffer_write_u32(&out, vector_length(idx->scripts));
+	buffer_write_u32(&out, vector_length(idx->texts));
+	buffer_write_u32(&out, vector_length(idx->grams));
+	buffer_write_u32(&out, vector_length(idx->postings));
+	buffer_write_u32(&out, idx->pool_size);
+
+	struct mes_index_script *s;
+	vector_foreach_p(s, idx->scripts) {
+		buffer_write_u32(&out, s->hash);
+		buffer_write_u32(&out, s->first_text);
+		buffer_write_u32(&out, s->nr_texts);
+		buffer_write_u32(&out, string_length(s->name));
+		buffer_write_bytes(&out, (uint8_t*)s->name, string_length(s->name));
+	}
+	struct mes_index_text *t;
+	vector_foreach_p(t, idx->texts) {
+		write_u32_array(&out, (uint32_t[]) { t->script, t->no, t->address, t->off, t->len }, 5);
+	}
+	struct mes_index_gram *g;
+	vector_foreach_p(g, idx->grams) {
+		write_u32_array(&out, (uint32_t[]) { g->gram, g->off, g->count }, 3);
+	}
+	write_u32_array(&out, idx->postings.a, vector_length(idx->postings));
+	buffer_write_bytes(&out, (uint8_t*)idx->pool, idx->pool_size);
+
+	bool r = file_write(path, out.buf, out.index);
+	free(out.buf);
+	return r;
+}
+
+struct index_reader {
+	uint8_t *data;
+	size_t size;
+	size_t pos;
+	bool error;
+};
+
+static uint32_t read_u32(struct index_reader *r)
+{
+	if (r->pos + 4 > r->size) {
+		r->error = true;
+		return 0;
+	}
+	uint32_t v = le_get32(r->data, r->pos);
+	r->pos += 4;
+	return v;
+}
+
+static const uint8_t *read_bytes(struct index_reader *r, size_t n)
+{
+	if (n > r->size - r->pos) {
+		r->error = true;
+		return NULL;
+	}
+	const uint8_t *p = r->data + r->pos;
+	r->pos += n;
+	return p;
+}
+
+bool mes_index_read(struct mes_index *idx, const char *path)
+{
+	struct index_reader r = {0};
+	if (!(r.data = file_read(path, &r.size)))
+		return false;
+
+	mes_index_init(idx, -1, -1);
+	const uint8_t *magic = read_bytes(&r, 4);
+	if (!magic || memcmp(magic, MES_INDEX_MAGIC, 4) || read_u32(&r) != MES_INDEX_VERSION) {
+		WARNING("Not a mes index file (or wrong version): %s", path);
+		free(r.data);
+		return false;
+	}
+	idx->game = (int32_t)read_u32(&r);
+	idx->name_function = (int32_t)read_u32(&r);
+	uint32_t nr_scripts = read_u32(&r);
+	uint32_t nr_texts = read_u32(&r);
+	uint32_t nr_grams = read_u32(&r);
+	uint32_t nr_postings = read_u32(&r);
+	uint32_t pool_size = read_u32(&r);
+
+	for (uint32_t i = 0; i < nr_scripts && !r.error; i++) {
+		struct mes_index_script s;
+		s.hash = read_u32(&r);
+		s.first_text = read_u32(&r);
+		s.nr_texts = read_u32(&r);
+		uint32_t name_len = read_u32(&r);
+		const uint8_t *name = read_bytes(&r, name_len);
+		if (r.error)
+			break;
+		s.name = string_new_len((const char*)name, name_len);
+		vector_push(struct mes_index_script, idx->scripts, s);
+	}
+	for (uint32_t i = 0; i < nr_texts && !r.error; i++) {
+		struct mes_index_text t;
+		t.script = read_u32(&r);
+		t.no = read_u32(&r);
+		t.address = read_u32(&r);
+		t.off = read_u32(&r);
+		t.len = read_u32(&r);
+		vector_push(struct mes_index_text, idx->texts, t);
+	}
+	for (uint32_t i = 0; i < nr_grams && !r.error; i++) {
+		struct mes_index_gram g;
+		g.gram = read_u32(&r);
+		g.off = read_u32(&r);
+		g.count = read_u32(&r);
+		vector_push(struct mes_index_gram, idx->grams, g);
+	}
+	for (uint32_t i = 0; i < nr_postings && !r.error; i++) {
+		vector_push(uint32_t, idx->postings, read_u32(&r));
+	}
+	const uint8_t *pool = read_bytes(&r, pool_size);
+	if (!r.error) {
+		idx->pool = xmalloc(max(pool_size, 1));
+		memcpy(idx->pool, pool, pool_size);
+		idx->pool_size = idx->pool_cap = pool_size;
+	}
+	free(r.data);
+
+	// validate offsets
+	struct mes_index_script *s;
+	vector_foreach_p(s, idx->scripts) {
+		if (r.error)
+			break;
+		if ((uint64_t)s->first_text + s->nr_texts > nr_texts)
+			r.error = true;
+	}
+	struct mes_index_text *t;
+	vector_foreach_p(t, idx->texts) {
+		if (r.error)
+			break;
+		// each entry must be a NUL-terminated string within the pool
+		if (t->script >= nr_scripts || (uint64_t)t->off + t->len >= pool_size
+				|| idx->pool[t->off + t->len] != '\0')
+			r.error = true;
+	}
+	struct mes_index_gram *g;
+	vector_foreach_p(g, idx->grams) {
+		if (r.error)
+			break;
+		if ((uint64_t)g->off + g->count > nr_postings)
+			r.error = true;
+	}
+	uint32_t p;
+	vector_foreach(p, idx->postings) {
+		if (r.error)
+			break;
+		if (p >= nr_texts)
+			r.error = true;
+	}
+	if (r.error) {
+		WARNING("Corrupt mes index file: %s", path);
+		mes_index_free(idx);
+		return false;
+	}
+	return true;
+}
+
+// serialization }}}
+// search {{{
+
+static struct mes_index_gram *find_gram(struct mes_index *idx, uint32_t gram)
+{
+	size_t lo = 0, hi = vector_length(idx->grams);
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		uint32_t g = vector_A(idx->grams, mid).gram;
+		if (g == gram)
+			return &vector_A(idx->grams, mid);
+		if (g < gram)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/*
+ * Call `handle_text` for every text entry containing `query` (in index order).
+ */
+void mes_index_search(struct mes_index *idx, const char *query,
+		void(*handle_text)(struct mes_index*, struct mes_index_text*, void*),
+		void *data)
+{
+	size_t len = strlen(query);
+	if (len < 3) {
+		// too short for the trigram table; scan every entry
+		struct mes_index_text *t;
+		vector_foreach_p(t, idx->texts) {
+			if (strstr(idx->pool + t->off, query))
+				handle_text(idx, t, data);
+		}
+		return;
+	}
+
+	// find the rarest trigram in the query
+	struct mes_index_gram *best = NULL;
+	for (size_t i = 0; i + 2 < len; i++) {
+		struct mes_index_gram *g = find_gram(idx, make_gram(query + i));
+		if (!g)
+			return;
+		if (!best || g->count < best->count)
+			best = g;
+	}
+
+	// verify candidates
+	for (uint32_t i = 0; i < best->count; i++) {
+		struct mes_index_text *t = &vector_A(idx->texts, vector_A(idx->postings, best->off + i));
+		if (t->len >= len && strstr(idx->pool + t->off, query))
+			handle_text(idx, t, data);
+	}
+}
+
+// search }}}
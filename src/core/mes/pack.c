@@ -293,6 +293,10 @@ uint8_t *mes_pack(mes_statement_list stmts, size_t *size_out)
 	struct buffer mes;
 	buffer_init(&mes, NULL, 0);
 
+	// statements are normally laid out before packing, so the final size is known
+	if (!vector_empty(stmts))
+		buffer_reserve(&mes, vector_A(stmts, vector_length(stmts) - 1)->next_address);
+
 	struct mes_statement *stmt;
 	vector_foreach(stmt, stmts) {
 		pack(&mes, stmt);
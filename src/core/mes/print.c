@@ -17,6 +17,7 @@
 #include <stdio.h>
 
 #include "nulib.h"
+#include "nulib/buffer.h"
 #include "nulib/port.h"
 #include "nulib/string.h"
 #include "ai5/game.h"
@@ -42,68 +43,176 @@ static bool stmt_is_normal_text(struct mes_statement *stmt)
 		&& stmt->TXT.terminated && !stmt->TXT.unprefixed;
 }
 
-void mes_statement_list_foreach_text(mes_statement_list statements,
+static bool stmt_is_name_call(struct mes_statement *stmt, struct mes_statement *next,
+		int name_function)
+{
+	if (stmt->op != MES_STMT_CALL_PROC || !next || !stmt_is_normal_text(next))
+		return false;
+	int f = get_int_parameter(stmt->CALL.params, 0);
+	return f >= 0 && f == name_function;
+}
+
+/*
+ * Iterate over runs of text in a statement list. Each run is passed to `handle_span`
+ * as a pointer into the statement list and a statement count; the run consists of
+ * normal text statements and (if `name_function` is non-negative) calls to the name
+ * function. No strings are materialized; use `mes_text_span_to_string` if needed.
+ */
+void mes_statement_list_foreach_text_span(mes_statement_list statements,
 		int name_function,
-		void(*handle_text)(string text, struct mes_statement*, unsigned, void*),
+		void(*handle_span)(struct mes_statement**, unsigned, void*),
 		void(*handle_statement)(struct mes_statement*, void*),
 		void *data)
 {
-	string text = NULL;
-	struct mes_statement *text_stmt = NULL;
-	unsigned text_nr_statements = 0;
-	for (unsigned i = 0; i < vector_length(statements); i++) {
+	const unsigned nr_statements = vector_length(statements);
+	unsigned span_start = 0;
+	unsigned span_len = 0;
+	for (unsigned i = 0; i < nr_statements; i++) {
 		struct mes_statement *stmt = vector_A(statements, i);
-		struct mes_statement *next = i + 1 < vector_length(statements) ?
+		struct mes_statement *next = i + 1 < nr_statements ?
 			vector_A(statements, i + 1) : NULL;
 		if (stmt_is_normal_text(stmt)) {
-			if (!text) {
-				text = string_dup(stmt->TXT.text);
-				text_stmt = stmt;
-				text_nr_statements = 1;
-			} else if (stmt->is_jump_target) {
-				handle_text(text, text_stmt, text_nr_statements, data);
-				string_free(text);
-				text = string_dup(stmt->TXT.text);
-				text_stmt = stmt;
-				text_nr_statements = 1;
-			} else {
-				text = string_concat(text, stmt->TXT.text);
-				text_nr_statements++;
+			if (span_len && stmt->is_jump_target) {
+				handle_span(&vector_A(statements, span_start), span_len, data);
+				span_len = 0;
 			}
+			if (!span_len)
+				span_start = i;
+			span_len++;
 			continue;
 		}
-		if (text && stmt->op == MES_STMT_CALL_PROC && next && stmt_is_normal_text(next)) {
-			int f = get_int_parameter(stmt->CALL.params, 0);
-			if (f >= 0 && f == name_function) {
-				text = string_concat_fmt(text, "$%i", f);
-				text_nr_statements++;
-				continue;
-			}
+		if (span_len && stmt_is_name_call(stmt, next, name_function)) {
+			span_len++;
+			continue;
 		}
-		if (text) {
-			handle_text(text, text_stmt, text_nr_statements, data);
-			string_free(text);
-			text = NULL;
+		if (span_len) {
+			handle_span(&vector_A(statements, span_start), span_len, data);
+			span_len = 0;
 		}
 		if (handle_statement)
 			handle_statement(stmt, data);
 	}
-	if (text) {
-		handle_text(text, text_stmt, text_nr_statements, data);
-		string_free(text);
+	if (span_len)
+		handle_span(&vector_A(statements, span_start), span_len, data);
+}
+
+static void text_span_write(struct buffer *b, struct mes_statement **stmts, unsigned nr_stmts)
+{
+	for (unsigned i = 0; i < nr_stmts; i++) {
+		if (stmt_is_normal_text(stmts[i])) {
+			buffer_write_bytes(b, (uint8_t*)stmts[i]->TXT.text,
+					string_length(stmts[i]->TXT.text));
+		} else {
+			// name function call
+			char num[16];
+			int len = snprintf(num, sizeof(num), "$%i",
+					get_int_parameter(stmts[i]->CALL.params, 0));
+			buffer_write_bytes(b, (uint8_t*)num, len);
+		}
 	}
 }
 
+/*
+ * Materialize the text of a span as passed to the handler of
+ * `mes_statement_list_foreach_text_span`.
+ */
+string mes_text_span_to_string(struct mes_statement **stmts, unsigned nr_stmts)
+{
+	struct buffer b;
+	buffer_init(&b, NULL, 0);
+	text_span_write(&b, stmts, nr_stmts);
+	string text = string_new_len((char*)b.buf, b.index);
+	free(b.buf);
+	return text;
+}
+
+struct foreach_text_data {
+	struct buffer scratch;
+	void(*handle_text)(string text, struct mes_statement*, unsigned, void*);
+	void *data;
+};
+
+static void foreach_text_handle_span(struct mes_statement **stmts, unsigned nr_stmts,
+		void *_data)
+{
+	struct foreach_text_data *data = _data;
+	// the scratch buffer is reused across spans so that each line costs one allocation
+	data->scratch.index = 0;
+	text_span_write(&data->scratch, stmts, nr_stmts);
+	string text = string_new_len((char*)data->scratch.buf, data->scratch.index);
+	data->handle_text(text, stmts[0], nr_stmts, data->data);
+	string_free(text);
+}
+
+void mes_statement_list_foreach_text(mes_statement_list statements,
+		int name_function,
+		void(*handle_text)(string text, struct mes_statement*, unsigned, void*),
+		void(*handle_statement)(struct mes_statement*, void*),
+		void *data)
+{
+	struct foreach_text_data d = {
+		.handle_text = handle_text,
+		.data = data,
+	};
+	buffer_init(&d.scratch, NULL, 0);
+	mes_statement_list_foreach_text_span(statements, name_function,
+			foreach_text_handle_span, handle_statement, &d);
+	free(d.scratch.buf);
+}
+
 // text iterator }}}
 // blocks {{{
 
+// output helpers {{{
+// These avoid port_printf in the hot paths of the AST and text printers.
+
 static void indent_print(struct port *out, int indent)
 {
-	for (int i = 0; i < indent; i++) {
-		port_putc(out, '\t');
+	static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+	const int nr_tabs = sizeof(tabs) - 1;
+	while (indent > 0) {
+		int n = indent < nr_tabs ? indent : nr_tabs;
+		port_write_bytes(out, (const uint8_t*)tabs, n);
+		indent -= n;
+	}
+}
+
+static void int_print(struct port *out, int i)
+{
+	char buf[16];
+	char *p = buf + sizeof(buf);
+	unsigned u = i < 0 ? -(unsigned)i : (unsigned)i;
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (i < 0)
+		*--p = '-';
+	port_write_bytes(out, (uint8_t*)p, (buf + sizeof(buf)) - p);
+}
+
+// prints "L_%08x:\n"
+static void label_print(struct port *out, uint32_t addr)
+{
+	static const char hex[] = "0123456789abcdef";
+	char buf[12] = { 'L', '_' };
+	for (int i = 0; i < 8; i++) {
+		buf[2 + i] = hex[(addr >> ((7 - i) * 4)) & 0xf];
 	}
+	buf[10] = ':';
+	buf[11] = '\n';
+	port_write_bytes(out, (uint8_t*)buf, sizeof(buf));
 }
 
+static void quoted_print(struct port *out, string text)
+{
+	port_putc(out, '"');
+	port_write_bytes(out, (uint8_t*)text, string_length(text));
+	port_putc(out, '"');
+}
+
+// output helpers }}}
+
 static enum mes_virtual_op vop(struct mes_statement *stmt)
 {
 	if (game_is_aiwin())
@@ -116,7 +225,7 @@ static void mes_block_edge_print(struct mes_basic_block *block, struct port *out
 	struct mes_statement *edge = block->end;
 	if (edge->is_jump_target) {
 		indent_print(out, indent - 1);
-		port_printf(out, "L_%08x:\n", edge->address);
+		label_print(out, edge->address);
 	}
 	indent_print(out, indent);
 
@@ -307,7 +416,8 @@ static void mes_ast_statement_list_print_text(string text, struct mes_statement
 {
 	struct statement_list_print_data *data = _data;
 	indent_print(data->out, data->indent);
-	port_printf(data->out, "\"%s\";\n", text);
+	quoted_print(data->out, text);
+	port_write_bytes(data->out, (uint8_t*)";\n", 2);
 }
 
 static void mes_ast_statement_list_print_stmt(struct mes_statement *stmt, void *_data)
@@ -334,7 +444,7 @@ static void mes_ast_node_print(struct mes_ast *node, int name_function, struct p
 {
 	if (node->is_goto_target) {
 		indent_print(out, indent - 1);
-		port_printf(out, "L_%08x:\n", node->address);
+		label_print(out, node->address);
 	}
 	switch (node->type) {
 	case MES_AST_STATEMENTS:
@@ -403,7 +513,11 @@ void mes_ast_print(struct mes_ast *node, int name_function, struct port *out)
 
 static void _mes_text_print(struct port *out, int i, string text)
 {
-	port_printf(out, "# %d \"%s\"\n\n", i, text);
+	port_write_bytes(out, (uint8_t*)"# ", 2);
+	int_print(out, i);
+	port_putc(out, ' ');
+	quoted_print(out, text);
+	port_write_bytes(out, (uint8_t*)"\n\n", 2);
 }
 
 struct text_print_data {
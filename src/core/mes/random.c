@@ -0,0 +1,330 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include "nulib.h"
+#include "nulib/string.h"
+#include "nulib/vector.h"
+#include "ai5/game.h"
+#include "ai5/mes.h"
+
+#include "mes.h"
+#include "flat_parser.h"
+
+/*
+ * Random script generator. Programs are built from the same constructors as the flat
+ * parser uses, restricted to constructs that every game of the target engine accepts
+ * and that have exactly one representation in each format (so that a round-trip
+ * through the parser, packer, flat printer and decompiler must reproduce them).
+ */
+
+#define MAX_DEPTH 3
+#define MAX_EXPR_DEPTH 3
+#define MAX_STATEMENTS 8
+
+struct rgen {
+	uint32_t state;
+	// statements left to generate
+	unsigned budget;
+	unsigned depth;
+	bool in_loop;
+};
+
+// {{{ utility
+
+static uint32_t rnd(struct rgen *g)
+{
+	// xorshift32
+	uint32_t x = g->state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	g->state = x;
+	return x;
+}
+
+static unsigned rnd_below(struct rgen *g, unsigned n)
+{
+	return rnd(g) % n;
+}
+
+static bool rnd_chance(struct rgen *g, unsigned percent)
+{
+	return rnd_below(g, 100) < percent;
+}
+
+static struct mes_expression *rnd_constant(struct rgen *g)
+{
+	switch (rnd_below(g, 4)) {
+	case 0:  return mes_expr_constant(rnd_below(g, 0x80));
+	case 1:  return mes_expr_constant(rnd_below(g, 0x100));
+	case 2:  return mes_expr_constant(rnd_below(g, 0x10000));
+	default: return mes_expr_constant(rnd(g) & 0x7fffffff);
+	}
+}
+
+// small constant, used for variable indices
+static struct mes_expression *rnd_index(struct rgen *g, unsigned n)
+{
+	return mes_expr_constant(rnd_below(g, n));
+}
+
+static string rnd_zenkaku(struct rgen *g)
+{
+	static const char * const chars[] = {
+		"あ", "い", "う", "え", "お", "か", "き", "く", "け", "こ",
+		"さ", "し", "す", "せ", "そ", "た", "ち", "つ", "て", "と",
+		"な", "に", "ぬ", "ね", "の", "ア", "イ", "ウ", "エ", "オ",
+		"。", "、", "！", "？", "「", "」",
+	};
+	string s = string_new("");
+	unsigned len = 1 + rnd_below(g, 24);
+	for (unsigned i = 0; i < len; i++) {
+		s = string_concat_cstring(s, chars[rnd_below(g, ARRAY_SIZE(chars))]);
+	}
+	return s;
+}
+
+static string rnd_hankaku(struct rgen *g)
+{
+	static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+	char buf[17];
+	unsigned len = 1 + rnd_below(g, 16);
+	for (unsigned i = 0; i < len; i++) {
+		buf[i] = chars[rnd_below(g, sizeof(chars) - 1)];
+	}
+	buf[len] = '\0';
+	return string_new(buf);
+}
+
+// }}} utility
+// {{{ expressions
+
+static const enum mes_expression_op binary_ops[] = {
+	MES_EXPR_PLUS, MES_EXPR_MINUS, MES_EXPR_MUL, MES_EXPR_DIV, MES_EXPR_MOD,
+	MES_EXPR_LT, MES_EXPR_GT, MES_EXPR_LTE, MES_EXPR_GTE, MES_EXPR_EQ, MES_EXPR_NEQ,
+	MES_EXPR_BITAND, MES_EXPR_BITXOR, MES_EXPR_BITIOR, MES_EXPR_AND, MES_EXPR_OR,
+};
+
+static struct mes_expression *ai5_rnd_expr(struct rgen *g, unsigned depth);
+static struct mes_expression *aiw_rnd_expr(struct rgen *g, unsigned depth);
+
+static struct mes_expression *rnd_expr(struct rgen *g, unsigned depth)
+{
+	return game_is_aiwin() ? aiw_rnd_expr(g, depth) : ai5_rnd_expr(g, depth);
+}
+
+static struct mes_expression *ai5_rnd_primary(struct rgen *g, unsigned depth)
+{
+	switch (rnd_below(g, 9)) {
+	case 0:  return mes_expr_var4(rnd_index(g, 0x80));
+	case 1:  return mes_expr_arg(rnd_index(g, 8));
+	case 2:  return mes_expr_var16(rnd_below(g, 26));
+	case 3:  return mes_expr_var32(rnd_below(g, 26));
+	case 4:  return mes_expr_system_var16(rnd_index(g, 16));
+	case 5:  return mes_expr_random(rnd_constant(g));
+	case 6:
+		if (depth > 0)
+			return mes_expr_array_index(MES_EXPR_PTR16_GET8, rnd_below(g, 26),
+					rnd_expr(g, depth - 1));
+		// fallthrough
+	default:
+		return rnd_constant(g);
+	}
+}
+
+static struct mes_expression *ai5_rnd_expr(struct rgen *g, unsigned depth)
+{
+	if (depth == 0 || rnd_chance(g, 40))
+		return ai5_rnd_primary(g, depth);
+	enum mes_expression_op op = binary_ops[rnd_below(g, ARRAY_SIZE(binary_ops))];
+	struct mes_expression *lhs = ai5_rnd_expr(g, depth - 1);
+	return mes_binary_expr(op, lhs, ai5_rnd_expr(g, depth - 1));
+}
+
+static struct mes_expression *aiw_rnd_primary(struct rgen *g, unsigned depth)
+{
+	switch (rnd_below(g, 8)) {
+	case 0:  return aiw_mes_expr_var4(rnd_index(g, 0x80));
+	case 1:  return aiw_mes_expr_var16(rnd_index(g, 26));
+	case 2:  return aiw_mes_expr_sysvar(rnd_index(g, 16));
+	case 3:  return aiw_mes_expr_var32(rnd_below(g, 26));
+	case 4:  return aiw_mes_expr_random(1 + rnd_below(g, 1000));
+	case 5:
+		if (depth > 0)
+			return aiw_mes_expr_ptr_get8(rnd_below(g, 26), rnd_expr(g, depth - 1));
+		// fallthrough
+	default:
+		return rnd_constant(g);
+	}
+}
+
+static struct mes_expression *aiw_rnd_expr(struct rgen *g, unsigned depth)
+{
+	if (depth == 0 || rnd_chance(g, 40))
+		return aiw_rnd_primary(g, depth);
+	enum mes_expression_op op = binary_ops[rnd_below(g, ARRAY_SIZE(binary_ops))];
+	struct mes_expression *lhs = aiw_rnd_expr(g, depth - 1);
+	return mes_binary_expr(op, lhs, aiw_rnd_expr(g, depth - 1));
+}
+
+static mes_expression_list rnd_exprs(struct rgen *g)
+{
+	mes_expression_list exprs = vector_initializer;
+	unsigned n = 1 + rnd_below(g, 3);
+	for (unsigned i = 0; i < n; i++) {
+		vector_push(struct mes_expression*, exprs, rnd_expr(g, MAX_EXPR_DEPTH));
+	}
+	return exprs;
+}
+
+static mes_parameter_list rnd_call_params(struct rgen *g)
+{
+	mes_parameter_list params = vector_initializer;
+	vector_push(struct mes_parameter, params, mes_param_expr(rnd_index(g, 16)));
+	unsigned n = rnd_below(g, 4);
+	for (unsigned i = 0; i < n; i++) {
+		vector_push(struct mes_parameter, params,
+				mes_param_expr(rnd_expr(g, MAX_EXPR_DEPTH)));
+	}
+	return params;
+}
+
+// }}} expressions
+// {{{ statements
+
+static struct mes_statement *ai5_rnd_stmt(struct rgen *g)
+{
+	uint8_t no = rnd_below(g, 26);
+	switch (rnd_below(g, 12)) {
+	case 0:  return mes_stmt_txt(rnd_zenkaku(g));
+	case 1:  return mes_stmt_str(rnd_hankaku(g));
+	case 2:  return mes_stmt_setrbx(rnd_index(g, 0x80), rnd_exprs(g));
+	case 3:  return mes_stmt_set_arg(rnd_index(g, 8), rnd_exprs(g));
+	case 4:  return mes_stmt_setv(no, rnd_exprs(g));
+	case 5:  return mes_stmt_setrd(no, rnd_exprs(g));
+	case 6:  return mes_stmt_setac(no, rnd_expr(g, 1), rnd_exprs(g));
+	case 7:  return mes_stmt_seta_at(no + 1, rnd_expr(g, 1), rnd_exprs(g));
+	case 8:  return mes_stmt_sys_var16_set(rnd_index(g, 16), rnd_exprs(g));
+	case 9:  return mes_stmt_proc(rnd_call_params(g));
+	case 10: return mes_stmt_line(rnd_below(g, 4));
+	default: return mes_stmt_txt(rnd_zenkaku(g));
+	}
+}
+
+static struct mes_statement *aiw_rnd_stmt(struct rgen *g)
+{
+	uint8_t no = rnd_below(g, 26);
+	struct mes_statement *stmt;
+	switch (rnd_below(g, 8)) {
+	case 0:  return aiw_mes_stmt_set_flag(rnd_index(g, 0x80), rnd_exprs(g));
+	case 1:  return aiw_mes_stmt_set_var16(rnd_index(g, 26), rnd_exprs(g));
+	case 2:  return aiw_mes_stmt_set_sysvar(rnd_index(g, 16), rnd_exprs(g));
+	case 3:  return aiw_mes_stmt_set_var32(no, rnd_expr(g, MAX_EXPR_DEPTH));
+	case 4:  return aiw_mes_stmt_ptr_set8(no, rnd_expr(g, 1), rnd_exprs(g));
+	case 5:  return _aiw_mes_stmt_call(AIW_MES_STMT_CALL_PROC, rnd_call_params(g));
+	default:
+		// hankaku text is padded to an even length on AIWIN, so only zenkaku
+		// text round-trips exactly
+		stmt = aiw_mes_stmt(AIW_MES_STMT_TXT);
+		stmt->TXT.text = rnd_zenkaku(g);
+		stmt->TXT.terminated = true;
+		return stmt;
+	}
+}
+
+// }}} statements
+// {{{ AST
+
+static mes_ast_block rnd_block(struct rgen *g);
+
+static mes_ast_block rnd_statements(struct rgen *g)
+{
+	mes_statement_list stmts = vector_initializer;
+	unsigned n = 1 + rnd_below(g, MAX_STATEMENTS);
+	for (unsigned i = 0; i < n && g->budget; i++, g->budget--) {
+		vector_push(struct mes_statement*, stmts,
+				game_is_aiwin() ? aiw_rnd_stmt(g) : ai5_rnd_stmt(g));
+	}
+	if (vector_empty(stmts)) {
+		vector_push(struct mes_statement*, stmts,
+				game_is_aiwin() ? aiw_rnd_stmt(g) : ai5_rnd_stmt(g));
+	}
+	return mf_ast_statements(stmts);
+}
+
+// non-empty block, nested one level deeper
+static mes_ast_block rnd_body(struct rgen *g, bool in_loop)
+{
+	bool outer_loop = g->in_loop;
+	g->depth++;
+	g->in_loop = in_loop;
+	mes_ast_block body = rnd_block(g);
+	g->in_loop = outer_loop;
+	g->depth--;
+	return body;
+}
+
+static struct mes_ast *rnd_cond(struct rgen *g)
+{
+	struct mes_expression *cond = rnd_expr(g, MAX_EXPR_DEPTH);
+	mes_ast_block consequent = rnd_body(g, g->in_loop);
+	mes_ast_block alternative = vector_initializer;
+	if (rnd_chance(g, 50))
+		alternative = rnd_body(g, g->in_loop);
+	// a break may only end a block, since anything after it would be unreachable
+	if (g->in_loop && rnd_chance(g, 25))
+		consequent = mf_ast_push(consequent, mf_ast_node(MES_AST_BREAK));
+	return mf_ast_cond(cond, consequent, alternative);
+}
+
+static mes_ast_block rnd_block(struct rgen *g)
+{
+	mes_ast_block block = rnd_statements(g);
+	while (g->budget && rnd_chance(g, 60)) {
+		unsigned r = g->depth < MAX_DEPTH ? rnd_below(g, 4) : 0;
+		if (r == 1)
+			block = mf_ast_push(block, rnd_cond(g));
+		else if (r == 2)
+			block = mf_ast_push(block, mf_ast_loop(rnd_expr(g, MAX_EXPR_DEPTH),
+						rnd_body(g, true)));
+		// consecutive statement lists would be merged by the decompiler
+		block = mf_ast_append(block, rnd_statements(g));
+	}
+	return block;
+}
+
+/*
+ * Generate a random program of roughly `nr_statements` statements for the target
+ * game: a toplevel block followed by procedure definitions, with conditionals and
+ * loops nested up to a few levels deep. The result is deterministic for a given
+ * seed, so that a failing program can be regenerated.
+ */
+mes_ast_block mes_random_program(uint32_t seed, unsigned nr_statements)
+{
+	struct rgen g = {
+		// xorshift32 gets stuck at zero
+		.state = seed ? seed : 0x9e3779b9,
+		.budget = max(1, nr_statements),
+	};
+	mes_ast_block program = rnd_block(&g);
+	for (unsigned no = 0; g.budget; no++) {
+		program = mf_ast_push(program, mf_ast_proc(MES_AST_PROCEDURE,
+					mes_expr_constant(no), rnd_body(&g, false)));
+	}
+	return program;
+}
+
+// }}} AST
@@ -455,3 +455,31 @@ uint32_t aiw_mes_statement_size(struct mes_statement *stmt)
 	}
 	return len;
 }
+
+/*
+ * Place a statement at the given address, recording its extent in
+ * address/next_address. Returns the address of the following statement.
+ *
+ * The size is always measured: a statement may have been modified since it was
+ * last placed, and struct mes_statement has no room to mark a cached size stale.
+ */
+uint32_t mes_statement_place(struct mes_statement *stmt, uint32_t addr)
+{
+	stmt->address = addr;
+	stmt->next_address = addr + mes_statement_size(stmt);
+	return stmt->next_address;
+}
+
+/*
+ * Assign addresses to a list of statements in a single pass. Returns the total
+ * size of the packed statements.
+ */
+uint32_t mes_statement_list_assign_addresses(mes_statement_list statements)
+{
+	uint32_t ip = 0;
+	struct mes_statement *stmt;
+	vector_foreach(stmt, statements) {
+		ip = mes_statement_place(stmt, ip);
+	}
+	return ip;
+}
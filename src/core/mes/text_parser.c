@@ -14,13 +14,16 @@
  * along with this program; if not, see <http://gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "nulib.h"
 #include "nulib/hashtable.h"
+#include "nulib/port.h"
 #include "nulib/string.h"
 #include "nulib/vector.h"
 #include "nulib/utfsjis.h"
@@ -28,76 +31,27 @@
 
 #include "mes.h"
 
-#ifdef _WIN32
-ssize_t getdelim(char **lineptr, size_t *n, int delim, FILE *stream) {
-    char *cur_pos, *new_lineptr;
-    size_t new_lineptr_len;
-    int c;
-
-    if (lineptr == NULL || n == NULL || stream == NULL) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    if (*lineptr == NULL) {
-        *n = 128; /* init len */
-        if ((*lineptr = xmalloc(*n)) == NULL) {
-            errno = ENOMEM;
-            return -1;
-        }
-    }
-
-    cur_pos = *lineptr;
-    for (;;) {
-        c = getc(stream);
-
-        if (ferror(stream) || (c == EOF && cur_pos == *lineptr))
-            return -1;
-
-        if (c == EOF)
-            break;
-
-        if ((*lineptr + *n - cur_pos) < 2) {
-            if (SSIZE_MAX / 2 < *n) {
-#ifdef EOVERFLOW
-                errno = EOVERFLOW;
-#else
-                errno = ERANGE; /* no EOVERFLOW defined */
-#endif
-                return -1;
-            }
-            new_lineptr_len = *n * 2;
-
-            if ((new_lineptr = xrealloc(*lineptr, new_lineptr_len)) == NULL) {
-                errno = ENOMEM;
-                return -1;
-            }
-            cur_pos = new_lineptr + (cur_pos - *lineptr);
-            *lineptr = new_lineptr;
-            *n = new_lineptr_len;
-        }
-
-        *cur_pos++ = (char)c;
-
-        if (c == delim)
-            break;
-    }
-
-    *cur_pos = '\0';
-    return (ssize_t)(cur_pos - *lineptr);
-}
-
-ssize_t getline(char **lineptr, size_t *n, FILE *stream) {
-    return getdelim(lineptr, n, '\n', stream);
-}
-#endif // _WIN32
-
 struct mes_encoder {
 	struct mes_statement *(*text)(string, bool);
 	struct mes_statement *(*line)(void);
 	struct mes_statement *(*call)(unsigned);
+	// copy a statement created by one of the above
+	struct mes_statement *(*copy)(struct mes_statement*);
 };
 
+// the encoder only generates constant parameters
+static mes_parameter_list copy_call_params(mes_parameter_list params)
+{
+	mes_parameter_list copy = vector_initializer;
+	struct mes_parameter *p;
+	vector_foreach_p(p, params) {
+		struct mes_expression *expr = xmalloc(sizeof(struct mes_expression));
+		*expr = *p->expr;
+		vector_push(struct mes_parameter, copy, mes_param_expr(expr));
+	}
+	return copy;
+}
+
 struct mes_statement *ai5_encode_text(string text, bool zenkaku)
 {
 	return zenkaku ? mes_stmt_txt(text) : mes_stmt_str(text);
@@ -115,10 +69,29 @@ struct mes_statement *ai5_encode_call(unsigned fno)
 	return stmt;
 }
 
+struct mes_statement *ai5_encode_copy(struct mes_statement *stmt)
+{
+	struct mes_statement *copy = xmalloc(sizeof(struct mes_statement));
+	*copy = *stmt;
+	switch (stmt->op) {
+	case MES_STMT_ZENKAKU:
+	case MES_STMT_HANKAKU:
+		copy->TXT.text = string_dup(stmt->TXT.text);
+		break;
+	case MES_STMT_CALL_PROC:
+		copy->CALL.params = copy_call_params(stmt->CALL.params);
+		break;
+	default:
+		break;
+	}
+	return copy;
+}
+
 static struct mes_encoder ai5_encoder = {
 	.text = ai5_encode_text,
 	.line = ai5_encode_line,
 	.call = ai5_encode_call,
+	.copy = ai5_encode_copy,
 };
 
 struct mes_statement *aiw_encode_text(string text, bool zenkaku)
@@ -145,62 +118,90 @@ struct mes_statement *aiw_encode_call(unsigned fno)
 	return stmt;
 }
 
+struct mes_statement *aiw_encode_copy(struct mes_statement *stmt)
+{
+	struct mes_statement *copy = xmalloc(sizeof(struct mes_statement));
+	*copy = *stmt;
+	switch (stmt->aiw_op) {
+	case AIW_MES_STMT_TXT:
+		copy->TXT.text = string_dup(stmt->TXT.text);
+		break;
+	case AIW_MES_STMT_CALL_PROC:
+		copy->CALL.params = copy_call_params(stmt->CALL.params);
+		break;
+	default:
+		break;
+	}
+	return copy;
+}
+
 static struct mes_encoder aiw_encoder = {
 	.text = aiw_encode_text,
 	.line = aiw_encode_line,
 	.call = aiw_encode_call,
+	.copy = aiw_encode_copy,
 };
 
 struct mes_text_sub_state {
+	// number of the current line (1-based)
 	unsigned line;
 	int columns;
+	// name from the most recent file header (bundles only)
+	bool bundle;
+	string file;
+	// cursor into the file buffer
+	char *p;
+	char *end;
 };
 
-static struct mes_encoder *mes_encoder = &ai5_encoder;
-
 #define PARSE_ERROR(state, msg, ...) \
-	sys_warning("Parse error: At line %d: " msg "\n", (state)->line + 1, ##__VA_ARGS__)
+	sys_warning("Parse error: At line %d: " msg "\n", (state)->line, ##__VA_ARGS__)
 
 #define PARSE_WARNING(state, msg, ...) \
-	sys_warning("WARNING: At line %d: " msg "\n", (state)->line + 1, ##__VA_ARGS__)
+	sys_warning("WARNING: At line %d: " msg "\n", (state)->line, ##__VA_ARGS__)
 
-typedef vector_t(char*) line_list;
-
-static bool read_lines(FILE *f, line_list *out)
+// read the entire file into a single NUL-terminated buffer
+static char *read_file(FILE *f, size_t *size_out)
 {
-	line_list lines = vector_initializer;
-
-	errno = 0;
+	size_t cap = 64 * 1024;
+	size_t size = 0;
+	char *buf = xmalloc(cap);
 	while (true) {
-		size_t _n;
-		char *line = NULL;
-		ssize_t size = getline(&line, &_n, f);
-		if (size <= 0) {
-			free(line);
-			break;
+		size += fread(buf + size, 1, cap - size - 1, f);
+		if (ferror(f)) {
+			free(buf);
+			return NULL;
 		}
-
-		// remove newline
-		if (line[size-1] == '\n') {
-			size--;
-			line[size] = '\0';
+		if (feof(f))
+			break;
+		if (cap - size - 1 == 0) {
+			cap *= 2;
+			buf = xrealloc(buf, cap);
 		}
-
-		vector_push(char*, lines, line);
 	}
+	buf[size] = '\0';
+	*size_out = size;
+	return buf;
+}
 
-	// handle read error
-	if (errno) {
-		char *p;
-		vector_foreach(p, lines) {
-			free(p);
-		}
-		vector_destroy(lines);
-		return false;
+/*
+ * Get the next line from the file buffer. The line is terminated in place, so
+ * the returned pointer remains valid for as long as the buffer does.
+ */
+static char *next_line(struct mes_text_sub_state *state)
+{
+	if (state->p >= state->end)
+		return NULL;
+	char *line = state->p;
+	char *eol = memchr(line, '\n', state->end - line);
+	if (eol) {
+		*eol = '\0';
+		state->p = eol + 1;
+	} else {
+		state->p = state->end;
 	}
-
-	*out = lines;
-	return true;
+	state->line++;
+	return line;
 }
 
 static inline bool expect_char(struct mes_text_sub_state *state, char **str, char c)
@@ -256,7 +257,7 @@ static inline bool read_string(struct mes_text_sub_state *state, char **str, str
 			return false;
 		}
 		if (*p == '\\') {
-			switch (++(*p)) {
+			switch (*(++p)) {
 			case 'n':
 			case 't':
 			case 'r':
@@ -324,6 +325,23 @@ static bool parse_head(struct mes_text_sub_state *state, char *head,
 		return expect_eol(state, head);
 	}
 
+	// file header (start of a new file in a bundle)
+	if (!strncmp(head, "file", 4) && (isspace(head[4]) || head[4] == '=')) {
+		if (!state->bundle) {
+			PARSE_ERROR(state, "File header outside of translation bundle");
+			return false;
+		}
+		head += 4;
+		skip_whitespace(&head);
+		if (!expect_char(state, &head, '='))
+			return false;
+		skip_whitespace(&head);
+		if (!read_string(state, &head, &state->file))
+			return false;
+		skip_whitespace(&head);
+		return expect_eol(state, head);
+	}
+
 	// start of substitution header
 	if (!read_int(state, &head, &sub->no))
 		return false;
@@ -347,15 +365,12 @@ static bool parse_head(struct mes_text_sub_state *state, char *head,
 void mes_text_sub_list_free(mes_text_sub_list list)
 {
 	struct mes_text_substitution *sub;
-	vector_foreach_p(sub, list) {
-		struct mes_text_line s;
-		vector_foreach(s, sub->to) {
-			free(s.text);
-		}
+	vector_foreach_p(sub, list.subs) {
 		vector_destroy(sub->to);
 		string_free(sub->from);
 	}
-	vector_destroy(list);
+	vector_destroy(list.subs);
+	free(list.text);
 }
 
 static unsigned strcols(struct mes_text_sub_state *state, const char *str)
@@ -389,106 +404,292 @@ static unsigned strcols(struct mes_text_sub_state *state, const char *str)
 	return cols;
 }
 
-bool mes_text_parse(FILE *f, mes_text_sub_list *out)
+/*
+ * Parse substitutions until the end of the buffer, or until a file header is
+ * encountered (in which case state->file is set).
+ */
+static bool parse_subs(struct mes_text_sub_state *state, mes_text_sub_list *out)
 {
-	line_list lines;
-	if (!read_lines(f, &lines)) {
-		WARNING("Read failure: %s", strerror(errno));
-		return true;
-	}
-
-	struct mes_text_sub_state state = {0};
-	mes_text_sub_list subs = vector_initializer;
-	while (state.line < vector_length(lines)) {
+	while (state->p < state->end) {
 		// parse substitution headers
 		struct mes_text_substitution sub = { .no = -1 };
-		while (state.line < vector_length(lines)) {
+		char *line;
+		while ((line = next_line(state))) {
 			// skip empty lines
-			while (state.line < vector_length(lines)
-					&& vector_A(lines, state.line)[0] == '\0')
-				state.line++;
+			if (*line == '\0')
+				continue;
 			// parse control line
-			if (!parse_head(&state, vector_A(lines, state.line++), &sub))
-				goto error;
+			if (!parse_head(state, line, &sub))
+				return false;
+			// start of next file
+			if (state->file)
+				return true;
 			// start of substitution
 			if (sub.no >= 0)
 				break;
 		}
-		sub.columns = state.columns;
+		if (sub.no < 0)
+			break;
+		sub.columns = state->columns;
 
 		// read lines until first blank line
-		while (state.line < vector_length(lines)) {
-			char *str = vector_A(lines, state.line);
+		while ((line = next_line(state))) {
 			// '## ...' is a comment
-			if (str[0] == '#' && str[1] == '#') {
-				state.line++;
+			if (line[0] == '#' && line[1] == '#')
 				continue;
-			}
-			unsigned cols = strcols(&state, str);
-			state.line++;
-			if (*str == '\0')
+			if (*line == '\0')
 				break;
-			struct mes_text_line l = { strdup(str), cols };
+			struct mes_text_line l = { line, strcols(state, line) };
 			vector_push(struct mes_text_line, sub.to, l);
 		}
 
-		vector_push(struct mes_text_substitution, subs, sub);
+		vector_push(struct mes_text_substitution, out->subs, sub);
 	}
+	return true;
+}
 
-	char *p;
-	vector_foreach(p, lines) {
-		free(p);
+bool mes_text_parse(FILE *f, mes_text_sub_list *out)
+{
+	size_t size;
+	char *text = read_file(f, &size);
+	if (!text) {
+		WARNING("Read failure: %s", strerror(errno));
+		return false;
+	}
+
+	struct mes_text_sub_state state = { .p = text, .end = text + size };
+	mes_text_sub_list subs = { .subs = vector_initializer, .text = text };
+	if (!parse_subs(&state, &subs)) {
+		mes_text_sub_list_free(subs);
+		return false;
 	}
-	vector_destroy(lines);
 
 	*out = subs;
 	return true;
-error:
-	vector_foreach(p, lines) {
-		free(p);
+}
+
+bool mes_text_bundle_parse(FILE *f, mes_text_bundle *out)
+{
+	size_t size;
+	char *text = read_file(f, &size);
+	if (!text) {
+		WARNING("Read failure: %s", strerror(errno));
+		return false;
 	}
-	vector_destroy(lines);
-	mes_text_sub_list_free(subs);
+
+	struct mes_text_sub_state state = { .bundle = true, .p = text, .end = text + size };
+	mes_text_bundle bundle = { .files = vector_initializer, .text = text };
+
+	// only configuration headers and comments may precede the first file
+	mes_text_sub_list preamble = { .subs = vector_initializer };
+	bool ok = parse_subs(&state, &preamble);
+	if (ok && !vector_empty(preamble.subs)) {
+		PARSE_ERROR(&state, "Substitution before first file header");
+		ok = false;
+	}
+	mes_text_sub_list_free(preamble);
+	if (!ok)
+		goto error;
+
+	while (state.file) {
+		struct mes_text_bundle_file file = {
+			.name = state.file,
+			.subs = { .subs = vector_initializer },
+		};
+		state.file = NULL;
+		ok = parse_subs(&state, &file.subs);
+		vector_push(struct mes_text_bundle_file, bundle.files, file);
+		if (!ok)
+			goto error;
+	}
+
+	*out = bundle;
+	return true;
+error:
+	string_free(state.file);
+	mes_text_bundle_free(bundle);
 	return false;
 }
 
-struct text_pos {
-	string text;
-	struct mes_statement *stmt;
-	unsigned nr_stmts;
+void mes_text_bundle_free(mes_text_bundle bundle)
+{
+	struct mes_text_bundle_file *file;
+	vector_foreach_p(file, bundle.files) {
+		string_free(file->name);
+		mes_text_sub_list_free(file->subs);
+	}
+	vector_destroy(bundle.files);
+	free(bundle.text);
+}
+
+// An occurrence of a source line within a bundle.
+struct dup_ref {
+	unsigned file;
+	struct mes_text_substitution *sub;
+};
+
+struct dup_group {
+	string from;
+	vector_t(struct dup_ref) refs;
 };
 
-typedef vector_t(struct text_pos) text_pos_list;
+declare_hashtable_string_type(dup_table, unsigned);
+define_hashtable_string(dup_table, unsigned);
+
+typedef vector_t(struct dup_group) dup_group_list;
 
-static void push_text_pos(string text, struct mes_statement *stmt, unsigned nr_stmt,
-		void *_data)
+// group the substitutions of a bundle by source line
+static dup_group_list dup_groups(mes_text_bundle *bundle)
 {
-	text_pos_list *text_locs = _data;
-	struct text_pos pos = { string_dup(text), stmt, nr_stmt };
-	vector_push(struct text_pos, *text_locs, pos);
+	hashtable_t(dup_table) table = hashtable_initializer(dup_table);
+	dup_group_list groups = vector_initializer;
+
+	for (unsigned i = 0; i < vector_length(bundle->files); i++) {
+		struct mes_text_bundle_file *file = &vector_A(bundle->files, i);
+		struct mes_text_substitution *sub;
+		vector_foreach_p(sub, file->subs.subs) {
+			int ret;
+			hashtable_iter_t k = hashtable_put(dup_table, &table, sub->from, &ret);
+			if (ret != HASHTABLE_KEY_PRESENT) {
+				struct dup_group g = { .from = sub->from, .refs = vector_initializer };
+				hashtable_val(&table, k) = vector_length(groups);
+				vector_push(struct dup_group, groups, g);
+			}
+			struct dup_ref ref = { .file = i, .sub = sub };
+			vector_push(struct dup_ref, vector_A(groups, hashtable_val(&table, k)).refs, ref);
+		}
+	}
+
+	hashtable_destroy(dup_table, &table);
+	return groups;
 }
 
-// Every jump target is stored in a hash table indexed by the original statement address.
-// Once the new statement list is prepared, this table is used to update jump addresses.
-declare_hashtable_int_type(addr_table, struct mes_statement*);
-define_hashtable_int(addr_table, struct mes_statement*);
+static void dup_groups_free(dup_group_list groups)
+{
+	struct dup_group *g;
+	vector_foreach_p(g, groups) {
+		vector_destroy(g->refs);
+	}
+	vector_destroy(groups);
+}
 
-static void addr_table_add(hashtable_t(addr_table) *table, uint32_t addr,
-		struct mes_statement *stmt)
+/*
+ * Copy the translation of a source line into every other substitution with the same
+ * source line which has no translation of its own. Returns the number of substitutions
+ * filled. The copied lines point into the bundle's text buffer.
+ */
+unsigned mes_text_bundle_fill_duplicates(mes_text_bundle *bundle)
 {
-	int ret;
-	hashtable_iter_t k = hashtable_put(addr_table, table, addr, &ret);
-	if (unlikely(ret == HASHTABLE_KEY_PRESENT))
-		ERROR("multiple statements with same address");
-	hashtable_val(table, k) = stmt;
+	unsigned nr_filled = 0;
+	dup_group_list groups = dup_groups(bundle);
+	struct dup_group *g;
+	vector_foreach_p(g, groups) {
+		if (vector_length(g->refs) < 2)
+			continue;
+		// first translated occurrence
+		struct mes_text_substitution *src = NULL;
+		struct dup_ref *ref;
+		vector_foreach_p(ref, g->refs) {
+			if (!vector_empty(ref->sub->to)) {
+				src = ref->sub;
+				break;
+			}
+		}
+		if (!src)
+			continue;
+		vector_foreach_p(ref, g->refs) {
+			if (!vector_empty(ref->sub->to))
+				continue;
+			struct mes_text_line *line;
+			vector_foreach_p(line, src->to) {
+				vector_push(struct mes_text_line, ref->sub->to, *line);
+			}
+			nr_filled++;
+		}
+	}
+	dup_groups_free(groups);
+	return nr_filled;
+}
+
+/*
+ * Write a report of source lines occurring more than once in a bundle, along with the
+ * location (file and line number) of each occurrence. Untranslated occurrences are
+ * marked with '*'. Returns the number of duplicated lines.
+ */
+unsigned mes_text_bundle_print_duplicates(mes_text_bundle *bundle, struct port *out)
+{
+	unsigned nr_dups = 0;
+	dup_group_list groups = dup_groups(bundle);
+	struct dup_group *g;
+	vector_foreach_p(g, groups) {
+		if (vector_length(g->refs) < 2)
+			continue;
+		port_printf(out, "%u\t%s\n", (unsigned)vector_length(g->refs), g->from);
+		struct dup_ref *ref;
+		vector_foreach_p(ref, g->refs) {
+			port_printf(out, "\t%s:%d%s\n",
+					vector_A(bundle->files, ref->file).name,
+					ref->sub->no,
+					vector_empty(ref->sub->to) ? " *" : "");
+		}
+		nr_dups++;
+	}
+	dup_groups_free(groups);
+	return nr_dups;
 }
 
-static uint32_t addr_table_get(hashtable_t(addr_table) *table, uint32_t addr)
+// A run of statements in the input list which is displayed as a single line of text.
+struct text_span {
+	unsigned start;
+	unsigned nr_stmts;
+};
+
+typedef vector_t(struct text_span) text_span_list;
+
+struct text_span_data {
+	struct mes_statement **base;
+	text_span_list spans;
+};
+
+static void push_text_span(struct mes_statement **stmts, unsigned nr_stmts, void *_data)
+{
+	struct text_span_data *data = _data;
+	struct text_span span = { stmts - data->base, nr_stmts };
+	vector_push(struct text_span, data->spans, span);
+}
+
+// Each substituted span is recorded along with the cumulative change in size after it.
+// Since addresses are only shifted between edits, this list is enough to map any
+// original jump target to its new address.
+struct text_edit {
+	uint32_t old_start;
+	uint32_t old_end;
+	uint32_t new_start;
+	int64_t delta;
+};
+
+typedef vector_t(struct text_edit) text_edit_list;
+
+static uint32_t text_edit_map_address(text_edit_list *edits, uint32_t addr)
 {
-	hashtable_iter_t k = hashtable_get(addr_table, table, addr);
-	if (unlikely(k == hashtable_end(table)))
+	// find the last edit starting at or before addr
+	size_t lo = 0, hi = vector_length(*edits);
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (vector_A(*edits, mid).old_start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return addr;
+
+	struct text_edit *e = &vector_A(*edits, lo - 1);
+	if (addr == e->old_start)
+		return e->new_start;
+	if (addr < e->old_end)
 		ERROR("address lookup failed for %08x", (unsigned)addr);
-	return hashtable_val(table, k)->address;
+	return addr + e->delta;
 }
 
 // update statement address and push to statement list
@@ -496,33 +697,57 @@ static void push_stmt(struct mes_statement *stmt, mes_statement_list *mes, uint3
 {
 	if (!stmt)
 		return;
-	stmt->address = *mes_addr;
-	*mes_addr += mes_statement_size(stmt);
+	*mes_addr = mes_statement_place(stmt, *mes_addr);
 	vector_push(struct mes_statement*, *mes, stmt);
 }
 
-static void push_string(const char *text, size_t len, bool zenkaku,
-		mes_statement_list *mes, uint32_t *mes_addr)
+// Encoded substitutions are cached by their text, so that a line which recurs across a
+// batch of files is only encoded once. The cache is owned by the caller of
+// mes_substitute_text; each hit is copied into the output statement list.
+struct encode_entry {
+	// key: the target game, columns setting and lines of the substitution
+	int game;
+	int columns;
+	unsigned nr_lines;
+	// lines of the substitution, each followed by a NUL byte
+	char *text;
+	size_t text_size;
+	// encoded statements (addresses unassigned)
+	mes_statement_list stmts;
+	// lines exceeding the configured columns value
+	unsigned nr_overlong;
+	// next entry with the same hash
+	struct encode_entry *next;
+};
+
+declare_hashtable_int_type(encode_table, struct encode_entry*);
+define_hashtable_int(encode_table, struct encode_entry*);
+
+struct mes_text_encode_cache {
+	hashtable_t(encode_table) table;
+	// the cache may be shared between threads; entries are never modified once
+	// added, so only lookups/insertions need the lock
+	pthread_mutex_t lock;
+};
+
+static void encode_push_text(struct mes_encoder *enc, mes_statement_list *out,
+		const char *text, size_t len, bool zenkaku)
 {
-	string str = string_new_len(text, len);
-	struct mes_statement *stmt = mes_encoder->text(str, zenkaku);
-	push_stmt(stmt, mes, mes_addr);
+	struct mes_statement *stmt = enc->text(string_new_len(text, len), zenkaku);
+	vector_push(struct mes_statement*, *out, stmt);
 }
 
-// split text into hankaku/zenkaku parts and push statements to list
-bool encode_substitution(struct mes_text_substitution *sub, mes_statement_list *mes,
-		uint32_t *mes_addr)
+static void encode_push(mes_statement_list *out, struct mes_statement *stmt)
 {
-	if (vector_length(sub->to) == 0) {
-		const char *tmp;
-		// TODO: print this only in verbose mode
-		//sys_warning("WARNING: no substitution for string %d\n", sub->no);
-		push_string(sub->from, string_length(sub->from),
-				utf8_sjis_char_length(sub->from, &tmp) == 2,
-				mes, mes_addr);
-		return false;
-	}
+	if (stmt)
+		vector_push(struct mes_statement*, *out, stmt);
+}
 
+// split text into hankaku/zenkaku parts
+static void encode_lines(struct mes_encoder *enc, struct mes_text_substitution *sub,
+		struct encode_entry *entry)
+{
+	mes_statement_list *out = &entry->stmts;
 	int line_no = 0;
 	struct mes_text_line line = vector_A(sub->to, 0);
 	const char *p = line.text;
@@ -532,14 +757,13 @@ bool encode_substitution(struct mes_text_substitution *sub, mes_statement_list *
 		// end of line
 		if (*p == '\0') {
 			if (p > start)
-				push_string(start, p - start, zenkaku, mes, mes_addr);
+				encode_push_text(enc, out, start, p - start, zenkaku);
 			if (++line_no >= vector_length(sub->to))
 				break;
 			if (line.columns < sub->columns)
-				push_stmt(mes_encoder->line(), mes, mes_addr);
+				encode_push(out, enc->line());
 			if (sub->columns && line.columns > sub->columns)
-				sys_warning("WARNING: Line # %d exceeds configured columns value\n",
-						sub->no);
+				entry->nr_overlong++;
 			line = vector_A(sub->to, line_no);
 			p = line.text;
 			start = p;
@@ -551,8 +775,8 @@ bool encode_substitution(struct mes_text_substitution *sub, mes_statement_list *
 			if (*endptr != ')' || i < 0)
 				ERROR("Invalid '$' call in string: %s", p);
 			if (p > start)
-				push_string(start, p - start, zenkaku, mes, mes_addr);
-			push_stmt(mes_encoder->call(i), mes, mes_addr);
+				encode_push_text(enc, out, start, p - start, zenkaku);
+			encode_push(out, enc->call(i));
 			p = endptr + 1;
 		}
 		const char *next;
@@ -581,27 +805,160 @@ bool encode_substitution(struct mes_text_substitution *sub, mes_statement_list *
 			next_zenkaku = utf8_sjis_char_length(p, &next) == 2;
 		}
 		if (p > start && zenkaku != next_zenkaku) {
-			push_string(start, p - start, zenkaku, mes, mes_addr);
+			encode_push_text(enc, out, start, p - start, zenkaku);
 			start = p;
 		}
 		zenkaku = next_zenkaku;
 		p = next;
 	}
+}
+
+// FNV-1a over the key of an entry; also computes the size of the entry's text
+static uint32_t encode_hash(struct mes_text_substitution *sub, size_t *size_out)
+{
+	uint32_t h = 2166136261u;
+	h = (h ^ (uint32_t)ai5_target_game) * 16777619u;
+	h = (h ^ (uint32_t)sub->columns) * 16777619u;
+	size_t size = 0;
+	struct mes_text_line *line;
+	vector_foreach_p(line, sub->to) {
+		const char *p = line->text;
+		do {
+			h = (h ^ (uint8_t)*p) * 16777619u;
+			size++;
+		} while (*p++);
+	}
+	*size_out = size;
+	return h;
+}
+
+static bool encode_entry_match(struct encode_entry *entry, struct mes_text_substitution *sub,
+		size_t size)
+{
+	if (entry->game != ai5_target_game || entry->columns != sub->columns
+			|| entry->nr_lines != vector_length(sub->to) || entry->text_size != size)
+		return false;
+	const char *p = entry->text;
+	struct mes_text_line *line;
+	vector_foreach_p(line, sub->to) {
+		size_t len = strlen(line->text) + 1;
+		if (memcmp(p, line->text, len))
+			return false;
+		p += len;
+	}
 	return true;
 }
 
-static void copy_stmt(mes_statement_list mes, unsigned mes_pos, uint32_t *mes_addr,
-		mes_statement_list *mes_out, hashtable_t(addr_table) *table)
+static struct encode_entry *encode_entry_new(struct mes_encoder *enc,
+		struct mes_text_substitution *sub, size_t size)
+{
+	struct encode_entry *entry = xmalloc(sizeof(struct encode_entry));
+	*entry = (struct encode_entry) {
+		.game = ai5_target_game,
+		.columns = sub->columns,
+		.nr_lines = vector_length(sub->to),
+		.text = xmalloc(size),
+		.text_size = size,
+		.stmts = vector_initializer,
+	};
+	char *p = entry->text;
+	struct mes_text_line *line;
+	vector_foreach_p(line, sub->to) {
+		size_t len = strlen(line->text) + 1;
+		memcpy(p, line->text, len);
+		p += len;
+	}
+	encode_lines(enc, sub, entry);
+	return entry;
+}
+
+static struct encode_entry *encode_cache_get(struct mes_text_encode_cache *cache,
+		struct mes_encoder *enc, struct mes_text_substitution *sub)
+{
+	size_t size;
+	uint32_t h = encode_hash(sub, &size);
+
+	int ret;
+	hashtable_iter_t k = hashtable_put(encode_table, &cache->table, (int32_t)h, &ret);
+	struct encode_entry *head = NULL;
+	if (ret == HASHTABLE_KEY_PRESENT) {
+		head = hashtable_val(&cache->table, k);
+		for (struct encode_entry *e = head; e; e = e->next) {
+			if (encode_entry_match(e, sub, size))
+				return e;
+		}
+	}
+
+	struct encode_entry *entry = encode_entry_new(enc, sub, size);
+	entry->next = head;
+	hashtable_val(&cache->table, k) = entry;
+	return entry;
+}
+
+struct mes_text_encode_cache *mes_text_encode_cache_new(void)
+{
+	struct mes_text_encode_cache *cache = xmalloc(sizeof(struct mes_text_encode_cache));
+	hashtable_t(encode_table) table = hashtable_initializer(encode_table);
+	cache->table = table;
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+void mes_text_encode_cache_free(struct mes_text_encode_cache *cache)
 {
-	assert(mes_pos < vector_length(mes));
-	struct mes_statement *stmt = vector_A(mes, mes_pos);
-	// add old address to table if the statement is a jump target
-	if (stmt->is_jump_target)
-		addr_table_add(table, stmt->address, stmt);
-	push_stmt(stmt, mes_out, mes_addr);
+	if (!cache)
+		return;
+	struct encode_entry *entry;
+	hashtable_foreach_value(&cache->table, entry) {
+		while (entry) {
+			struct encode_entry *next = entry->next;
+			mes_statement_list_free(entry->stmts);
+			free(entry->text);
+			free(entry);
+			entry = next;
+		}
+	}
+	hashtable_destroy(encode_table, &cache->table);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
 }
 
-static void ai5_update_addresses(mes_statement_list mes_out, hashtable_t(addr_table) *table)
+// encode substitution text as statements and push to list
+static bool encode_substitution(struct mes_encoder *enc, struct mes_text_encode_cache *cache,
+		struct mes_text_substitution *sub, mes_statement_list *mes, uint32_t *mes_addr)
+{
+	if (vector_length(sub->to) == 0) {
+		const char *tmp;
+		// TODO: print this only in verbose mode
+		//sys_warning("WARNING: no substitution for string %d\n", sub->no);
+		bool zenkaku = utf8_sjis_char_length(sub->from, &tmp) == 2;
+		push_stmt(enc->text(string_dup(sub->from), zenkaku), mes, mes_addr);
+		return false;
+	}
+
+	// without a cache, the encoded statements are moved to the output list
+	struct encode_entry tmp = { .stmts = vector_initializer };
+	struct encode_entry *entry = &tmp;
+	if (cache) {
+		pthread_mutex_lock(&cache->lock);
+		entry = encode_cache_get(cache, enc, sub);
+		pthread_mutex_unlock(&cache->lock);
+	} else
+		encode_lines(enc, sub, &tmp);
+
+	for (unsigned i = 0; i < entry->nr_overlong; i++) {
+		sys_warning("WARNING: Line # %d exceeds configured columns value\n", sub->no);
+	}
+	struct mes_statement *stmt;
+	vector_foreach(stmt, entry->stmts) {
+		push_stmt(cache ? enc->copy(stmt) : stmt, mes, mes_addr);
+	}
+	if (!cache)
+		vector_destroy(tmp.stmts);
+	return true;
+}
+
+static void ai5_update_addresses(mes_statement_list mes_out, text_edit_list *edits)
 {
 	struct mes_statement *stmt;
 	vector_foreach(stmt, mes_out) {
@@ -614,11 +971,11 @@ static void ai5_update_addresses(mes_statement_list mes_out, hashtable_t(addr_ta
 		default: continue;
 		}
 		// replace old address with new address
-		*addr = addr_table_get(table, *addr);
+		*addr = text_edit_map_address(edits, *addr);
 	}
 }
 
-static void aiw_update_addresses(mes_statement_list mes_out, hashtable_t(addr_table) *table)
+static void aiw_update_addresses(mes_statement_list mes_out, text_edit_list *edits)
 {
 	struct mes_statement *stmt;
 	vector_foreach(stmt, mes_out) {
@@ -630,83 +987,97 @@ static void aiw_update_addresses(mes_statement_list mes_out, hashtable_t(addr_ta
 		default: continue;
 		}
 		// replace old address with new address
-		*addr = addr_table_get(table, *addr);
+		*addr = text_edit_map_address(edits, *addr);
 	}
 }
 
-mes_statement_list mes_substitute_text(mes_statement_list mes, mes_text_sub_list subs_in)
+static int sub_ptr_cmp(const void *_a, const void *_b)
 {
-	if (game_is_aiwin())
-		mes_encoder = &aiw_encoder;
-	else
-		mes_encoder = &ai5_encoder;
-
-	// create list of text positions
-	text_pos_list text_locs = vector_initializer;
-	mes_statement_list_foreach_text(mes, -1, push_text_pos, NULL, &text_locs);
+	struct mes_text_substitution *a = *(struct mes_text_substitution**)_a;
+	struct mes_text_substitution *b = *(struct mes_text_substitution**)_b;
+	if (a->no != b->no)
+		return a->no < b->no ? -1 : 1;
+	// preserve input order for duplicates (the last one wins)
+	return a < b ? -1 : (a > b ? 1 : 0);
+}
 
-	// create corresponding list of text substitutions
-	mes_text_sub_list subs = vector_initializer;
-	vector_resize(struct mes_text_substitution, subs, vector_length(text_locs));
-	memset(subs.a, 0, subs.n * sizeof(struct mes_text_substitution));
-	struct mes_text_substitution *sub;
-	vector_foreach_p(sub, subs_in) {
-		if (sub->no < 0 || sub->no >= vector_length(subs))
-			ERROR("Invalid string number in substitution: %d", sub->no);
-		assert(sub->no >= 0 && sub->no <= vector_length(subs));
-		vector_set(struct mes_text_substitution, subs, sub->no, *sub);
+/*
+ * Substitute text into a mes file. If `cache` is given, encoded substitutions are
+ * reused from (and added to) it; a cache may be shared by any number of calls,
+ * including concurrent calls from different threads.
+ */
+mes_statement_list mes_substitute_text(mes_statement_list mes, mes_text_sub_list subs_in,
+		struct mes_text_encode_cache *cache)
+{
+	struct mes_encoder *enc = game_is_aiwin() ? &aiw_encoder : &ai5_encoder;
+
+	// locate text spans in the input statement list
+	struct text_span_data span_data = { mes.a, vector_initializer };
+	mes_statement_list_foreach_text_span(mes, -1, push_text_span, NULL, &span_data);
+	text_span_list spans = span_data.spans;
+
+	// sort substitutions by string number
+	size_t nr_subs = vector_length(subs_in.subs);
+	struct mes_text_substitution **subs = xcalloc(nr_subs, sizeof(*subs));
+	for (size_t i = 0; i < nr_subs; i++) {
+		subs[i] = &vector_A(subs_in.subs, i);
+		if (subs[i]->no < 0 || subs[i]->no >= vector_length(spans))
+			ERROR("Invalid string number in substitution: %d", subs[i]->no);
 	}
-
-	// hash table associating (original) address to statement object for each jump target
-	hashtable_t(addr_table) table = hashtable_initializer(addr_table);
+	qsort(subs, nr_subs, sizeof(*subs), sub_ptr_cmp);
 
 	// create new statement list with text substituted
 	unsigned mes_pos = 0;
 	uint32_t mes_addr = 0;
 	mes_statement_list mes_out = vector_initializer;
+	text_edit_list edits = vector_initializer;
 	unsigned missing_subs = 0;
-	for (int i = 0; i < vector_length(subs); i++) {
-		struct mes_text_substitution *sub = &vector_A(subs, i);
-		struct text_pos *loc = &vector_A(text_locs, i);
+	for (size_t i = 0; i < nr_subs; i++) {
+		struct mes_text_substitution *sub = subs[i];
 		if (!sub->from)
 			continue;
+		if (i + 1 < nr_subs && subs[i+1]->no == sub->no)
+			continue;
+		struct text_span *span = &vector_A(spans, sub->no);
+
 		// copy statements up until the current substitution
-		for (; vector_A(mes, mes_pos) != loc->stmt; mes_pos++) {
-			copy_stmt(mes, mes_pos, &mes_addr, &mes_out, &table);
+		for (; mes_pos < span->start; mes_pos++) {
+			push_stmt(vector_A(mes, mes_pos), &mes_out, &mes_addr);
 		}
+
 		// encode substitution text as statement(s) and push to new list
-		size_t n = vector_length(mes_out);
-		if (!encode_substitution(sub, &mes_out, &mes_addr))
+		struct mes_statement *last = vector_A(mes, mes_pos + span->nr_stmts - 1);
+		struct text_edit edit = {
+			.old_start = vector_A(mes, mes_pos)->address,
+			.old_end = last->address + mes_statement_size(last),
+			.new_start = mes_addr,
+		};
+		if (!encode_substitution(enc, cache, sub, &mes_out, &mes_addr))
 			missing_subs++;
-		if (loc->stmt->is_jump_target) {
-			addr_table_add(&table, vector_A(mes, mes_pos)->address, vector_A(mes_out, n));
-		}
+		edit.delta = (int64_t)mes_addr - edit.old_end;
+		vector_push(struct text_edit, edits, edit);
 
 		// skip original statements
-		for (int j = mes_pos; j < mes_pos + loc->nr_stmts; j++) {
+		for (unsigned j = mes_pos; j < mes_pos + span->nr_stmts; j++) {
 			mes_statement_free(vector_A(mes, j));
 		}
-		mes_pos += loc->nr_stmts;
+		mes_pos += span->nr_stmts;
 	}
 	// copy remaining statements at end of file
 	for (; mes_pos < vector_length(mes); mes_pos++) {
-		copy_stmt(mes, mes_pos, &mes_addr, &mes_out, &table);
+		push_stmt(vector_A(mes, mes_pos), &mes_out, &mes_addr);
 	}
 
 	// update jump target addresses
 	if (game_is_aiwin())
-		aiw_update_addresses(mes_out, &table);
+		aiw_update_addresses(mes_out, &edits);
 	else
-		ai5_update_addresses(mes_out, &table);
+		ai5_update_addresses(mes_out, &edits);
 
-	struct text_pos *loc;
-	vector_foreach_p(loc, text_locs) {
-		string_free(loc->text);
-	}
-	vector_destroy(text_locs);
-	vector_destroy(subs);
+	free(subs);
+	vector_destroy(spans);
+	vector_destroy(edits);
 	vector_destroy(mes);
-	hashtable_destroy(addr_table, &table);
 	if (missing_subs)
 		sys_warning("WARNING: %u lines without substitutions.\n", missing_subs);
 	return mes_out;
@@ -0,0 +1,552 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "nulib.h"
+#include "nulib/buffer.h"
+#include "nulib/file.h"
+#include "nulib/little_endian.h"
+#include "nulib/string.h"
+#include "nulib/vector.h"
+#include "ai5/game.h"
+
+#include "mes.h"
+
+/*
+ * The table is a flat list of references sorted by (kind, number), so that all
+ * references to a given procedure/variable can be found with a binary search.
+ *
+ * On disk (all integers are little endian u32):
+ *
+ *   "MXRF" version nr_names nr_refs
+ *   names: len name[len]
+ *   refs:  kind|(access<<8) script no address
+ */
+
+#define MES_XREF_MAGIC "MXRF"
+#define MES_XREF_VERSION 2
+
+const char * const mes_xref_kind_names[MES_XREF_NR_KINDS] = {
+	[MES_XREF_PROC] = "proc",
+	[MES_XREF_SUB] = "sub",
+	[MES_XREF_MES] = "mes",
+	[MES_XREF_FLAG] = "flag",
+	[MES_XREF_VAR16] = "var16",
+	[MES_XREF_VAR32] = "var32",
+	[MES_XREF_SYSVAR] = "sysvar",
+	[MES_XREF_SYSVAR32] = "sysvar32",
+	[MES_XREF_ARG] = "arg",
+};
+
+const char * const mes_xref_access_names[MES_XREF_NR_ACCESS] = {
+	[MES_XREF_DEFINE] = "define",
+	[MES_XREF_CALL] = "call",
+	[MES_XREF_READ] = "read",
+	[MES_XREF_WRITE] = "write",
+};
+
+void mes_xref_table_init(struct mes_xref_table *table)
+{
+	memset(table, 0, sizeof(struct mes_xref_table));
+}
+
+void mes_xref_table_free(struct mes_xref_table *table)
+{
+	string name;
+	vector_foreach(name, table->names) {
+		string_free(name);
+	}
+	vector_destroy(table->names);
+	vector_destroy(table->refs);
+	mes_xref_table_init(table);
+}
+
+int mes_xref_name_index(struct mes_xref_table *table, const char *name)
+{
+	for (unsigned i = 0; i < vector_length(table->names); i++) {
+		if (!strcasecmp(vector_A(table->names, i), name))
+			return i;
+	}
+	return -1;
+}
+
+static uint32_t intern_name(struct mes_xref_table *table, const char *name)
+{
+	int i = mes_xref_name_index(table, name);
+	if (i >= 0)
+		return i;
+	vector_push(string, table->names, string_new(name));
+	return vector_length(table->names) - 1;
+}
+
+// collection {{{
+
+struct xref_state {
+	struct mes_xref_table *table;
+	uint32_t script;
+	uint32_t address;
+};
+
+static void push_ref(struct xref_state *state, enum mes_xref_kind kind,
+		enum mes_xref_access access, uint32_t no)
+{
+	struct mes_xref ref = {
+		.kind = kind,
+		.access = access,
+		.script = state->script,
+		.no = no,
+		.address = state->address,
+	};
+	vector_push(struct mes_xref, state->table->refs, ref);
+}
+
+static bool expr_constant(struct mes_expression *expr, uint32_t *out)
+{
+	if (game_is_aiwin()) {
+		switch (expr->aiw_op) {
+		case AIW_MES_EXPR_IMM: *out = expr->arg8; return true;
+		case AIW_MES_EXPR_IMM16: *out = expr->arg16; return true;
+		case AIW_MES_EXPR_IMM32: *out = expr->arg32; return true;
+		default: return false;
+		}
+	}
+	switch (expr->op) {
+	case MES_EXPR_IMM: *out = expr->arg8; return true;
+	case MES_EXPR_IMM16: *out = expr->arg16; return true;
+	case MES_EXPR_IMM32: *out = expr->arg32; return true;
+	default: return false;
+	}
+}
+
+static void expr_refs(struct xref_state *state, struct mes_expression *expr)
+{
+	if (!expr)
+		return;
+	if (game_is_aiwin()) {
+		switch (expr->aiw_op) {
+		case AIW_MES_EXPR_GET_FLAG_CONST:
+			push_ref(state, MES_XREF_FLAG, MES_XREF_READ, expr->arg16);
+			break;
+		case AIW_MES_EXPR_GET_VAR16_CONST:
+			push_ref(state, MES_XREF_VAR16, MES_XREF_READ, expr->arg16);
+			break;
+		case AIW_MES_EXPR_GET_SYSVAR_CONST:
+			push_ref(state, MES_XREF_SYSVAR, MES_XREF_READ, expr->arg16);
+			break;
+		case AIW_MES_EXPR_VAR32:
+			push_ref(state, MES_XREF_VAR32, MES_XREF_READ, expr->arg8);
+			break;
+		default:
+			break;
+		}
+	} else {
+		switch (expr->op) {
+		case MES_EXPR_GET_FLAG_CONST:
+			push_ref(state, MES_XREF_FLAG, MES_XREF_READ, expr->arg16);
+			break;
+		case MES_EXPR_GET_VAR16:
+			push_ref(state, MES_XREF_VAR16, MES_XREF_READ, expr->arg8);
+			break;
+		case MES_EXPR_GET_VAR32:
+			push_ref(state, MES_XREF_VAR32, MES_XREF_READ, expr->arg8);
+			break;
+		case MES_EXPR_GET_ARG_CONST:
+			push_ref(state, MES_XREF_ARG, MES_XREF_READ, expr->arg16);
+			break;
+		case MES_EXPR_PTR16_GET16:
+		case MES_EXPR_PTR32_GET32: {
+			// pointer variable 0 is the system variable table
+			uint32_t no;
+			if (expr->arg8 == 0 && expr_constant(expr->sub_a, &no)) {
+				push_ref(state, expr->op == MES_EXPR_PTR16_GET16 ? MES_XREF_SYSVAR
+						: MES_XREF_SYSVAR32, MES_XREF_READ, no);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+	expr_refs(state, expr->sub_a);
+	expr_refs(state, expr->sub_b);
+}
+
+static void expr_list_refs(struct xref_state *state, mes_expression_list exprs)
+{
+	struct mes_expression *expr;
+	vector_foreach(expr, exprs) {
+		expr_refs(state, expr);
+	}
+}
+
+static void param_list_refs(struct xref_state *state, mes_parameter_list params)
+{
+	struct mes_parameter *p;
+	vector_foreach_p(p, params) {
+		if (p->type == MES_PARAM_EXPRESSION)
+			expr_refs(state, p->expr);
+	}
+}
+
+// references to consecutive variables set by a single statement
+static void set_refs(struct xref_state *state, enum mes_xref_kind kind,
+		struct mes_statement *stmt)
+{
+	for (unsigned i = 0; i < vector_length(stmt->SET_VAR_CONST.val_exprs); i++) {
+		push_ref(state, kind, MES_XREF_WRITE, stmt->SET_VAR_CONST.var_no + i);
+	}
+	expr_list_refs(state, stmt->SET_VAR_CONST.val_exprs);
+}
+
+// references to consecutive system variables set through pointer variable 0
+static void sysvar_set_refs(struct xref_state *state, enum mes_xref_kind kind,
+		struct mes_statement *stmt)
+{
+	uint32_t no;
+	if (stmt->PTR_SET.var_no == 0 && expr_constant(stmt->PTR_SET.off_expr, &no)) {
+		for (unsigned i = 0; i < vector_length(stmt->PTR_SET.val_exprs); i++) {
+			push_ref(state, kind, MES_XREF_WRITE, no + i);
+		}
+	}
+	expr_refs(state, stmt->PTR_SET.off_expr);
+	expr_list_refs(state, stmt->PTR_SET.val_exprs);
+}
+
+static void call_refs(struct xref_state *state, enum mes_xref_kind kind,
+		mes_parameter_list params)
+{
+	if (vector_length(params) > 0) {
+		struct mes_parameter *p = &vector_A(params, 0);
+		uint32_t no;
+		if (kind == MES_XREF_MES && p->type == MES_PARAM_STRING)
+			push_ref(state, kind, MES_XREF_CALL, intern_name(state->table, p->str));
+		else if (kind != MES_XREF_MES && p->type == MES_PARAM_EXPRESSION
+				&& expr_constant(p->expr, &no))
+			push_ref(state, kind, MES_XREF_CALL, no);
+	}
+	param_list_refs(state, params);
+}
+
+static void def_refs(struct xref_state *state, enum mes_xref_kind kind,
+		struct mes_expression *no_expr)
+{
+	uint32_t no;
+	if (expr_constant(no_expr, &no))
+		push_ref(state, kind, MES_XREF_DEFINE, no);
+	expr_refs(state, no_expr);
+}
+
+static void stmt_refs(struct xref_state *state, struct mes_statement *stmt)
+{
+	switch (stmt->op) {
+	case MES_STMT_SET_FLAG_CONST:
+		set_refs(state, MES_XREF_FLAG, stmt);
+		break;
+	case MES_STMT_SET_VAR16:
+		set_refs(state, MES_XREF_VAR16, stmt);
+		break;
+	case MES_STMT_SET_VAR32:
+		set_refs(state, MES_XREF_VAR32, stmt);
+		break;
+	case MES_STMT_SET_ARG_CONST:
+		set_refs(state, MES_XREF_ARG, stmt);
+		break;
+	case MES_STMT_SET_FLAG_EXPR:
+	case MES_STMT_SET_ARG_EXPR:
+		expr_refs(state, stmt->SET_VAR_EXPR.var_expr);
+		expr_list_refs(state, stmt->SET_VAR_EXPR.val_exprs);
+		break;
+	case MES_STMT_PTR16_SET16:
+		sysvar_set_refs(state, MES_XREF_SYSVAR, stmt);
+		break;
+	case MES_STMT_PTR32_SET32:
+		sysvar_set_refs(state, MES_XREF_SYSVAR32, stmt);
+		break;
+	case MES_STMT_PTR16_SET8:
+	case MES_STMT_PTR32_SET8:
+	case MES_STMT_PTR32_SET16:
+		expr_refs(state, stmt->PTR_SET.off_expr);
+		expr_list_refs(state, stmt->PTR_SET.val_exprs);
+		break;
+	case MES_STMT_JZ:
+		expr_refs(state, stmt->JZ.expr);
+		break;
+	case MES_STMT_SYS:
+		expr_refs(state, stmt->SYS.expr);
+		param_list_refs(state, stmt->SYS.params);
+		break;
+	case MES_STMT_CALL_PROC:
+		call_refs(state, MES_XREF_PROC, stmt->CALL.params);
+		break;
+	case MES_STMT_CALL_SUB:
+		call_refs(state, MES_XREF_SUB, stmt->CALL.params);
+		break;
+	case MES_STMT_JMP_MES:
+	case MES_STMT_CALL_MES:
+		call_refs(state, MES_XREF_MES, stmt->CALL.params);
+		break;
+	case MES_STMT_UTIL:
+	case MES_STMT_1B:
+		param_list_refs(state, stmt->CALL.params);
+		break;
+	case MES_STMT_DEF_MENU:
+		param_list_refs(state, stmt->DEF_MENU.params);
+		break;
+	case MES_STMT_MENU_EXEC:
+		if (ai5_target_game == GAME_NONOMURA)
+			param_list_refs(state, stmt->DEF_MENU.params);
+		break;
+	case MES_STMT_DEF_PROC:
+		def_refs(state, MES_XREF_PROC, stmt->DEF_PROC.no_expr);
+		break;
+	case MES_STMT_DEF_SUB:
+		def_refs(state, MES_XREF_SUB, stmt->DEF_PROC.no_expr);
+		break;
+	case MES_STMT_18:
+		expr_refs(state, stmt->SET_VAR_EXPR.var_expr);
+		break;
+	default:
+		break;
+	}
+}
+
+static void aiw_stmt_refs(struct xref_state *state, struct mes_statement *stmt)
+{
+	switch (stmt->aiw_op) {
+	case AIW_MES_STMT_SET_FLAG_CONST:
+		set_refs(state, MES_XREF_FLAG, stmt);
+		break;
+	case AIW_MES_STMT_SET_VAR16_CONST:
+		set_refs(state, MES_XREF_VAR16, stmt);
+		break;
+	case AIW_MES_STMT_SET_SYSVAR_CONST:
+		set_refs(state, MES_XREF_SYSVAR, stmt);
+		break;
+	case AIW_MES_STMT_SET_VAR32:
+		set_refs(state, MES_XREF_VAR32, stmt);
+		break;
+	case AIW_MES_STMT_SET_FLAG_EXPR:
+	case AIW_MES_STMT_SET_VAR16_EXPR:
+	case AIW_MES_STMT_SET_SYSVAR_EXPR:
+		expr_refs(state, stmt->SET_VAR_EXPR.var_expr);
+		expr_list_refs(state, stmt->SET_VAR_EXPR.val_exprs);
+		break;
+	case AIW_MES_STMT_PTR_SET8:
+	case AIW_MES_STMT_PTR_SET16:
+		expr_refs(state, stmt->PTR_SET.off_expr);
+		expr_list_refs(state, stmt->PTR_SET.val_exprs);
+		break;
+	case AIW_MES_STMT_JZ:
+		expr_refs(state, stmt->JZ.expr);
+		break;
+	case AIW_MES_STMT_CALL_PROC:
+		call_refs(state, MES_XREF_PROC, stmt->CALL.params);
+		break;
+	case AIW_MES_STMT_JMP_MES:
+	case AIW_MES_STMT_CALL_MES:
+		call_refs(state, MES_XREF_MES, stmt->CALL.params);
+		break;
+	case AIW_MES_STMT_DEF_PROC:
+		def_refs(state, MES_XREF_PROC, stmt->DEF_PROC.no_expr);
+		break;
+	case AIW_MES_STMT_DEF_MENU: {
+		expr_refs(state, stmt->AIW_DEF_MENU.expr);
+		struct aiw_mes_menu_case *c;
+		vector_foreach_p(c, stmt->AIW_DEF_MENU.cases) {
+			expr_refs(state, c->cond);
+			struct mes_statement *s;
+			vector_foreach(s, c->body) {
+				aiw_stmt_refs(state, s);
+			}
+		}
+		break;
+	}
+	case AIW_MES_STMT_MENU_EXEC:
+		expr_list_refs(state, stmt->AIW_MENU_EXEC.exprs);
+		break;
+	case AIW_MES_STMT_21:
+	case AIW_MES_STMT_FE:
+	case AIW_MES_STMT_END:
+	case AIW_MES_STMT_TXT:
+	case AIW_MES_STMT_JMP:
+	case AIW_MES_STMT_35:
+	case AIW_MES_STMT_37:
+		break;
+	default:
+		// all remaining statements are calls with a parameter list
+		param_list_refs(state, stmt->CALL.params);
+		break;
+	}
+}
+
+/*
+ * Add all references in a (parsed) mes file to the table.
+ */
+void mes_xref_add_script(struct mes_xref_table *table, const char *name,
+		mes_statement_list statements)
+{
+	struct xref_state state = {
+		.table = table,
+		.script = intern_name(table, name),
+	};
+	bool aiwin = game_is_aiwin();
+	struct mes_statement *stmt;
+	vector_foreach(stmt, statements) {
+		state.address = stmt->address;
+		if (aiwin)
+			aiw_stmt_refs(&state, stmt);
+		else
+			stmt_refs(&state, stmt);
+	}
+}
+
+static int xref_cmp(const void *_a, const void *_b)
+{
+	const struct mes_xref *a = _a;
+	const struct mes_xref *b = _b;
+	if (a->kind != b->kind)
+		return a->kind < b->kind ? -1 : 1;
+	if (a->no != b->no)
+		return a->no < b->no ? -1 : 1;
+	if (a->script != b->script)
+		return a->script < b->script ? -1 : 1;
+	if (a->address != b->address)
+		return a->address < b->address ? -1 : 1;
+	return a->access - b->access;
+}
+
+/*
+ * Sort the table for lookup. Must be called after all scripts are added.
+ */
+void mes_xref_table_finalize(struct mes_xref_table *table)
+{
+	qsort(table->refs.a, vector_length(table->refs), sizeof(struct mes_xref), xref_cmp);
+}
+
+// collection }}}
+// serialization {{{
+
+bool mes_xref_table_write(struct mes_xref_table *table, const char *path)
+{
+	struct buffer out;
+	buffer_init(&out, NULL, 0);
+	buffer_write_bytes(&out, (uint8_t*)MES_XREF_MAGIC, 4);
+	buffer_write_u32(&out, MES_XREF_VERSION);
+	buffer_write_u32(&out, vector_length(table->names));
+	buffer_write_u32(&out, vector_length(table->refs));
+
+	string name;
+	vector_foreach(name, table->names) {
+		buffer_write_u32(&out, string_length(name));
+		buffer_write_bytes(&out, (uint8_t*)name, string_length(name));
+	}
+	struct mes_xref *ref;
+	vector_foreach_p(ref, table->refs) {
+		buffer_write_u32(&out, ref->kind | (ref->access << 8));
+		buffer_write_u32(&out, ref->script);
+		buffer_write_u32(&out, ref->no);
+		buffer_write_u32(&out, ref->address);
+	}
+
+	bool r = file_write(path, out.buf, out.index);
+	free(out.buf);
+	return r;
+}
+
+bool mes_xref_table_read(struct mes_xref_table *table, const char *path)
+{
+	size_t size;
+	uint8_t *data = file_read(path, &size);
+	if (!data)
+		return false;
+
+	mes_xref_table_init(table);
+	if (size < 16 || memcmp(data, MES_XREF_MAGIC, 4)
+			|| le_get32(data, 4) != MES_XREF_VERSION) {
+		free(data);
+		return false;
+	}
+	uint32_t nr_names = le_get32(data, 8);
+	uint32_t nr_refs = le_get32(data, 12);
+
+	size_t pos = 16;
+	for (uint32_t i = 0; i < nr_names; i++) {
+		if (size - pos < 4)
+			goto error;
+		uint32_t len = le_get32(data, pos);
+		if (size - pos - 4 < len)
+			goto error;
+		vector_push(string, table->names, string_new_len((char*)data + pos + 4, len));
+		pos += 4 + len;
+	}
+	if ((size - pos) / 16 < nr_refs)
+		goto error;
+	for (uint32_t i = 0; i < nr_refs; i++, pos += 16) {
+		uint32_t type = le_get32(data, pos);
+		struct mes_xref ref = {
+			.kind = type & 0xff,
+			.access = (type >> 8) & 0xff,
+			.script = le_get32(data, pos + 4),
+			.no = le_get32(data, pos + 8),
+			.address = le_get32(data, pos + 12),
+		};
+		if (ref.kind >= MES_XREF_NR_KINDS || ref.access >= MES_XREF_NR_ACCESS
+				|| ref.script >= nr_names
+				|| (ref.kind == MES_XREF_MES && ref.no >= nr_names))
+			goto error;
+		vector_push(struct mes_xref, table->refs, ref);
+	}
+	free(data);
+	return true;
+error:
+	WARNING("Corrupt cross-reference file: %s", path);
+	free(data);
+	mes_xref_table_free(table);
+	return false;
+}
+
+// serialization }}}
+
+/*
+ * Call `handle_ref` for every reference to the given procedure/variable.
+ * Returns the number of references found.
+ */
+unsigned mes_xref_lookup(struct mes_xref_table *table, enum mes_xref_kind kind, uint32_t no,
+		void(*handle_ref)(struct mes_xref_table*, struct mes_xref*, void*),
+		void *data)
+{
+	// find the first entry not less than (kind, no)
+	size_t lo = 0, hi = vector_length(table->refs);
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct mes_xref *ref = &vector_A(table->refs, mid);
+		if (ref->kind < kind || (ref->kind == kind && ref->no < no))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	unsigned count = 0;
+	for (; lo < vector_length(table->refs); lo++, count++) {
+		struct mes_xref *ref = &vector_A(table->refs, lo);
+		if (ref->kind != kind || ref->no != no)
+			break;
+		handle_ref(table, ref, data);
+	}
+	return count;
+}
@@ -0,0 +1,241 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "nulib.h"
+#include "nulib/file.h"
+#include "nulib/port.h"
+#include "nulib/string.h"
+#include "ai5/cg.h"
+
+#include "video.h"
+
+bool video_format_from_name(const char *name, enum video_format *out)
+{
+	if (!strcasecmp(name, "y4m"))
+		*out = VIDEO_Y4M;
+	else if (!strcasecmp(name, "rgba"))
+		*out = VIDEO_RGBA;
+	else if (!strcasecmp(name, "png"))
+		*out = VIDEO_PNG;
+	else
+		return false;
+	return true;
+}
+
+bool video_writer_begin(struct video_writer *v, unsigned w, unsigned h,
+		unsigned fps_num, unsigned fps_den)
+{
+	v->w = w;
+	v->h = h;
+	v->nr_frames = 0;
+	v->planes = NULL;
+	v->png = NULL;
+	v->png_size = 0;
+	v->failed = true;
+
+	switch (v->format) {
+	case VIDEO_Y4M:
+		v->planes = xmalloc(w * h * 3);
+		v->failed = !port_printf(v->out, "YUV4MPEG2 W%u H%u F%u:%u Ip A1:1 C444\n",
+				w, h, fps_num, fps_den);
+		break;
+	case VIDEO_RGBA:
+		v->failed = false;
+		break;
+	case VIDEO_PNG:
+		if (mkdir_p(v->dir) < 0) {
+			WARNING("Failed to create output directory \"%s\": %s", v->dir,
+					strerror(errno));
+			break;
+		}
+		v->failed = false;
+		break;
+	}
+	return !v->failed;
+}
+
+// Y4M {{{
+
+/*
+ * Convert RGB to limited range BT.601 Y'CbCr, which is what consumers of Y4M
+ * streams assume by default.
+ */
+static void y4m_convert(struct video_writer *v, const uint8_t *pixels, unsigned stride)
+{
+	uint8_t *y_p = v->planes;
+	uint8_t *cb_p = y_p + v->w * v->h;
+	uint8_t *cr_p = cb_p + v->w * v->h;
+	for (unsigned row = 0; row < v->h; row++) {
+		const uint8_t *p = pixels + row * stride;
+		for (unsigned col = 0; col < v->w; col++, p += 4) {
+			int r = p[0], g = p[1], b = p[2];
+			*y_p++ = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+			*cb_p++ = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+			*cr_p++ = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+		}
+	}
+}
+
+static bool y4m_write(struct video_writer *v)
+{
+	static const uint8_t frame_header[] = "FRAME\n";
+	return port_write_bytes(v->out, frame_header, sizeof(frame_header) - 1)
+		&& port_write_bytes(v->out, v->planes, v->w * v->h * 3);
+}
+
+// Y4M }}}
+// RGBA {{{
+
+static bool rgba_write(struct video_writer *v, const uint8_t *pixels, unsigned stride)
+{
+	if (stride == v->w * 4)
+		return port_write_bytes(v->out, pixels, v->w * v->h * 4);
+	for (unsigned row = 0; row < v->h; row++) {
+		if (!port_write_bytes(v->out, pixels + row * stride, v->w * 4))
+			return false;
+	}
+	return true;
+}
+
+// RGBA }}}
+// PNG {{{
+
+static string png_path(struct video_writer *v)
+{
+	string path = string_new(v->dir);
+	if (path[0] && path[string_length(path) - 1] != '/')
+		path = string_concat_cstring(path, "/");
+	return string_concat_fmt(path, "%06u.png", v->nr_frames);
+}
+
+// encode a CG to PNG in memory
+static uint8_t *png_encode_mem(struct cg *cg, size_t *size_out)
+{
+#ifdef _WIN32
+	// no open_memstream; go through an anonymous temporary file instead
+	FILE *f = tmpfile();
+	if (!f)
+		return NULL;
+	uint8_t *data = NULL;
+	long size;
+	if (cg_write(cg, f, CG_TYPE_PNG) && !fflush(f) && (size = ftell(f)) > 0) {
+		rewind(f);
+		data = xmalloc(size);
+		if (fread(data, size, 1, f) != 1) {
+			free(data);
+			data = NULL;
+		}
+		*size_out = size;
+	}
+	fclose(f);
+	return data;
+#else
+	char *data = NULL;
+	size_t size = 0;
+	FILE *f = open_memstream(&data, &size);
+	if (!f)
+		return NULL;
+	bool ok = cg_write(cg, f, CG_TYPE_PNG);
+	// data and size are only valid after the stream is closed
+	if (fclose(f) || !ok) {
+		free(data);
+		return NULL;
+	}
+	*size_out = size;
+	return (uint8_t*)data;
+#endif
+}
+
+// encode a frame, keeping the encoded data until the next frame
+static bool png_encode(struct video_writer *v, const uint8_t *pixels, unsigned stride)
+{
+	struct cg *cg = cg_alloc_direct(v->w, v->h);
+	for (unsigned row = 0; row < v->h; row++) {
+		memcpy(cg->pixels + row * v->w * 4, pixels + row * stride, v->w * 4);
+	}
+
+	free(v->png);
+	v->png = png_encode_mem(cg, &v->png_size);
+	cg_free(cg);
+	if (!v->png) {
+		WARNING("Failed to encode PNG");
+		return false;
+	}
+	return true;
+}
+
+// write the encoded frame to the next file in the sequence
+static bool png_write(struct video_writer *v)
+{
+	string path = png_path(v);
+	bool ok = file_write(path, v->png, v->png_size);
+	if (!ok)
+		WARNING("Failed to write \"%s\": %s", path, strerror(errno));
+	string_free(path);
+	return ok;
+}
+
+// PNG }}}
+
+/*
+ * Write a frame (RGBA) which lasts for `repeat` frame periods.
+ */
+bool video_writer_frame(struct video_writer *v, const uint8_t *pixels, unsigned stride,
+		unsigned repeat)
+{
+	if (v->format == VIDEO_Y4M)
+		y4m_convert(v, pixels, stride);
+
+	for (unsigned i = 0; i < repeat; i++, v->nr_frames++) {
+		bool ok = false;
+		switch (v->format) {
+		case VIDEO_Y4M:
+			ok = y4m_write(v);
+			break;
+		case VIDEO_RGBA:
+			ok = rgba_write(v, pixels, stride);
+			break;
+		case VIDEO_PNG:
+			ok = (i || png_encode(v, pixels, stride)) && png_write(v);
+			break;
+		}
+		if (!ok) {
+			v->failed = true;
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Release the writer's buffers. Returns false if the video could not be written
+ * in full (i.e. if video_writer_begin or any call to video_writer_frame failed).
+ * The output stream/directory itself is owned by the caller.
+ */
+bool video_writer_end(struct video_writer *v)
+{
+	free(v->planes);
+	free(v->png);
+	v->planes = NULL;
+	v->png = NULL;
+	return !v->failed;
+}
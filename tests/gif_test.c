@@ -0,0 +1,451 @@
+/* Copyright (C) 2025 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+/*
+ * Round-trip test for the GIF encoder: frames are encoded, then decoded with a
+ * strict (giflib-style) decoder and compared against the input.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nulib.h"
+#include "nulib/little_endian.h"
+#include "nulib/port.h"
+
+#include "gif.h"
+
+static const char *test_name = "";
+static unsigned nr_failed = 0;
+
+#define FAIL(fmt, ...) do { \
+	fprintf(stderr, "FAIL %s: " fmt "\n", test_name, ##__VA_ARGS__); \
+	nr_failed++; \
+} while (0)
+
+// Decoder {{{
+
+struct lzw_reader {
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+	uint32_t acc;
+	unsigned nr_bits;
+};
+
+static int lzw_read(struct lzw_reader *r, unsigned size)
+{
+	while (r->nr_bits < size) {
+		if (r->pos >= r->size)
+			return -1;
+		r->acc |= (uint32_t)r->data[r->pos++] << r->nr_bits;
+		r->nr_bits += 8;
+	}
+	int code = r->acc & ((1u << size) - 1);
+	r->acc >>= size;
+	r->nr_bits -= size;
+	return code;
+}
+
+/*
+ * Decode LZW data into exactly `n` indices. Fails if the data ends before the
+ * end-of-information code, or if any code is out of range.
+ */
+static bool lzw_decode(const uint8_t *data, size_t size, unsigned min_code_size,
+		uint8_t *out, unsigned n)
+{
+	static uint16_t prefix[4096];
+	static uint8_t suffix[4096];
+	static uint8_t stack[4096];
+	const unsigned clear_code = 1 << min_code_size;
+	unsigned code_size = min_code_size + 1;
+	unsigned next = clear_code + 2;
+	unsigned pos = 0;
+	int prev = -1;
+	struct lzw_reader r = { .data = data, .size = size };
+
+	for (;;) {
+		int code = lzw_read(&r, code_size);
+		if (code < 0)
+			return false;
+		if (code == clear_code) {
+			code_size = min_code_size + 1;
+			next = clear_code + 2;
+			prev = -1;
+			continue;
+		}
+		if (code == clear_code + 1)
+			return pos == n;
+		if (prev < 0) {
+			if (code >= clear_code || pos >= n)
+				return false;
+			out[pos++] = code;
+			prev = code;
+			continue;
+		}
+		if (code > next || (code == next && next >= 4096))
+			return false;
+
+		// first character of the new entry
+		int c = code == next ? prev : code;
+		while (c >= (int)clear_code)
+			c = prefix[c];
+		if (next < 4096) {
+			prefix[next] = prev;
+			suffix[next] = c;
+			next++;
+		}
+
+		unsigned len = 0;
+		for (c = code; c >= (int)clear_code; c = prefix[c])
+			stack[len++] = suffix[c];
+		stack[len++] = c;
+		if (pos + len > n)
+			return false;
+		while (len)
+			out[pos++] = stack[--len];
+
+		if (next == (1u << code_size) && code_size < 12)
+			code_size++;
+		prev = code;
+	}
+}
+
+struct gif_reader {
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+};
+
+static bool read_bytes(struct gif_reader *r, size_t n, const uint8_t **out)
+{
+	if (r->pos + n > r->size)
+		return false;
+	*out = r->data + r->pos;
+	r->pos += n;
+	return true;
+}
+
+// concatenate data sub-blocks (or skip them, if `out` is NULL)
+static bool read_sub_blocks(struct gif_reader *r, uint8_t **out, size_t *size_out)
+{
+	size_t size = 0;
+	const uint8_t *len, *block;
+	for (;;) {
+		if (!read_bytes(r, 1, &len))
+			return false;
+		if (!*len)
+			break;
+		if (!read_bytes(r, *len, &block))
+			return false;
+		if (out) {
+			*out = xrealloc(*out, size + *len);
+			memcpy(*out + size, block, *len);
+		}
+		size += *len;
+	}
+	if (size_out)
+		*size_out = size;
+	return true;
+}
+
+/*
+ * Decode a GIF, compositing each frame onto an RGB canvas. Returns the number of
+ * frames, or -1 on error; `frames` receives the canvas after each frame.
+ */
+static int decode_gif(const uint8_t *data, size_t size, unsigned w, unsigned h,
+		uint8_t **frames, unsigned max_frames)
+{
+	struct gif_reader r = { .data = data, .size = size };
+	const uint8_t *p;
+	if (!read_bytes(&r, 13, &p) || memcmp(p, "GIF89a", 6))
+		return -1;
+	if (le_get16(p, 6) != w || le_get16(p, 8) != h || (p[10] & 0x80))
+		return -1;
+
+	uint8_t *canvas = xcalloc(w * h, 3);
+	unsigned nr_frames = 0;
+	int transparent = -1;
+	for (;;) {
+		if (!read_bytes(&r, 1, &p))
+			goto err;
+		if (*p == 0x3b)
+			break;
+		if (*p == 0x21) {
+			if (!read_bytes(&r, 1, &p))
+				goto err;
+			if (*p == 0xf9) {
+				if (!read_bytes(&r, 6, &p) || p[0] != 4 || p[5] != 0)
+					goto err;
+				transparent = (p[1] & 1) ? p[4] : -1;
+				continue;
+			}
+			if (!read_sub_blocks(&r, NULL, NULL))
+				goto err;
+			continue;
+		}
+		if (*p != 0x2c || !read_bytes(&r, 9, &p))
+			goto err;
+		unsigned x = le_get16(p, 0), y = le_get16(p, 2);
+		unsigned fw = le_get16(p, 4), fh = le_get16(p, 6);
+		if (!fw || !fh || x + fw > w || y + fh > h || !(p[8] & 0x80))
+			goto err;
+		unsigned nr_colors = 2 << (p[8] & 7);
+		const uint8_t *colors;
+		const uint8_t *min_code_size;
+		if (!read_bytes(&r, nr_colors * 3, &colors) || !read_bytes(&r, 1, &min_code_size))
+			goto err;
+		if (*min_code_size < 2 || *min_code_size > 8)
+			goto err;
+
+		uint8_t *lzw = NULL;
+		size_t lzw_size;
+		uint8_t *indices = xmalloc(fw * fh);
+		bool ok = read_sub_blocks(&r, &lzw, &lzw_size)
+			&& lzw_decode(lzw, lzw_size, *min_code_size, indices, fw * fh);
+		free(lzw);
+		for (unsigned i = 0; ok && i < fw * fh; i++) {
+			if (indices[i] == transparent)
+				continue;
+			if (indices[i] >= nr_colors) {
+				ok = false;
+				break;
+			}
+			uint8_t *dst = canvas + ((y + i / fw) * w + x + i % fw) * 3;
+			memcpy(dst, colors + indices[i] * 3, 3);
+		}
+		free(indices);
+		if (!ok || nr_frames >= max_frames)
+			goto err;
+		frames[nr_frames] = xmalloc(w * h * 3);
+		memcpy(frames[nr_frames], canvas, w * h * 3);
+		nr_frames++;
+		transparent = -1;
+	}
+	free(canvas);
+	return nr_frames;
+err:
+	free(canvas);
+	for (unsigned i = 0; i < nr_frames; i++) {
+		free(frames[i]);
+	}
+	return -1;
+}
+
+// Decoder }}}
+// Tests {{{
+
+#define MAX_FRAMES 16
+
+struct frame {
+	uint8_t *pixels;
+	// hint rectangle passed to the encoder
+	int x, y, w, h;
+};
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static void set_color(uint8_t *px, unsigned color)
+{
+	px[0] = color * 37;
+	px[1] = color * 91 + (color >> 8);
+	px[2] = color * 13 + 7;
+	px[3] = 0xff;
+}
+
+/*
+ * Encode frames, decode the result and check that each decoded frame matches
+ * its input exactly (or, if `exact` is false, only that the GIF is valid).
+ */
+static void round_trip(const char *name, unsigned w, unsigned h, struct frame *frames,
+		unsigned nr_frames, bool exact)
+{
+	test_name = name;
+	for (unsigned nr_threads = 1; nr_threads <= 4; nr_threads += 3) {
+		struct port out;
+		struct gif_encoder gif;
+		port_buffer_init(&out);
+		bool ok = gif_encoder_begin(&gif, &out, w, h, nr_threads);
+		for (unsigned i = 0; ok && i < nr_frames; i++) {
+			struct frame *f = &frames[i];
+			ok = gif_encoder_frame(&gif, f->pixels, w * 4, f->x, f->y, f->w, f->h, 10);
+		}
+		ok = gif_encoder_end(&gif) && ok;
+		size_t size;
+		uint8_t *data = port_buffer_get(&out, &size);
+		if (!ok) {
+			FAIL("encoder failed");
+			free(data);
+			return;
+		}
+
+		uint8_t *decoded[MAX_FRAMES];
+		int n = decode_gif(data, size, w, h, decoded, MAX_FRAMES);
+		free(data);
+		if (n < 0) {
+			FAIL("invalid GIF (%u threads)", nr_threads);
+			return;
+		}
+		if ((unsigned)n != nr_frames)
+			FAIL("decoded %d of %u frames", n, nr_frames);
+		for (unsigned i = 0; i < (unsigned)n; i++) {
+			if (exact && i < nr_frames) {
+				for (unsigned j = 0; j < w * h; j++) {
+					if (memcmp(decoded[i] + j * 3, frames[i].pixels + j * 4, 3)) {
+						FAIL("frame %u differs at (%u,%u)", i, j % w, j / w);
+						break;
+					}
+				}
+			}
+			free(decoded[i]);
+		}
+	}
+}
+
+static struct frame full_frame(unsigned w, unsigned h)
+{
+	return (struct frame) { xcalloc(w * h, 4), 0, 0, w, h };
+}
+
+/*
+ * Single-row images of every length up to 600 pixels, with color counts giving
+ * each LZW minimum code size from 2 to 8, so that the last code and the
+ * end-of-information code land on each side of every code width change.
+ */
+static void test_code_widths(void)
+{
+	static const unsigned nr_colors[] = { 2, 3, 4, 7, 8, 15, 16, 31, 32, 63, 64, 127, 255 };
+	char name[64];
+	for (unsigned c = 0; c < ARRAY_SIZE(nr_colors); c++) {
+		for (unsigned n = 1; n <= 600; n++) {
+			for (unsigned pattern = 0; pattern < 2; pattern++) {
+				struct frame f = full_frame(n, 1);
+				for (unsigned i = 0; i < n; i++) {
+					// random, or a repeating ramp (long dictionary strings)
+					unsigned color = pattern ? i % nr_colors[c] : rng() % nr_colors[c];
+					set_color(f.pixels + i * 4, color);
+				}
+				snprintf(name, sizeof(name), "code-widths/%u-colors/%u/%u",
+						nr_colors[c], n, pattern);
+				round_trip(name, n, 1, &f, 1, true);
+				free(f.pixels);
+			}
+		}
+	}
+}
+
+/*
+ * Images large enough to fill the LZW dictionary several times over.
+ */
+static void test_dictionary_reset(void)
+{
+	static const unsigned nr_colors[] = { 2, 16, 255 };
+	for (unsigned c = 0; c < ARRAY_SIZE(nr_colors); c++) {
+		struct frame f = full_frame(256, 192);
+		for (unsigned i = 0; i < 256 * 192; i++) {
+			set_color(f.pixels + i * 4, rng() % nr_colors[c]);
+		}
+		round_trip("dictionary-reset", 256, 192, &f, 1, true);
+		free(f.pixels);
+	}
+}
+
+/*
+ * Frames which change scattered pixels within (and outside of) the hint
+ * rectangle, so that unchanged pixels inside the changed region are encoded as
+ * transparent and only a sub-rectangle of the image is encoded.
+ */
+static void test_sub_rects(void)
+{
+	const unsigned w = 64, h = 48;
+	struct frame frames[MAX_FRAMES];
+	frames[0] = full_frame(w, h);
+	for (unsigned i = 0; i < w * h; i++) {
+		set_color(frames[0].pixels + i * 4, rng() % 40);
+	}
+	for (unsigned i = 1; i < MAX_FRAMES; i++) {
+		frames[i] = full_frame(w, h);
+		memcpy(frames[i].pixels, frames[i-1].pixels, w * h * 4);
+		struct frame *f = &frames[i];
+		f->x = rng() % w;
+		f->y = rng() % h;
+		f->w = 1 + rng() % (w - f->x);
+		f->h = 1 + rng() % (h - f->y);
+		// frame 5 changes nothing; frame 6 changes a single pixel
+		unsigned nr_changes = i == 5 ? 0 : i == 6 ? 1 : 1 + rng() % 20;
+		for (unsigned j = 0; j < nr_changes; j++) {
+			unsigned x = f->x + rng() % f->w;
+			unsigned y = f->y + rng() % f->h;
+			set_color(f->pixels + (y * w + x) * 4, rng() % 300);
+		}
+	}
+	// the last frame has a hint rectangle partly outside of the image
+	frames[MAX_FRAMES-1].x = -8;
+	frames[MAX_FRAMES-1].y = -8;
+	frames[MAX_FRAMES-1].w = w + 16;
+	frames[MAX_FRAMES-1].h = h + 16;
+	round_trip("sub-rects", w, h, frames, MAX_FRAMES, true);
+	for (unsigned i = 0; i < MAX_FRAMES; i++) {
+		free(frames[i].pixels);
+	}
+}
+
+/*
+ * Frames with more than 255 colors are dithered; check that they still decode.
+ */
+static void test_dithered(void)
+{
+	const unsigned w = 80, h = 60;
+	struct frame frames[2] = { full_frame(w, h), full_frame(w, h) };
+	for (unsigned i = 0; i < w * h; i++) {
+		uint8_t *p = frames[0].pixels + i * 4;
+		p[0] = rng();
+		p[1] = rng();
+		p[2] = rng();
+		p[3] = 0xff;
+	}
+	memcpy(frames[1].pixels, frames[0].pixels, w * h * 4);
+	for (unsigned i = 0; i < w * h; i += 3) {
+		frames[1].pixels[i * 4] ^= 0x80;
+	}
+	round_trip("dithered", w, h, frames, 2, false);
+	free(frames[0].pixels);
+	free(frames[1].pixels);
+}
+
+// Tests }}}
+
+int main(void)
+{
+	test_code_widths();
+	test_dictionary_reset();
+	test_sub_rects();
+	test_dithered();
+	if (nr_failed) {
+		fprintf(stderr, "%u failures\n", nr_failed);
+		return 1;
+	}
+	return 0;
+}